@@ -1,490 +1,1324 @@
-/*
- * BTServerC
- * 
- * 
- * before compiling, stop the OS from running this with:
- * sudo systemctl stop BTServer
- */
-
-#include <stdio.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <sys/socket.h>
-#include <bluetooth/bluetooth.h>
-#include <bluetooth/rfcomm.h>
-#include <time.h>
-#include <wiringPi.h>
-#include <wiringPiI2C.h>
-
-#include "./include/spectrometerDriver.h"
-#include "./include/experimentFSM.h"
-
-
-#define PHONE_MAC 88:AD:D2:F1:A2:83
-#define PI_MAC B8:27:EB:AF:AC:37
-
-#define PRESSURE_READING_RATE 750
-
-static int getClient();
-static int sendStringToClient(int client, char *string); 
-static int sendDoubleArrayToClient(int client,double *arr, char command);
-static char *specStructToCommandString(specSettings s);
-static specSettings CommandStringToSpecStruct(char *cmdStr);
-
-
-
-
-static FILE *log;
-static int pressureThreadRunning = 0;
-static int spectraThreadRunning = 0;
-
-int main(int argc, char **argv)
-{
-    char inBuf[1024];
-    char outBuf[1024];
-    char pressureReadingString[128];
-    char dn[1024], pn[1024], ts[1024];
-
-
-
-    int i, k;
-    int notCreated;
-
-    int deviceConnected = 0;
-
-    int toggle = 1;
-    int bytes_read;
-
-    int serverSock = 0, client = 0;
-
-
-
-    //NumScans;Time between;Integration time; boxcar width; averages; result
-    specSettings mySpec = {5, 60, 1000, 0, 3, "PI_DEFAULT_DR", "PI_DEFAULT_PAT","12_31_91_2359"};
-
-    /*spectraThread
-     * When started, beams several strings containing spectrum data
-     * String delimited by ';'
-     * [command][index offset];[reading]; (*8)
-     */
-    PI_THREAD(spectraThread)
-    {
-        double specBuffer[NUM_WAVELENGTHS];
-
-        //get a reading and place it into our buffer
-        //if spec not connected, default to buffer y = x
-        getSpectrometerReading(specBuffer);
-
-		//now zap it over:
-		sendDoubleArrayToClient(client, specBuffer,SNAPSHOT);
-
-        //if we are streaming readings, fire up another one of these threads before return
-        //spectraThreadRunning = 0;
-        if (spectraThreadRunning) {
-            int notCreated = piThreadCreate(spectraThread);
-            if (piThreadCreate(spectraThread)) {
-                printf("pi thread failed somehow!\n");
-                exit(5);
-            }
-        }
-
-    }
-
-    /*pressureThread
-     * when started, streams pressure readings at specified rate.
-     * Terminates when main() sets pressureThreadRunning back to 0. 
-     */
-    PI_THREAD(pressureThread)
-    {
-        while (pressureThreadRunning) {
-            sprintf(pressureReadingString, "%c%i", REQUEST_PRESSURE, getPressureReading());
-            sendStringToClient(client, pressureReadingString);
-            delay(PRESSURE_READING_RATE);
-        }
-    }
-    
-
-
-
-
-
-    /*statusThread
-     * when started, streams info regarding the current experiment
-     */
-    PI_THREAD(statusThread)
-    {
-		char buffer[1024];
-
-		//start with some default settings that we don't really care
-		//about if the experiment is idle.
-		specSettings s = {0,0,0,0,0,"","",""};
-        if (experimentIsInited()) {
-			s = getExperimentSettings();	
-		}
-		
-		strcpy(buffer,specStructToCommandString(s));
-        deviceConnected = sendStringToClient(client, buffer);
-        //printf("sending status string: %s\n",outBuf);
-    }
-    
-    //and a simple wrapper to start it.
-    //using this so that we have a function pointer
-    //to send to the FSM process
-    int startStatusThread() {
-		return piThreadCreate(statusThread) ? 1 : 0;
-	}
-
-
-
-
-    //main loop: continually seek a connection and fire off threads
-    //to handle it
-    while (1) {
-        sprintf(inBuf, "./log_%s.txt", "blerp");
-        log = fopen(inBuf, "a");
-        if (!log) {
-            exit(-1);
-        }
-
-        serverSock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-        client = getClient(serverSock);
-        deviceConnected = 1;
-
-        while (deviceConnected) {
-
-            // prepare a clean buffer... 
-            memset(inBuf, 0, sizeof (inBuf));
-            //...and read data from the client into inBuf
-            bytes_read = read(client, inBuf, sizeof (inBuf));
-
-            if (bytes_read > 0) {
-                printf("received [%s]\n", inBuf);
-                //fprintf(log, "received [%s]\n", inBuf);
-            } else {
-                printf("Client has disconnected. Noticed upon Read.\n");
-                deviceConnected = 0;
-                break;
-            }
-
-            //big main switch statement here switching on command char:
-            switch (inBuf[0]) {
-
-            case MOTOR_ON:
-                //sendStringToClient(client, "Turning on motor...\n");
-                motor_ON();
-                break;
-
-            case MOTOR_OFF:
-                //sendStringToClient(client, "Turning off motor...\n");
-                motor_OFF();
-                break;
-
-            case LED_ON:
-                //sendStringToClient(client, "Turning on LED...\n");
-                led_ON();
-                break;
-
-            case LED_OFF:
-                //sendStringToClient(client, "Turning off LED...\n");
-                led_OFF();
-                break;
-
-			//wen exiting the hardware screen, reset everything
-			case HARDWARE_OFF:
-				pressureThreadRunning = 0;
-				spectraThreadRunning = 0;
-				led_OFF();
-				motor_OFF();
-			
-				break;
-
-            case REQUEST_PRESSURE:
-
-                //if this command comes, start up the thread to
-                //continually send pressure readings
-                if (pressureThreadRunning) {
-                    pressureThreadRunning = 0;
-                } else {
-                    pressureThreadRunning = 1;
-                    notCreated = piThreadCreate(pressureThread);
-                    if (notCreated) {
-                        printf("pi thread failed somehow!\n");
-                        exit(5);
-                    }
-                }
-                break;
-
-            case SNAPSHOT:
-
-                //if this command comes, start the thread to transmit spectrum
-                //sendStringToClient(client, "Received spectrum request...\n");
-                spectraThreadRunning = 0;
-                notCreated = piThreadCreate(spectraThread);
-                if (notCreated) {
-                    printf("pi thread failed somehow!\n");
-                    exit(5);
-                }
-                break;
-
-			case START_STREAM:
-				spectraThreadRunning = 1;
-				notCreated = piThreadCreate(spectraThread);
-                if (notCreated) {
-                    printf("pi thread failed somehow!\n");
-                    exit(5);
-                }
-				break;
-				
-			case STOP_STREAM:
-				spectraThreadRunning = 0;
-				break;
-	
-            case SETTINGS:
-
-                //if this command comes, we expect to receive settings. read them
-                //in from the message to the struct.
-                
-                //Read from &inbuf[1] because 1st char contains the command itself
-
-                //NumScans;Time between;Integration time; boxcar width; averages
-                
-                //commandStringToSpecStruct(string,mySpec);
-                sscanf(&inBuf[1], "%i;%i;%i;%i;%i;%[^\n]", &mySpec.numScans, &mySpec.timeBetweenScans,
-                        &mySpec.integrationTime, &mySpec.boxcarWidth, &mySpec.avgPerScan,
-                         outBuf);
-                
-                printf("trying to tokenize %s\n",outBuf);
-                
-                //since sscanf is finnicky with strings, we just scan
-                //in one above, then tokenize that big string, knowing what
-                //order they will be in. Clunky but functional. 
-                //strsep catches empty strings so we use that 
-                //char *ptr = strtok(outBuf,";");                
-                char *ptr = strtok(outBuf,";");
-                if(ptr) {
-					strcpy(dn,ptr);
-				}
-                ptr = strtok(NULL,";");
-                if(ptr) {
-					strcpy(pn,ptr);
-				}
-				
-                ptr = strtok(NULL,";");
-                if(ptr) {
-					strcpy(ts,ptr);
-				}
-				
-				mySpec.doctorName = dn;
-                mySpec.patientName = pn;
-                mySpec.timestamp = ts;
-				
-				applySpecSettings(mySpec);
-                printSpecSettings(mySpec);
-                
-				//now that we have gotten the strings, check to see
-				//if we also want to start the experiment:
-				ptr = strtok(NULL,";");
-				
-				if(ptr && strcmp(ptr,"Engage thrusters")) {
-					//if we get here, the command string included
-					//a request to start the experiment. 
-					initExperiment(mySpec, startStatusThread);
-					runExperiment(START_EXPERIMENT);
-				} 
-
-
-                break;
-
-            case EXP_STOP:
-                runExperiment(STOP_EXPERIMENT);
-                break;
-
-                //if the user wants status, create a worker thread to beam it over
-            case EXP_STATUS:        
-                if (piThreadCreate(statusThread)) {
-                    printf("pi thread failed somehow!\n");
-                    exit(5);
-                }
-                break;
-                
-            case EXP_LIST:; //semicolon lets us declare vars in a switch statement
-				char *savedExperiments[10] = {"hey","friend","here","is","a","list","of","experiments","for","you"};  //= getExperimentList();
-				int numSavedExperiments = 10; //getExperimentListLength();
-				char buf[512];
-
-				
-				for(int i = 0; i < numSavedExperiments; i++) {
-					
-					if(i == 0) {
-						sprintf(buf,"%c;Header",EXP_LIST);
-						sendStringToClient(client,buf);
-						delay(50);
-						}
-						
-					sprintf(buf,"%c%s",EXP_LIST,savedExperiments[i]);
-					sendStringToClient(client,buf);
-					delay(50);
-					}
-					
-				sprintf(buf,"%c;Footer",EXP_LIST);
-				sendStringToClient(client,buf);
-
-				
-				
-				break;
-
-            case 'F':
-                deviceConnected = sendStringToClient(client, "You have found a debug message! hehe :)\n");
-                break;
-
-            default:
-                if ((int) inBuf[0] == 0) {
-                    printf("got null\n", client);
-                }
-                deviceConnected = sendStringToClient(client, "Unrecognized Inbound Message!!\n");
-                break;
-            }
-        }
-
-        printf("restarting listening loop!\n");
-
-        pressureThreadRunning = 0;
-        spectraThreadRunning = 0;
-
-        close(client);
-        close(serverSock);
-        fclose(log);
-
-    }//end main listening loop
-
-	//we will almost certainly never get here: 
-    printf("SESSION END\n");
-
-    return 0;
-}
-
-/*
- * getClient
- * Accepts an open server socket, listens on the socket for connections,
- * and returns the client it finds. 
- */
-static int getClient(int serverSock)
-{
-	
-	//ideally this would securely open a connection but nonfunctional:
-	//return system("sudo ./py/advertiser.py");
-	
-	
-	//doing it in c WITHOUT uuid:
-	
-    char inBuf[1023];
-    // allocate socket
-    struct sockaddr_rc loc_addr = {0}, rem_addr = {0};
-    socklen_t opt = sizeof (rem_addr);
-
-
-    // bind socket to port 1 of the first available 
-    // local bluetooth adapter
-    loc_addr.rc_family = AF_BLUETOOTH;
-    loc_addr.rc_bdaddr = *BDADDR_ANY;
-    loc_addr.rc_channel = (uint8_t) 1;
-    printf("Attempting to bind socket...\n");
-
-
-    bind(serverSock, (struct sockaddr *) &loc_addr, sizeof (loc_addr));
-
-    // put socket into listening mode
-    printf("Listening for connections...\n");
-
-    listen(serverSock, 1);
-
-    // accept one connection
-    int client = accept(serverSock, (struct sockaddr *) &rem_addr, &opt);
-
-    ba2str(&rem_addr.rc_bdaddr, inBuf);
-    fprintf(stderr, "accepted connection from %s with client = %i\n", inBuf,client);
-    //fprintf(log, "accepted connection from %s\n", inBuf);
-
-    return client;
-    
-}
-
-/*
- * Sends input string, up to 256 in lengh, across bluetooth client.
- * returns 1 if connected and message sent; else returns 0
- */
-int sendStringToClient(int client, char *string)
-{
-    int err;
-    char buf[256];
-    memset(buf, 0, sizeof (buf));
-    sprintf(buf, string);
-    err = write(client, buf, strlen(buf));
-
-    if (err < 0) {
-        //we want to return 0 if the client isn't there anymore.
-        //eg, status thread tries to run while the researcher is eating lunch
-        printf("Client Disconnected. Noticed upon write.\n");
-        return 0;
-    } else {
-        //we want to return 1 if still running
-        printf("Sent to client: %s\n", buf);
-        //fprintf(log, "Response: %s\n", buf);
-        return 1;
-    }
-}
-
-int sendDoubleArrayToClient(int client,double *arr, char command) {
-			char specString[256] = "";
-			char tmpBuf[128] = "";
-			int index, offset = 0, k = 0;
-			int retVal;
-        
-        //now iterate through and apend 8 readings per string
-        //send index and then 8 values for offsets 0-7
-        for (index = 0; index < NUM_WAVELENGTHS; index += 8) {
-
-            sprintf(specString, "%c%i;", command, index);
-            for (offset = 0; offset < 7; offset++) {
-                sprintf(tmpBuf, "%.2f;", arr[index + offset]);
-                strcat(specString, tmpBuf);
-            }
-            //and leave the ';' out of last entry:
-            sprintf(tmpBuf, "%.2f", arr[index + 7]);
-            strcat(specString, tmpBuf);
-
-			//this guy will return 1 when it succeeds
-            if(sendStringToClient(client, specString) == 0) {
-				return 0;
-			}
-            
-            //delay(15);
-            k++;
-			}
-			printf("finished data stream! %i Strings sent\n", k);
-			return 1;
-			
-		}
-
-
-static char *specStructToCommandString(specSettings s) {
-			static char buffer[256];
-			sprintf(buffer, "%c%i;%s;%s;%i;%i;%i;%i;%i;%s\n",
-                EXP_STATUS,
-                experimentRunning(),
-                s.doctorName,
-                s.patientName,
-                s.numScans,
-                s.timeBetweenScans,
-                s.integrationTime,
-                s.boxcarWidth,
-                s.avgPerScan,
-                getExpStatusMessage());
-                
-                return buffer;
-		}
-		
-static specSettings CommandStringToSpecStruct(char *cmdStr) {
-			
-		}
-
+/*
+ * BTServerC
+ * 
+ * 
+ * before compiling, stop the OS from running this with:
+ * sudo systemctl stop BTServer
+ *
+ * options:
+ *   --record <file>    capture frames, pressure and commands to file
+ *   --replay <file>    play a capture back instead of using the hardware
+ *                      and the phone, then report and exit
+ *   --fast             replay as fast as possible rather than in real time
+ *   --local <path>     take clients on a unix socket at path instead of
+ *                      over bluetooth (the soak harness, tools/soak.c)
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include <time.h>
+#include <pthread.h>
+#include <wiringPi.h>
+#include <wiringPiI2C.h>
+
+#include "./include/spectrometerDriver.h"
+#include "./include/experimentFSM.h"
+#include "./include/peakTracker.h"
+#include "./include/pressureSampler.h"
+#include "./include/telemetry.h"
+#include "./include/commandParser.h"
+#include "./include/spectrumKernels.h"
+#include "./include/sessionRecorder.h"
+#include "./include/baselineRemoval.h"
+#include "./include/statusPublisher.h"
+#include "./include/resultArchive.h"
+#include "./include/scanStore.h"
+#include "./include/spectrumPyramid.h"
+#include "./include/shiftEstimator.h"
+#include "./include/acquisitionBroker.h"
+
+
+#define PHONE_MAC 88:AD:D2:F1:A2:83
+#define PI_MAC B8:27:EB:AF:AC:37
+
+#define PRESSURE_BATCH_INTERVAL 250 //ms between batched pressure sends
+#define PRESSURE_BATCH_MAX 256
+#define SPECTRA_RETRY_DELAY 250 //ms between stream frames while the spec is down
+#define EXP_RESULTS_MAX 256     //most scan results sent with one EXP_STATUS
+#define SCAN_RESULT_SIZE 16     //bytes per result in an EXP_RESULTS message
+#define SETTINGS_NAME_LENGTH 128 //longest doctor/patient name or timestamp we keep
+#define LOOKUP_PREVIEW_SIDE 256 //default preview size, along each axis
+#define LOOKUP_MAX_CELLS 16384  //most pyramid cells sent in one EXP_LOOKUP reply
+#define LOOKUP_HEADER_SIZE 24
+#define LOOKUP_CHUNK 0xFF       //in place of the level: a chunk of the results file
+#define LOOKUP_CHUNK_HEADER_SIZE 16
+#define LOOKUP_CHUNK_BYTES 2048 //results file bytes per chunk
+#define LOOKUP_WINDOW 16        //chunks sent per request, by default
+#define LOOKUP_MAX_WINDOW 64
+
+static int getClient();
+static int getLocalClient(int serverSock, char *path);
+static int sendStringToClient(char *string); 
+static int sendBytesToClient(void *bytes, int length);
+static int sendPeakRecordToClient(int device, peakRecord peak);
+static int sendPressureBatchToClient(unsigned short *samples, pressureBatch batch);
+static int sendPressureHistoryToClient(unsigned short *samples, unsigned int *times, int count);
+static int sendSpectrumToClient(specFrame *frame, char command);
+static void onSpecConnectionChange(int device, int state);
+static int sendScanResultsToClient(scanResult *results, int count);
+static int sendLookupToClient(fieldView payload);
+static int sendResultChunksToClient(char *name, long offset, int count);
+static void onScanResult(scanResult result);
+static void parseStreamOptions(fieldView payload, specSettings spec);
+static char *specStructToCommandString(int id, specSettings s);
+static int encodeStatus(char *buf, int size);
+static int sendStatusAndResults();
+static int claimSpectraThread();
+static int spectraWanted();
+static int claimPressureThread();
+static int pressureWanted();
+static specSettings CommandStringToSpecStruct(char *cmdStr);
+
+
+
+
+static FILE *log;
+static int pressureThreadRunning = 0;
+//likewise only ever one pressureThread
+static pthread_mutex_t pressureLock = PTHREAD_MUTEX_INITIALIZER;
+static int pressureThreadActive = 0;
+static int spectraThreadRunning = 0;
+//there's only ever one spectraThread, serving every stream and snapshot
+static pthread_mutex_t spectraLock = PTHREAD_MUTEX_INITIALIZER;
+static int spectraThreadActive = 0;
+static int snapshotWanted = 0;
+static int peakStreamRunning = 0;
+static int streamDeviceMask = 0;
+static int streamExposure = 0;      //auto-exposed stream's integration time: -1 = not found yet, 0 = fixed
+static int streamIntegration = 0;   //the fixed one, and the filters, as the SETTINGS left them
+static filterChain streamFilters;   //compiled under spectraLock, so never seen half-written
+static int streamBaseline = BASELINE_OFF;   //and what comes off each frame before it goes out
+static double streamLambda = 0;
+//each streamed spectrometer's first frame, which peak records are shifted from
+static shiftEstimator streamShifts[MAX_SPECTROMETERS];
+static volatile int streamShiftsStale = 1;
+
+int main(int argc, char **argv)
+{
+    char inBuf[1024];
+    char outBuf[1024];
+    char dn[SETTINGS_NAME_LENGTH], pn[SETTINGS_NAME_LENGTH], ts[SETTINGS_NAME_LENGTH];
+    static commandReader reader;
+    commandView cmd;
+    fieldView field, rest;
+    int parsed;
+
+
+
+    int i, k;
+    int notCreated;
+
+    int deviceConnected = 0;
+
+    int toggle = 1;
+    int bytes_read;
+
+    int serverSock = 0, client = 0;
+
+    char *recordPath = NULL, *replayPath = NULL, *localPath = NULL;
+    int replayFast = 0;
+
+
+
+    //NumScans;Time between;Integration time; boxcar width; averages; result
+    specSettings mySpec = {.numScans = 5, .timeBetweenScans = 60, .integrationTime = 1000, .boxcarWidth = 0, .avgPerScan = 3,
+                           .doctorName = "PI_DEFAULT_DR", .patientName = "PI_DEFAULT_PAT", .timestamp = "12_31_91_2359"};
+
+    /*spectraThread
+     * Takes one reading from each spectrometer in streamDeviceMask and
+     * sends them as spectrum messages (see sendSpectrumToClient), or as
+     * peak records in peak mode, over and over while streaming, and once
+     * for each snapshot. Ends when there's neither.
+     */
+    PI_THREAD(spectraThread)
+    {
+        specFrame frames[MAX_SPECTROMETERS] = {{0}};
+        static baselineWorkspace baseline;
+        static filterChain filters;
+        //only this thread touches these, so they can't change under a frame
+        static double *wavelengths[MAX_SPECTROMETERS];
+        static int numPixels[MAX_SPECTROMETERS];
+        acquisitionRequest request;
+        double peak, low, brightest, floor;
+        int k, numFrames, numGood;
+
+        while (spectraWanted()) {
+            pthread_mutex_lock(&spectraLock);
+            filters = streamFilters;
+            pthread_mutex_unlock(&spectraLock);
+            request = (acquisitionRequest) {streamDeviceMask, streamIntegration, &filters, 0, BROKER_STREAM, 0};
+            brightest = -1;
+            floor = 0;
+            numGood = 0;
+
+            //a new peak stream measures from its own first frames, and
+            //fetches the wavelength arrays once rather than on every frame
+            if (streamShiftsStale) {
+                for (k = 0; k < MAX_SPECTROMETERS; k++) {
+                    shiftReset(&streamShifts[k]);
+                    int n = getDeviceNumPixels(k);
+                    double *wl = realloc(wavelengths[k], (n > 0 ? n : 1) * sizeof (double));
+                    if (!wl) {
+                        numPixels[k] = 0;
+                        continue;
+                    }
+                    wavelengths[k] = wl;
+                    numPixels[k] = getDeviceWavelengthArray(k, wl, n);
+                }
+                streamShiftsStale = 0;
+            }
+
+            //a snapshot will take a frame somebody else read a moment ago
+            if (!spectraThreadRunning) {
+                request.priority = BROKER_SNAPSHOT;
+                request.maxAge = SNAPSHOT_MAX_AGE;
+            }
+
+            //an auto-exposed stream finds its exposure before its first frame
+            if (streamExposure < 0) {
+                streamExposure = brokerAutoExpose(streamDeviceMask, request.priority);
+            }
+            if (streamExposure > 0) {
+                request.integrationTime = streamExposure;
+            }
+
+            //get a reading from every streamed spectrometer at once
+            //if spec never connected, we get a simulated peak.
+            //if one dropped out, its frame fails straight away; tell the phone
+            //on a snapshot, and just idle a moment while streaming
+            numFrames = brokerAcquire(&request, frames);
+            for (k = 0; k < numFrames; k++) {
+                if (frames[k].status != 0) {
+                    continue;
+                }
+                numGood++;
+                if (streamExposure > 0) {
+                    peak = framePeak(&frames[k], &low);
+                    if (peak > brightest) {
+                        brightest = peak;
+                        floor = low;
+                    }
+                }
+
+                //exposure goes by the detector's own counts; everything after
+                //by the spectrum with its background taken off
+                baselineRemove(&baseline, streamBaseline, streamLambda, frames[k].spectrum, frames[k].numPixels);
+
+                if (peakStreamRunning) {
+                    //in peak mode we only send a few bytes describing the peak
+                    peakRecord peak;
+                    int d = frames[k].device;
+                    int n = frames[k].numPixels < numPixels[d] ? frames[k].numPixels : numPixels[d];
+                    if (estimatePeak(wavelengths[d], frames[k].spectrum, n, &peak) == 0) {
+                        double shift = 0;
+                        if (!streamShifts[d].ready) {
+                            shiftSetReference(&streamShifts[d], wavelengths[d], frames[k].spectrum, n);
+                        } else {
+                            shiftEstimate(&streamShifts[d], wavelengths[d], frames[k].spectrum, n, &shift);
+                        }
+                        peak.timestamp = frames[k].timestamp;
+                        peak.shift = shift;
+                        peakHistoryAdd(frames[k].device, peak);
+                        sendPeakRecordToClient(frames[k].device, peak);
+                    }
+                } else {
+                    //otherwise zap the whole spectrum over
+                    sendSpectrumToClient(&frames[k], SNAPSHOT);
+                }
+            }
+
+            //and keeps it in the band from its own frames as the sample changes
+            if (streamExposure > 0 && brightest >= 0) {
+                streamExposure = adjustExposure(streamExposure, brightest, floor);
+            }
+
+            if (numGood == 0) {
+                if (!spectraThreadRunning) {
+                    sendStringToClient("Spectrometer unavailable!\n");
+                    continue;
+                }
+                delay(SPECTRA_RETRY_DELAY);
+            }
+        }
+
+        //the frames' arrays are kept from one reading to the next
+        freeSpecFrames(frames, MAX_SPECTROMETERS);
+        return NULL;
+    }
+
+    /*pressureThread
+     * when started, drains whatever the pressure sampler has collected
+     * and sends it as one binary batch every PRESSURE_BATCH_INTERVAL.
+     * Terminates when main() sets pressureThreadRunning back to 0, unless
+     * it was set again before the thread looked, in which case it carries on.
+     */
+    PI_THREAD(pressureThread)
+    {
+        unsigned short samples[PRESSURE_BATCH_MAX];
+        pressureBatch batch;
+
+        while (pressureWanted()) {
+            while (drainPressureSamples(samples, PRESSURE_BATCH_MAX, &batch) > 0) {
+                sendPressureBatchToClient(samples, batch);
+            }
+            delay(PRESSURE_BATCH_INTERVAL);
+        }
+    }
+    
+
+
+
+
+
+
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (!strcmp(argv[i], "--fast")) {
+            replayFast = 1;
+        } else if (!strcmp(argv[i], "--local") && i + 1 < argc) {
+            localPath = argv[++i];
+        } else {
+            printf("unknown option %s\n", argv[i]);
+        }
+    }
+
+    //a replay has to be loaded before the hardware, which it stands in for
+    if (replayPath && sessionReplayOpen(replayPath, !replayFast) != 0) {
+        exit(1);
+    }
+
+    //open the spectrometer, GPIO and ADC now rather than on the first
+    //command, so the phone's first request is as quick as any other
+    setSpecConnectionCallback(onSpecConnectionChange);
+    setScanResultCallback(onScanResult);
+    if (initHardware() != 0) {
+        printf("Hardware init failed at startup; will retry on first use.\n");
+    }
+    if (recordPath) {
+        sessionRecordStart(recordPath);
+    }
+
+    //the experiments just mark their status as changed; this pushes it
+    //to the phone if it has subscribed
+    if (statusPublisherStart(encodeStatus, sendBytesToClient) != 0) {
+        exit(5);
+    }
+
+    //pick up any experiment we were in the middle of when we went down.
+    //not during a replay, which should only do what the recording did
+    if (!sessionReplaying()) {
+        recoverExperiments(statusChanged);
+    }
+
+    //one log and one listening socket for the life of the server, not
+    //one per connection; a client that reconnects while we're still
+    //tidying up after it waits in the socket's backlog
+    sprintf(inBuf, "./log_%s.txt", "blerp");
+    log = fopen(inBuf, "a");
+    if (!log) {
+        exit(-1);
+    }
+    if (sessionReplaying()) {
+        serverSock = -1;
+    } else if (localPath) {
+        serverSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    } else {
+        serverSock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+    }
+
+    //main loop: continually seek a connection and fire off threads
+    //to handle it
+    while (1) {
+        if (sessionReplaying()) {
+            client = sessionReplayConnect();
+        } else if (localPath) {
+            client = getLocalClient(serverSock, localPath);
+        } else {
+            client = getClient(serverSock);
+        }
+        deviceConnected = telemetryStart(client) == 0;
+        commandReaderInit(&reader, client);
+
+        while (deviceConnected) {
+
+            //handle every complete command we have; only once we run out
+            //do we go back to the socket for more
+            parsed = commandReaderNext(&reader, &cmd);
+            if (parsed < 0) {
+                printf("Client sent a bad frame; dropping it.\n");
+                deviceConnected = 0;
+                break;
+            }
+            if (parsed == 0) {
+                bytes_read = commandReaderFill(&reader);
+                if (bytes_read <= 0) {
+                    printf("Client has disconnected. Noticed upon Read.\n");
+                    deviceConnected = 0;
+                    break;
+                }
+                continue;
+            }
+
+            printf("received [%c%.*s]\n", cmd.command, cmd.payload.length, cmd.payload.data);
+            sessionRecordCommand(cmd);
+            //fprintf(log, "received [%s]\n", inBuf);
+
+            //big main switch statement here switching on command char:
+            switch (cmd.command) {
+
+            case MOTOR_ON:
+                //sendStringToClient("Turning on motor...\n");
+                motor_ON();
+                break;
+
+            case MOTOR_OFF:
+                //sendStringToClient("Turning off motor...\n");
+                motor_OFF();
+                break;
+
+            case LED_ON:
+                //sendStringToClient("Turning on LED...\n");
+                led_ON();
+                break;
+
+            case LED_OFF:
+                //sendStringToClient("Turning off LED...\n");
+                led_OFF();
+                break;
+
+			//wen exiting the hardware screen, reset everything
+			case HARDWARE_OFF:
+				pressureThreadRunning = 0;
+				spectraThreadRunning = 0;
+				peakStreamRunning = 0;
+				stopPressureSampler();
+				led_OFF();
+				motor_OFF();
+			
+				break;
+
+            case REQUEST_PRESSURE:
+
+                //if this command comes, start up the thread to
+                //continually send pressure readings.
+                //optional payload: [rate in Hz];[decimation]
+                if (pressureThreadRunning) {
+                    pressureThreadRunning = 0;
+                    stopPressureSampler();
+                } else {
+                    rest = cmd.payload;
+                    int rate = nextField(&rest, &field, ';') ? fieldToInt(field, 0) : 0;
+                    int decimation = nextField(&rest, &field, ';') ? fieldToInt(field, 0) : 0;
+                    if (startPressureSampler(rate, decimation)) {
+                        break;
+                    }
+                    pressureThreadRunning = 1;
+                    notCreated = claimPressureThread() && piThreadCreate(pressureThread);
+                    if (notCreated) {
+                        printf("pi thread failed somehow!\n");
+                        exit(5);
+                    }
+                }
+                break;
+
+            case SNAPSHOT:
+
+                //if this command comes, start the thread to transmit spectrum
+                //sendStringToClient("Received spectrum request...\n");
+                parseStreamOptions(cmd.payload, mySpec);
+                spectraThreadRunning = 0;
+                peakStreamRunning = 0;
+                snapshotWanted = 1;
+                if (claimSpectraThread() && piThreadCreate(spectraThread)) {
+                    printf("pi thread failed somehow!\n");
+                    exit(5);
+                }
+                break;
+
+			//optional payload: devices=0,2;exposure=auto (defaults to the SETTINGS ones)
+			case START_STREAM:
+				parseStreamOptions(cmd.payload, mySpec);
+				spectraThreadRunning = 1;
+				peakStreamRunning = 0;
+				if (claimSpectraThread() && piThreadCreate(spectraThread)) {
+                    printf("pi thread failed somehow!\n");
+                    exit(5);
+                }
+				break;
+				
+			case STOP_STREAM:
+				spectraThreadRunning = 0;
+				peakStreamRunning = 0;
+				break;
+
+			//toggles a stream of compact peak records
+			case PEAK_STREAM:
+				if (peakStreamRunning) {
+					spectraThreadRunning = 0;
+					peakStreamRunning = 0;
+					break;
+				}
+				parseStreamOptions(cmd.payload, mySpec);
+				peakHistoryReset();
+				streamShiftsStale = 1;
+				peakStreamRunning = 1;
+				spectraThreadRunning = 1;
+				if (claimSpectraThread() && piThreadCreate(spectraThread)) {
+					printf("pi thread failed somehow!\n");
+					exit(5);
+				}
+				break;
+
+			//count;min;max;mean of the recent peaks, then the latest record.
+			//optional payload: the spectrometer to ask about
+			case PEAK_HISTORY:;
+				peakStats stats = getPeakHistoryStats(fieldToInt(cmd.payload, 0));
+				sprintf(outBuf, "%c%i;%.3f;%.3f;%.3f;%.3f;%.1f;%.3f",
+						PEAK_HISTORY, stats.count, stats.min, stats.max, stats.mean,
+						stats.last.wavelength, stats.last.intensity, stats.last.fwhm);
+				sendStringToClient(outBuf);
+				break;
+	
+            case SETTINGS:
+
+                //if this command comes, we expect to receive settings. read them
+                //in from the message to the struct.
+                
+                //NumScans;Time between;Integration time; boxcar width; averages;
+                //doctor;patient;timestamp, then any key=value options and
+                //maybe the request to start. Fields we don't get keep their
+                //old values.
+                rest = cmd.payload;
+                if (nextField(&rest, &field, ';')) {
+                    mySpec.numScans = fieldToInt(field, mySpec.numScans);
+                }
+                if (nextField(&rest, &field, ';')) {
+                    mySpec.timeBetweenScans = fieldToInt(field, mySpec.timeBetweenScans);
+                }
+                if (nextField(&rest, &field, ';')) {
+                    mySpec.integrationTime = fieldToInt(field, mySpec.integrationTime);
+                }
+                if (nextField(&rest, &field, ';')) {
+                    mySpec.boxcarWidth = fieldToInt(field, mySpec.boxcarWidth);
+                }
+                if (nextField(&rest, &field, ';')) {
+                    mySpec.avgPerScan = fieldToInt(field, mySpec.avgPerScan);
+                }
+
+                //the names are the only thing that outlives this command,
+                //so they are the only thing we copy out of it
+                if (nextField(&rest, &field, ';')) {
+                    fieldCopy(field, dn, sizeof (dn));
+                    mySpec.doctorName = dn;
+                }
+                if (nextField(&rest, &field, ';')) {
+                    fieldCopy(field, pn, sizeof (pn));
+                    mySpec.patientName = pn;
+                }
+                if (nextField(&rest, &field, ';')) {
+                    fieldCopy(field, ts, sizeof (ts));
+                    mySpec.timestamp = ts;
+                }
+				
+				//anything left is either a key=value option or the
+				//request to start the experiment:
+				fieldView startRequest = {NULL, 0};
+				while (nextField(&rest, &field, ';')) {
+					if (memchr(field.data, '=', field.length)) {
+						parseSpecOption(&mySpec, field);
+					} else if (field.length > 0 && !startRequest.data) {
+						startRequest = field;
+					}
+				}
+				
+				brokerApplySettings(mySpec);
+                printSpecSettings(mySpec);
+				
+				if(startRequest.data && !fieldEquals(startRequest,"Engage thrusters")) {
+					//if we get here, the command string included
+					//a request to start the experiment. It runs
+					//alongside any that are going already
+					int id = initExperiment(mySpec, statusChanged);
+					if (id < 0) {
+						sendStringToClient("Could not start experiment: already running too many, or one with this timestamp\n");
+					} else {
+						runExperimentInstance(id, START_EXPERIMENT);
+					}
+				} 
+
+
+                break;
+
+            //optional payload: number of seconds of history wanted
+            case PRESSURE_HISTORY:; 
+                static unsigned short historyBuf[PRESSURE_HISTORY_LENGTH];
+                static unsigned int historyTimes[PRESSURE_HISTORY_LENGTH];
+                int wanted = fieldToInt(cmd.payload, PRESSURE_HISTORY_LENGTH);
+                if (wanted <= 0 || wanted > PRESSURE_HISTORY_LENGTH) {
+                    wanted = PRESSURE_HISTORY_LENGTH;
+                }
+                int numHistory = getPressureHistory(historyBuf, historyTimes, wanted);
+                sendPressureHistoryToClient(historyBuf, historyTimes, numHistory);
+                break;
+
+            case SPEC_CONNECTION:
+                for (i = 0; i < getNumSpectrometers(); i++) {
+                    onSpecConnectionChange(i, getDeviceConnectionState(i));
+                }
+                break;
+
+            //optional payload: the timestamp of the experiment to stop.
+            //without one, every experiment stops
+            case EXP_STOP:;
+                char stopTimestamp[SETTINGS_NAME_LENGTH];
+                int stopIds[MAX_EXPERIMENTS];
+                int numStop;
+                if (cmd.payload.length > 0) {
+                    fieldCopy(cmd.payload, stopTimestamp, sizeof (stopTimestamp));
+                    stopIds[0] = findExperiment(stopTimestamp);
+                    numStop = stopIds[0] < 0 ? 0 : 1;
+                } else {
+                    numStop = getExperimentIds(stopIds, MAX_EXPERIMENTS);
+                }
+                for (i = 0; i < numStop; i++) {
+                    runExperimentInstance(stopIds[i], STOP_EXPERIMENT);
+                }
+                break;
+
+            //optional payload: subscribe, to have the status pushed as it
+            //changes from now on, or unsubscribe. Either way (or with no
+            //payload) the current status and results are sent now
+            case EXP_STATUS:
+                if (fieldEquals(cmd.payload, "subscribe")) {
+                    statusSubscribe(1);
+                } else if (fieldEquals(cmd.payload, "unsubscribe")) {
+                    statusSubscribe(0);
+                }
+                deviceConnected = sendStatusAndResults();
+                break;
+                
+            case EXP_LOOKUP:
+                deviceConnected = sendLookupToClient(cmd.payload);
+                break;
+
+            case EXP_LIST:; //semicolon lets us declare vars in a switch statement
+				char *savedExperiments[10] = {"hey","friend","here","is","a","list","of","experiments","for","you"};  //= getExperimentList();
+				int numSavedExperiments = 10; //getExperimentListLength();
+				char buf[512];
+
+				
+				for(int i = 0; i < numSavedExperiments; i++) {
+					
+					if(i == 0) {
+						sprintf(buf,"%c;Header",EXP_LIST);
+						sendStringToClient(buf);
+						}
+						
+					sprintf(buf,"%c%s",EXP_LIST,savedExperiments[i]);
+					sendStringToClient(buf);
+					}
+					
+				sprintf(buf,"%c;Footer",EXP_LIST);
+				sendStringToClient(buf);
+
+				
+				
+				break;
+
+            //mean, range and trend of one result field across finished
+            //experiments. payload: patient=;doctor=;from=;to=;last=;device=;field=
+            //reply: experiments;count;mean;min;max;range;slope per day;first;last
+            case EXP_QUERY:;
+                archiveQuery query;
+                archiveStats found;
+                char names[2][ARCHIVE_NAME_LENGTH];
+
+                if (parseArchiveQuery(cmd.payload, &query, names) != 0) {
+                    sendStringToClient("Bad archive query!\n");
+                    break;
+                }
+                if (archiveQueryStats(&query, &found) != 0) {
+                    sendStringToClient("Archive unavailable!\n");
+                    break;
+                }
+                sprintf(outBuf, "%c%i;%i;%.4f;%.4f;%.4f;%.4f;%.6f;%u;%u",
+                        EXP_QUERY, found.experiments, found.count, found.mean, found.min, found.max,
+                        found.max - found.min, found.slope, found.first, found.last);
+                deviceConnected = sendStringToClient(outBuf);
+                break;
+
+            case 'F':
+                deviceConnected = sendStringToClient("You have found a debug message! hehe :)\n");
+                break;
+
+            default:
+                if ((int) cmd.command == 0) {
+                    printf("got null\n", client);
+                }
+                deviceConnected = sendStringToClient("Unrecognized Inbound Message!!\n");
+                break;
+            }
+        }
+
+        printf("restarting listening loop!\n");
+
+        pressureThreadRunning = 0;
+        spectraThreadRunning = 0;
+        peakStreamRunning = 0;
+        statusSubscribe(0);
+        stopPressureSampler();
+        telemetryStop();
+
+        close(client);
+
+        //a replay is one pass through the recording
+        if (sessionReplaying()) {
+            sessionReplayReport();
+            break;
+        }
+
+    }//end main listening loop
+
+	//we will almost certainly never get here, unless replaying: 
+    if (serverSock >= 0) {
+        close(serverSock);
+    }
+    fclose(log);
+    sessionRecordStop();
+    printf("SESSION END\n");
+
+    return 0;
+}
+
+/*
+ * getClient
+ * Accepts an open server socket, listens on the socket for connections
+ * (binding it the first time), and returns the client it finds. 
+ */
+static int getClient(int serverSock)
+{
+	
+	//ideally this would securely open a connection but nonfunctional:
+	//return system("sudo ./py/advertiser.py");
+	
+	
+	//doing it in c WITHOUT uuid:
+	
+    char inBuf[1023];
+    // allocate socket
+    struct sockaddr_rc loc_addr = {0}, rem_addr = {0};
+    socklen_t opt = sizeof (rem_addr);
+    static int listening = 0;
+
+    if (!listening) {
+        // bind socket to port 1 of the first available 
+        // local bluetooth adapter
+        loc_addr.rc_family = AF_BLUETOOTH;
+        loc_addr.rc_bdaddr = *BDADDR_ANY;
+        loc_addr.rc_channel = (uint8_t) 1;
+        printf("Attempting to bind socket...\n");
+
+        bind(serverSock, (struct sockaddr *) &loc_addr, sizeof (loc_addr));
+
+        // put socket into listening mode
+        listen(serverSock, 1);
+        listening = 1;
+    }
+    printf("Listening for connections...\n");
+
+    // accept one connection
+    int client = accept(serverSock, (struct sockaddr *) &rem_addr, &opt);
+
+    ba2str(&rem_addr.rc_bdaddr, inBuf);
+    fprintf(stderr, "accepted connection from %s with client = %i\n", inBuf,client);
+    //fprintf(log, "accepted connection from %s\n", inBuf);
+
+    return client;
+    
+}
+
+/*
+ * getLocalClient
+ * getClient for a unix socket at path, replacing whatever was there
+ */
+static int getLocalClient(int serverSock, char *path)
+{
+    struct sockaddr_un addr = {0};
+    static int listening = 0;
+
+    if (!listening) {
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof (addr.sun_path), "%s", path);
+        unlink(path);
+        if (bind(serverSock, (struct sockaddr *) &addr, sizeof (addr)) != 0 || listen(serverSock, 1) != 0) {
+            printf("could not listen on %s\n", path);
+            exit(-1);
+        }
+        listening = 1;
+    }
+    printf("Listening for connections on %s...\n", path);
+    return accept(serverSock, NULL, NULL);
+}
+
+/*
+ * Queues input string on the telemetry channel that matches its command
+ * character. Pressure, peak and status replies go out at high priority.
+ * returns 1 if connected and message queued; else returns 0
+ */
+static int sendStringToClient(char *string)
+{
+    int connected = sendBytesToClient(string, strlen(string));
+
+    if (connected) {
+        printf("Sent to client: %s\n", string);
+    }
+    return connected;
+}
+
+/*
+ * Queues raw bytes for the client, for the binary records that can't go
+ * through the string path (they may contain zeros). The first byte is
+ * the command character, which also picks the channel.
+ * returns 1 if connected and message queued; else returns 0
+ */
+static int sendBytesToClient(void *bytes, int length)
+{
+    int channel, priority = PRIORITY_HIGH;
+
+    switch (((unsigned char *) bytes)[0]) {
+    case EXP_STATUS:
+    case EXP_RESULTS:
+    case SPEC_CONNECTION:
+        channel = CHANNEL_STATUS;
+        break;
+    case REQUEST_PRESSURE:
+    case PRESSURE_HISTORY:
+        channel = CHANNEL_PRESSURE;
+        break;
+    case PEAK_STREAM:
+    case PEAK_HISTORY:
+        channel = CHANNEL_PEAK;
+        break;
+    case SNAPSHOT:
+        channel = CHANNEL_SPECTRUM;
+        priority = PRIORITY_LOW;
+        break;
+    case EXP_LOOKUP:
+        channel = CHANNEL_LOOKUP;
+        priority = PRIORITY_LOW;
+        break;
+    case EXP_LIST:
+    case EXP_QUERY:
+        channel = CHANNEL_LIST;
+        break;
+    default:
+        channel = CHANNEL_CONTROL;
+        break;
+    }
+
+    //we want to return 0 if the client isn't there anymore.
+    //eg, status thread tries to run while the researcher is eating lunch
+    return telemetrySend(channel, priority, bytes, length);
+}
+
+/*
+ * Sends one peak record as
+ * [PEAK_STREAM][device][timestamp][wavelength][intensity][fwhm][shift]
+ * with the fields in the Pi's native (little-endian) byte order.
+ * 22 bytes per frame instead of a whole spectrum.
+ */
+static int sendPeakRecordToClient(int device, peakRecord peak)
+{
+    unsigned char buf[2 + sizeof (peakRecord)];
+
+    buf[0] = PEAK_STREAM;
+    buf[1] = device;
+    memcpy(&buf[2], &peak, sizeof (peakRecord));
+    return sendBytesToClient(buf, sizeof (buf));
+}
+
+/*
+ * Sends a run of pressure samples as
+ * [REQUEST_PRESSURE][uint16 count][uint32 start ms][uint32 period us][uint16 samples...]
+ */
+static int sendPressureBatchToClient(unsigned short *samples, pressureBatch batch)
+{
+    unsigned char buf[11 + 2 * batch.count];
+    unsigned short count = batch.count;
+
+    buf[0] = REQUEST_PRESSURE;
+    memcpy(&buf[1], &count, 2);
+    memcpy(&buf[3], &batch.startTime, 4);
+    memcpy(&buf[7], &batch.periodMicros, 4);
+    memcpy(&buf[11], samples, 2 * count);
+    return sendBytesToClient(buf, 11 + 2 * count);
+}
+
+/*
+ * Sends the pressure history as
+ * [PRESSURE_HISTORY][uint16 count][uint32 ms...][uint16 samples...]
+ * with a time for every entry, as the history has gaps wherever
+ * the sampler was stopped.
+ */
+static int sendPressureHistoryToClient(unsigned short *samples, unsigned int *times, int count)
+{
+    unsigned char buf[3 + 6 * count];
+    unsigned short n = count;
+
+    buf[0] = PRESSURE_HISTORY;
+    memcpy(&buf[1], &n, 2);
+    memcpy(&buf[3], times, 4 * count);
+    memcpy(&buf[3 + 4 * count], samples, 2 * count);
+    return sendBytesToClient(buf, 3 + 6 * count);
+}
+
+/*
+ * Called by the driver's hot-plug supervisor whenever a spectrometer
+ * comes or goes, so the phone hears about it without asking.
+ * [SPEC_CONNECTION][device];[state];[serial number]
+ */
+static void onSpecConnectionChange(int device, int state)
+{
+    char buf[128];
+
+    sprintf(buf, "%c%i;%i;%s", SPEC_CONNECTION, device, state, getDeviceInfo(device).serialNumber);
+    sendStringToClient(buf);
+}
+
+/*
+ * Answers EXP_LOOKUP from a finished experiment's pyramid. The payload is
+ * the experiment's timestamp, then either
+ *   pixels=P;scans=S   the most points the client can plot along each axis
+ *                      (default LOOKUP_PREVIEW_SIDE): the finest whole level that fits
+ *   tile=L,R,C         tile (R, C) of level L, PYRAMID_TILE_SIZE cells a side
+ *   offset=N;chunks=K  K chunks (default LOOKUP_WINDOW) of the results file
+ *                      itself from byte N on; see sendResultChunksToClient
+ * and the reply is
+ * [EXP_LOOKUP][uint8 level][uint8 levels][uint8 values per cell]
+ * [uint32 level rows][uint32 level cols][uint32 first row][uint32 first col]
+ * [uint16 rows][uint16 cols] then the cells row (pixel) by row as float32:
+ * the value on level 0, min, max, mean above it. NaN is a cell with no data.
+ */
+static int sendLookupToClient(fieldView payload)
+{
+    char name[SETTINGS_NAME_LENGTH], path[SETTINGS_NAME_LENGTH + 64];
+    fieldView field, key, value;
+    spectrumPyramid p;
+    unsigned char *buf;
+    int maxRows = LOOKUP_PREVIEW_SIDE, maxCols = LOOKUP_PREVIEW_SIDE;
+    int level = -1, row = 0, col = 0, rows, cols, n, connected, chunks = LOOKUP_WINDOW;
+    long offset = -1;
+    unsigned int u;
+    unsigned short s;
+
+    nextField(&payload, &field, ';');
+    fieldCopy(field, name, sizeof (name));
+    if (!name[0] || strchr(name, '/') || strstr(name, "..")) {
+        return sendStringToClient("Bad experiment lookup!\n");
+    }
+    while (nextField(&payload, &field, ';')) {
+        value = field;
+        nextField(&value, &key, '=');
+        if (fieldEquals(key, "pixels")) {
+            maxRows = fieldToInt(value, maxRows);
+        } else if (fieldEquals(key, "scans")) {
+            maxCols = fieldToInt(value, maxCols);
+        } else if (fieldEquals(key, "tile")) {
+            nextField(&value, &field, ',');
+            level = fieldToInt(field, -1);
+            nextField(&value, &field, ',');
+            row = fieldToInt(field, 0) * PYRAMID_TILE_SIZE;
+            col = fieldToInt(value, 0) * PYRAMID_TILE_SIZE;
+        } else if (fieldEquals(key, "offset")) {
+            offset = fieldToInt(value, -1);
+        } else if (fieldEquals(key, "chunks")) {
+            chunks = fieldToInt(value, chunks);
+        }
+    }
+    if (offset >= 0) {
+        return sendResultChunksToClient(name, offset, chunks);
+    }
+
+    sprintf(path, "./experiment_results/%s%s", name, PYRAMID_SUFFIX);
+    if (pyramidOpen(&p, path) != 0) {
+        return sendStringToClient("No preview for that experiment!\n");
+    }
+    if (level < 0) {
+        //the whole level goes in one reply, so it has to be small enough
+        level = pyramidChooseLevel(&p, maxRows, maxCols);
+        while (level < p.numLevels - 1 && (long) p.levels[level].rows * p.levels[level].cols > LOOKUP_MAX_CELLS) {
+            level++;
+        }
+        rows = p.levels[level].rows;
+        cols = p.levels[level].cols;
+    } else {
+        rows = cols = PYRAMID_TILE_SIZE;
+    }
+    if (level >= p.numLevels || (long) rows * cols > LOOKUP_MAX_CELLS) {
+        pyramidClose(&p);
+        return sendStringToClient("Bad experiment lookup!\n");
+    }
+
+    buf = malloc(LOOKUP_HEADER_SIZE + (long) rows * cols * 3 * sizeof (float));
+    if (!buf) {
+        pyramidClose(&p);
+        printf("we didnt get the memory for a lookup\n");
+        return 1;
+    }
+    n = pyramidRead(&p, level, row, col, rows, cols, (float *) &buf[LOOKUP_HEADER_SIZE], &rows, &cols);
+    if (n < 0) {
+        free(buf);
+        pyramidClose(&p);
+        return sendStringToClient("Could not read that experiment!\n");
+    }
+
+    buf[0] = EXP_LOOKUP;
+    buf[1] = level;
+    buf[2] = p.numLevels;
+    buf[3] = pyramidValuesPerCell(level);
+    u = p.levels[level].rows;
+    memcpy(&buf[4], &u, 4);
+    u = p.levels[level].cols;
+    memcpy(&buf[8], &u, 4);
+    u = row;
+    memcpy(&buf[12], &u, 4);
+    u = col;
+    memcpy(&buf[16], &u, 4);
+    s = rows;
+    memcpy(&buf[20], &s, 2);
+    s = cols;
+    memcpy(&buf[22], &s, 2);
+    pyramidClose(&p);
+
+    connected = sendBytesToClient(buf, LOOKUP_HEADER_SIZE + n * sizeof (float));
+    free(buf);
+    return connected;
+}
+
+/*
+ * Sends up to count chunks of a finished experiment's results file,
+ * starting at byte offset, each as
+ * [EXP_LOOKUP][LOOKUP_CHUNK][uint16 length][uint32 file size][uint32 offset]
+ * [uint32 checksum][length bytes of the file]
+ * with an FNV-1a checksum of the bytes, the same as the scan store's. The
+ * chunk ending at the file size is the last; asking from the end gets an
+ * empty one. There's nothing to acknowledge: the client asks for the next
+ * window from the end of the last chunk it checked, and after a dropped
+ * link it just asks from there again. A changed file size means the file
+ * was rewritten, and it starts over.
+ *
+ * The window is mapped rather than read, and each chunk copied straight
+ * from the mapping into its message. sendfile would be less still, but
+ * the chunks go out framed and interleaved by the telemetry layer
+ */
+static int sendResultChunksToClient(char *name, long offset, int count)
+{
+    char path[SETTINGS_NAME_LENGTH + 64];
+    unsigned char buf[LOOKUP_CHUNK_HEADER_SIZE + LOOKUP_CHUNK_BYTES];
+    unsigned char *map;
+    int ids[MAX_EXPERIMENTS];
+    int i, fd, connected = 1, numExperiments = getExperimentIds(ids, MAX_EXPERIMENTS);
+    long start, end, length;
+    unsigned int u;
+    unsigned short s;
+    struct stat st;
+
+    //still being written: it isn't what it will be yet
+    for (i = 0; i < numExperiments; i++) {
+        char *timestamp = getInstanceSettings(ids[i]).timestamp;
+        if (timestamp && !strcmp(timestamp, name)) {
+            return sendStringToClient("That experiment is still running!\n");
+        }
+    }
+
+    count = count < 1 ? 1 : count > LOOKUP_MAX_WINDOW ? LOOKUP_MAX_WINDOW : count;
+    sprintf(path, "./experiment_results/%s", name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return sendStringToClient("No results for that experiment!\n");
+    }
+    if (offset > st.st_size) {
+        close(fd);
+        return sendStringToClient("Bad experiment lookup!\n");
+    }
+
+    //just the window, from the page it starts in
+    end = offset + (long) count * LOOKUP_CHUNK_BYTES;
+    end = end > st.st_size ? st.st_size : end;
+    start = offset - offset % sysconf(_SC_PAGESIZE);
+    map = NULL;
+    if (end > start) {
+        map = mmap(NULL, end - start, PROT_READ, MAP_PRIVATE, fd, start);
+        if (map == MAP_FAILED) {
+            close(fd);
+            printf("could not map %s\n", path);
+            return sendStringToClient("Could not read that experiment!\n");
+        }
+    }
+    close(fd);
+
+    buf[0] = EXP_LOOKUP;
+    buf[1] = LOOKUP_CHUNK;
+    u = st.st_size;
+    memcpy(&buf[4], &u, 4);
+    do {
+        length = end - offset < LOOKUP_CHUNK_BYTES ? end - offset : LOOKUP_CHUNK_BYTES;
+        if (length > 0) {
+            memcpy(&buf[LOOKUP_CHUNK_HEADER_SIZE], &map[offset - start], length);
+        }
+        s = length;
+        memcpy(&buf[2], &s, 2);
+        u = offset;
+        memcpy(&buf[8], &u, 4);
+        u = scanStoreChecksum(SCAN_STORE_CHECKSUM_START, &buf[LOOKUP_CHUNK_HEADER_SIZE], length);
+        memcpy(&buf[12], &u, 4);
+        connected = sendBytesToClient(buf, LOOKUP_CHUNK_HEADER_SIZE + length);
+        offset += length;
+    } while (connected && offset < end);
+
+    if (map) {
+        munmap(map, end - start);
+    }
+    return connected;
+}
+
+/*
+ * Sends experiment results as
+ * [EXP_RESULTS][uint16 count] followed by count of
+ * [uint8 experiment][uint8 device][uint16 scan][uint32 timestamp][float32 peak][float32 shift]
+ * Each fit is pushed on its own as it finishes; EXP_STATUS sends the lot.
+ */
+static int sendScanResultsToClient(scanResult *results, int count)
+{
+    unsigned char buf[3 + SCAN_RESULT_SIZE * count];
+    unsigned char *rec;
+    unsigned short n = count, scan;
+    float peak, shift;
+    int i;
+
+    buf[0] = EXP_RESULTS;
+    memcpy(&buf[1], &n, 2);
+    for (i = 0; i < count; i++) {
+        rec = &buf[3 + SCAN_RESULT_SIZE * i];
+        scan = results[i].scan;
+        peak = results[i].peakWavelength;
+        shift = results[i].shift;
+        rec[0] = results[i].experiment;
+        rec[1] = results[i].device;
+        memcpy(&rec[2], &scan, 2);
+        memcpy(&rec[4], &results[i].timestamp, 4);
+        memcpy(&rec[8], &peak, 4);
+        memcpy(&rec[12], &shift, 4);
+    }
+    return sendBytesToClient(buf, sizeof (buf));
+}
+
+/*
+ * Called by the experiment's fitting thread as each scan is fitted
+ */
+static void onScanResult(scanResult result)
+{
+    sendScanResultsToClient(&result, 1);
+}
+
+/*
+ * Sends one spectrometer's frame as one message:
+ * [command][uint8 device][uint32 frame timestamp][uint16 count][float32 readings...]
+ * Frames taken together share (nearly) the same timestamp, so the phone
+ * can line them up. The telemetry layer cuts each one into chunks so it
+ * can't hold up the small stuff.
+ */
+static int sendSpectrumToClient(specFrame *frame, char command)
+{
+    unsigned char buf[8 + frame->numPixels * sizeof (float)];
+    unsigned short count = frame->numPixels;
+
+    buf[0] = command;
+    buf[1] = frame->device;
+    memcpy(&buf[2], &frame->timestamp, 4);
+    memcpy(&buf[6], &count, 2);
+    spectrumEncodeFloat32(frame->spectrum, &buf[8], frame->numPixels);
+    return sendBytesToClient(buf, sizeof (buf));
+}
+
+/*
+ * Which spectrometers a snapshot or stream should use, whether it is
+ * auto-exposed, how it is filtered and what baseline comes off:
+ * devices=..., exposure=..., filter=... and baseline=... options in the
+ * payload if there are any, otherwise
+ * whatever SETTINGS last asked for
+ */
+static void parseStreamOptions(fieldView payload, specSettings spec)
+{
+    fieldView field;
+
+    while (nextField(&payload, &field, ';')) {
+        if (memchr(field.data, '=', field.length)) {
+            parseSpecOption(&spec, field);
+        }
+    }
+    streamDeviceMask = spec.deviceMask;
+    streamExposure = spec.autoExposure ? -1 : 0;
+    streamIntegration = spec.integrationTime;
+    pthread_mutex_lock(&spectraLock);
+    filterChainCompile(&streamFilters, spec.boxcarWidth, spec.filters);
+    pthread_mutex_unlock(&spectraLock);
+    streamBaseline = spec.baselineMethod;
+    streamLambda = spec.baselineLambda;
+}
+
+
+/*
+ * The status of every experiment (or the idle status if there are
+ * none), one line each. The status publisher calls this when the
+ * status has changed and somebody wants it, and caches the result
+ */
+static int encodeStatus(char *buf, int size)
+{
+    //start with some default settings that we don't really care
+    //about if the experiment is idle.
+    specSettings s = {.doctorName = "", .patientName = "", .timestamp = ""};
+    int ids[MAX_EXPERIMENTS];
+    int i, length = 0, numExperiments = getExperimentIds(ids, MAX_EXPERIMENTS);
+
+    if (numExperiments == 0) {
+        return snprintf(buf, size, "%s", specStructToCommandString(-1, s));
+    }
+    for (i = 0; i < numExperiments && length < size; i++) {
+        s = getInstanceSettings(ids[i]);
+        length += snprintf(&buf[length], size - length, "%s", specStructToCommandString(ids[i], s));
+    }
+    return length < size ? length : size;
+}
+
+/*
+ * Sends the status (from the publisher's cache, if nothing has changed)
+ * followed by the results fitted so far, so the phone can draw the trend
+ * of a run that is still going
+ */
+static int sendStatusAndResults()
+{
+    static char status[STATUS_MAX_LENGTH];
+    static scanResult series[EXP_RESULTS_MAX];
+    int ids[MAX_EXPERIMENTS];
+    int i, numResults, connected, numExperiments;
+
+    connected = sendBytesToClient(status, statusSnapshot(status, sizeof (status), NULL));
+    numExperiments = getExperimentIds(ids, MAX_EXPERIMENTS);
+    for (i = 0; i < numExperiments; i++) {
+        numResults = getInstanceResults(ids[i], series, EXP_RESULTS_MAX);
+        if (numResults > 0) {
+            sendScanResultsToClient(series, numResults);
+        }
+    }
+    return connected;
+}
+
+/*
+ * Called by SNAPSHOT, START_STREAM and PEAK_STREAM once they've said what
+ * they want. Returns 1 if there's no spectraThread to do it, and the
+ * caller has to start one; otherwise the one there is picks it up.
+ */
+static int claimSpectraThread()
+{
+    int start;
+
+    pthread_mutex_lock(&spectraLock);
+    start = !spectraThreadActive;
+    spectraThreadActive = 1;
+    pthread_mutex_unlock(&spectraLock);
+    return start;
+}
+
+/*
+ * The spectraThread asks this before each reading: is there a stream, or
+ * a snapshot that hasn't been taken? If not, the thread is done, and the
+ * next request will have to start another.
+ */
+static int spectraWanted()
+{
+    int wanted;
+
+    pthread_mutex_lock(&spectraLock);
+    wanted = spectraThreadRunning || snapshotWanted;
+    snapshotWanted = 0;
+    spectraThreadActive = wanted;
+    pthread_mutex_unlock(&spectraLock);
+    return wanted;
+}
+
+/*
+ * As claimSpectraThread, for REQUEST_PRESSURE: 1 if there's no
+ * pressureThread still going that will see pressureThreadRunning set
+ */
+static int claimPressureThread()
+{
+    int start;
+
+    pthread_mutex_lock(&pressureLock);
+    start = !pressureThreadActive;
+    pressureThreadActive = 1;
+    pthread_mutex_unlock(&pressureLock);
+    return start;
+}
+
+//as spectraWanted: asked by the pressureThread before each batch
+static int pressureWanted()
+{
+    int wanted;
+
+    pthread_mutex_lock(&pressureLock);
+    wanted = pressureThreadRunning;
+    pressureThreadActive = wanted;
+    pthread_mutex_unlock(&pressureLock);
+    return wanted;
+}
+
+//id -1 for the idle status, when nothing is running
+static char *specStructToCommandString(int id, specSettings s) {
+			static char buffer[1024];
+			sprintf(buffer, "%c%i;%s;%s;%i;%i;%i;%i;%i;%s\n",
+                EXP_STATUS,
+                id >= 0,
+                s.doctorName,
+                s.patientName,
+                s.numScans,
+                s.timeBetweenScans,
+                s.integrationTime,
+                s.boxcarWidth,
+                s.avgPerScan,
+                getInstanceStatusMessage(id));
+                
+                return buffer;
+		}
+		
+static specSettings CommandStringToSpecStruct(char *cmdStr) {
+			
+		}
+
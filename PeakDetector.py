@@ -11,12 +11,15 @@ DO THIS IN C BEFORE CALLING!!
 """
 
 #!/usr/bin/python3
+import sys
 import numpy as np
 import matplotlib.pyplot as plt
 from scipy.optimize import curve_fit
 
-#FILENAME TO FIT:
-filename = './raw_data.txt'
+#FILENAME TO FIT, AND WHERE TO PUT THE RESULT:
+#(the server passes its own so several fits can run at once)
+filename = sys.argv[1] if len(sys.argv) > 1 else './raw_data.txt'
+resultname = sys.argv[2] if len(sys.argv) > 2 else './peak_result.txt'
 
 #CUSTOM FIT PARAMETERS:
 #stepsize to use for gaussian fit within window:
@@ -47,6 +50,16 @@ def myGaussFit(wavelengths,intensities,stepsize = 1,):
         
     return retVal
 
+def fitQuality(intensities,fitted):
+    #R^2 of the fit; a raw fallback counts as no fit at all
+    if fitted is intensities:
+        return 0.0
+    residual = np.sum((intensities - fitted)**2)
+    total = np.sum((intensities - np.mean(intensities))**2)
+    if total == 0:
+        return 0.0
+    return 1 - residual / total
+
 def myGaussFit_side(wavelengths,intensities,numSidePoints= 10):
     #generate our guess:
     peak_height = max(intensities)
@@ -90,6 +103,7 @@ inFile.close()
 
 fitted = myGaussFit(wavelengths,raw_intensities)
 #fitted = myGaussFit_side(wavelengths,raw_intensities)
+quality = fitQuality(raw_intensities,fitted)
 
 #normalize and prepare for graphing:
 x = wavelengths
@@ -112,6 +126,6 @@ plt.show(block = True)
 '''
 #print('peak detected at:', peak_wavelength)
 
-outfile = open('./peak_result.txt','w')
-outfile.write('%.2f' % peak_wavelength)
+outfile = open(resultname,'w')
+outfile.write('%.2f %.4f' % (peak_wavelength, quality))
 outfile.close()
@@ -0,0 +1,67 @@
+/* acquisitionBroker.h
+ * The one way in to the spectrometers for everybody who wants readings:
+ * experiments, streams and snapshots.
+ *
+ * The driver reads each device on its own, but the integration time and
+ * filter chain are shared, and setting them up then acquiring were separate
+ * calls from separate threads, so a snapshot could change the exposure
+ * in the middle of an experiment's scan. Here every request carries its
+ * own settings, and the broker hands the device to one request at a
+ * time: the highest priority waiting, in arrival order within a
+ * priority. The settings are only touched when they differ from the
+ * last ones applied.
+ *
+ * The latest good frame from each device is kept, with the settings it
+ * was taken at. A request whose settings match is served from it if it
+ * is recent enough, without integrating again, so a snapshot taken
+ * during an experiment gets the experiment's own read.
+ */
+#ifndef ACQUISITIONBROKER_H
+#define ACQUISITIONBROKER_H
+
+#include "./spectrometerDriver.h"
+
+#define SNAPSHOT_MAX_AGE 1000       //ms a cached frame is still good enough for a snapshot
+
+//who is asking, lowest first. Higher priorities get the device first
+enum broker_priorities {
+    BROKER_SNAPSHOT,
+    BROKER_STREAM,
+    BROKER_EXPERIMENT,
+};
+
+typedef struct {
+    int deviceMask;         //as acquireSpectra. 0 = spectrometer 0
+    int integrationTime;    //ms. 0 = whatever is set already
+    const filterChain *filters; //formatted reads only. NULL = none
+    int raw;                //1 = raw counts, as acquireRawSpectra
+    int priority;           //broker_priorities
+    unsigned int maxAge;    //ms before the request that a cached frame may have been
+                            //taken. 0 = only a read that finishes after it was made
+} acquisitionRequest;
+
+/*brokerAcquire
+ * one frame per device in request->deviceMask, in ascending device
+ * order, as acquireSpectra. Blocks while requests ahead of it have the
+ * device. Frames come from the cache only if every device has a
+ * matching one; otherwise they are all read fresh.
+ *
+ * Returns the number of frames filled in, or -1 on init failure
+ */
+int brokerAcquire(const acquisitionRequest *request, specFrame *frames);
+
+/*brokerAutoExpose
+ * autoExpose, with the device held for the whole of its probing
+ *
+ * Returns the integration time in ms, or -1 if nothing could be read
+ */
+int brokerAutoExpose(int deviceMask, int priority);
+
+/*brokerApplySettings
+ * applySpecSettings, waiting for any read in progress to finish first.
+ * Requests carry their own filters, so the chain it compiles is only
+ * what reads outside the broker get
+ */
+int brokerApplySettings(specSettings in);
+
+#endif
@@ -0,0 +1,67 @@
+/* baselineRemoval.h
+ * Takes the slowly varying background (mostly fluorescence) out from
+ * under a spectrum before its peak is looked for.
+ *
+ * The baseline z is the smooth curve that best follows the spectrum y
+ * with each pixel weighted by w, and its curvature penalised by lambda:
+ * it solves (W + lambda D'D) z = W y, where D is the second difference.
+ * The weights are then made small where the spectrum stands above the
+ * baseline (a peak) and large where it doesn't, and it is solved again,
+ * a few times over:
+ *
+ *  - asymmetric least squares (ALS) weights a pixel p above the baseline
+ *    and 1 - p below it;
+ *  - arPLS weights it with a logistic curve set from the spread of the
+ *    pixels below the baseline, so it needs no p, and stops once the
+ *    weights stop changing.
+ *
+ * W + lambda D'D is pentadiagonal, so each solve is a banded LDL'
+ * factorisation and two sweeps over five arrays: O(n), and no allocation
+ * once the workspace has grown to the detector.
+ */
+#ifndef BASELINEREMOVAL_H
+#define BASELINEREMOVAL_H
+
+#define BASELINE_DEFAULT_LAMBDA 1e6     //stiffness for a 1-2k pixel detector
+#define BASELINE_ALS_ASYMMETRY 0.01     //ALS weight above the baseline
+#define BASELINE_MAX_ITERATIONS 20
+#define BASELINE_TOLERANCE 1e-3         //arPLS stops when the weights change by less than this
+
+enum baseline_methods {
+    BASELINE_OFF,
+    BASELINE_ALS,
+    BASELINE_ARPLS,
+};
+
+//what a baseline costs between frames. A zeroed one is empty and ready
+typedef struct {
+    int capacity;           //pixels the arrays hold
+    int size;               //pixels the penalty is set up for
+    double lambda;          //and at what stiffness
+    double *penalty;        //lambda D'D: diagonal, then the first and second off-diagonals
+    double *diag;           //the factor's D
+    double *lower1;         //and L's two sub-diagonals
+    double *lower2;
+    double *weights;
+    double *forward;        //L^-1 W y, on the way to the solution
+    double *baseline;       //the last baseline found
+} baselineWorkspace;
+
+/*baselineRemove
+ * subtracts the baseline from the n readings of spectrum, in place.
+ * lambda <= 0 means BASELINE_DEFAULT_LAMBDA. Nothing is done for
+ * BASELINE_OFF. The baseline itself is left in b->baseline.
+ *
+ * One workspace per thread: it holds the factorisation in progress.
+ *
+ * Returns the number of solves it took, 0 if off, or -1 on no memory or
+ * a bad n (the spectrum is then left as it was)
+ */
+int baselineRemove(baselineWorkspace *b, int method, double lambda, double *spectrum, int n);
+
+/*baselineFree
+ * frees the arrays. The workspace is then empty, as a zeroed one
+ */
+void baselineFree(baselineWorkspace *b);
+
+#endif
@@ -0,0 +1,87 @@
+/* commandParser.h
+ * Framing and parsing for the commands the client sends us.
+ *
+ * Every command arrives as
+ *   [uint16 length][command char][payload]
+ * with the length (little-endian) counting the command char and payload.
+ * A read() can return part of a command or several of them; the reader
+ * keeps a per-connection receive buffer and hands back each command once
+ * it is complete.
+ *
+ * Nothing is copied out of the receive buffer: commands and their fields
+ * are views (pointer + length) into it, and stay valid until the next
+ * commandReaderFill. Anything that has to outlive the command (names for
+ * the experiment, say) is copied with fieldCopy.
+ */
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#define COMMAND_HEADER_SIZE 2
+#define COMMAND_BUFFER_SIZE 4096
+#define COMMAND_MAX_LENGTH (COMMAND_BUFFER_SIZE - COMMAND_HEADER_SIZE)
+
+//a run of bytes inside the receive buffer. not NUL terminated!
+typedef struct {
+    const char *data;
+    int length;
+} fieldView;
+
+typedef struct {
+    char command;
+    fieldView payload;          //everything after the command char
+} commandView;
+
+typedef struct {
+    int fd;
+    int start;                  //first byte not yet handed out
+    int end;                    //one past the last byte received
+    unsigned char buf[COMMAND_BUFFER_SIZE];
+} commandReader;
+
+/*commandReaderInit
+ * sets up a reader for a freshly connected client
+ */
+void commandReaderInit(commandReader *reader, int fd);
+
+/*commandReaderFill
+ * blocks until there is more data from the client and appends it to the
+ * buffer. Invalidates every view handed out so far.
+ *
+ * Returns the number of bytes read, 0 or less if the client has gone
+ */
+int commandReaderFill(commandReader *reader);
+
+/*commandReaderNext
+ * takes the next complete command off the buffer. Trailing newlines
+ * on the payload are left off.
+ *
+ * Returns 1 if cmd was filled in, 0 if the rest hasn't arrived yet,
+ * -1 if the client sent a length we can never buffer
+ */
+int commandReaderNext(commandReader *reader, commandView *cmd);
+
+/*nextField
+ * splits the first field off rest at separator, leaving rest pointing
+ * just past it (like strsep, but without writing to the buffer)
+ *
+ * Returns 1 if a field was split off, 0 once rest is used up
+ */
+int nextField(fieldView *rest, fieldView *field, char separator);
+
+//the field as a decimal integer, or fallback if it doesn't start with one
+int fieldToInt(fieldView field, int fallback);
+
+//the field as a decimal number (1.5, 2e-3, ...), or fallback if it isn't one
+double fieldToDouble(fieldView field, double fallback);
+
+//1 if the field is exactly string
+int fieldEquals(fieldView field, const char *string);
+
+//copies the field into dst as a C string, cutting it to fit.
+//returns the number of characters copied
+int fieldCopy(fieldView field, char *dst, int size);
+
+//a view of a whole C string
+fieldView fieldFromString(const char *string);
+
+#endif
@@ -1,40 +1,98 @@
-/* ExperimentFSM.h
- * Interface to the state machine which will govern device behavior.
- * Receives commands from the server and runs the experiment.
- * 
- * 
- */
- #ifndef FSM_H
- #define FSM_H
- 
-
-#include "./spectrometerDriver.h"
-
-enum FSM_commands {
-    SELF,
-	TIMEOUT,
-	START_EXPERIMENT,
-	STOP_EXPERIMENT
-};
-
-//initialize an experiment with a bundle of experiment
-//settings, as well as the socket we want to communicate on.
-//we pass in whatever update method the server wants us to use: 
-int initExperiment(specSettings spec, int (*updateFunction)());
-int experimentIsInited();
-
-//run the experiment with an incomming command. 
-int runExperiment(char command);
-
-//return true if running
-int experimentRunning();
-
-//return the settings being used currently
-specSettings getExperimentSettings();
-
-//returns a human readable string describing current experiment status
-char *getExpStatusMessage();
-
-#endif
-
-
+/* ExperimentFSM.h
+ * Interface to the state machine which will govern device behavior.
+ * Receives commands from the server and runs the experiments.
+ * 
+ * Up to MAX_EXPERIMENTS run at once, each known by the id initExperiment
+ * gives it. The calls without an id act on the one started last.
+ */
+ #ifndef FSM_H
+ #define FSM_H
+ 
+
+#include "./spectrometerDriver.h"
+
+#define MAX_EXPERIMENTS 4       //experiments that can run at the same time
+
+enum FSM_commands {
+    SELF,
+	TIMEOUT,
+	START_EXPERIMENT,
+	STOP_EXPERIMENT,
+	RESUME_EXPERIMENT,      //carry on with an experiment loaded from its scan file
+	FINALISE_EXPERIMENT     //write the results of one loaded from its scan file
+};
+
+//initialize an experiment with a bundle of experiment
+//settings, as well as the socket we want to communicate on.
+//we pass in whatever update method the server wants us to use.
+//returns the experiment's id, or -1 if every slot is taken or an
+//experiment with the same timestamp is already running
+int initExperiment(specSettings spec, int (*updateFunction)());
+
+//return true if any experiment is set up
+int experimentIsInited();
+
+/*recoverExperiments
+ * looks for experiments that were cut short (by a crash or a restart)
+ * and picks them up from their scan files. One that was still on
+ * schedule is resumed; the rest get their results written from the
+ * scans they have.
+ *
+ * Returns the number of experiments recovered
+ */
+int recoverExperiments(int (*updateFunction)());
+
+//run the experiment with an incomming command. 
+int runExperiment(char command);
+int runExperimentInstance(int id, char command);
+
+//return true if any experiment is running
+int experimentRunning();
+
+/*getExperimentIds
+ * puts the ids of up to max set-up experiments in ids (if it isn't NULL)
+ *
+ * Returns how many there are
+ */
+int getExperimentIds(int *ids, int max);
+
+//the id of the running experiment with this timestamp, or -1
+int findExperiment(const char *timestamp);
+
+//return the settings being used currently
+specSettings getExperimentSettings();
+specSettings getInstanceSettings(int id);
+
+//returns a human readable string describing current experiment status
+char *getExpStatusMessage();
+char *getInstanceStatusMessage(int id);
+
+//one fitted scan from one spectrometer
+typedef struct {
+	int experiment;             //id of the experiment it belongs to
+	int scan;
+	int device;
+	unsigned int timestamp;     //millis() when the scan was taken
+	double peakWavelength;
+	double shift;               //peak shift since this device's first scan
+} scanResult;
+
+/*setScanResultCallback
+ * Scans are fitted in the background while the experiment waits for the
+ * next one. The callback is called (from the fitting thread) with each
+ * result as soon as it is ready.
+ */
+void setScanResultCallback(void (*callback)(scanResult result));
+
+/*getExperimentResults
+ * copies up to max of the results fitted so far, in the order the scans
+ * were taken.
+ *
+ * Returns the number copied
+ */
+int getExperimentResults(scanResult *results, int max);
+int getInstanceResults(int id, scanResult *results, int max);
+
+#endif
+
+
@@ -0,0 +1,86 @@
+/* filterChain.h
+ * The smoothing every formatted reading goes through, as a chain of
+ * filters set up once from SETTINGS rather than checked on every frame.
+ *
+ * A chain is written as stages separated by commas, each a name and its
+ * numbers separated by colons:
+ *
+ *   boxcar:W       moving average of W pixels
+ *   sg:W:P[:D]     Savitzky-Golay: a degree P polynomial fitted over W
+ *                  pixels (odd), or its Dth derivative (per pixel)
+ *   gauss:S        Gaussian of S pixels standard deviation
+ *   median:W       running median of W pixels
+ *
+ * e.g. "median:5,sg:11:2". The SETTINGS boxcar width is the chain's
+ * first stage, ahead of these.
+ *
+ * Compiling works out each stage's taps and folds neighbouring linear
+ * stages into one kernel, so a frame takes one convolution pass per run
+ * of them (a median splits the runs). A lone boxcar keeps its running
+ * sum, and costs what it always has. Each pass clamps its window to the
+ * ends of the detector, so within a kernel's width of the ends a folded
+ * chain differs a little from running its stages one by one.
+ */
+#ifndef FILTERCHAIN_H
+#define FILTERCHAIN_H
+
+#define FILTER_MAX_STAGES 5         //the boxcar and four more
+#define FILTER_MAX_TAPS 65          //widest kernel, after folding
+#define FILTER_TEXT_LENGTH 64       //a chain, as SETTINGS writes it
+#define FILTER_MAX_BOXCAR 16
+
+enum filter_types {
+    FILTER_BOXCAR,
+    FILTER_SAVGOL,
+    FILTER_GAUSSIAN,
+    FILTER_MEDIAN,
+    FILTER_CONVOLVE,        //compiled passes only: any other kernel
+};
+
+//one stage, as asked for
+typedef struct {
+    int type;               //filter_types
+    int width;              //pixels, for all but the Gaussian
+    int order;              //Savitzky-Golay polynomial degree
+    int derivative;         //and which derivative of it. 0 = smoothing
+    double sigma;           //Gaussian
+} filterStage;
+
+//one pass over a frame, as compiled
+typedef struct {
+    int type;               //FILTER_BOXCAR (running sum), FILTER_MEDIAN or FILTER_CONVOLVE
+    int left;               //taps before the pixel
+    int count;              //taps in all; the width of a boxcar or median
+    double taps[FILTER_MAX_TAPS];
+} filterPass;
+
+//a zeroed chain does nothing
+typedef struct {
+    int numStages;
+    filterStage stages[FILTER_MAX_STAGES];
+    int numPasses;
+    filterPass passes[FILTER_MAX_STAGES];
+} filterChain;
+
+/*filterChainCompile
+ * sets the chain up as a boxcar of boxcarWidth (none if 1 or less)
+ * followed by the stages in text (none if NULL or empty).
+ *
+ * Returns 0 on success. On a bad chain it says why and returns -1, with
+ * just the boxcar set up
+ */
+int filterChainCompile(filterChain *c, int boxcarWidth, const char *text);
+
+/*filterChainApply
+ * runs in through the chain into out, n pixels. in is used as scratch
+ * between passes, so is left changed if there is more than one. in and
+ * out must not overlap.
+ */
+void filterChainApply(const filterChain *c, double *in, double *out, int n);
+
+/*filterChainEquals
+ * 1 if the two chains were compiled from the same stages
+ */
+int filterChainEquals(const filterChain *a, const filterChain *b);
+
+#endif
@@ -0,0 +1,52 @@
+/* peakTracker.h
+ * Fast per-frame peak estimation for streaming mode.
+ * Keeps a rolling history of recent peaks for each spectrometer, so the
+ * server can report min/max/mean without touching the spectra themselves.
+ */
+#ifndef PEAKTRACKER_H
+#define PEAKTRACKER_H
+
+//number of frames kept in the rolling history
+#define PEAK_HISTORY_LENGTH 256
+
+//compact description of one frame's peak
+typedef struct {
+    unsigned int timestamp;     //millis() when the frame was taken
+    float wavelength;           //sub-pixel peak position
+    float intensity;            //interpolated peak height
+    float fwhm;                 //full width at half maximum, in wavelength units
+    float shift;                //from the stream's first frame, by cross-correlation
+} peakRecord;
+
+//summary of the rolling history, all in wavelength units
+typedef struct {
+    int count;
+    float min;
+    float max;
+    float mean;
+    peakRecord last;
+} peakStats;
+
+/*estimatePeak
+ * argmax, then a centroid over the .98 window around it (falling back to a
+ * three-point parabola when the window is too narrow), then FWHM by
+ * interpolating the half-maximum crossings on each side.
+ *
+ * Returns 0 on success, -1 on a bad array
+ */
+int estimatePeak(double *wavelengths, double *intensities, int numElements, peakRecord *out);
+
+/*peakHistoryReset / peakHistoryAdd
+ * clear every spectrometer's rolling history, or push a new record into
+ * one of them. Adding is O(1) amortized; the oldest record falls out once
+ * the history is full.
+ */
+void peakHistoryReset();
+void peakHistoryAdd(int device, peakRecord r);
+
+/*getPeakHistoryStats
+ * O(1) summary of the records currently held in a spectrometer's history
+ */
+peakStats getPeakHistoryStats(int device);
+
+#endif
@@ -0,0 +1,60 @@
+/* pressureSampler.h
+ * Dedicated high-rate sampler for the MCP3004 pressure channel.
+ * Raw readings are filtered and decimated into a ring buffer which the
+ * server drains in batches, and further downsampled into a long history
+ * that the client can ask for.
+ */
+#ifndef PRESSURESAMPLER_H
+#define PRESSURESAMPLER_H
+
+#define PRESSURE_DEFAULT_RATE 200        //raw ADC reads per second
+#define PRESSURE_DEFAULT_DECIMATION 10   //raw reads per filtered sample
+#define PRESSURE_MAX_RATE 5000
+
+#define PRESSURE_RING_LENGTH 2048        //filtered samples awaiting transmit
+#define PRESSURE_HISTORY_LENGTH 3600     //downsampled history entries
+#define PRESSURE_HISTORY_PERIOD 1000     //ms per history entry
+
+//a run of evenly spaced filtered samples, as drained from the ring
+typedef struct {
+    unsigned int startTime;     //millis() of the first sample
+    unsigned int periodMicros;  //spacing between samples
+    int count;
+} pressureBatch;
+
+/*startPressureSampler
+ * starts the sampler thread reading the ADC at rateHz, producing one
+ * filtered sample per decimation reads. If already running, the new
+ * rate and decimation take effect immediately.
+ *
+ * Returns 0 on success, -1 if the thread could not be started
+ */
+int startPressureSampler(int rateHz, int decimation);
+
+/*stopPressureSampler
+ * stops the sampler thread. The history is kept.
+ */
+void stopPressureSampler();
+
+int pressureSamplerRunning();
+
+/*drainPressureSamples
+ * moves up to max filtered samples out of the ring and into samples,
+ * oldest first. batch describes their timing. A batch stops short at a
+ * break in the spacing (the sampler fell behind, was restarted or changed
+ * rate), so call again until it returns 0.
+ *
+ * Returns the number of samples drained
+ */
+int drainPressureSamples(unsigned short *samples, int max, pressureBatch *batch);
+
+/*getPressureHistory
+ * copies up to max of the most recent history entries into samples,
+ * oldest first, and the millis() at which each one was closed into times.
+ * Entries are not evenly spaced: there is a gap wherever the sampler was stopped.
+ *
+ * Returns the number of entries copied
+ */
+int getPressureHistory(unsigned short *samples, unsigned int *times, int max);
+
+#endif
@@ -0,0 +1,86 @@
+/* resultArchive.h
+ * Column store of every finished experiment's per-scan results, for
+ * questions across many runs ("how has this patient's shift trended
+ * over the last 50?") without opening each results file.
+ *
+ * Each experiment is one row of the experiment table (its settings, when
+ * it started and which result rows are its own), and its scans are
+ * appended to one file per column: time, scan, device, peak, shift and
+ * fit quality. An experiment's rows are always contiguous. Sorted
+ * indexes on patient, doctor and start time pick out the experiments a
+ * query is about; only their slices of the columns it needs are read.
+ * All of it is kept in memory once loaded.
+ */
+#ifndef RESULTARCHIVE_H
+#define RESULTARCHIVE_H
+
+#include "./spectrometerDriver.h"
+
+#define ARCHIVE_DIR "./experiment_results/archive"
+#define ARCHIVE_NAME_LENGTH 64
+
+//one scan's result, as handed to archiveAddExperiment
+typedef struct {
+    unsigned int wallTime;      //time() when the scan was taken
+    int scan;
+    int device;
+    double peak;
+    double shift;
+    double quality;             //R^2 of the peak fit, -1 if unknown
+} archiveRow;
+
+enum archive_fields {
+    ARCHIVE_PEAK,
+    ARCHIVE_SHIFT,
+    ARCHIVE_QUALITY,
+};
+
+//which experiments and scans a query covers. Unset (NULL/0/-1) means any
+typedef struct {
+    const char *patient;
+    const char *doctor;
+    unsigned int from;          //experiments started at or after this time()
+    unsigned int to;            //...and at or before this one
+    int lastRuns;               //only the most recent this many of those
+    int device;                 //-1 = every spectrometer
+    int field;                  //archive_fields value to aggregate
+} archiveQuery;
+
+typedef struct {
+    int experiments;            //experiments that matched
+    int count;                  //scans aggregated
+    double mean;
+    double min;
+    double max;
+    double slope;               //least-squares trend, per day
+    unsigned int first;         //time() of the earliest and latest scan
+    unsigned int last;
+} archiveStats;
+
+/*archiveAddExperiment
+ * appends a finished experiment and its results, and files it in the
+ * indexes. start is time() when it started.
+ *
+ * Returns 0 on success, -1 if it could not be written
+ */
+int archiveAddExperiment(specSettings s, unsigned int start, archiveRow *rows, int count);
+
+/*archiveQueryStats
+ * mean, range and trend of one field over every scan the query covers.
+ * Scans with unknown fit quality are left out of quality queries.
+ *
+ * Returns 0 on success (stats.count may be 0), -1 if the archive can't be read
+ */
+int archiveQueryStats(archiveQuery *q, archiveStats *stats);
+
+/*parseArchiveQuery
+ * fills in q from a query payload of key=value fields separated by ';':
+ *   patient=NAME doctor=NAME from=T to=T last=N device=D
+ *   field=peak|shift|quality   (default shift)
+ * The names are copied into names, which must outlive q.
+ *
+ * Returns 0 on success, -1 on an unknown key or field
+ */
+int parseArchiveQuery(fieldView payload, archiveQuery *q, char names[2][ARCHIVE_NAME_LENGTH]);
+
+#endif
@@ -0,0 +1,133 @@
+/* scanStore.h
+ * Append-only file of an experiment's scans and fitted results.
+ *
+ * Each averaged scan is appended the moment it is taken, so a long
+ * experiment doesn't have to hold its spectra in memory and a crash or
+ * restart loses at most the last few. The file is
+ *   [magic "SCANWAL1"][uint16 header length][header]
+ * followed by records of
+ *   [uint8 type][uint32 length][payload][uint32 checksum]
+ * A record that is cut short or fails its checksum marks the end of the
+ * file; anything after it is thrown away when the file is reopened.
+ */
+#ifndef SCANSTORE_H
+#define SCANSTORE_H
+
+#include <pthread.h>
+
+#include "./spectrometerDriver.h"
+
+#define SCAN_STORE_DIR "./experiment_results"
+#define SCAN_STORE_SUFFIX ".scans"
+#define SCAN_STORE_PATH_LENGTH 256
+#define SCAN_STORE_HEADER_LENGTH 512
+#define SCAN_STORE_CHECKSUM_START 2166136261u
+
+enum scan_record_types {
+    RECORD_SCAN = 1,        //one averaged spectrum (older stores; now RECORD_COUNTED_SCAN)
+    RECORD_RESULT,          //the fit of an earlier scan
+    RECORD_RAW_SCAN,        //summed raw counts, not yet averaged
+    RECORD_COUNTED_SCAN,    //one averaged spectrum, and how many reads went into it
+};
+
+typedef struct {
+    int fd;
+    int scansPerSync;       //0 = every scan, -1 = leave it to the OS
+    int unsynced;           //scans written since the last fsync
+    pthread_mutex_t lock;
+    char path[SCAN_STORE_PATH_LENGTH];
+} scanStore;
+
+//one record, as handed back when a store is reopened
+typedef struct {
+    int type;
+    int scan;
+    int device;
+    unsigned int timestamp;     //millis() when the scan was taken
+    unsigned int wallTime;      //time() when the scan was taken
+    long spectrumOffset;        //scans: where to read the spectrum from
+    int numPixels;              //scans: and how many readings it has
+    int numReads;               //RECORD_RAW_SCAN: reads in the sums, 0 for averaged scans
+    int readsUsed;              //scans: reads that went into it, 0 if not recorded
+    double result;              //RECORD_RESULT: fitted peak and its shift
+    double shift;
+    double quality;             //RECORD_RESULT: R^2 of the fit, -1 if not recorded
+} storedRecord;
+
+/*scanStoreCreate
+ * creates (or empties) the store for a new experiment, with header
+ * describing its settings
+ *
+ * Returns 0 on success, -1 if the file could not be written
+ */
+int scanStoreCreate(scanStore *s, const char *path, const char *header, int scansPerSync);
+
+/*scanStoreOpen
+ * reopens an existing store for appending. The header is copied into
+ * header, and visit is called once for each intact record in order.
+ * A damaged tail is cut off. Syncing starts at every scan; set
+ * scansPerSync from the header if it says otherwise.
+ *
+ * Returns 0 on success, -1 if it is not a store we can read
+ */
+int scanStoreOpen(scanStore *s, const char *path, char *header, int headerSize,
+                  void (*visit)(storedRecord *record, void *arg), void *arg);
+
+/*scanStoreAppendScan
+ * appends one spectrum of numPixels readings, averaged from readsUsed
+ * reads, and fsyncs if the batch is full
+ *
+ * Returns the offset to read it back from, or -1 on failure
+ */
+long scanStoreAppendScan(scanStore *s, int scan, int device, unsigned int timestamp,
+                         double *spectrum, int readsUsed, int numPixels);
+
+/*scanStoreAppendRawScan
+ * appends the uint32 sums of numReads raw readings, which is half the
+ * size of a double spectrum and saves the division until it is read
+ *
+ * Returns the offset to read it back from, or -1 on failure
+ */
+long scanStoreAppendRawScan(scanStore *s, int scan, int device, unsigned int timestamp,
+                            unsigned int *sums, int numReads, int numPixels);
+
+/*scanStoreAppendResult
+ * appends the fit of an earlier scan and how well it fitted. Never fsyncs on its own: a lost
+ * result is just fitted again.
+ *
+ * Returns 0 on success
+ */
+int scanStoreAppendResult(scanStore *s, int scan, int device, double result, double shift, double quality);
+
+/*scanStoreReadSpectrum
+ * reads count readings of a stored spectrum, starting at reading first.
+ * numReads is the record's numReads: for a raw scan the sums are divided
+ * by it on the way out. Safe to call from several threads at once.
+ *
+ * Returns 0 on success
+ */
+int scanStoreReadSpectrum(scanStore *s, long offset, int numReads, int first, int count, double *out);
+
+//fsyncs anything not yet on disk
+void scanStoreSync(scanStore *s);
+
+//syncs and closes the store, then deletes it if remove is set
+void scanStoreClose(scanStore *s, int remove);
+
+/*scanStoreFindAll
+ * lists the stores left in SCAN_STORE_DIR, ie experiments that never
+ * finished
+ *
+ * Returns the number of paths written to paths
+ */
+int scanStoreFindAll(char paths[][SCAN_STORE_PATH_LENGTH], int max);
+
+/*scanStoreChecksum
+ * the FNV-1a checksum records are written with. Start hash at
+ * SCAN_STORE_CHECKSUM_START, or pass an earlier part's result to carry on
+ *
+ * Returns the updated hash
+ */
+unsigned int scanStoreChecksum(unsigned int hash, const void *data, int length);
+
+#endif
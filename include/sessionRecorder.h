@@ -0,0 +1,102 @@
+/* sessionRecorder.h
+ * Capture a session to a file, and play it back through the server.
+ *
+ * While recording, every spectrum the driver reads (before any boxcar),
+ * every pressure sample and every client command is appended to the
+ * file with its time since the recording started. The file is
+ *   [magic "SESSREC1"]
+ * followed by records of
+ *   [uint8 type][uint8 device][uint32 ms][uint32 length][payload]
+ * Spectra are stored as float32, or uint16 for raw counts.
+ *
+ * Replaying stands in for the hardware and the phone: the driver takes
+ * its devices and readings from the file, and the commands are fed to
+ * the server over a local socket as if a client had sent them. Either
+ * at the pace they were recorded, or as fast as the server will take
+ * them, to measure its throughput.
+ */
+#ifndef SESSION_RECORDER_H
+#define SESSION_RECORDER_H
+
+#include "./spectrometerDriver.h"
+#include "./commandParser.h"
+
+enum session_record_types {
+    SESSION_DEVICE = 1,     //serial, model, pixel count and wavelengths of a spectrometer
+    SESSION_FRAME,          //a formatted spectrum, as float32
+    SESSION_RAW_FRAME,      //raw counts, as uint16
+    SESSION_PRESSURE,       //one uint16 ADC reading
+    SESSION_COMMAND,        //a client command: command char then payload
+};
+
+/*sessionRecordStart
+ * starts capturing to path, beginning with every spectrometer we know of
+ *
+ * Returns 0 on success, -1 if the file could not be created
+ */
+int sessionRecordStart(const char *path);
+
+//flushes and closes the recording
+void sessionRecordStop();
+
+//1 while a recording is going
+int sessionRecording();
+
+/*sessionRecordDevice / sessionRecordFrame / sessionRecordCounts /
+ *sessionRecordPressure / sessionRecordCommand
+ * append one record, if we are recording. Safe from any thread.
+ */
+void sessionRecordDevice(int device);
+void sessionRecordFrame(int device, const double *spectrum, int numPixels);
+void sessionRecordCounts(int device, const unsigned short *counts, int numPixels);
+void sessionRecordPressure(int reading);
+void sessionRecordCommand(commandView cmd);
+
+/*sessionReplayOpen
+ * loads a recording to be played back in place of the hardware. Call it
+ * before initHardware. realTime = 1 keeps the recorded timing, 0 goes
+ * as fast as the server can consume it.
+ *
+ * Returns 0 on success, -1 if it is not a recording we can read
+ */
+int sessionReplayOpen(const char *path, int realTime);
+
+//1 if a recording has been opened for replay
+int sessionReplaying();
+
+/*sessionReplayConnect
+ * starts the playback and hands back the server's end of the socket the
+ * recorded commands arrive on. Everything sent to it is read and
+ * counted. Once the recording runs out the socket is shut, so the
+ * server sees the client go.
+ *
+ * Returns the socket, or -1
+ */
+int sessionReplayConnect();
+
+/*sessionReplayDevice
+ * the recorded description of a spectrometer slot. Fills in info and up
+ * to max wavelengths.
+ *
+ * Returns the pixel count, or -1 if the slot wasn't in the recording
+ */
+int sessionReplayDevice(int device, specDeviceInfo *info, double *wavelengths, int max);
+
+/*sessionReplayFrame
+ * waits for the next recorded spectrum from device and puts up to max
+ * readings of it into spectrum (raw counts are converted). Its
+ * timestamp is millis() when it was handed over.
+ *
+ * Returns the number of readings, or -1 once the recording has run out
+ */
+int sessionReplayFrame(int device, double *spectrum, int max, unsigned int *timestamp);
+
+/*sessionReplayPressure
+ * the next recorded pressure sample, or the last one again if none is due
+ */
+int sessionReplayPressure();
+
+//prints how long the playback took and what went through the server
+void sessionReplayReport();
+
+#endif
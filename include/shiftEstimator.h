@@ -0,0 +1,76 @@
+/* shiftEstimator.h
+ * How far a spectrum has moved along the wavelength axis relative to a
+ * reference spectrum, by cross-correlation.
+ *
+ * The reference is resampled onto a uniform wavelength grid, its ends
+ * tied down to zero (so the edges of the detector don't correlate with
+ * anything), zero-padded and transformed once. Each spectrum after it
+ * is resampled onto the same grid and transformed the same way; the
+ * inverse transform of the product gives the correlation at every lag,
+ * and a parabola through the best lag and its neighbours places the
+ * peak to a fraction of a grid step. No peak shape is assumed.
+ *
+ * The transform is a radix-2 real FFT done as a half-size complex one,
+ * with its twiddles and bit reversal worked out once per size.
+ */
+#ifndef SHIFTESTIMATOR_H
+#define SHIFTESTIMATOR_H
+
+//the precomputed parts of a real FFT of size points
+typedef struct {
+    int size;               //power of two
+    int *bitReverse;        //size / 2 entries
+    double *twiddle;        //size / 4 complex twiddles of the half-size FFT
+    double *split;          //size / 4 + 1 complex twiddles joining its halves
+} fftPlan;
+
+typedef struct {
+    int ready;              //1 once there is a reference
+    int samples;            //points on the grid
+    double start;           //wavelength of the first one
+    double step;            //and between each
+    fftPlan plan;
+    double *reference;      //conjugated transform of the reference, size / 2 + 1 complex
+} shiftEstimator;
+
+/*fftPlanCreate
+ * works out the tables for a real FFT of size points (a power of two, at
+ * least 4). A plan that is already that size is kept as it is.
+ *
+ * Returns 0 on success, -1 on a bad size or no memory
+ */
+int fftPlanCreate(fftPlan *p, int size);
+void fftPlanDestroy(fftPlan *p);
+
+/*fftReal / fftRealInverse
+ * the forward transform of size real points into size / 2 + 1 complex
+ * values (re, im interleaved), and back again. data holds size + 2
+ * doubles, and is transformed in place.
+ */
+void fftReal(fftPlan *p, double *data);
+void fftRealInverse(fftPlan *p, double *data);
+
+/*shiftSetReference
+ * makes this spectrum the one shifts are measured from. The grid spans
+ * its wavelengths, one point per pixel.
+ *
+ * Returns 0 on success, -1 on a bad array or no memory
+ */
+int shiftSetReference(shiftEstimator *s, const double *wavelengths, const double *intensities, int numPixels);
+
+/*shiftEstimate
+ * puts the shift of this spectrum from the reference in *shift, in
+ * wavelength units (positive = towards longer wavelengths). Safe to call
+ * from several threads at once with the same reference.
+ *
+ * Returns 0 on success, -1 if there is no reference or a bad array
+ */
+int shiftEstimate(shiftEstimator *s, const double *wavelengths, const double *intensities, int numPixels, double *shift);
+
+/*shiftReset
+ * forgets the reference and frees what it held. A zeroed shiftEstimator
+ * is already reset.
+ */
+void shiftReset(shiftEstimator *s);
+
+#endif
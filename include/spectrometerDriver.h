@@ -1,121 +1,310 @@
-
-/*
- * Custom wrapper for the spectrometer project for easy function calls 
- * in response to incoming commands
- * 
- * Joseph Adamson
- * /
- ***********************************************************************/
-
-//!! a different secret message <3!!
-
-#ifndef SPECDRIVER_H
-#define SPECDRIVER_H
-
-#define NUM_WAVELENGTHS 1024 //known for our spectrometer
-
-
-//specSettings: struct containing spectrometer paramaters and defaults
-
-typedef struct {
-    int numScans;
-    int timeBetweenScans;
-    int integrationTime;
-    int boxcarWidth;
-    int avgPerScan;
-
-    char *doctorName;
-    char *patientName;
-	char *timestamp;
-} specSettings;
-
-enum server_commands {
-    MOTOR_ON = 97,
-    MOTOR_OFF,
-	LED_ON,
-    LED_OFF,
-    REQUEST_PRESSURE,
-    SNAPSHOT,
-    START_STREAM,
-    STOP_STREAM,
-    SETTINGS,
-	EXP_START,       	//begin the experiment
-    EXP_STOP,           //stop the experiment
-    EXP_STATUS,         //return status (available/running) and settings
-                                //of current experiment
-    EXP_LIST,           //return a list of completed experiments
-    EXP_LOOKUP,         //begin stream process of specific experiment
-    EXP_DELETE,    		//delete a given experiment
-    
-    HARDWARE_OFF, 
-};
-
-
-
-/*PrintSpecSettings
- * provides a printout of passed-in specsettings struct
- */
-void printSpecSettings(specSettings in);
-
-/*applySpecSettings
- * applies parameters from incoming struct to our instance
- */
-int applySpecSettings(specSettings in);
-
-/*setIntegrationTime
- * Sets the integration time of the spectrometer in MILLISECONDS
- */
-int setIntegrationTime(int newTime);
-
-/*getSpectrometerReading
- * Asks the spectrometer to take a reading, and place the results
- * into inBuff. If no spec connected, inbuff is populated with buf[i] = i
- * Returns 0 on success
- * Returns -1 on init or reading failure
- */
-int getSpectrometerReading(double *inBuff);
-int getSpectrometerWavelengthArray(double *wavelengths);
-
-
-/*getPressureReading
- * Grab a reading from the ADC and pass it along. 
- * 
- * Returns reading on success
- * Returns 777 if no adc connected
- * Returns -1 if init failure
- * */
-int getPressureReading();
-
-/*Functions to turn the motor pin on and off. 
- * 
- * Exits upon init failure
- */
-void motor_ON();
-void motor_OFF();
-
-/*Functions to turn the LED on or off
- * 
- * Exits upon init failure
- */
-void led_ON();
-void led_OFF();
-
-
-/*boxcarAverage
- * produce a smooth array, using boxcar width Width operating on inputArray
- * 
- * Always returns 1
- */
-int boxcarAverage(int width, double *inputArray, double *outputArray, int numElements);
-
-/*
- * 
- */
-
-/* endSession();
- * 
- */
-int endSession();
-
-
-#endif
+
+/*
+ * Custom wrapper for the spectrometer project for easy function calls 
+ * in response to incoming commands
+ * 
+ * Joseph Adamson
+ * /
+ ***********************************************************************/
+
+//!! a different secret message <3!!
+
+#ifndef SPECDRIVER_H
+#define SPECDRIVER_H
+
+#include "./commandParser.h"
+#include "./filterChain.h"
+
+#define DEFAULT_PIXELS 1024  //simulated device, and anything that won't say
+#define MAX_PIXELS 8192      //we don't believe a device that claims more
+#define MAX_SPECTROMETERS 4   //one Pi can drive up to this many at once
+#define MAX_INTENSITY 3500    //readings at or above this have clipped
+
+
+//specSettings: struct containing spectrometer paramaters and defaults
+
+typedef struct {
+    int numScans;
+    int timeBetweenScans;
+    int integrationTime;
+    int boxcarWidth;
+    int avgPerScan;
+
+    char *doctorName;
+    char *patientName;
+	char *timestamp;
+
+    int deviceMask;     //bit d set = use spectrometer d. 0 = just spectrometer 0
+    int scansPerSync;   //fsync the scan file every this many scans. 0 = every scan, -1 = never
+    int rawMode;        //1 = experiments keep 16-bit counts until the fit
+    int autoExposure;   //1 = integrationTime is found (and kept up) by auto-exposure
+    double precision;   //stop averaging once every pixel's standard error is this
+                        //many counts; avgPerScan is then the most reads. 0 = off
+    int minReads;       //...but never with fewer reads than this (at least 2)
+    int shiftMethod;    //shift_methods: how each scan's shift from the first is measured
+    int baselineMethod; //baseline_methods (baselineRemoval.h): what comes off before the fit
+    double baselineLambda;  //its stiffness. 0 = the default
+    char filters[FILTER_TEXT_LENGTH];  //filter chain after the boxcar (filterChain.h). "" = none
+} specSettings;
+
+enum shift_methods {
+    SHIFT_CORRELATE,    //cross-correlate the whole spectrum with the first scan's
+    SHIFT_FIT,          //difference of the fitted peaks
+};
+
+//specDeviceInfo: what we know about the connected spectrometer,
+//read once when the hardware is opened
+typedef struct {
+    char serialNumber[64];
+    char model[64];
+    int numPixels;
+} specDeviceInfo;
+
+//specFrame: one reading from one spectrometer, as returned by acquireSpectra
+//(in spectrum) or acquireRawSpectra (in counts, unsmoothed). The arrays are
+//grown to fit the device as needed; start with a zeroed frame and release
+//it with freeSpecFrames
+typedef struct {
+    int device;
+    int status;                 //0 on success, -1 on failure
+    unsigned int timestamp;     //millis() at the middle of the integration
+    int numPixels;
+    int raw;                    //1 if counts was filled in rather than spectrum
+    int capacity;               //readings spectrum has room for
+    double *spectrum;
+    int countCapacity;
+    unsigned short *counts;
+} specFrame;
+
+//spectrometer connection states, as published by the hot-plug supervisor
+enum spec_connection_states {
+    SPEC_ABSENT,        //never seen one; readings are simulated
+    SPEC_CONNECTED,
+    SPEC_RECONNECTING,  //lost it; readings fail until it comes back
+};
+
+enum server_commands {
+    MOTOR_ON = 97,
+    MOTOR_OFF,
+	LED_ON,
+    LED_OFF,
+    REQUEST_PRESSURE,
+    SNAPSHOT,
+    START_STREAM,
+    STOP_STREAM,
+    SETTINGS,
+	EXP_START,       	//begin the experiment
+    EXP_STOP,           //stop the experiment
+    EXP_STATUS,         //return status (available/running) and settings
+                                //of current experiment
+    EXP_LIST,           //return a list of completed experiments
+    EXP_LOOKUP,         //begin stream process of specific experiment
+    EXP_DELETE,    		//delete a given experiment
+    
+    HARDWARE_OFF, 
+    PEAK_STREAM,        //stream compact per-frame peak records instead of spectra
+    PEAK_HISTORY,       //return min/max/mean of the recent streamed peaks
+    PRESSURE_HISTORY,   //return the downsampled pressure history
+    SPEC_CONNECTION,    //return (or push, on change) the spectrometer connection state
+    EXP_RESULTS,        //per-scan peak results of the running experiment
+    EXP_QUERY,          //statistics over the archive of finished experiments
+};
+
+
+
+/*initHardware
+ * Opens the spectrometer, wiringPi, PWM and the ADC, and caches the
+ * wavelength calibration. Every driver call will do this on first use
+ * anyway; calling it at startup keeps that cost off the first command.
+ * 
+ * Returns 0 on success
+ */
+int initHardware();
+
+/*PrintSpecSettings
+ * provides a printout of passed-in specsettings struct
+ */
+void printSpecSettings(specSettings in);
+
+/*applySpecSettings
+ * applies parameters from incoming struct to our instance
+ */
+int applySpecSettings(specSettings in);
+
+/*parseSpecOption
+ * applies one optional "key=value" SETTINGS field to spec.
+ * Known keys:
+ *   devices=0,2    spectrometers to use for experiments
+ *   sync=10        fsync the experiment's scan file every 10 scans
+ *                  (sync=off leaves it to the OS)
+ *   raw=1          experiments average raw 16-bit counts, and only
+ *                  convert (and smooth) them for the fit
+ *   exposure=auto  pick the integration time with autoExpose, and keep
+ *                  it up to date as readings come in
+ *   precision=0.5  average each scan only until the standard error of
+ *                  every pixel is down to 0.5 counts, with avgPerScan
+ *                  as the most reads to take
+ *   minreads=3     the fewest reads a precision-limited scan takes
+ *   shift=fit      measure shifts from the peak fits, not by correlation
+ *   baseline=arpls take the background off every spectrum (experiment
+ *                  and stream) before its peak is found: als, arpls or off
+ *   lambda=1e5     the baseline's stiffness; bigger follows it less closely
+ *   filter=median:5,sg:11:2
+ *                  smoothing after the boxcar, as a filter chain (see
+ *                  filterChain.h); filter=none for just the boxcar
+ * 
+ * Returns 0 if the option was understood, -1 otherwise
+ */
+int parseSpecOption(specSettings *spec, fieldView option);
+
+/*setIntegrationTime
+ * Sets the integration time of every spectrometer in MILLISECONDS
+ */
+int setIntegrationTime(int newTime);
+
+/*setBoxcarWidth
+ * Sets the boxcar width applied to every (formatted) reading from now on,
+ * with no other filters after it
+ */
+int setBoxcarWidth(int width);
+
+/*setFilterChain
+ * Sets the whole filter chain applied to every (formatted) reading from
+ * now on. The chain is copied
+ */
+int setFilterChain(const filterChain *chain);
+
+/*autoExpose
+ * Finds the shortest integration time at which the brightest pixel of
+ * the spectrometers in deviceMask sits in the auto-exposure band, clear
+ * of MAX_INTENSITY. Probes upwards from a short exposure, scaling each
+ * time by how far off the last probe was, and applies the result.
+ * 
+ * Returns the integration time in ms, or -1 if nothing could be read
+ */
+int autoExpose(int deviceMask);
+
+/*adjustExposure
+ * the integration time that would bring a reading with this peak (and
+ * this dark floor), taken at integrationTime, into the band. Returns
+ * integrationTime itself if it is there already. Lets a stream or
+ * experiment stay exposed without any extra probes.
+ */
+int adjustExposure(int integrationTime, double peak, double floor);
+
+/*framePeak
+ * the brightest reading of a frame, formatted or raw. If floor isn't
+ * NULL the dimmest one is put there.
+ */
+double framePeak(const specFrame *frame, double *floor);
+
+/*getSpectrometerReading / getDeviceReading
+ * Asks spectrometer 0 (or the given one) to take a reading, and place up
+ * to max readings into inBuff. If no spec was ever connected,
+ * spectrometer 0 gives a simulated peak.
+ * Returns the number of readings on success
+ * Returns -1 on init or reading failure, and straight away while the
+ * supervisor is reconnecting a lost device
+ */
+int getSpectrometerReading(double *inBuff, int max);
+int getDeviceReading(int device, double *inBuff, int max);
+
+/*acquireSpectra
+ * Reads every spectrometer in deviceMask at the same time, each on its
+ * own thread, one frame per device in ascending device order. Check each
+ * frame's status; a missing or lost device fails only its own frame.
+ * A mask of 0 means spectrometer 0.
+ * Returns the number of frames filled in, or -1 on init failure
+ */
+int acquireSpectra(int deviceMask, specFrame *frames);
+
+/*acquireRawSpectra
+ * the same, but each frame gets the detector's raw 16-bit counts, with no
+ * boxcar and no conversion to double. A quarter of the memory traffic
+ * for anything that just sums frames up.
+ */
+int acquireRawSpectra(int deviceMask, specFrame *frames);
+
+/*freeSpecFrames
+ * releases the spectra acquireSpectra allocated for count frames
+ */
+void freeSpecFrames(specFrame *frames, int count);
+
+/*getNumSpectrometers
+ * 1 + the highest spectrometer slot that has been connected (at least 1)
+ */
+int getNumSpectrometers();
+
+/*getDeviceNumPixels
+ * how many readings a spectrum from this spectrometer has, as it told us
+ * when it was opened
+ */
+int getDeviceNumPixels(int device);
+
+/*getSpectrometerWavelengthArray / getDeviceWavelengthArray
+ * Copies up to max wavelengths of the cached calibration of spectrometer
+ * 0 (or the given one) into wavelengths. If no spec connected,
+ * wavelengths[i] = i
+ * Returns the number copied, or -1
+ */
+int getSpectrometerWavelengthArray(double *wavelengths, int max);
+int getDeviceWavelengthArray(int device, double *wavelengths, int max);
+
+/*getSpectrometerInfo / getDeviceInfo
+ * Serial number, model and pixel count of spectrometer 0 (or the given one)
+ */
+specDeviceInfo getSpectrometerInfo();
+specDeviceInfo getDeviceInfo(int device);
+
+/*getSpecConnectionState / getDeviceConnectionState / setSpecConnectionCallback
+ * current spec_connection_states value of spectrometer 0 (or the given
+ * one), and a hook the supervisor calls (from its own thread) whenever a
+ * device's state changes
+ */
+int getSpecConnectionState();
+int getDeviceConnectionState(int device);
+void setSpecConnectionCallback(void (*callback)(int device, int state));
+
+
+/*getPressureReading
+ * Grab a reading from the ADC and pass it along. 
+ * 
+ * Returns reading on success
+ * Returns 777 if no adc connected
+ * Returns -1 if init failure
+ * */
+int getPressureReading();
+
+/*Functions to turn the motor pin on and off. 
+ * 
+ * Exits upon init failure
+ */
+void motor_ON();
+void motor_OFF();
+
+/*Functions to turn the LED on or off
+ * 
+ * Exits upon init failure
+ */
+void led_ON();
+void led_OFF();
+
+
+/*boxcarAverage
+ * produce a smooth array, using boxcar width Width operating on inputArray
+ * 
+ * Always returns 1
+ */
+int boxcarAverage(int width, double *inputArray, double *outputArray, int numElements);
+
+/*
+ * 
+ */
+
+/* endSession();
+ * 
+ */
+int endSession();
+
+
+#endif
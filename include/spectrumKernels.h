@@ -0,0 +1,83 @@
+/* spectrumKernels.h
+ * The per-pixel loops every reading goes through: smoothing, averaging,
+ * peak search and packing for the client.
+ *
+ * Each one works for any pixel count, but has its own copy compiled for
+ * the detectors we actually have (1024, 2048 and 3648 pixels), where the
+ * loop bounds are constants the compiler can unroll and vectorise.
+ */
+#ifndef SPECTRUM_KERNELS_H
+#define SPECTRUM_KERNELS_H
+
+/*spectrumBoxcar
+ * moving average of width readings centred on each pixel, with the
+ * ends clamped. Runs in O(n) whatever the width. in and out must not
+ * overlap.
+ */
+void spectrumBoxcar(int width, const double *in, double *out, int n);
+
+/*spectrumConvolve
+ * out[i] = sum of taps[j] * in[i - left + j] over the count taps, with
+ * the indices clamped to the ends as the boxcar's. The middle of the
+ * spectrum is done a tap at a time down the whole row, which is what
+ * vectorises. in and out must not overlap.
+ */
+void spectrumConvolve(const double *taps, int left, int count, const double *in, double *out, int n);
+
+/*spectrumMedian
+ * running median of width readings, windowed and clamped as the boxcar
+ * (the mean of the middle two for an even width). A sorted copy of the
+ * window is kept up to date, so each pixel costs O(width). in and out
+ * must not overlap.
+ */
+void spectrumMedian(int width, const double *in, double *out, int n);
+
+//sum[i] += in[i]
+void spectrumAccumulate(double *sum, const double *in, int n);
+
+//data[i] *= factor
+void spectrumScale(double *data, double factor, int n);
+
+/*spectrumPeakIndex
+ * index of the largest reading (the first, if there's a tie). If minimum
+ * isn't NULL, the smallest reading is put there too.
+ */
+int spectrumPeakIndex(const double *in, int n, double *minimum);
+
+/*spectrumAccumulateCounts
+ * sum[i] += counts[i], for averaging raw detector counts without ever
+ * leaving integers
+ */
+void spectrumAccumulateCounts(unsigned int *sum, const unsigned short *counts, int n);
+
+/*spectrumAccumulateSquares / spectrumAccumulateCountSquares
+ * sumSquares[i] += in[i]^2, alongside the sum, for the spread of the reads
+ */
+void spectrumAccumulateSquares(double *sumSquares, const double *in, int n);
+void spectrumAccumulateCountSquares(double *sumSquares, const unsigned short *counts, int n);
+
+/*spectrumWorstVariance / spectrumWorstCountVariance
+ * the largest per-pixel sample variance of reads readings, given their
+ * sums (double, or raw count sums) and sums of squares. Divide by reads
+ * for the variance of the mean.
+ * Returns -1 with fewer than 2 reads, where there is no spread to speak of
+ */
+double spectrumWorstVariance(const double *sum, const double *sumSquares, int reads, int n);
+double spectrumWorstCountVariance(const unsigned int *sum, const double *sumSquares, int reads, int n);
+
+/*spectrumCountsFromDoubles
+ * rounds readings to 16-bit counts, clamped to 0..65535
+ */
+void spectrumCountsFromDoubles(const double *in, unsigned short *out, int n);
+
+/*spectrumSumsToDoubles
+ * out[i] = sums[i] * scale. Where raw counts finally become floating point
+ */
+void spectrumSumsToDoubles(const unsigned int *sums, double scale, double *out, int n);
+
+/*spectrumEncodeFloat32
+ * packs the readings as little-endian float32s, 4 bytes each, into out
+ */
+void spectrumEncodeFloat32(const double *in, unsigned char *out, int n);
+
+#endif
@@ -0,0 +1,107 @@
+/* spectrumPyramid.h
+ * Level-of-detail copies of a finished experiment's spectra, so a client
+ * can plot a huge experiment from a few hundred points and only fetch
+ * full resolution where it zooms in.
+ *
+ * Level 0 is the full pixels x scans matrix (one column per stored scan,
+ * as in the results file). Each level above it halves both axes, taking
+ * the min, max and mean of the cells it merges; an axis stops halving
+ * once it is down to PYRAMID_MIN_SIDE cells. The file is
+ *   [magic "SPECLOD1"][uint32 levels][uint32 rows, cols per level]
+ * then each level's cells, row (pixel) by row: a float per cell on
+ * level 0, float min, max, mean on the rest. Missing cells (a scan from
+ * a smaller detector) are NaN.
+ *
+ * The writer takes the matrix a band of rows at a time and keeps just
+ * one partial row per level, so building it costs no more memory than
+ * writing the results file does.
+ */
+#ifndef SPECTRUMPYRAMID_H
+#define SPECTRUMPYRAMID_H
+
+#define PYRAMID_SUFFIX ".lod"
+#define PYRAMID_MAX_LEVELS 24
+#define PYRAMID_MIN_SIDE 16         //an axis isn't halved below this many cells
+#define PYRAMID_TILE_SIZE 64        //cells along each side of a tile
+
+typedef struct {
+    int rows;                   //pixels
+    int cols;                   //scans
+    long offset;                //where its cells start in the file
+} pyramidLevel;
+
+typedef struct {
+    float min;
+    float max;
+    double sum;
+    int count;                  //cells that weren't missing
+} pyramidCell;
+
+typedef struct {
+    int fd;
+    int numLevels;
+    pyramidLevel levels[PYRAMID_MAX_LEVELS];
+    //writer only: the row being built on each level, how many of the
+    //level below have gone into it and how many it has written
+    pyramidCell *pending[PYRAMID_MAX_LEVELS];
+    int merged[PYRAMID_MAX_LEVELS];
+    int written[PYRAMID_MAX_LEVELS];
+    float *values;              //one row of cells, encoded for the file
+    char path[256];
+} spectrumPyramid;
+
+/*pyramidCreate
+ * starts writing the pyramid of a rows x cols matrix to path. It only
+ * appears under that name once pyramidFinish succeeds.
+ *
+ * Returns 0 on success, -1 if the file could not be created
+ */
+int pyramidCreate(spectrumPyramid *p, const char *path, int rows, int cols);
+
+/*pyramidAddBand
+ * adds the next count rows of the matrix. band holds them a column at a
+ * time: row r of column c is band[c * count + r]. NaN marks a missing cell.
+ *
+ * Returns 0 on success, -1 on a write error
+ */
+int pyramidAddBand(spectrumPyramid *p, const double *band, int count);
+
+/*pyramidFinish
+ * flushes the last rows and puts the file in place. Closes p either way.
+ *
+ * Returns 0 on success, -1 if the matrix was short or a write failed
+ */
+int pyramidFinish(spectrumPyramid *p);
+
+/*pyramidOpen
+ * opens a finished pyramid for reading
+ *
+ * Returns 0 on success, -1 if it is missing or damaged
+ */
+int pyramidOpen(spectrumPyramid *p, const char *path);
+
+/*pyramidChooseLevel
+ * the finest level that fits in maxRows x maxCols (<= 0 = no limit on
+ * that axis), or the coarsest there is if none does
+ */
+int pyramidChooseLevel(spectrumPyramid *p, int maxRows, int maxCols);
+
+/*pyramidRead
+ * reads the window of a level starting at (row, col), count rows by
+ * width columns, clipped to the level. Each cell goes to out as floats:
+ * one on level 0, min, max, mean on the others. *rows and *cols get the
+ * size of the window after clipping.
+ *
+ * Returns the number of floats written, -1 on a read error
+ */
+int pyramidRead(spectrumPyramid *p, int level, int row, int col, int count, int width,
+                float *out, int *rows, int *cols);
+
+/*pyramidValuesPerCell
+ * floats per cell on a level
+ */
+int pyramidValuesPerCell(int level);
+
+void pyramidClose(spectrumPyramid *p);
+
+#endif
@@ -0,0 +1,48 @@
+/* statusPublisher.h
+ * Experiment status, kept as a versioned snapshot and pushed to the
+ * client only when it changes.
+ *
+ * The experiments bump the version (statusChanged) on every transition;
+ * that's all they do. The status is only encoded again when somebody
+ * wants it and the version has moved on, and one long-lived thread
+ * pushes it to a subscribed client, waiting STATUS_COALESCE ms after a
+ * change so a burst of them goes out as one message. While nothing
+ * changes, nothing runs.
+ */
+#ifndef STATUSPUBLISHER_H
+#define STATUSPUBLISHER_H
+
+#define STATUS_COALESCE 200         //ms to let a burst of changes settle
+#define STATUS_MAX_LENGTH 4096      //longest encoded status
+
+/*statusPublisherStart
+ * starts the push thread. encode fills buf with the current status (at
+ * most size bytes) and returns its length; send queues bytes for the
+ * client. Calling it again just swaps the two functions.
+ *
+ * Returns 0 on success, -1 if the thread could not be started
+ */
+int statusPublisherStart(int (*encode)(char *buf, int size), int (*send)(void *bytes, int length));
+
+/*statusChanged
+ * marks the status as changed. Cheap, and safe from any thread; this is
+ * what the experiments are given to call. Always returns 0.
+ */
+int statusChanged();
+
+/*statusSubscribe
+ * 1 to have the status pushed whenever it changes, 0 to stop. A new
+ * subscriber gets the current status straight away.
+ */
+void statusSubscribe(int on);
+
+/*statusSnapshot
+ * copies the current encoded status into buf (up to size bytes), encoding
+ * it only if it has changed since it was last asked for. If version isn't
+ * NULL the snapshot's version is put there.
+ *
+ * Returns its length
+ */
+int statusSnapshot(char *buf, int size, unsigned int *version);
+
+#endif
@@ -0,0 +1,61 @@
+/* telemetry.h
+ * Multiplexed, timestamped message layer over the client socket.
+ *
+ * Every message goes out as one or more frames:
+ *   [uint8 channel][uint8 flags][uint16 length][uint32 timestamp][payload]
+ * with the timestamp in millis() at the time the message was queued.
+ * Messages longer than TELEMETRY_CHUNK_SIZE are cut into frames of that
+ * size, with TELEMETRY_MORE_FRAGMENTS set on all but the last. Low
+ * priority messages (spectra, lookups) go out one after another, between
+ * the high priority frames. Long high priority messages (status,
+ * histories, archive replies) go a chunk at a time too, with any short
+ * one sent between two chunks. A message never overtakes an earlier one
+ * on its own channel, so the client has at most one partial message per
+ * channel to reassemble, and never more than one low and one high.
+ */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#define TELEMETRY_HEADER_SIZE 8
+#define TELEMETRY_CHUNK_SIZE 256        //max payload per low priority frame
+#define TELEMETRY_MAX_LOW_QUEUED 4      //older unsent spectra get dropped past this
+
+#define TELEMETRY_MORE_FRAGMENTS 0x01
+
+enum telemetry_channels {
+    CHANNEL_CONTROL,        //debug and error replies
+    CHANNEL_STATUS,         //EXP_STATUS
+    CHANNEL_PRESSURE,       //pressure batches and history
+    CHANNEL_PEAK,           //peak records and history
+    CHANNEL_SPECTRUM,       //full spectra
+    CHANNEL_LIST,           //EXP_LIST and EXP_QUERY replies
+    CHANNEL_LOOKUP,         //EXP_LOOKUP previews, tiles and results file chunks
+};
+
+enum telemetry_priorities {
+    PRIORITY_LOW,
+    PRIORITY_HIGH,
+};
+
+/*telemetryStart
+ * binds the layer to a connected client socket and starts the sender thread
+ *
+ * Returns 0 on success, -1 if the thread could not be started
+ */
+int telemetryStart(int client);
+
+/*telemetryStop
+ * stops the sender thread and throws away anything still queued.
+ * Does not close the socket.
+ */
+void telemetryStop();
+
+/*telemetrySend
+ * copies the payload and queues it on the given channel. Returns
+ * immediately; the sender thread does the writing.
+ *
+ * Returns 1 if the client is still connected, else 0
+ */
+int telemetrySend(int channel, int priority, void *data, int length);
+
+#endif
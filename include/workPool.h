@@ -0,0 +1,32 @@
+/* workPool.h
+ * Small work-stealing thread pool for spreading per-scan work over the
+ * Pi's cores.
+ */
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#define WORKPOOL_MAX_WORKERS 8
+
+//one unit of work: called once for every index in the job
+typedef void (*workFunction)(void *arg, int index);
+
+/*workPoolInit
+ * starts numWorkers threads (0 = one per online core). Called for you by
+ * workPoolRun if needed.
+ *
+ * Returns 0 on success, -1 if no thread could be started
+ */
+int workPoolInit(int numWorkers);
+
+/*workPoolRun
+ * calls fn(arg, i) for every i in [0, count), spread over the pool, and
+ * returns once they have all finished. Each worker starts on its own
+ * contiguous block of indices and steals half of somebody else's
+ * remaining block when it runs out. Jobs are run one at a time.
+ *
+ * Returns 0 on success, -1 if the pool could not be started (in which
+ * case nothing has been run)
+ */
+int workPoolRun(workFunction fn, void *arg, int count);
+
+#endif
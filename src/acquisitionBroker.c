@@ -0,0 +1,245 @@
+/* acquisitionBroker.c
+ * Priority hand-off of the spectrometers, and the frame cache.
+ *
+ * There is no broker thread: whoever's turn it is does the reading on
+ * its own thread, as it did before, so a request that gets the device
+ * straight away costs no more than calling the driver. brokerLock covers
+ * the queue and the cache; the settings last applied are only touched
+ * by whoever holds the device.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <wiringPi.h>
+
+#include "../include/acquisitionBroker.h"
+
+//one waiting request, on its own caller's stack
+typedef struct brokerWaiter {
+    int priority;
+    struct brokerWaiter *next;
+} brokerWaiter;
+
+typedef struct {
+    int valid;
+    int raw;
+    int integrationTime;
+    filterChain filters;
+    unsigned int taken;         //millis() when the read finished
+    specFrame frame;
+} cachedFrame;
+
+static pthread_mutex_t brokerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t brokerTurn = PTHREAD_COND_INITIALIZER;
+static brokerWaiter *queue = NULL;  //highest priority first
+static int deviceBusy = 0;
+
+static cachedFrame cache[MAX_SPECTROMETERS];
+
+//what the driver was last set to; -1 = don't know
+static int appliedTime = -1;
+static filterChain appliedFilters;
+static int filtersKnown = 0;
+static const filterChain noFilters;
+
+static void takeTurn(int priority);
+static void giveTurn();
+static int requestTime(const acquisitionRequest *request);
+static const filterChain *requestFilters(const acquisitionRequest *request);
+static int fromCache(const acquisitionRequest *request, int mask, unsigned int asked, specFrame *frames);
+static void toCache(const acquisitionRequest *request, specFrame *frames, int count);
+static int copyFrame(specFrame *to, const specFrame *from);
+
+
+int brokerAcquire(const acquisitionRequest *request, specFrame *frames)
+{
+    int n, mask = request->deviceMask ? request->deviceMask : 1;
+    unsigned int asked = millis();
+
+    pthread_mutex_lock(&brokerLock);
+    n = fromCache(request, mask, asked, frames);
+    if (n > 0) {
+        pthread_mutex_unlock(&brokerLock);
+        return n;
+    }
+    takeTurn(request->priority);
+
+    //whoever had the device before us may have just read what we want
+    n = fromCache(request, mask, asked, frames);
+    if (n == 0) {
+        pthread_mutex_unlock(&brokerLock);
+        if (request->integrationTime > 0 && request->integrationTime != appliedTime) {
+            appliedTime = setIntegrationTime(request->integrationTime) == 0 ? request->integrationTime : -1;
+        }
+        if (!request->raw && (!filtersKnown || !filterChainEquals(requestFilters(request), &appliedFilters))) {
+            appliedFilters = *requestFilters(request);
+            setFilterChain(&appliedFilters);
+            filtersKnown = 1;
+        }
+        n = request->raw ? acquireRawSpectra(mask, frames) : acquireSpectra(mask, frames);
+        pthread_mutex_lock(&brokerLock);
+        toCache(request, frames, n);
+    }
+    giveTurn();
+    pthread_mutex_unlock(&brokerLock);
+    return n;
+}
+
+int brokerAutoExpose(int deviceMask, int priority)
+{
+    int t;
+
+    pthread_mutex_lock(&brokerLock);
+    takeTurn(priority);
+    pthread_mutex_unlock(&brokerLock);
+
+    //a failed probe leaves the time wherever it got to
+    t = autoExpose(deviceMask);
+    appliedTime = t;
+
+    pthread_mutex_lock(&brokerLock);
+    giveTurn();
+    pthread_mutex_unlock(&brokerLock);
+    return t;
+}
+
+int brokerApplySettings(specSettings in)
+{
+    int err;
+
+    pthread_mutex_lock(&brokerLock);
+    takeTurn(BROKER_EXPERIMENT);
+    pthread_mutex_unlock(&brokerLock);
+
+    err = applySpecSettings(in);
+    appliedTime = err == 0 ? in.integrationTime : -1;
+    filtersKnown = 0;
+
+    pthread_mutex_lock(&brokerLock);
+    giveTurn();
+    pthread_mutex_unlock(&brokerLock);
+    return err;
+}
+
+//queue up behind everyone of this priority or higher, and wait to be
+//at the front with the device free. called with brokerLock held
+static void takeTurn(int priority)
+{
+    brokerWaiter me = {priority, NULL}, **at = &queue;
+
+    while (*at && (*at)->priority >= priority) {
+        at = &(*at)->next;
+    }
+    me.next = *at;
+    *at = &me;
+
+    while (deviceBusy || queue != &me) {
+        pthread_cond_wait(&brokerTurn, &brokerLock);
+    }
+    queue = me.next;
+    deviceBusy = 1;
+}
+
+//called with brokerLock held
+static void giveTurn()
+{
+    deviceBusy = 0;
+    pthread_cond_broadcast(&brokerTurn);
+}
+
+static int requestTime(const acquisitionRequest *request)
+{
+    return request->integrationTime > 0 ? request->integrationTime : appliedTime;
+}
+
+static const filterChain *requestFilters(const acquisitionRequest *request)
+{
+    return request->filters ? request->filters : &noFilters;
+}
+
+//all of the mask's frames if every one of them is cached at the request's
+//settings and recent enough, otherwise 0. called with brokerLock held
+static int fromCache(const acquisitionRequest *request, int mask, unsigned int asked, specFrame *frames)
+{
+    int d, n = 0, t = requestTime(request), numDevices = getNumSpectrometers();
+    cachedFrame *c;
+
+    if (t <= 0) {
+        return 0;
+    }
+    for (d = 0; d < numDevices; d++) {
+        c = &cache[d];
+        if (!(mask & (1 << d))) {
+            continue;
+        }
+        if (!c->valid || c->raw != request->raw || c->integrationTime != t
+            || (!request->raw && !filterChainEquals(&c->filters, requestFilters(request)))
+            || (int) (asked - c->taken) >= (int) request->maxAge) {
+            return 0;
+        }
+    }
+    for (d = 0; d < numDevices; d++) {
+        if (mask & (1 << d)) {
+            if (copyFrame(&frames[n], &cache[d].frame) != 0) {
+                return 0;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+//keep the good frames of a read; a failed one means that device has
+//nothing fresh to offer, as does a read whose settings didn't take.
+//called with brokerLock held
+static void toCache(const acquisitionRequest *request, specFrame *frames, int count)
+{
+    int k, t = requestTime(request);
+    unsigned int now = millis();
+    cachedFrame *c;
+
+    for (k = 0; k < count; k++) {
+        c = &cache[frames[k].device];
+        c->valid = frames[k].status == 0 && t > 0 && t == appliedTime && copyFrame(&c->frame, &frames[k]) == 0;
+        c->raw = request->raw;
+        c->integrationTime = t;
+        c->filters = *requestFilters(request);
+        c->taken = now;
+    }
+}
+
+//the readings themselves, growing to's arrays to fit as the driver does
+static int copyFrame(specFrame *to, const specFrame *from)
+{
+    if (from->raw) {
+        if (to->countCapacity < from->numPixels) {
+            unsigned short *counts = realloc(to->counts, from->numPixels * sizeof (unsigned short));
+            if (!counts) {
+                printf("we didnt get the memory for a cached frame\n");
+                return -1;
+            }
+            to->counts = counts;
+            to->countCapacity = from->numPixels;
+        }
+        memcpy(to->counts, from->counts, from->numPixels * sizeof (unsigned short));
+    } else {
+        if (to->capacity < from->numPixels) {
+            double *spectrum = realloc(to->spectrum, from->numPixels * sizeof (double));
+            if (!spectrum) {
+                printf("we didnt get the memory for a cached frame\n");
+                return -1;
+            }
+            to->spectrum = spectrum;
+            to->capacity = from->numPixels;
+        }
+        memcpy(to->spectrum, from->spectrum, from->numPixels * sizeof (double));
+    }
+    to->device = from->device;
+    to->status = from->status;
+    to->timestamp = from->timestamp;
+    to->numPixels = from->numPixels;
+    to->raw = from->raw;
+    return 0;
+}
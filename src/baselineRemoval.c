@@ -0,0 +1,200 @@
+/* baselineRemoval.c
+ * ALS and arPLS baselines, on a pentadiagonal LDL' solver.
+ *
+ * The penalty lambda D'D depends only on n and lambda, so it is worked
+ * out once and kept until either changes. Each solve adds the weights to
+ * its diagonal, factors, and substitutes forwards in the same sweep, then
+ * back: with L unit lower triangular with sub-diagonals l1, l2,
+ *
+ *   d[i]  = a[i] - l1[i-1]^2 d[i-1] - l2[i-2]^2 d[i-2]
+ *   l1[i] = (b[i] - l2[i-1] l1[i-1] d[i-1]) / d[i]
+ *   l2[i] = c[i] / d[i]
+ *
+ * where a, b, c are the diagonal and off-diagonals of W + lambda D'D.
+ * Every array lives in the one block, so a solve walks a few kilobytes
+ * that stay in cache.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/baselineRemoval.h"
+
+#define WORKSPACE_ARRAYS 9      //the penalty's three bands and six more
+
+static int prepare(baselineWorkspace *b, int n, double lambda);
+static int solve(baselineWorkspace *b, const double *y, int n);
+static int alsWeights(baselineWorkspace *b, const double *y, int n);
+static int arplsWeights(baselineWorkspace *b, const double *y, int n);
+
+
+int baselineRemove(baselineWorkspace *b, int method, double lambda, double *spectrum, int n)
+{
+    int i, solves = 0, settled = 0;
+
+    if (method != BASELINE_ALS && method != BASELINE_ARPLS) {
+        return 0;
+    }
+    if (n < 3 || prepare(b, n, lambda > 0 ? lambda : BASELINE_DEFAULT_LAMBDA) != 0) {
+        return -1;
+    }
+
+    //every pixel counts the same the first time round
+    for (i = 0; i < n; i++) {
+        b->weights[i] = 1;
+    }
+    while (!settled && solves < BASELINE_MAX_ITERATIONS) {
+        if (solve(b, spectrum, n) != 0) {
+            printf("baseline solve broke down after %i iterations\n", solves);
+            return -1;
+        }
+        solves++;
+        settled = method == BASELINE_ALS ? alsWeights(b, spectrum, n) : arplsWeights(b, spectrum, n);
+    }
+
+    for (i = 0; i < n; i++) {
+        spectrum[i] -= b->baseline[i];
+    }
+    return solves;
+}
+
+void baselineFree(baselineWorkspace *b)
+{
+    //every array is in the penalty's block
+    free(b->penalty);
+    memset(b, 0, sizeof (*b));
+}
+
+//grow the arrays to n and set up lambda D'D, unless they already are
+static int prepare(baselineWorkspace *b, int n, double lambda)
+{
+    static const double second[3] = {1, -2, 1};
+    double *block, *a, *o1, *o2;
+    int i, j, k;
+
+    if (b->size == n && b->lambda == lambda) {
+        return 0;
+    }
+    if (b->capacity < n) {
+        block = realloc(b->penalty, WORKSPACE_ARRAYS * n * sizeof (double));
+        if (!block) {
+            printf("we didnt get the memory for a baseline of %i pixels\n", n);
+            return -1;
+        }
+        b->capacity = n;
+        b->penalty = block;
+    }
+    block = b->penalty;
+    b->diag = block + 3 * b->capacity;
+    b->lower1 = block + 4 * b->capacity;
+    b->lower2 = block + 5 * b->capacity;
+    b->weights = block + 6 * b->capacity;
+    b->forward = block + 7 * b->capacity;
+    b->baseline = block + 8 * b->capacity;
+
+    //D'D is the sum over each row of D, (1, -2, 1) at pixels r..r+2
+    a = b->penalty;
+    o1 = a + b->capacity;
+    o2 = a + 2 * b->capacity;
+    memset(a, 0, 3 * b->capacity * sizeof (double));
+    for (i = 0; i + 2 < n; i++) {
+        for (j = 0; j < 3; j++) {
+            a[i + j] += lambda * second[j] * second[j];
+            for (k = j + 1; k < 3; k++) {
+                (k - j == 1 ? o1 : o2)[i + j] += lambda * second[j] * second[k];
+            }
+        }
+    }
+    b->size = n;
+    b->lambda = lambda;
+    return 0;
+}
+
+//(W + lambda D'D) baseline = W y. returns -1 if it isn't positive definite,
+//which only rounding on an absurd lambda can do
+static int solve(baselineWorkspace *b, const double *y, int n)
+{
+    const double *a = b->penalty, *o1 = a + b->capacity, *o2 = a + 2 * b->capacity, *w = b->weights;
+    double *d = b->diag, *l1 = b->lower1, *l2 = b->lower2, *u = b->forward, *z = b->baseline;
+    double di, ui;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        di = a[i] + w[i];
+        ui = w[i] * y[i];
+        if (i >= 1) {
+            di -= l1[i - 1] * l1[i - 1] * d[i - 1];
+            ui -= l1[i - 1] * u[i - 1];
+        }
+        if (i >= 2) {
+            di -= l2[i - 2] * l2[i - 2] * d[i - 2];
+            ui -= l2[i - 2] * u[i - 2];
+        }
+        if (!(di > 0)) {
+            return -1;
+        }
+        d[i] = di;
+        u[i] = ui;
+        l1[i] = (o1[i] - (i >= 1 ? l2[i - 1] * l1[i - 1] * d[i - 1] : 0)) / di;
+        l2[i] = o2[i] / di;
+    }
+
+    //the bands past the end are zero, so l1[n-1], l2[n-2] and l2[n-1] are too
+    z[n - 1] = u[n - 1] / d[n - 1];
+    z[n - 2] = u[n - 2] / d[n - 2] - l1[n - 2] * z[n - 1];
+    for (i = n - 3; i >= 0; i--) {
+        z[i] = u[i] / d[i] - l1[i] * z[i + 1] - l2[i] * z[i + 2];
+    }
+    return 0;
+}
+
+//p above the baseline, 1 - p below. settled (1) once no pixel changes side
+static int alsWeights(baselineWorkspace *b, const double *y, int n)
+{
+    double w;
+    int i, changed = 0;
+
+    for (i = 0; i < n; i++) {
+        w = y[i] > b->baseline[i] ? BASELINE_ALS_ASYMMETRY : 1 - BASELINE_ALS_ASYMMETRY;
+        changed += w != b->weights[i];
+        b->weights[i] = w;
+    }
+    return changed == 0;
+}
+
+//a logistic step placed from the mean m and spread s of the residuals below
+//the baseline: 1 / (1 + exp(2 (r - (2s - m)) / s)). settled (1) once the
+//weights move by less than BASELINE_TOLERANCE of their size, or there is
+//nothing below the baseline to go on
+static int arplsWeights(baselineWorkspace *b, const double *y, int n)
+{
+    double r, w, sum = 0, sumSquares = 0, mean, spread, moved = 0, size = 0;
+    int i, below = 0;
+
+    for (i = 0; i < n; i++) {
+        r = y[i] - b->baseline[i];
+        if (r < 0) {
+            sum += r;
+            sumSquares += r * r;
+            below++;
+        }
+    }
+    if (below < 2) {
+        return 1;
+    }
+    mean = sum / below;
+    spread = sqrt((sumSquares - sum * mean) / below);
+    if (!(spread > 0)) {
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        r = 2 * (y[i] - b->baseline[i] - (2 * spread - mean)) / spread;
+        w = r > 700 ? 0 : 1 / (1 + exp(r));
+        moved += (w - b->weights[i]) * (w - b->weights[i]);
+        size += b->weights[i] * b->weights[i];
+        b->weights[i] = w;
+    }
+    return moved < BASELINE_TOLERANCE * BASELINE_TOLERANCE * size;
+}
@@ -0,0 +1,159 @@
+/* commandParser.c
+ * Incremental reader for length-prefixed client commands.
+ *
+ * The receive buffer is consumed from the front as commands are handed
+ * out. When it empties we start again from the beginning; when a partial
+ * command is left over we slide just those bytes down to the front, so a
+ * read always has room for at least the rest of it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/commandParser.h"
+
+
+void commandReaderInit(commandReader *reader, int fd)
+{
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+int commandReaderFill(commandReader *reader)
+{
+    int pending = reader->end - reader->start;
+    int bytes;
+
+    if (pending == 0) {
+        reader->start = reader->end = 0;
+    } else if (reader->start > 0) {
+        //only a partial command is left; it might not fit where it is
+        memmove(reader->buf, &reader->buf[reader->start], pending);
+        reader->start = 0;
+        reader->end = pending;
+    }
+
+    bytes = read(reader->fd, &reader->buf[reader->end], COMMAND_BUFFER_SIZE - reader->end);
+    if (bytes > 0) {
+        reader->end += bytes;
+    }
+    return bytes;
+}
+
+int commandReaderNext(commandReader *reader, commandView *cmd)
+{
+    unsigned char *p;
+    int length;
+
+    while (1) {
+        if (reader->end - reader->start < COMMAND_HEADER_SIZE) {
+            return 0;
+        }
+        p = &reader->buf[reader->start];
+        length = p[0] | (p[1] << 8);
+        if (length > COMMAND_MAX_LENGTH) {
+            printf("command of %i bytes is too long to buffer\n", length);
+            return -1;
+        }
+        if (reader->end - reader->start < COMMAND_HEADER_SIZE + length) {
+            return 0;
+        }
+        reader->start += COMMAND_HEADER_SIZE + length;
+
+        //an empty frame is just a keepalive
+        if (length > 0) {
+            break;
+        }
+    }
+
+    cmd->command = p[COMMAND_HEADER_SIZE];
+    cmd->payload.data = (const char *) &p[COMMAND_HEADER_SIZE + 1];
+    cmd->payload.length = length - 1;
+    while (cmd->payload.length > 0
+           && (cmd->payload.data[cmd->payload.length - 1] == '\n'
+               || cmd->payload.data[cmd->payload.length - 1] == '\r')) {
+        cmd->payload.length--;
+    }
+    return 1;
+}
+
+int nextField(fieldView *rest, fieldView *field, char separator)
+{
+    const char *sep;
+
+    if (rest->data == NULL) {
+        return 0;
+    }
+
+    field->data = rest->data;
+    sep = memchr(rest->data, separator, rest->length);
+    if (sep) {
+        field->length = sep - rest->data;
+        rest->length -= field->length + 1;
+        rest->data = sep + 1;
+    } else {
+        //last one; mark rest as used up so an empty final field still counts
+        field->length = rest->length;
+        rest->data = NULL;
+        rest->length = 0;
+    }
+    return 1;
+}
+
+int fieldToInt(fieldView field, int fallback)
+{
+    int i = 0, negative = 0, value = 0;
+
+    while (i < field.length && field.data[i] == ' ') {
+        i++;
+    }
+    if (i < field.length && (field.data[i] == '-' || field.data[i] == '+')) {
+        negative = field.data[i] == '-';
+        i++;
+    }
+    if (i == field.length || field.data[i] < '0' || field.data[i] > '9') {
+        return fallback;
+    }
+    while (i < field.length && field.data[i] >= '0' && field.data[i] <= '9') {
+        value = value * 10 + field.data[i] - '0';
+        i++;
+    }
+    return negative ? -value : value;
+}
+
+double fieldToDouble(fieldView field, double fallback)
+{
+    char number[64], *end;
+    double value;
+
+    //strtod wants it terminated, and the field is in the middle of the buffer
+    fieldCopy(field, number, sizeof (number));
+    value = strtod(number, &end);
+    return end == number ? fallback : value;
+}
+
+int fieldEquals(fieldView field, const char *string)
+{
+    return (int) strlen(string) == field.length && !memcmp(field.data, string, field.length);
+}
+
+int fieldCopy(fieldView field, char *dst, int size)
+{
+    int n = field.length < size - 1 ? field.length : size - 1;
+
+    if (size <= 0) {
+        return 0;
+    }
+    memcpy(dst, field.data, n);
+    dst[n] = '\0';
+    return n;
+}
+
+fieldView fieldFromString(const char *string)
+{
+    fieldView f = {string, strlen(string)};
+
+    return f;
+}
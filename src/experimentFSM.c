@@ -1,628 +1,1852 @@
-/* ExperimentFSM.c
- * implements the state machine which will govern device behavior.
- * Receives commands from the server and runs the experiment.
- * 
- * 
- */
-#include <wiringPi.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-
-#include "../include/spectrometerDriver.h"
-#include "../include/experimentFSM.h"
-
-
-//function which opens and returns a correctly formatted index file
-//if it for some reason doesn't exist:
-static FILE *safelyOpenIndex();
-
-
-//some functions to essentially serialize/deserialize spec instances:
-static char *specStructToIndexString(specSettings s);
-
-
-//peak detection work happens here:
-static double findPeakValueWavelength(double *wavelengths, double *intensities);
-
-static char *getStateString(int s);
-
-static specSettings thisExperiment;
-static char experimentStatusMessage[512] = "Uninitialized";
-static int inited = 0;
-static int update = 0;
-static int readingsTaken = 0;
-static int numSavedExperiments;
-
-static int (*updateServer)();
-
-static FILE *expFile;
-static FILE *expIndex;
-
-static double wavelengths[NUM_WAVELENGTHS],
-			  averagedArray[NUM_WAVELENGTHS], 
-			  spectrumArray[NUM_WAVELENGTHS],
-			  finalArray[NUM_WAVELENGTHS];
-
-
-//a quick and dirty single-linked list to allow arbitrary numbers of readings:
-typedef struct listNode {
-	double array[NUM_WAVELENGTHS];
-	struct listNode *nextNode;
-	} listNode;
-	
-static listNode *list_add(listNode *head,double *doubleArray);
-static void list_print(listNode *head);
-static void list_destroy(listNode *head);
-
-
-static listNode *spectrumList;
-	
-	
-	
-static void writeExperimentFile(FILE *f, listNode *head, double *results);
-
-
-
-
-static enum experiment_states {
-    IDLE,
-    GETTING_SPECTRA,
-    AWAITING_TIMEOUT,
-    WRITING_RESULTS,
-} experimentState = IDLE;
-
-
-int initExperiment(specSettings spec, int (*updateFunction)())
-{
-    thisExperiment = spec;
-    experimentState = IDLE;
-    readingsTaken = 0;
-    updateServer = updateFunction;
-    for(int i = 0; i < NUM_WAVELENGTHS; i++) {
-		averagedArray[i] = 0;
-		spectrumArray[i] = 0;
-	}
-	getSpectrometerWavelengthArray(wavelengths);
-    spectrumList = NULL;
-    inited = 1;
-}
-
-int runExperiment(char command)
-{
-    if (!inited) {
-        printf("\n\n Tried to run experiment without init. \n\n");
-        while (1);
-    }
-
-#ifdef VERBOSE
-        printf("running fsm in state %i with command %i \n", experimentState, command);
-#endif
-
-    //this timer thread will post its event to the experiment FSM after the set amount of time
-
-    PI_THREAD(timerThread)
-    {
-         printf("starting a timer for %i seconds\n", thisExperiment.timeBetweenScans);   
-        //delay accepts argument in milliseconds.
-        //block for set time, then update the experiment
-        delay(thisExperiment.timeBetweenScans * 1000);
-        runExperiment(TIMEOUT);
-        
-    }
-
-    int i, j;
-    switch (experimentState) {
-
-    case IDLE:
-
-        switch (command) {
-        case START_EXPERIMENT:
-
-            if(!inited) {
-				printf("Whoops! Somehow we haven't inited. This one's fatal :( \n");
-				exit(-9);
-			}
-
-            /*
-             * LABSMITH STUFF GOES HERE?!
-             * IN FUTURE, MOVE TO A PRIMING_CHIP STATE 
-             * 
-             */ 
-            
-            //prepare a file for this experiment
-            char reportPath[256];
-            sprintf(reportPath,"./experiment_results/%s",thisExperiment.timestamp);
-                        
-			expFile = fopen(reportPath,"w");
-			if (!expFile) {
-				printf("could not create file! ");
-				while(1);
-			}
-			
-            experimentState = GETTING_SPECTRA;
-            updateServer();
-            //now we run ourself, since this is an internal transition.
-            //shouldnt recurse too much during normal operation :)
-            runExperiment(SELF);
-            break;
-
-        default:
-
-            break;
-
-        }
-        break; //break IDLE
-
-        //upon entering this state, we grab a spectrum reading first thing: 
-    case GETTING_SPECTRA:
-
-
-        switch (command) {
-        case SELF:
-            printf("Collecting Spectrum\n\n");
-            led_ON();
-
-            //grab and total some readings...
-            for (i = 0; i < thisExperiment.avgPerScan; i++) {
-                getSpectrometerReading(spectrumArray);
-                for (j = 0; j < 1024; j++) {
-                    averagedArray[j] += spectrumArray[j];
-                }
-            }
-
-            //...then perform the averaging
-            for (i = 0; i < NUM_WAVELENGTHS; i++) {
-                averagedArray[i] /= thisExperiment.avgPerScan;
-                finalArray[i] = averagedArray[i];
-                averagedArray[i] = 0;       
-            }
-
-            //we have now taken one more reading:
-            readingsTaken++;
-
-            spectrumList = list_add(spectrumList,finalArray);
-            
-
-            led_OFF();
-
-#ifdef VERBOSE
-			printf("finished getting reading number %i\n", readingsTaken);
-#endif                
-            
-            //now, check to see if we have taken enough scans. if not, set a timer and keep waiting. 
-            if (readingsTaken < thisExperiment.numScans) {
-                //start a timer thread. these threads return 0 if successfully started:
-
-                if (piThreadCreate(timerThread)) {
-                    printf("pi thread failed somehow!\n");
-                    int tryCount = 0;
-                    for(tryCount = 0; tryCount < 3; tryCount++) {
-						//break out if we succeed
-						printf("trying attempt %i\n",tryCount);
-
-						if(!piThreadCreate(timerThread)) {
-							break;
-						}
-					}
-					if (tryCount == 3) {
-						printf("Something went seriously wrong with your threads\n");
-						exit(-11);
-						//runExperiment(STOP_EXPERIMENT);
-					}
-                   
-                }
-                
-				//not sure if we need to, but let's give the thread a 
-				//moment to set up, because we break immediately after:
-                delay(100);
-
-                experimentState = AWAITING_TIMEOUT;
-                
-                updateServer();                
-                break;
-            } else {
-                experimentState = WRITING_RESULTS;
-                //we run ourselves
-                runExperiment(SELF);
-                break;
-            }
-
-            break; //break SELF
-
-        case STOP_EXPERIMENT:
-            inited = 0;
-            experimentState = IDLE;
-            list_destroy(spectrumList);
-            break;
-
-        default:
-
-            break;
-
-
-        }
-        break; //break GETTING_SPECTRA
-
-    case AWAITING_TIMEOUT:
-    
-    #ifdef VERBOSE
-                printf("awaiting timeout...\n");
-    #endif
-        
-        switch (command) {
-
-            //when we finally get here, the timer has expired and we
-            //are ready to grab another measurement.
-            //note, the timer will never expire during a time when we 
-            //don't need at least one more reading, so we always transition
-            //upon this timer. 
-        case TIMEOUT:
-#ifdef VERBOSE
-                printf("got timeout!\n");
-#endif
-            experimentState = GETTING_SPECTRA;
-            runExperiment(SELF);
-            break;
-
-        case STOP_EXPERIMENT:
-            inited = 0;
-            experimentState = IDLE;
-            list_destroy(spectrumList);
-            break;
-
-        }
-        break;
-
-
-    case WRITING_RESULTS:
-        printf("\nfinished getting spectra.\nWRITING RESULTS!\n\n");
-		updateServer();
-
-		//carve out a result array:
-		double *resultArray = malloc(thisExperiment.numScans*sizeof(double));
-		if(!resultArray) {
-			printf("we didnt get the memory\n");
-		}
-		
-		//i'm so happy this works:
-		listNode *cur;
-		int i = 0;
-		for(cur = spectrumList; cur != NULL; cur = cur->nextNode) {
-			resultArray[i++] = findPeakValueWavelength(wavelengths,cur->array);
-		}
-		
-		
-		//open the index file and write a serialized spec struct to it:
-		expIndex = safelyOpenIndex();
-		char *indexString = specStructToIndexString(thisExperiment);
-		fprintf(expIndex,indexString);
-
-		//printf everything to our file:
-		printf("trying to write result file...\n");
-		writeExperimentFile(expFile,spectrumList,resultArray);
-
-		//tidy up and return to idling:
-		fclose(expFile);
-		fclose(expIndex);
-		
-		char buf[512];
-
-		//this beautiful line replaces the first line with the new experimentcount
-		sprintf(buf,"(cd experiment_results; sed -e '1 s/.*.*/%i/g' INDEX > tmp; mv tmp INDEX)",++numSavedExperiments);
-		system(buf);
-
-		//list_print(spectrumList);
-		printf("trying to free the memory\n");
-		free(resultArray);
-        list_destroy(spectrumList);
-        inited = 0;
-        experimentState = IDLE;
-        updateServer();
-
-        break;
-
-    default:
-
-        break;
-    }
-}
-
-int experimentRunning()
-{
-    return experimentState == IDLE ? 0 : 1;
-}
-
-
-specSettings getExperimentSettings()
-{
-    return thisExperiment;
-}
-
-char *getExpStatusMessage()
-{
-    sprintf(experimentStatusMessage, "Experiment Status: %s", getStateString(experimentState));
-    return experimentStatusMessage;
-}
-
-int experimentIsInited()
-{
-    return inited;
-}
-
-
-//private function to get strings from states
-static char *getStateString(int s)
-{
-	static char str[512];
-	
-	if(s == IDLE) {
-		return "Idle";
-	} else if(s == WRITING_RESULTS) {
-		return "Performing post-processing/peak detection...";
-	} else {
-		sprintf(str,"Finished measurement %i/%i with %i second intervals",readingsTaken,thisExperiment.numScans,thisExperiment.timeBetweenScans);
-        return str;
-	}
-}
-
-
-static specSettings indexStringToSpecStruct(char *indexString) 
-{
-	specSettings s;
-	return s;
-	
-}
-
-static char *specStructToStatusString(specSettings s) {
-	
-}
-
-static char *specStructToIndexString(specSettings s) {
-	static char str[512];
-	sprintf(str, "exp_%s;%s;%s;%i;%i;%i;%i;%i\n",
-		thisExperiment.timestamp,
-		thisExperiment.doctorName,
-		thisExperiment.patientName,
-		thisExperiment.numScans,
-		thisExperiment.timeBetweenScans,
-		thisExperiment.integrationTime,
-		thisExperiment.boxcarWidth,
-		thisExperiment.avgPerScan);
-		
-		return str;
-	}
-
-
-
-//highly slimmed-down linked list of double arrays
-static listNode *list_add(listNode *head,double *doubleArray) {
-		int i;
-		int count = 1;
-	
-		if(head == NULL) {
-			printf("STARTED LIST with item 0\n");
-			head = (listNode*)malloc(sizeof(listNode));
-			
-			if(head == NULL) {
-				printf("empty head.\n");
-				while(1);
-			}
-			
-			for(i = 0; i < NUM_WAVELENGTHS; i++) {
-				head->array[i] = doubleArray[i];
-			}
-			head->nextNode = NULL;
-
-			return head;
-		} else {
-			listNode *cur = head;
-			//iterate to the end of the list:
-			while(cur->nextNode != NULL) {
-				cur = cur->nextNode;
-				count++;
-			}
-			
-			//allocate a new node and set up its contents
-			listNode *tmp = malloc(sizeof(listNode));
-			if(!tmp) {
-				printf("we didnt get the memory for a node :(\n");
-				while(1);
-			}
-			
-			
-			tmp->nextNode = NULL;
-			for(i = 0; i < NUM_WAVELENGTHS; i++) {
-				tmp->array[i] = doubleArray[i];
-			}
-			
-			printf("added item %i to list\n",count);
-			cur->nextNode = tmp;
-			
-			return head;
-		}
-	
-		
-}
-
-//free the whole list
-static void list_destroy(listNode *head) {
-	if(head == NULL) {
-		printf("List destroyed!\n");
-		return;
-	}
-	list_destroy(head->nextNode);
-	free(head);
-}
-
-//recursive one-way iterator? why not!! 
-static void list_print_recurse(listNode *head, int count) {
-	if (head == NULL) {
-		printf("end list_print\n");
-		return;
-	}
-	printf("first 3 of array %i = %f %f %f\n",count,head->array[0],head->array[1],head->array[2]);
-	list_print_recurse(head->nextNode,++count);
-}
-
-//want to recurse without supplying count? we got you.
-static void list_print(listNode *head) {
-	if (head == NULL) {
-		printf("list is empty\n");
-		return;
-	}
-	list_print_recurse(head,0);
-}
-
-//this is where we do the peak detection work;
-//or rather, where we have python do it! 
-static double findPeakValueWavelength(double *wavelengths, double *intensities) {
-	
-	char str[256];
-	double peakWavelength = 0;
-	float low = 0, high = 0, raw_peak = 0;
-	int peakIndex = 0;
-	FILE *rawData = fopen("./raw_data.txt","w");
-	
-	if(!rawData || wavelengths == NULL || intensities == NULL) {
-		printf("file problems or bad array!\n");
-		return 0;
-	}
-	
-
-	//loop through and get the index of the peak
-	for(int i = 0; i < NUM_WAVELENGTHS; i++) {
-		if (intensities[i] > raw_peak) {
-			raw_peak = intensities[i];
-			peakIndex = i;
-		}
-	}
-	//printf("found peak %f with index %i\n",raw_peak,peakIndex);
-	
-	//iterate forwards to get high bound:
-	int i = peakIndex + 1;
-	while(i < NUM_WAVELENGTHS) {
-		if(intensities[i] <= .98 * raw_peak) {
-			high = wavelengths[i];
-			break;
-		}
-		i++;
-	}
-	
-	//iterate backwards to get low bound:
-	i = peakIndex - 1;
-	while(i >= 0) {
-		if(intensities[i] <= .98 * raw_peak) {
-			low = wavelengths[i];
-			break;
-		}
-		i--;
-	}
-	
-	
-	for(int i = 0; i < NUM_WAVELENGTHS; i++) {
-		double wave = wavelengths[i];
-		double intens = intensities[i];
-		if (wave >= low && wave <= high ) {
-			fprintf(rawData,"%.2lf	%.2lf\n",wave,intens);
-		}
-	}
-	//fprintf(rawData,"DATA END");
-	
-	printf("done writing to file! working with window = %.2f nm\n",high-low);
-	
-		fclose(rawData);
-	
-	printf("Now starting python...\n");
-	system("sudo python3 ./PeakDetector.py");
-	
-	//now python's output file will be fitted:
-	FILE *fittedData = fopen("./peak_result.txt","r");
-	if(!fittedData) {
-		printf("file problems!\n");
-		exit(-1);
-	}
-	
-	fscanf(fittedData,"%lf",&peakWavelength);
-	fclose(fittedData);
-	
-	printf("done!! we found wavelength = %.2lf\n", peakWavelength);
-
-	
-    return peakWavelength;
-
-	
-}
-
-
-//write the measurements and results to the file
-static void writeExperimentFile(FILE *f, listNode *head, double *results) {
-	char line[2048] = "";
-	char tmp[2048];
-
-	//line = specStruct2descriptor OR SOMETHING
-	fprintf(f,"EXPERIMENT HEADER\n");
-
-	int i,j = 0;
-	for(i = 0; i < thisExperiment.numScans; i++) {
-		sprintf(tmp,"Reading %i\t",i + 1);
-		strcat(line,tmp);
-	}
-	strcat(line,"Results\n");
-	fprintf(f,line);
-	strcpy(line,"");
-
-	listNode *cur = head;
-
-	
-	for(i = 0; i < NUM_WAVELENGTHS; i++) {
-		cur = head;
-		//printf("traversed time and space %i/%i times\n",++j,NUM_WAVELENGTHS);
-		while(cur != NULL) {
-			sprintf(tmp,"%-11.2f\t",cur->array[i]);
-			strcat(line,tmp);
-			cur = cur->nextNode;
-		}
-		if (i < thisExperiment.numScans) {
-			sprintf(tmp,"%-11.2f\n",results[i]);
-			strcat(line,tmp);
-		} else {
-			strcat(line,"\n");
-		}
-		fprintf(f,line);
-		strcpy(line,"");
-	}
-}
-
-//when first creating a new index file we need to make sure to place
-//the header at the top
-static FILE *safelyOpenIndex() {
-	
-		//using "r" should return null if doesn't exist
-		FILE *fptr =  fopen("./experiment_results/INDEX","r");
-			if (!fptr) {
-				//the file doesn't exist, so create it wwith "w"
-				printf("creating index!\n");
-				fptr = fopen("./experiment_results/INDEX", "w");
-				fprintf(fptr, "0\n");
-				numSavedExperiments = 0;
-				fclose(fptr);
-			} else {
-				fscanf(fptr,"%i",&numSavedExperiments);
-				printf("we think there are %i experiment results here\n",numSavedExperiments);
-				fclose(fptr);
-			}
-
-	//finally, open it for appending and return:
-	return fopen("./experiment_results/INDEX","a");
-	
-	
-	}
-
-
-
-
-
-
-
-
+/* ExperimentFSM.c
+ * implements the state machine which will govern device behavior.
+ * Receives commands from the server and runs the experiment.
+ *
+ * Several experiments can run at once, each in its own slot with its own
+ * state machine, scan file and fitter. One scheduler thread takes every
+ * scan: when several experiments are due at (nearly) the same time and
+ * want the spectrometer set up the same way, their scans are taken with
+ * one set of reads and each gets its copy.
+ */
+#include <wiringPi.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "../include/spectrometerDriver.h"
+#include "../include/experimentFSM.h"
+#include "../include/workPool.h"
+#include "../include/scanStore.h"
+#include "../include/spectrumKernels.h"
+#include "../include/resultArchive.h"
+#include "../include/spectrumPyramid.h"
+#include "../include/shiftEstimator.h"
+#include "../include/acquisitionBroker.h"
+#include "../include/baselineRemoval.h"
+
+//how long to wait before retrying a scan when the spectrometer is down
+#define SCAN_RETRY_DELAY 2000
+//scans due within this many ms of each other are taken together
+#define SCAN_MERGE_WINDOW 1000
+//an interrupted experiment is resumed if it has missed its next scan by
+//no more than this many seconds; otherwise we just write up what it has
+#define RESUME_GRACE 300
+//readings held in memory at once while writing the results file
+#define WRITE_BUFFER_READINGS 32768
+#define MAX_RECOVERED 16
+#define NAME_LENGTH 128
+
+//a quick and dirty single-linked list to allow arbitrary numbers of readings:
+typedef struct listNode {
+	long offset;            //where the spectrum is in the scan store
+	int numPixels;
+	int numReads;           //raw scans: reads summed into it. 0 = averaged doubles
+	int readsUsed;          //reads that went into it either way (0 = not recorded)
+	int device;
+	int scan;
+	unsigned int timestamp;
+	unsigned int wallTime;  //time() when it was taken
+	int fitted;
+	double result;
+	double shift;
+	double quality;         //R^2 of the peak fit, -1 if unknown
+	struct listNode *nextNode;
+	} listNode;
+
+enum experiment_states {
+    IDLE,
+    GETTING_SPECTRA,
+    AWAITING_TIMEOUT,
+    WRITING_RESULTS,
+};
+
+//everything one experiment owns. The scheduling fields belong to
+//scheduleLock; the list and the fitter's place in it to fitLock
+typedef struct {
+	int id;
+	int inited;
+	enum experiment_states state;
+	specSettings settings;
+	char doctor[NAME_LENGTH], patient[NAME_LENGTH], timestamp[NAME_LENGTH];
+	char statusMessage[512];
+
+	int readingsTaken;
+	int waitingForDevice;
+	unsigned int scheduled;     //millis() this scan was due, for keeping the cadence
+	unsigned int nextScan;      //millis() we actually want the next one (retries come sooner)
+	int acquiring;              //the scheduler is reading into our buffers
+	int stopRequested;          //...and was asked to stop meanwhile
+
+	//auto-exposure: whether the integration time has been probed for
+	//yet, and the brightest reading (and its dark floor) this scan
+	int exposed;
+	double brightest, floor;
+
+	FILE *expFile;
+	//every scan goes straight into here; the list below only says where
+	scanStore store;
+	unsigned int lastScanTime;  //time() of the newest stored scan
+
+	//one of each per spectrometer, indexed by device number, each sized
+	//for that spectrometer's pixel count when the experiment is set up
+	double *wavelengths[MAX_SPECTROMETERS], *averagedArray[MAX_SPECTROMETERS];
+	//in raw mode readings are summed here instead, as counts
+	unsigned int *rawSums[MAX_SPECTROMETERS];
+	int numPixels[MAX_SPECTROMETERS];
+	int bufferCapacity[MAX_SPECTROMETERS];
+	int rawCapacity[MAX_SPECTROMETERS];
+	int goodReads[MAX_SPECTROMETERS];
+	//with adaptive averaging, the sum of squares of the reads too
+	double *sumSquares[MAX_SPECTROMETERS];
+	int squaresCapacity[MAX_SPECTROMETERS];
+	int enoughReads;            //this scan has all the reads it needs
+
+	//scans are fitted by fitThread as they come in. the fitter only
+	//ever touches nodes it has been handed, and we wait for it
+	//(stopFitting) before freeing any
+	listNode *spectrumList;
+	listNode *spareNodes;       //earlier runs' nodes, handed out again before any new ones
+	pthread_mutex_t fitLock;
+	pthread_cond_t fitReady;
+	pthread_cond_t fitIdle;
+	listNode *fitCursor;        //last node handed to the fitter
+	int fitterStarted;
+	int fitBusy;
+	int fitPaused;
+	//each spectrometer's first scan, which the rest are correlated with
+	shiftEstimator shifts[MAX_SPECTROMETERS];
+	filterChain filters;        //the settings' boxcar and filters, compiled once
+} experiment;
+
+//what the pool needs to fit one experiment's leftover scans
+typedef struct {
+	experiment *e;
+	listNode **nodes;
+} fitJob;
+
+//function which opens and returns a correctly formatted index file
+//if it for some reason doesn't exist:
+static FILE *safelyOpenIndex();
+
+
+//some functions to essentially serialize/deserialize spec instances:
+static char *specStructToIndexString(specSettings s);
+static char *specStructToStoreHeader(specSettings s);
+static int storeHeaderToSpecStruct(char *header, specSettings *s);
+
+
+//peak detection work happens here:
+static double findPeakValueWavelength(double *wavelengths, double *intensities, int numPixels, int job, double *quality);
+
+static char *getStateString(experiment *e);
+static int deviceInScan(experiment *e, int device);
+static int deviceInMask(experiment *e, int device);
+static experiment *newExperiment(specSettings spec);
+static experiment *loadStoredExperiment(char *path);
+static int sizeDeviceBuffers(experiment *e, int device);
+static int runInstance(experiment *e, char command);
+static void endExperiment(experiment *e);
+static void writeResults(experiment *e);
+static void archiveResults(experiment *e, int numResults);
+static void *resultsThread(void *arg);
+static void startScheduler();
+static int compatibleScans(experiment *a, experiment *b);
+static int scanPrecise(experiment *e);
+static void takeScans(experiment **group, int count);
+static void exposeExperiment(experiment *e);
+
+static experiment experiments[MAX_EXPERIMENTS];
+static int current = -1;        //the one initExperiment last set up
+static int numSavedExperiments;
+
+static int (*updateServer)();
+static void (*resultCallback)(scanResult result) = NULL;
+
+//guards every experiment's state and the scheduling fields
+static pthread_mutex_t scheduleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduleChanged = PTHREAD_COND_INITIALIZER;
+static int schedulerStarted = 0;
+
+//the INDEX file is shared by every experiment that finishes
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+
+static listNode *list_add(listNode *head,listNode **spare,long offset,int numPixels,int numReads,int readsUsed,int device,int scan,unsigned int timestamp,unsigned int wallTime);
+static listNode *list_find(listNode *head,int device,int scan);
+static listNode *list_truncate(listNode *head,listNode **spare,int numScans);
+static void list_print(listNode *head);
+static void list_destroy(listNode *head,listNode **spare);
+static void visitStoredRecord(storedRecord *r, void *arg);
+
+static void startFitting(experiment *e);
+static void stopFitting(experiment *e);
+static void clearResults(experiment *e);
+static void fitNode(experiment *e, listNode *node, int job);
+static void readNodeSpectrum(experiment *e, listNode *node, double *spectrum);
+
+//the pool calls this once per scan left unfitted at the end
+static void fitScan(void *arg, int index);
+
+
+
+static void writeExperimentFile(experiment *e, FILE *f, double *results);
+
+
+
+
+int initExperiment(specSettings spec, int (*updateFunction)())
+{
+    experiment *e;
+    int i;
+
+    updateServer = updateFunction;
+
+    pthread_mutex_lock(&scheduleLock);
+    //the timestamp names the results, so it has to be ours alone
+    for (i = 0; i < MAX_EXPERIMENTS; i++) {
+        if (experiments[i].inited && !strcmp(experiments[i].timestamp, spec.timestamp ? spec.timestamp : "")) {
+            pthread_mutex_unlock(&scheduleLock);
+            printf("experiment %s is already running\n", spec.timestamp);
+            return -1;
+        }
+    }
+    e = newExperiment(spec);
+    if (e) {
+        current = e->id;
+    }
+    pthread_mutex_unlock(&scheduleLock);
+
+    if (!e) {
+        printf("already running %i experiments; not starting another\n", MAX_EXPERIMENTS);
+        return -1;
+    }
+    return e->id;
+}
+
+void setScanResultCallback(void (*callback)(scanResult result))
+{
+    resultCallback = callback;
+}
+
+int runExperiment(char command)
+{
+    return runExperimentInstance(current, command);
+}
+
+int runExperimentInstance(int id, char command)
+{
+    int r;
+
+    if (id < 0 || id >= MAX_EXPERIMENTS) {
+        return -1;
+    }
+    pthread_mutex_lock(&scheduleLock);
+    r = runInstance(&experiments[id], command);
+    pthread_mutex_unlock(&scheduleLock);
+    return r;
+}
+
+/*runInstance
+ * one step of an experiment's state machine. caller holds scheduleLock.
+ * The scans themselves are taken by the scheduler, which moves the
+ * experiment to GETTING_SPECTRA, reads into its buffers and then runs
+ * it with SELF to store the scan.
+ */
+static int runInstance(experiment *e, char command)
+{
+    if (!e->inited) {
+        printf("\n\n Tried to run experiment without init. \n\n");
+        return -1;
+    }
+
+#ifdef VERBOSE
+        printf("running fsm %i in state %i with command %i \n", e->id, e->state, command);
+#endif
+
+    int k;
+    char reportPath[256];
+    switch (e->state) {
+
+    case IDLE:
+
+        switch (command) {
+        case START_EXPERIMENT:
+
+            /*
+             * LABSMITH STUFF GOES HERE?!
+             * IN FUTURE, MOVE TO A PRIMING_CHIP STATE
+             *
+             */
+
+            //prepare a file for this experiment
+            sprintf(reportPath,"./experiment_results/%s",e->timestamp);
+
+			e->expFile = fopen(reportPath,"w");
+			if (!e->expFile) {
+				printf("could not create file! ");
+				endExperiment(e);
+				updateServer();
+				break;
+			}
+
+			//and the scan file that everything goes into as we take it
+			sprintf(reportPath,"%s/%s%s",SCAN_STORE_DIR,e->timestamp,SCAN_STORE_SUFFIX);
+			if (scanStoreCreate(&e->store,reportPath,specStructToStoreHeader(e->settings),e->settings.scansPerSync)) {
+				printf("Not starting an experiment we can't save.\n");
+				fclose(e->expFile);
+				endExperiment(e);
+				updateServer();
+				break;
+			}
+
+			//fit each scan while we wait for the next one
+			startFitting(e);
+
+			//the first scan is due now
+			e->scheduled = e->nextScan = millis();
+            e->state = AWAITING_TIMEOUT;
+            startScheduler();
+            updateServer();
+            break;
+
+        //an experiment we were in the middle of when we went down.
+        //we just take the next scan straight away
+        case RESUME_EXPERIMENT:
+            sprintf(reportPath,"./experiment_results/%s",e->timestamp);
+            e->expFile = fopen(reportPath,"w");
+            if (!e->expFile) {
+                printf("could not create file! ");
+                break;
+            }
+            printf("Resuming experiment %s at measurement %i/%i\n",e->timestamp,e->readingsTaken + 1,e->settings.numScans);
+            startFitting(e);
+            e->scheduled = e->nextScan = millis();
+            e->state = AWAITING_TIMEOUT;
+            startScheduler();
+            updateServer();
+            break;
+
+        //one that can't be resumed: write up the scans it got, now
+        case FINALISE_EXPERIMENT:
+            sprintf(reportPath,"./experiment_results/%s",e->timestamp);
+            e->expFile = fopen(reportPath,"w");
+            if (!e->expFile) {
+                printf("could not create file! ");
+                break;
+            }
+            printf("Finalising experiment %s with %i/%i measurements\n",e->timestamp,e->readingsTaken,e->settings.numScans);
+            e->state = WRITING_RESULTS;
+            writeResults(e);
+            break;
+
+        default:
+
+            break;
+
+        }
+        break; //break IDLE
+
+        //the scheduler has just read this scan for us:
+    case GETTING_SPECTRA:
+
+
+        switch (command) {
+        case SELF:
+            //every device has to come through for the scan to count
+            e->waitingForDevice = 0;
+            for (k = 0; k < MAX_SPECTROMETERS; k++) {
+                if (deviceInScan(e, k) && e->goodReads[k] == 0) {
+                    e->waitingForDevice = 1;
+                }
+            }
+
+            //with auto-exposure, nudge the integration time for the next
+            //scan if this one wasn't in the band. a clipped scan is no use
+            //to anyone, so that one is taken again straight away (unless
+            //the exposure is as short as it goes)
+            int retake = 0;
+            if (e->settings.autoExposure && !e->waitingForDevice && e->brightest >= 0) {
+                int t = adjustExposure(e->settings.integrationTime, e->brightest, e->floor);
+                if (t != e->settings.integrationTime) {
+                    printf("experiment %s: peak %.0f at %i ms; exposing for %i ms\n",
+                           e->timestamp, e->brightest, e->settings.integrationTime, t);
+                    retake = e->brightest >= MAX_INTENSITY;
+                    e->settings.integrationTime = t;
+                }
+            }
+
+            //...then perform the averaging, one list entry per device
+            for (k = 0; k < MAX_SPECTROMETERS; k++) {
+                if (!e->waitingForDevice && !retake && deviceInScan(e, k)) {
+                    unsigned int scanTime = millis();
+                    long offset;
+                    int numReads = 0;
+                    if (e->settings.rawMode) {
+                        //stored as sums; divided when it's read back for the fit
+                        numReads = e->goodReads[k];
+                        offset = scanStoreAppendRawScan(&e->store,e->readingsTaken,k,scanTime,e->rawSums[k],numReads,e->numPixels[k]);
+                    } else {
+                        spectrumScale(e->averagedArray[k], 1.0 / e->goodReads[k], e->numPixels[k]);
+                        offset = scanStoreAppendScan(&e->store,e->readingsTaken,k,scanTime,e->averagedArray[k],e->goodReads[k],e->numPixels[k]);
+                    }
+                    if (offset < 0) {
+                        printf("lost scan %i.%i!\n",e->readingsTaken + 1,k);
+                    } else {
+                        pthread_mutex_lock(&e->fitLock);
+                        e->spectrumList = list_add(e->spectrumList,&e->spareNodes,offset,e->numPixels[k],numReads,e->goodReads[k],k,e->readingsTaken,scanTime,time(NULL));
+                        if (e->settings.precision > 0) {
+                            printf("scan %i.%i averaged %i of at most %i reads\n",e->readingsTaken + 1,k,e->goodReads[k],e->settings.avgPerScan);
+                        }
+                        pthread_cond_signal(&e->fitReady);
+                        pthread_mutex_unlock(&e->fitLock);
+                    }
+                }
+                if (e->averagedArray[k]) {
+                    memset(e->averagedArray[k], 0, e->numPixels[k] * sizeof (double));
+                }
+                if (e->rawSums[k]) {
+                    memset(e->rawSums[k], 0, e->numPixels[k] * sizeof (unsigned int));
+                }
+                if (e->sumSquares[k]) {
+                    memset(e->sumSquares[k], 0, e->numPixels[k] * sizeof (double));
+                }
+                e->goodReads[k] = 0;
+            }
+
+            //we have now taken one more reading, unless the spectrometer
+            //is down; then we try this scan again shortly. the next scan
+            //is timed from when this one was due, so merged scans keep
+            //their own cadence
+            unsigned int now = millis();
+            if (retake) {
+                printf("scan %i clipped; taking it again\n", e->readingsTaken + 1);
+                e->nextScan = now;
+            } else if (!e->waitingForDevice) {
+                e->readingsTaken++;
+                e->scheduled += e->settings.timeBetweenScans * 1000;
+                if ((int) (e->scheduled - now) < 0) {
+                    e->scheduled = now;
+                }
+                e->nextScan = e->scheduled;
+            } else {
+                printf("Spectrometer unavailable; retrying scan in %i ms\n", SCAN_RETRY_DELAY);
+                e->nextScan = now + SCAN_RETRY_DELAY;
+            }
+
+#ifdef VERBOSE
+			printf("finished getting reading number %i\n", e->readingsTaken);
+#endif
+
+            //now, check to see if we have taken enough scans. if not, wait for the scheduler
+            if (retake || e->waitingForDevice || e->readingsTaken < e->settings.numScans) {
+                e->state = AWAITING_TIMEOUT;
+                pthread_cond_signal(&scheduleChanged);
+                updateServer();
+                break;
+            } else {
+                e->state = WRITING_RESULTS;
+                //the write-up takes a while; don't hold up anyone else's scans
+                pthread_t writer;
+                if (pthread_create(&writer, NULL, resultsThread, e)) {
+                    printf("pi thread failed somehow!\n");
+                    writeResults(e);
+                    break;
+                }
+                pthread_detach(writer);
+                break;
+            }
+
+            break; //break SELF
+
+        case STOP_EXPERIMENT:
+            //the scheduler stops it once it's done reading
+            e->stopRequested = 1;
+            break;
+
+        default:
+
+            break;
+
+
+        }
+        break; //break GETTING_SPECTRA
+
+    case AWAITING_TIMEOUT:
+
+    #ifdef VERBOSE
+                printf("awaiting timeout...\n");
+    #endif
+
+        switch (command) {
+
+        case STOP_EXPERIMENT:
+            clearResults(e);
+            scanStoreClose(&e->store, 1);
+            fclose(e->expFile);
+            endExperiment(e);
+            pthread_cond_signal(&scheduleChanged);
+            break;
+
+        }
+        break;
+
+
+    default:
+
+        break;
+    }
+    return 0;
+}
+
+int experimentRunning()
+{
+    int i, running = 0;
+
+    pthread_mutex_lock(&scheduleLock);
+    for (i = 0; i < MAX_EXPERIMENTS; i++) {
+        if (experiments[i].inited && experiments[i].state != IDLE) {
+            running = 1;
+        }
+    }
+    pthread_mutex_unlock(&scheduleLock);
+    return running;
+}
+
+
+specSettings getExperimentSettings()
+{
+    return getInstanceSettings(current);
+}
+
+specSettings getInstanceSettings(int id)
+{
+    specSettings s = {.doctorName = "", .patientName = "", .timestamp = ""};
+
+    if (id < 0 || id >= MAX_EXPERIMENTS) {
+        return s;
+    }
+    pthread_mutex_lock(&scheduleLock);
+    if (experiments[id].inited) {
+        s = experiments[id].settings;
+    }
+    pthread_mutex_unlock(&scheduleLock);
+    return s;
+}
+
+char *getExpStatusMessage()
+{
+    return getInstanceStatusMessage(current);
+}
+
+char *getInstanceStatusMessage(int id)
+{
+    static char idle[] = "Experiment Status: Idle";
+    experiment *e;
+
+    if (id < 0 || id >= MAX_EXPERIMENTS) {
+        return idle;
+    }
+    e = &experiments[id];
+    pthread_mutex_lock(&scheduleLock);
+    sprintf(e->statusMessage, "Experiment Status: %s", e->inited ? getStateString(e) : "Idle");
+    pthread_mutex_unlock(&scheduleLock);
+    return e->statusMessage;
+}
+
+int experimentIsInited()
+{
+    return getExperimentIds(NULL, MAX_EXPERIMENTS) > 0;
+}
+
+int getExperimentIds(int *ids, int max)
+{
+    int i, n = 0;
+
+    pthread_mutex_lock(&scheduleLock);
+    for (i = 0; i < MAX_EXPERIMENTS && n < max; i++) {
+        if (experiments[i].inited) {
+            if (ids) {
+                ids[n] = i;
+            }
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&scheduleLock);
+    return n;
+}
+
+int findExperiment(const char *timestamp)
+{
+    int i, id = -1;
+
+    pthread_mutex_lock(&scheduleLock);
+    for (i = 0; i < MAX_EXPERIMENTS; i++) {
+        if (experiments[i].inited && !strcmp(experiments[i].timestamp, timestamp)) {
+            id = i;
+        }
+    }
+    pthread_mutex_unlock(&scheduleLock);
+    return id;
+}
+
+
+/*schedulerThread
+ * Takes every experiment's scans. Sleeps until the earliest one is due,
+ * then takes it together with any others due within SCAN_MERGE_WINDOW
+ * that can share its reads. Started with the first experiment and then
+ * left running.
+ */
+PI_THREAD(schedulerThread)
+{
+	experiment *group[MAX_EXPERIMENTS], *first, *e;
+	struct timespec until;
+	unsigned int now;
+	int i, n, wait;
+
+	pthread_mutex_lock(&scheduleLock);
+	while (1) {
+		first = NULL;
+		for (i = 0; i < MAX_EXPERIMENTS; i++) {
+			e = &experiments[i];
+			if (e->inited && e->state == AWAITING_TIMEOUT
+				&& (!first || (int) (e->nextScan - first->nextScan) < 0)) {
+				first = e;
+			}
+		}
+		if (!first) {
+			pthread_cond_wait(&scheduleChanged, &scheduleLock);
+			continue;
+		}
+		now = millis();
+		wait = (int) (first->nextScan - now);
+		if (wait <= 0 && first->settings.autoExposure && !first->exposed) {
+			//find its exposure before the first scan, so that it can be
+			//grouped with whoever it ends up matching
+			first->state = GETTING_SPECTRA;
+			first->acquiring = 1;
+			pthread_mutex_unlock(&scheduleLock);
+			exposeExperiment(first);
+			pthread_mutex_lock(&scheduleLock);
+			first->acquiring = 0;
+			first->state = AWAITING_TIMEOUT;
+			if (first->stopRequested) {
+				runInstance(first, STOP_EXPERIMENT);
+			}
+			continue;
+		}
+		if (wait > 0) {
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += wait / 1000;
+			until.tv_nsec += (wait % 1000) * 1000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&scheduleChanged, &scheduleLock, &until);
+			continue;
+		}
+
+		//everybody who can share these reads, and is due about now anyway
+		n = 0;
+		for (i = 0; i < MAX_EXPERIMENTS; i++) {
+			e = &experiments[i];
+			if (e->inited && e->state == AWAITING_TIMEOUT && (e->exposed || !e->settings.autoExposure)
+				&& (int) (e->nextScan - (now + SCAN_MERGE_WINDOW)) <= 0 && compatibleScans(first, e)) {
+				e->state = GETTING_SPECTRA;
+				e->acquiring = 1;
+				group[n++] = e;
+			}
+		}
+		if (n > 1) {
+			printf("taking %i experiments' scans together\n", n);
+		}
+
+		pthread_mutex_unlock(&scheduleLock);
+		takeScans(group, n);
+		pthread_mutex_lock(&scheduleLock);
+
+		for (i = 0; i < n; i++) {
+			group[i]->acquiring = 0;
+			if (group[i]->stopRequested) {
+				group[i]->state = AWAITING_TIMEOUT;
+				runInstance(group[i], STOP_EXPERIMENT);
+			} else {
+				runInstance(group[i], SELF);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void startScheduler()
+{
+	pthread_cond_signal(&scheduleChanged);
+	if (!schedulerStarted) {
+		if (piThreadCreate(schedulerThread)) {
+			printf("pi thread failed somehow!\n");
+			exit(-11);
+		}
+		schedulerStarted = 1;
+	}
+}
+
+//can b's scan come out of the same reads as a's? the spectrometer has
+//to be set up the same; the filters only matter if the driver applies them
+static int compatibleScans(experiment *a, experiment *b)
+{
+	return a->settings.integrationTime == b->settings.integrationTime
+		&& a->settings.rawMode == b->settings.rawMode
+		&& (a->settings.rawMode || filterChainEquals(&a->filters, &b->filters));
+}
+
+/*takeScans
+ * reads every device any of the group wants until each of them has the
+ * reads it asked for, handing every read to each experiment still
+ * wanting it. That's avgPerScan reads, or with adaptive averaging as
+ * few as get it to its precision. Called without scheduleLock; nobody
+ * else touches the group's buffers while they are acquiring.
+ */
+static void takeScans(experiment **group, int count)
+{
+	static specFrame frames[MAX_SPECTROMETERS];
+	experiment *e;
+	double peak, floor = 0;
+	int i, j, k, d, numFrames, mask, raw = group[0]->settings.rawMode;
+	//each experiment brings its own settings, and the broker sets the
+	//spectrometer up for them. every read must be a new one
+	acquisitionRequest request = {0, group[0]->settings.integrationTime, &group[0]->filters,
+		raw, BROKER_EXPERIMENT, 0};
+
+	for (j = 0; j < count; j++) {
+		group[j]->brightest = -1;
+		group[j]->enoughReads = 0;
+	}
+
+	printf("Collecting Spectrum\n\n");
+	led_ON();
+
+	//grab and total some readings from every spectrometer in the
+	//group at once. failed reads (spectrometer unplugged) come back
+	//straight away and just don't count. in raw mode they stay 16-bit
+	//counts, summed as integers
+	for (i = 0; ; i++) {
+		//who still wants reads, and from which spectrometers
+		mask = 0;
+		for (j = 0; j < count; j++) {
+			e = group[j];
+			if (!e->enoughReads && (i >= e->settings.avgPerScan || (e->settings.precision > 0 && scanPrecise(e)))) {
+				e->enoughReads = 1;
+			}
+			if (!e->enoughReads) {
+				mask |= e->settings.deviceMask ? e->settings.deviceMask : 1;
+			}
+		}
+		if (!mask) {
+			break;
+		}
+
+		request.deviceMask = mask;
+		numFrames = brokerAcquire(&request, frames);
+		for (k = 0; k < numFrames; k++) {
+			d = frames[k].device;
+			if (frames[k].status != 0) {
+				continue;
+			}
+			peak = -1;
+			for (j = 0; j < count; j++) {
+				e = group[j];
+				if (e->enoughReads || !deviceInMask(e, d)) {
+					continue;
+				}
+				if (e->numPixels[d] == 0) {
+					//first time we've seen this one this experiment
+					sizeDeviceBuffers(e, d);
+				}
+				if (frames[k].numPixels != e->numPixels[d]) {
+					//swapped for a different detector mid-experiment;
+					//its readings can't go in with the others
+					printf("spectrometer %i now has %i pixels, not %i!\n",d,frames[k].numPixels,e->numPixels[d]);
+					continue;
+				}
+				if (frames[k].raw) {
+					spectrumAccumulateCounts(e->rawSums[d], frames[k].counts, e->numPixels[d]);
+					if (e->sumSquares[d]) {
+						spectrumAccumulateCountSquares(e->sumSquares[d], frames[k].counts, e->numPixels[d]);
+					}
+				} else {
+					spectrumAccumulate(e->averagedArray[d], frames[k].spectrum, e->numPixels[d]);
+					if (e->sumSquares[d]) {
+						spectrumAccumulateSquares(e->sumSquares[d], frames[k].spectrum, e->numPixels[d]);
+					}
+				}
+				e->goodReads[d]++;
+
+				//auto-exposed experiments keep an eye on every read
+				if (e->settings.autoExposure) {
+					if (peak < 0) {
+						peak = framePeak(&frames[k], &floor);
+					}
+					if (peak > e->brightest) {
+						e->brightest = peak;
+						e->floor = floor;
+					}
+				}
+			}
+		}
+	}
+
+	led_OFF();
+}
+
+
+//has adaptive averaging got every device of this scan to its precision?
+//the worst pixel decides: its standard error is sqrt(variance / reads)
+static int scanPrecise(experiment *e)
+{
+	double variance, target = e->settings.precision * e->settings.precision;
+	int d, minReads = e->settings.minReads > 2 ? e->settings.minReads : 2;
+
+	for (d = 0; d < MAX_SPECTROMETERS; d++) {
+		if (!deviceInScan(e, d)) {
+			continue;
+		}
+		if (e->goodReads[d] < minReads || !e->sumSquares[d]) {
+			return 0;
+		}
+		variance = e->settings.rawMode
+			? spectrumWorstCountVariance(e->rawSums[d], e->sumSquares[d], e->goodReads[d], e->numPixels[d])
+			: spectrumWorstVariance(e->averagedArray[d], e->sumSquares[d], e->goodReads[d], e->numPixels[d]);
+		if (variance / e->goodReads[d] > target) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//probe for an auto-exposed experiment's integration time. called without
+//scheduleLock, like takeScans. if nothing can be read we carry on with
+//the time it was sent, and the scans themselves will put it right
+static void exposeExperiment(experiment *e)
+{
+	int t = brokerAutoExpose(e->settings.deviceMask, BROKER_EXPERIMENT);
+
+	if (t > 0) {
+		e->settings.integrationTime = t;
+	}
+	e->exposed = 1;
+}
+
+//is this spectrometer part of the experiment? a mask of 0 means just device 0
+static int deviceInScan(experiment *e, int device)
+{
+	return deviceInMask(e, device) && device < getNumSpectrometers();
+}
+
+//...or at least was asked to be, whether or not it's plugged in
+static int deviceInMask(experiment *e, int device)
+{
+	int mask = e->settings.deviceMask ? e->settings.deviceMask : 1;
+
+	return (mask & (1 << device)) != 0;
+}
+
+//private function to get strings from states
+static char *getStateString(experiment *e)
+{
+	static char str[512];
+
+	if(e->state == IDLE) {
+		return "Idle";
+	} else if(e->waitingForDevice) {
+		sprintf(str,"Waiting for spectrometer to reconnect (%i/%i measurements taken)",e->readingsTaken,e->settings.numScans);
+		return str;
+	} else if(e->state == WRITING_RESULTS) {
+		return "Performing post-processing/peak detection...";
+	} else {
+		sprintf(str,"Finished measurement %i/%i with %i second intervals",e->readingsTaken,e->settings.numScans,e->settings.timeBetweenScans);
+        return str;
+	}
+}
+
+//claim a free slot for a new experiment and set it up. the names are
+//copied, since the caller's buffers won't outlive the command.
+//caller holds scheduleLock
+static experiment *newExperiment(specSettings spec)
+{
+	experiment *e = NULL;
+	int i, d;
+
+	for (i = 0; i < MAX_EXPERIMENTS; i++) {
+		if (!experiments[i].inited && experiments[i].state == IDLE) {
+			e = &experiments[i];
+			break;
+		}
+	}
+	if (!e) {
+		return NULL;
+	}
+
+	if (!e->fitterStarted) {
+		pthread_mutex_init(&e->fitLock, NULL);
+		pthread_cond_init(&e->fitReady, NULL);
+		pthread_cond_init(&e->fitIdle, NULL);
+		e->fitPaused = 1;
+	}
+	e->id = i;
+	e->settings = spec;
+	snprintf(e->doctor, NAME_LENGTH, "%s", spec.doctorName ? spec.doctorName : "");
+	snprintf(e->patient, NAME_LENGTH, "%s", spec.patientName ? spec.patientName : "");
+	snprintf(e->timestamp, NAME_LENGTH, "%s", spec.timestamp ? spec.timestamp : "");
+	e->settings.doctorName = e->doctor;
+	e->settings.patientName = e->patient;
+	e->settings.timestamp = e->timestamp;
+	filterChainCompile(&e->filters, spec.boxcarWidth, spec.filters);
+	e->readingsTaken = 0;
+	e->waitingForDevice = 0;
+	e->acquiring = 0;
+	e->stopRequested = 0;
+	e->exposed = 0;
+	e->brightest = -1;
+	e->lastScanTime = 0;
+	e->expFile = NULL;
+	memset(e->goodReads, 0, sizeof (e->goodReads));
+	for (d = 0; d < MAX_SPECTROMETERS; d++) {
+		sizeDeviceBuffers(e, d);
+	}
+	clearResults(e);
+	e->inited = 1;
+	return e;
+}
+
+//give the slot back. caller holds scheduleLock
+static void endExperiment(experiment *e)
+{
+	e->inited = 0;
+	e->state = IDLE;
+	e->stopRequested = 0;
+}
+
+
+static specSettings indexStringToSpecStruct(char *indexString)
+{
+	specSettings s;
+	return s;
+
+}
+
+static char *specStructToStatusString(specSettings s) {
+
+}
+
+static char *specStructToIndexString(specSettings s) {
+	static char str[512];
+	sprintf(str, "exp_%s;%s;%s;%i;%i;%i;%i;%i;%i\n",
+		s.timestamp,
+		s.doctorName,
+		s.patientName,
+		s.numScans,
+		s.timeBetweenScans,
+		s.integrationTime,
+		s.boxcarWidth,
+		s.avgPerScan,
+		s.deviceMask);
+
+		return str;
+	}
+
+//the settings at the top of the scan file; numbers first, since the
+//names are the only fields that could ever be empty
+static char *specStructToStoreHeader(specSettings s) {
+	static char str[SCAN_STORE_HEADER_LENGTH];
+	snprintf(str, sizeof (str), "%i;%i;%i;%i;%i;%i;%i;%s;%s;%s;%i;%i;%g;%i;%i;%i;%g;%s",
+		s.numScans,
+		s.timeBetweenScans,
+		s.integrationTime,
+		s.boxcarWidth,
+		s.avgPerScan,
+		s.deviceMask,
+		s.scansPerSync,
+		s.doctorName,
+		s.patientName,
+		s.timestamp,
+		s.rawMode,
+		s.autoExposure,
+		s.precision,
+		s.minReads,
+		s.shiftMethod,
+		s.baselineMethod,
+		s.baselineLambda,
+		s.filters);
+
+	return str;
+}
+
+//and back again. the names are copied into the experiment's own buffers
+static int storeHeaderToSpecStruct(char *header, specSettings *s) {
+	fieldView rest = fieldFromString(header), f;
+	int *numbers[] = {&s->numScans, &s->timeBetweenScans, &s->integrationTime,
+					  &s->boxcarWidth, &s->avgPerScan, &s->deviceMask, &s->scansPerSync};
+	int i;
+
+	for (i = 0; i < 7; i++) {
+		if (!nextField(&rest, &f, ';')) {
+			return -1;
+		}
+		*numbers[i] = fieldToInt(f, 0);
+	}
+	if (!nextField(&rest, &f, ';')) {
+		return -1;
+	}
+	fieldCopy(f, s->doctorName, NAME_LENGTH);
+	if (!nextField(&rest, &f, ';')) {
+		return -1;
+	}
+	fieldCopy(f, s->patientName, NAME_LENGTH);
+	if (!nextField(&rest, &f, ';')) {
+		return -1;
+	}
+	fieldCopy(f, s->timestamp, NAME_LENGTH);
+	//added later, so older stores won't have them
+	s->rawMode = nextField(&rest, &f, ';') ? fieldToInt(f, 0) : 0;
+	s->autoExposure = nextField(&rest, &f, ';') ? fieldToInt(f, 0) : 0;
+	s->precision = nextField(&rest, &f, ';') ? fieldToDouble(f, 0) : 0;
+	s->minReads = nextField(&rest, &f, ';') ? fieldToInt(f, 0) : 0;
+	//stores from before cross-correlation shifted by the fit
+	s->shiftMethod = nextField(&rest, &f, ';') ? fieldToInt(f, SHIFT_FIT) : SHIFT_FIT;
+	s->baselineMethod = nextField(&rest, &f, ';') ? fieldToInt(f, BASELINE_OFF) : BASELINE_OFF;
+	s->baselineLambda = nextField(&rest, &f, ';') ? fieldToDouble(f, 0) : 0;
+	if (nextField(&rest, &f, ';')) {
+		fieldCopy(f, s->filters, FILTER_TEXT_LENGTH);
+	} else {
+		s->filters[0] = '\0';
+	}
+	return 0;
+}
+
+
+
+//highly slimmed-down linked list of stored scans. nodes come off the
+//spare list if there are any, and go back on it rather than being freed,
+//so an experiment slot only ever mallocs as many as its longest run needed
+static listNode *list_add(listNode *head,listNode **spare,long offset,int numPixels,int numReads,int readsUsed,int device,int scan,unsigned int timestamp,unsigned int wallTime) {
+		int count = 1;
+		listNode *cur;
+		listNode *tmp = *spare;
+
+		//reuse or allocate a node and set up its contents
+		if(tmp) {
+			*spare = tmp->nextNode;
+		} else {
+			tmp = malloc(sizeof(listNode));
+		}
+		if(!tmp) {
+			printf("we didnt get the memory for a node :(\n");
+			while(1);
+		}
+		tmp->offset = offset;
+		tmp->numPixels = numPixels;
+		tmp->numReads = numReads;
+		tmp->readsUsed = readsUsed;
+		tmp->device = device;
+		tmp->scan = scan;
+		tmp->timestamp = timestamp;
+		tmp->wallTime = wallTime;
+		tmp->fitted = 0;
+		tmp->result = 0;
+		tmp->shift = 0;
+		tmp->quality = -1;
+		tmp->nextNode = NULL;
+
+		if(head == NULL) {
+			printf("STARTED LIST with item 0\n");
+			return tmp;
+		}
+
+		//iterate to the end of the list:
+		for(cur = head; cur->nextNode != NULL; cur = cur->nextNode) {
+			count++;
+		}
+		printf("added item %i to list\n",count);
+		cur->nextNode = tmp;
+
+		return head;
+}
+
+//the node for one device's part of one scan, if we have it
+static listNode *list_find(listNode *head,int device,int scan) {
+	for(; head != NULL; head = head->nextNode) {
+		if(head->device == device && head->scan == scan) {
+			return head;
+		}
+	}
+	return NULL;
+}
+
+//drop every node from scan numScans onwards onto the spare list
+static listNode *list_truncate(listNode *head,listNode **spare,int numScans) {
+	listNode **link = &head;
+	listNode *cur;
+
+	while(*link != NULL) {
+		cur = *link;
+		if(cur->scan >= numScans) {
+			*link = cur->nextNode;
+			cur->nextNode = *spare;
+			*spare = cur;
+		} else {
+			link = &cur->nextNode;
+		}
+	}
+	return head;
+}
+
+//put the whole list on the spare list. a loop rather than recursion;
+//a long experiment's list is deeper than the stack
+static void list_destroy(listNode *head,listNode **spare) {
+	listNode *next;
+
+	for(; head != NULL; head = next) {
+		next = head->nextNode;
+		head->nextNode = *spare;
+		*spare = head;
+	}
+	printf("List destroyed!\n");
+}
+
+//recursive one-way iterator? why not!!
+static void list_print_recurse(listNode *head, int count) {
+	if (head == NULL) {
+		printf("end list_print\n");
+		return;
+	}
+	printf("item %i = scan %i.%i at offset %li\n",count,head->scan + 1,head->device,head->offset);
+	list_print_recurse(head->nextNode,++count);
+}
+
+//want to recurse without supplying count? we got you.
+static void list_print(listNode *head) {
+	if (head == NULL) {
+		printf("list is empty\n");
+		return;
+	}
+	list_print_recurse(head,0);
+}
+
+//one post-processing fit, run on a pool worker. jobs are numbered so no
+//two fits anywhere share temp files: the fitters use 0..MAX_EXPERIMENTS-1
+static void fitScan(void *arg, int index) {
+	fitJob *job = arg;
+
+	fitNode(job->e, job->nodes[index], index * MAX_EXPERIMENTS + job->e->id);
+}
+
+//a scan's spectrum, as it is fitted: read back from the store, filtered
+//if it was kept as raw counts, and with the baseline off if there is one.
+//spectrum holds node->numPixels
+static void readNodeSpectrum(experiment *e, listNode *node, double *spectrum) {
+	//fitters and pool workers live as long as the server, so each keeps
+	//its own baseline workspace from one scan to the next
+	static __thread baselineWorkspace baseline;
+	double smoothed[node->numPixels];
+
+	if (scanStoreReadSpectrum(&e->store,node->offset,node->numReads,0,node->numPixels,spectrum) != 0) {
+		printf("could not read back scan %i.%i\n",node->scan + 1,node->device);
+		memset(spectrum, 0, node->numPixels * sizeof (double));
+	}
+	if (node->numReads) {
+		//raw counts were never filtered; that happens here instead
+		filterChainApply(&e->filters, spectrum, smoothed, node->numPixels);
+		memcpy(spectrum, smoothed, sizeof (smoothed));
+	}
+	baselineRemove(&baseline, e->settings.baselineMethod, e->settings.baselineLambda, spectrum, node->numPixels);
+}
+
+//fit one scan, work out how far its peak has moved since that device's
+//first scan, and pass the result on to whoever is listening
+static void fitNode(experiment *e, listNode *node, int job) {
+	double spectrum[node->numPixels], shift = 0;
+	listNode *first;
+	scanResult r;
+	int d = node->device, correlated = 0;
+	//a recovered scan may be from a detector that's no longer the one plugged in
+	int n = node->numPixels < e->numPixels[d] ? node->numPixels : e->numPixels[d];
+
+	readNodeSpectrum(e, node, spectrum);
+	node->result = findPeakValueWavelength(e->wavelengths[d],spectrum,n,job,&node->quality);
+
+	pthread_mutex_lock(&e->fitLock);
+	for(first = e->spectrumList; first != NULL; first = first->nextNode) {
+		if (first->device == d) {
+			break;
+		}
+	}
+	//the first scan becomes the reference the first time it's needed;
+	//after that it never changes, so the correlations can run unlocked
+	if (e->settings.shiftMethod == SHIFT_CORRELATE && first && first != node && !e->shifts[d].ready) {
+		double reference[first->numPixels];
+		int m = first->numPixels < e->numPixels[d] ? first->numPixels : e->numPixels[d];
+		readNodeSpectrum(e, first, reference);
+		shiftSetReference(&e->shifts[d], e->wavelengths[d], reference, m);
+	}
+	pthread_mutex_unlock(&e->fitLock);
+
+	if (e->settings.shiftMethod == SHIFT_CORRELATE && first != node) {
+		correlated = shiftEstimate(&e->shifts[d], e->wavelengths[d], spectrum, n, &shift) == 0;
+	}
+
+	//without a correlation, the difference of the fits. the fitter goes
+	//in order and writeResults fits each device's first scan before the
+	//pool starts, so the first one is always done by now (or is this one)
+	pthread_mutex_lock(&e->fitLock);
+	if (!correlated) {
+		shift = (first && first->fitted) ? node->result - first->result : 0;
+	}
+	node->shift = shift;
+	node->fitted = 1;
+	pthread_mutex_unlock(&e->fitLock);
+
+	//so a restart doesn't have to fit it again
+	scanStoreAppendResult(&e->store,node->scan,node->device,node->result,node->shift,node->quality);
+
+	if (resultCallback) {
+		r.experiment = e->id;
+		r.scan = node->scan;
+		r.device = node->device;
+		r.timestamp = node->timestamp;
+		r.peakWavelength = node->result;
+		r.shift = node->shift;
+		resultCallback(r);
+	}
+}
+
+/*fitThread
+ * Waits for scans to be added to an experiment's list and fits them one
+ * at a time, in order. One per experiment slot, started the first time
+ * the slot is used and then left running; stopFitting parks it.
+ */
+static void *fitThread(void *arg)
+{
+	experiment *e = arg;
+	listNode *node;
+
+	pthread_mutex_lock(&e->fitLock);
+	while (1) {
+		node = e->fitCursor ? e->fitCursor->nextNode : e->spectrumList;
+		if (e->fitPaused || node == NULL) {
+			pthread_cond_wait(&e->fitReady, &e->fitLock);
+			continue;
+		}
+		e->fitCursor = node;
+		if (node->fitted) {
+			//already done before a restart
+			continue;
+		}
+		e->fitBusy = 1;
+		pthread_mutex_unlock(&e->fitLock);
+
+		//our job number is the slot; the pool only runs once we have stopped
+		fitNode(e, node, e->id);
+
+		pthread_mutex_lock(&e->fitLock);
+		e->fitBusy = 0;
+		pthread_cond_broadcast(&e->fitIdle);
+	}
+	return NULL;
+}
+
+//let the fitter loose on the list, starting it if this is the first time
+static void startFitting(experiment *e) {
+	pthread_t fitter;
+
+	pthread_mutex_lock(&e->fitLock);
+	e->fitPaused = 0;
+	pthread_cond_signal(&e->fitReady);
+	pthread_mutex_unlock(&e->fitLock);
+
+	if (!e->fitterStarted) {
+		if (pthread_create(&fitter, NULL, fitThread, e)) {
+			//not fatal: everything will be fitted at the end instead
+			printf("pi thread failed somehow!\n");
+			return;
+		}
+		pthread_detach(fitter);
+		e->fitterStarted = 1;
+	}
+}
+
+//park the fitter, waiting for any fit it is in the middle of
+static void stopFitting(experiment *e) {
+	pthread_mutex_lock(&e->fitLock);
+	e->fitPaused = 1;
+	while (e->fitBusy) {
+		pthread_cond_wait(&e->fitIdle, &e->fitLock);
+	}
+	pthread_mutex_unlock(&e->fitLock);
+}
+
+//throw away the list (and the fitter's place in it)
+static void clearResults(experiment *e) {
+	stopFitting(e);
+	pthread_mutex_lock(&e->fitLock);
+	list_destroy(e->spectrumList, &e->spareNodes);
+	e->spectrumList = NULL;
+	e->fitCursor = NULL;
+	for (int k = 0; k < MAX_SPECTROMETERS; k++) {
+		shiftReset(&e->shifts[k]);
+	}
+	pthread_mutex_unlock(&e->fitLock);
+}
+
+int getExperimentResults(scanResult *results, int max) {
+	return getInstanceResults(current, results, max);
+}
+
+int getInstanceResults(int id, scanResult *results, int max) {
+	experiment *e;
+	listNode *cur;
+	int n = 0;
+
+	if (id < 0 || id >= MAX_EXPERIMENTS || !experiments[id].inited) {
+		return 0;
+	}
+	e = &experiments[id];
+	pthread_mutex_lock(&e->fitLock);
+	for(cur = e->spectrumList; cur != NULL && n < max; cur = cur->nextNode) {
+		if (!cur->fitted) {
+			continue;
+		}
+		results[n].experiment = id;
+		results[n].scan = cur->scan;
+		results[n].device = cur->device;
+		results[n].timestamp = cur->timestamp;
+		results[n].peakWavelength = cur->result;
+		results[n].shift = cur->shift;
+		n++;
+	}
+	pthread_mutex_unlock(&e->fitLock);
+	return n;
+}
+
+/*writeResults
+ * the WRITING_RESULTS state: fit whatever is left, write the results
+ * file and the index, and give the slot back. Runs on its own thread at
+ * the end of a scheduled experiment, so it takes the locks it needs.
+ */
+static void writeResults(experiment *e)
+{
+        printf("\nfinished getting spectra.\nWRITING RESULTS!\n\n");
+		updateServer();
+
+		//almost everything was fitted while we waited between scans.
+		//let the fitter finish what it's on, then pick up the rest
+		//(normally just the last scan) ourselves
+		stopFitting(e);
+
+		//carve out a result array, one per stored spectrum:
+		listNode *cur;
+		int numResults = 0, numUnfitted = 0;
+		for(cur = e->spectrumList; cur != NULL; cur = cur->nextNode) {
+			numResults++;
+		}
+		double *resultArray = malloc(numResults*sizeof(double));
+		listNode **nodes = malloc(numResults*sizeof(listNode *));
+		if(!resultArray || !nodes) {
+			printf("we didnt get the memory\n");
+		}
+
+		//every other scan's shift is taken from its device's first, so
+		//those are fitted here before the rest go out of order on the pool
+		//(after a restart nothing has been fitted yet). the fitter has
+		//stopped, so its job number is free
+		int i = 0, seen = 0;
+		for(cur = e->spectrumList; cur != NULL; cur = cur->nextNode) {
+			if (seen & (1 << cur->device)) {
+				continue;
+			}
+			seen |= 1 << cur->device;
+			if (!cur->fitted) {
+				fitNode(e, cur, e->id);
+			}
+		}
+
+		//i'm so happy this works:
+		for(cur = e->spectrumList; cur != NULL; cur = cur->nextNode) {
+			if (!cur->fitted) {
+				nodes[numUnfitted++] = cur;
+			}
+		}
+
+		//the fits are independent, so spread them over every core.
+		//each one writes its own node, so the order doesn't matter
+		fitJob job = {e, nodes};
+		if (workPoolRun(fitScan, &job, numUnfitted) != 0) {
+			for(i = 0; i < numUnfitted; i++) {
+				fitScan(&job, i);
+			}
+		}
+		free(nodes);
+
+		i = 0;
+		for(cur = e->spectrumList; cur != NULL; cur = cur->nextNode) {
+			resultArray[i++] = cur->result;
+		}
+
+
+		//printf everything to our file:
+		printf("trying to write result file...\n");
+		writeExperimentFile(e,e->expFile,resultArray);
+		fclose(e->expFile);
+
+		//open the index file and write a serialized spec struct to it.
+		//one experiment at a time, since they all share it
+		pthread_mutex_lock(&indexLock);
+		FILE *expIndex = safelyOpenIndex();
+		char *indexString = specStructToIndexString(e->settings);
+		fprintf(expIndex,indexString);
+		fclose(expIndex);
+
+		char buf[512];
+
+		//this beautiful line replaces the first line with the new experimentcount
+		sprintf(buf,"(cd experiment_results; sed -e '1 s/.*.*/%i/g' INDEX > tmp; mv tmp INDEX)",++numSavedExperiments);
+		system(buf);
+		pthread_mutex_unlock(&indexLock);
+
+		archiveResults(e, numResults);
+
+		//only now is it safe to let go of the scans
+		scanStoreClose(&e->store, 1);
+
+		//list_print(e->spectrumList);
+		printf("trying to free the memory\n");
+		free(resultArray);
+        clearResults(e);
+
+        pthread_mutex_lock(&scheduleLock);
+        endExperiment(e);
+        pthread_mutex_unlock(&scheduleLock);
+        updateServer();
+}
+
+//file every scan's result in the archive, for queries across experiments
+static void archiveResults(experiment *e, int numResults)
+{
+	archiveRow *rows = malloc((numResults ? numResults : 1) * sizeof (archiveRow));
+	unsigned int start = 0;
+	listNode *cur;
+	int i = 0;
+
+	if (!rows) {
+		printf("we didnt get the memory to archive %s\n", e->timestamp);
+		return;
+	}
+	for(cur = e->spectrumList; cur != NULL; cur = cur->nextNode) {
+		rows[i].wallTime = cur->wallTime;
+		rows[i].scan = cur->scan;
+		rows[i].device = cur->device;
+		rows[i].peak = cur->result;
+		rows[i].shift = cur->shift;
+		rows[i].quality = cur->quality;
+		if (i == 0 || cur->wallTime < start) {
+			start = cur->wallTime;
+		}
+		i++;
+	}
+	archiveAddExperiment(e->settings, start ? start : time(NULL), rows, i);
+	free(rows);
+}
+
+//writes up one experiment without holding up the scheduler
+static void *resultsThread(void *arg)
+{
+	writeResults(arg);
+	return NULL;
+}
+
+//this is where we do the peak detection work;
+//or rather, where we have python do it!
+//job keeps the temp files apart when several fits run at once.
+//quality gets the fit's R^2, or -1 if python didn't give one
+static double findPeakValueWavelength(double *wavelengths, double *intensities, int numPixels, int job, double *quality) {
+
+	char str[256];
+	char rawPath[64], resultPath[64];
+	double peakWavelength = 0;
+	float low = 0, high = 0, raw_peak = 0;
+	int peakIndex = 0;
+
+	*quality = -1;
+	sprintf(rawPath,"./raw_data_%i.txt",job);
+	sprintf(resultPath,"./peak_result_%i.txt",job);
+	FILE *rawData = fopen(rawPath,"w");
+
+	if(!rawData || wavelengths == NULL || intensities == NULL || numPixels <= 0) {
+		printf("file problems or bad array!\n");
+		if (rawData) {
+			fclose(rawData);
+		}
+		return 0;
+	}
+
+
+	//get the index of the peak
+	peakIndex = spectrumPeakIndex(intensities, numPixels, NULL);
+	raw_peak = intensities[peakIndex];
+	//printf("found peak %f with index %i\n",raw_peak,peakIndex);
+
+	//iterate forwards to get high bound:
+	int i = peakIndex + 1;
+	while(i < numPixels) {
+		if(intensities[i] <= .98 * raw_peak) {
+			high = wavelengths[i];
+			break;
+		}
+		i++;
+	}
+
+	//iterate backwards to get low bound:
+	i = peakIndex - 1;
+	while(i >= 0) {
+		if(intensities[i] <= .98 * raw_peak) {
+			low = wavelengths[i];
+			break;
+		}
+		i--;
+	}
+
+
+	for(int i = 0; i < numPixels; i++) {
+		double wave = wavelengths[i];
+		double intens = intensities[i];
+		if (wave >= low && wave <= high ) {
+			fprintf(rawData,"%.2lf	%.2lf\n",wave,intens);
+		}
+	}
+	//fprintf(rawData,"DATA END");
+
+	printf("done writing to file! working with window = %.2f nm\n",high-low);
+
+		fclose(rawData);
+
+	printf("Now starting python...\n");
+	sprintf(str,"sudo python3 ./PeakDetector.py %s %s",rawPath,resultPath);
+	system(str);
+
+	//now python's output file will be fitted:
+	FILE *fittedData = fopen(resultPath,"r");
+	if(!fittedData) {
+		printf("file problems!\n");
+		exit(-1);
+	}
+
+	if (fscanf(fittedData,"%lf %lf",&peakWavelength,quality) < 2) {
+		*quality = -1;
+	}
+	fclose(fittedData);
+	remove(rawPath);
+	remove(resultPath);
+
+	printf("done!! we found wavelength = %.2lf\n", peakWavelength);
+
+
+    return peakWavelength;
+
+
+}
+
+
+//write the measurements and results to the file, and the same matrix to
+//the experiment's pyramid for previews.
+//the spectra are read back from the scan store a band of rows at a time,
+//so this takes the same memory however many scans there are. A scan
+//from a smaller detector just leaves its column blank further down
+static void writeExperimentFile(experiment *e, FILE *f, double *results) {
+	listNode *cur, *head = e->spectrumList;
+	spectrumPyramid pyramid;
+	char pyramidPath[NAME_LENGTH + 64];
+	double *band;
+	int i, r, n, rows, bandRows, numResults = 0, numRows = 0, maxPixels = 0;
+
+	//line = specStruct2descriptor OR SOMETHING
+	fprintf(f,"EXPERIMENT HEADER\n");
+
+	for(cur = head; cur != NULL; cur = cur->nextNode) {
+		if (cur->readsUsed) {
+			fprintf(f,"Reading %i.%i (%i reads)\t",cur->scan + 1,cur->device,cur->readsUsed);
+		} else {
+			fprintf(f,"Reading %i.%i\t",cur->scan + 1,cur->device);
+		}
+		numResults++;
+		if (cur->numPixels > maxPixels) {
+			maxPixels = cur->numPixels;
+		}
+	}
+	numRows = maxPixels;
+	fprintf(f,"Results\n");
+	if (numResults > numRows) {
+		numRows = numResults;
+	}
+
+	bandRows = numResults ? WRITE_BUFFER_READINGS / numResults : numRows;
+	if (bandRows < 1) {
+		bandRows = 1;
+	} else if (bandRows > numRows) {
+		bandRows = numRows;
+	}
+	band = malloc((bandRows ? bandRows : 1) * (numResults ? numResults : 1) * sizeof (double));
+	if (!band) {
+		printf("we didnt get the memory\n");
+		return;
+	}
+	sprintf(pyramidPath,"%s/%s%s",SCAN_STORE_DIR,e->timestamp,PYRAMID_SUFFIX);
+	pyramidCreate(&pyramid,pyramidPath,maxPixels,numResults);
+
+	for(i = 0; i < numRows; i += bandRows) {
+		rows = numRows - i < bandRows ? numRows - i : bandRows;
+
+		n = 0;
+		for(cur = head; cur != NULL; cur = cur->nextNode, n++) {
+			int have = cur->numPixels - i;
+			have = have < 0 ? 0 : (have > rows ? rows : have);
+			if (have && scanStoreReadSpectrum(&e->store,cur->offset,cur->numReads,i,have,&band[n * rows]) != 0) {
+				memset(&band[n * rows], 0, have * sizeof (double));
+			}
+			for(r = have; r < rows; r++) {
+				band[n * rows + r] = NAN;
+			}
+		}
+		if (i < maxPixels && pyramid.fd >= 0 && pyramidAddBand(&pyramid,band,rows) != 0) {
+			pyramidFinish(&pyramid);
+		}
+
+		for(r = 0; r < rows; r++) {
+			n = 0;
+			for(cur = head; cur != NULL; cur = cur->nextNode, n++) {
+				if (i + r < cur->numPixels) {
+					fprintf(f,"%-11.2f\t",band[n * rows + r]);
+				} else {
+					fprintf(f,"%-11s\t","");
+				}
+			}
+			if (i + r < numResults) {
+				fprintf(f,"%-11.2f\n",results[i + r]);
+			} else {
+				fprintf(f,"\n");
+			}
+		}
+	}
+	free(band);
+	if (pyramid.fd >= 0) {
+		pyramidFinish(&pyramid);
+	}
+}
+
+//size one spectrometer's wavelength and averaging buffers for its
+//current pixel count, and fetch its calibration
+static int sizeDeviceBuffers(experiment *e, int device) {
+	int n = getDeviceNumPixels(device);
+	double *wl, *avg;
+	unsigned int *sums;
+
+	if (n > e->bufferCapacity[device]) {
+		wl = realloc(e->wavelengths[device], n * sizeof (double));
+		if (wl) {
+			e->wavelengths[device] = wl;
+		}
+		avg = realloc(e->averagedArray[device], n * sizeof (double));
+		if (avg) {
+			e->averagedArray[device] = avg;
+		}
+		if (!wl || !avg) {
+			printf("we didnt get the memory for %i pixels\n", n);
+			e->numPixels[device] = 0;
+			return -1;
+		}
+		e->bufferCapacity[device] = n;
+	}
+	if (e->settings.rawMode && n > e->rawCapacity[device]) {
+		sums = realloc(e->rawSums[device], n * sizeof (unsigned int));
+		if (!sums) {
+			printf("we didnt get the memory for %i pixels\n", n);
+			e->numPixels[device] = 0;
+			return -1;
+		}
+		e->rawSums[device] = sums;
+		e->rawCapacity[device] = n;
+	}
+	if (e->settings.precision > 0 && n > e->squaresCapacity[device]) {
+		double *squares = realloc(e->sumSquares[device], n * sizeof (double));
+		if (!squares) {
+			printf("we didnt get the memory for %i pixels\n", n);
+			e->numPixels[device] = 0;
+			return -1;
+		}
+		e->sumSquares[device] = squares;
+		e->squaresCapacity[device] = n;
+	}
+	e->numPixels[device] = n > 0 ? getDeviceWavelengthArray(device, e->wavelengths[device], n) : 0;
+	if (e->numPixels[device] < 0) {
+		e->numPixels[device] = 0;
+	}
+	if (e->numPixels[device] > 0) {
+		memset(e->averagedArray[device], 0, e->numPixels[device] * sizeof (double));
+		if (e->rawSums[device]) {
+			memset(e->rawSums[device], 0, e->numPixels[device] * sizeof (unsigned int));
+		}
+		if (e->sumSquares[device]) {
+			memset(e->sumSquares[device], 0, e->numPixels[device] * sizeof (double));
+		}
+	}
+	return 0;
+}
+
+//when first creating a new index file we need to make sure to place
+//the header at the top
+static FILE *safelyOpenIndex() {
+
+		//using "r" should return null if doesn't exist
+		FILE *fptr =  fopen("./experiment_results/INDEX","r");
+			if (!fptr) {
+				//the file doesn't exist, so create it wwith "w"
+				printf("creating index!\n");
+				fptr = fopen("./experiment_results/INDEX", "w");
+				fprintf(fptr, "0\n");
+				numSavedExperiments = 0;
+				fclose(fptr);
+			} else {
+				fscanf(fptr,"%i",&numSavedExperiments);
+				printf("we think there are %i experiment results here\n",numSavedExperiments);
+				fclose(fptr);
+			}
+
+	//finally, open it for appending and return:
+	return fopen("./experiment_results/INDEX","a");
+
+
+	}
+
+
+/*
+ * Interrupted experiments: every experiment that hasn't finished has a
+ * scan file in SCAN_STORE_DIR. We reload each one; if it is still
+ * within RESUME_GRACE of its next scan it carries on alongside any
+ * others, otherwise its results are written from the scans it got.
+ */
+int recoverExperiments(int (*updateFunction)())
+{
+	static char paths[MAX_RECOVERED][SCAN_STORE_PATH_LENGTH];
+	int i, numPaths, recovered = 0;
+	unsigned int now;
+	experiment *e;
+
+	updateServer = updateFunction;
+	numPaths = scanStoreFindAll(paths, MAX_RECOVERED);
+	for (i = 0; i < numPaths; i++) {
+		printf("found interrupted experiment %s\n", paths[i]);
+		pthread_mutex_lock(&scheduleLock);
+		e = loadStoredExperiment(paths[i]);
+		if (!e) {
+			pthread_mutex_unlock(&scheduleLock);
+			continue;
+		}
+
+		now = time(NULL);
+		if (e->readingsTaken < e->settings.numScans
+			&& now - e->lastScanTime <= (unsigned int) (e->settings.timeBetweenScans + RESUME_GRACE)) {
+			current = e->id;
+			runInstance(e, RESUME_EXPERIMENT);
+		} else {
+			runInstance(e, FINALISE_EXPERIMENT);
+		}
+		pthread_mutex_unlock(&scheduleLock);
+		recovered++;
+	}
+	return recovered;
+}
+
+//rebuild an experiment from a scan file into a free slot: settings, the
+//list of scans and any results that had already been fitted.
+//caller holds scheduleLock
+static experiment *loadStoredExperiment(char *path)
+{
+	char header[SCAN_STORE_HEADER_LENGTH];
+	specSettings s = {.doctorName = "", .patientName = "", .timestamp = ""};
+	int k, present;
+	experiment *e = newExperiment(s);
+
+	if (!e) {
+		printf("no free experiment slot for %s; leaving it for now\n", path);
+		return NULL;
+	}
+	if (scanStoreOpen(&e->store, path, header, sizeof (header), visitStoredRecord, e) != 0) {
+		endExperiment(e);
+		return NULL;
+	}
+	if (storeHeaderToSpecStruct(header, &e->settings) != 0) {
+		printf("%s has a bad header; leaving it alone\n", path);
+		clearResults(e);
+		scanStoreClose(&e->store, 0);
+		endExperiment(e);
+		return NULL;
+	}
+	e->store.scansPerSync = e->settings.scansPerSync;
+	filterChainCompile(&e->filters, e->settings.boxcarWidth, e->settings.filters);
+	brokerApplySettings(e->settings);
+	if (e->settings.rawMode || e->settings.precision > 0) {
+		//newExperiment didn't know to make room for the sums
+		for (k = 0; k < MAX_SPECTROMETERS; k++) {
+			sizeDeviceBuffers(e, k);
+		}
+	}
+
+	//a scan only counts if every device made it in before we went down
+	e->readingsTaken = 0;
+	while (1) {
+		present = 1;
+		for (k = 0; k < MAX_SPECTROMETERS; k++) {
+			if (deviceInMask(e, k) && !list_find(e->spectrumList, k, e->readingsTaken)) {
+				present = 0;
+			}
+		}
+		if (!present) {
+			break;
+		}
+		e->readingsTaken++;
+	}
+	e->spectrumList = list_truncate(e->spectrumList, &e->spareNodes, e->readingsTaken);
+
+	printf("%s: %i/%i measurements stored\n", path, e->readingsTaken, e->settings.numScans);
+	return e;
+}
+
+//called for each record as a scan file is reloaded
+static void visitStoredRecord(storedRecord *r, void *arg)
+{
+	experiment *e = arg;
+	listNode *node = list_find(e->spectrumList, r->device, r->scan);
+
+	if (r->type == RECORD_SCAN || r->type == RECORD_RAW_SCAN || r->type == RECORD_COUNTED_SCAN) {
+		if (node) {
+			//taken again after a restart; the newer one wins
+			node->offset = r->spectrumOffset;
+			node->numPixels = r->numPixels;
+			node->numReads = r->numReads;
+			node->readsUsed = r->readsUsed;
+			node->timestamp = r->timestamp;
+			node->wallTime = r->wallTime;
+			node->fitted = 0;
+		} else {
+			e->spectrumList = list_add(e->spectrumList, &e->spareNodes, r->spectrumOffset, r->numPixels, r->numReads, r->readsUsed, r->device, r->scan, r->timestamp, r->wallTime);
+		}
+		if (r->wallTime > e->lastScanTime) {
+			e->lastScanTime = r->wallTime;
+		}
+	} else if (r->type == RECORD_RESULT && node) {
+		node->result = r->result;
+		node->shift = r->shift;
+		node->quality = r->quality;
+		node->fitted = 1;
+	}
+}
@@ -0,0 +1,290 @@
+/* filterChain.c
+ * Parsing a filter chain, working out its taps, and running frames
+ * through it.
+ *
+ * Savitzky-Golay taps come from the least-squares fit itself: with J the
+ * window's powers of x (scaled to -1..1 so the normal equations stay
+ * well conditioned), row D of (J'J)^-1 J', times D!, is the Dth
+ * derivative of the fitted polynomial at the centre, for each pixel of
+ * the window. Everything linear is then folded into as few kernels as
+ * fit FILTER_MAX_TAPS, since two convolutions in a row are one
+ * convolution with the convolved taps.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/filterChain.h"
+#include "../include/spectrumKernels.h"
+
+#define SAVGOL_MAX_ORDER 6
+
+static int parseStage(char *text, filterStage *stage);
+static int stageTaps(const filterStage *stage, filterPass *pass);
+static int savitzkyGolayTaps(int width, int order, int derivative, double *taps);
+static int addPass(filterChain *c, const filterStage *stage);
+
+
+int filterChainCompile(filterChain *c, int boxcarWidth, const char *text)
+{
+    char copy[FILTER_TEXT_LENGTH], shown[FILTER_TEXT_LENGTH], *stage, *next;
+    filterStage s;
+    int err = 0;
+
+    memset(c, 0, sizeof (*c));
+    if (boxcarWidth < 0 || boxcarWidth > FILTER_MAX_BOXCAR) {
+        printf("Boxcar width must be an integer betwwen 0 and %i. Defaulting to %i.\n",
+               FILTER_MAX_BOXCAR, boxcarWidth < 0 ? 0 : FILTER_MAX_BOXCAR);
+        boxcarWidth = boxcarWidth < 0 ? 0 : FILTER_MAX_BOXCAR;
+    }
+    if (boxcarWidth > 1) {
+        s = (filterStage) {FILTER_BOXCAR, boxcarWidth, 0, 0, 0};
+        addPass(c, &s);
+    }
+    if (!text || !*text) {
+        return 0;
+    }
+
+    snprintf(copy, sizeof (copy), "%s", text);
+    for (stage = copy; stage && !err; stage = next) {
+        next = strchr(stage, ',');
+        if (next) {
+            *next++ = '\0';
+        }
+        memset(&s, 0, sizeof (s));
+        snprintf(shown, sizeof (shown), "%s", stage);
+        if (parseStage(stage, &s) != 0 || c->numStages == FILTER_MAX_STAGES || addPass(c, &s) != 0) {
+            printf("bad filter stage \"%s\" in %s\n", shown, text);
+            err = 1;
+        }
+    }
+    if (err) {
+        filterChainCompile(c, boxcarWidth, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+void filterChainApply(const filterChain *c, double *in, double *out, int n)
+{
+    const filterPass *p;
+    double *from = in, *to = out;
+    int k;
+
+    if (c->numPasses == 0) {
+        memcpy(out, in, n * sizeof (double));
+        return;
+    }
+    for (k = 0; k < c->numPasses; k++) {
+        p = &c->passes[k];
+        if (p->type == FILTER_BOXCAR) {
+            spectrumBoxcar(p->count, from, to, n);
+        } else if (p->type == FILTER_MEDIAN) {
+            spectrumMedian(p->count, from, to, n);
+        } else {
+            spectrumConvolve(p->taps, p->left, p->count, from, to, n);
+        }
+        from = to;
+        to = to == out ? in : out;
+    }
+    if (from != out) {
+        memcpy(out, from, n * sizeof (double));
+    }
+}
+
+int filterChainEquals(const filterChain *a, const filterChain *b)
+{
+    //compiled into zeroed chains, so the padding matches too
+    return a->numStages == b->numStages
+        && memcmp(a->stages, b->stages, a->numStages * sizeof (filterStage)) == 0;
+}
+
+//name:number:number..., in place. -1 if it isn't one we know, or its
+//numbers are out of range
+static int parseStage(char *text, filterStage *stage)
+{
+    double numbers[3] = {0, 0, 0};
+    char *colon = strchr(text, ':'), *end;
+    int count = 0;
+
+    while (colon && count < 3) {
+        numbers[count++] = strtod(colon + 1, &end);
+        if (end == colon + 1 || (*end && *end != ':')) {
+            return -1;
+        }
+        *colon = '\0';
+        colon = *end ? end : NULL;
+    }
+    if (colon) {
+        return -1;
+    }
+
+    if (strcmp(text, "boxcar") == 0 && count == 1) {
+        stage->type = FILTER_BOXCAR;
+        stage->width = (int) numbers[0];
+        return stage->width >= 1 && stage->width <= FILTER_MAX_TAPS ? 0 : -1;
+    }
+    if (strcmp(text, "median") == 0 && count == 1) {
+        stage->type = FILTER_MEDIAN;
+        stage->width = (int) numbers[0];
+        return stage->width >= 1 && stage->width <= FILTER_MAX_TAPS ? 0 : -1;
+    }
+    if (strcmp(text, "gauss") == 0 && count == 1) {
+        stage->type = FILTER_GAUSSIAN;
+        stage->sigma = numbers[0];
+        return stage->sigma > 0 && 2 * ceil(3 * stage->sigma) + 1 <= FILTER_MAX_TAPS ? 0 : -1;
+    }
+    if (strcmp(text, "sg") == 0 && count >= 2) {
+        stage->type = FILTER_SAVGOL;
+        stage->width = (int) numbers[0];
+        stage->order = (int) numbers[1];
+        stage->derivative = (int) numbers[2];
+        return stage->width % 2 == 1 && stage->width >= 3 && stage->width <= FILTER_MAX_TAPS
+            && stage->order >= 0 && stage->order < stage->width && stage->order <= SAVGOL_MAX_ORDER
+            && stage->derivative >= 0 && stage->derivative <= stage->order ? 0 : -1;
+    }
+    return -1;
+}
+
+//the stage as a pass of its own
+static int stageTaps(const filterStage *stage, filterPass *pass)
+{
+    int i, half;
+    double sum = 0;
+
+    memset(pass, 0, sizeof (*pass));
+    pass->type = stage->type == FILTER_BOXCAR || stage->type == FILTER_MEDIAN ? stage->type : FILTER_CONVOLVE;
+    switch (stage->type) {
+    case FILTER_BOXCAR:
+        //the running sum's window, as taps in case it gets folded
+        pass->left = stage->width / 2;
+        pass->count = stage->width;
+        for (i = 0; i < stage->width; i++) {
+            pass->taps[i] = 1.0 / stage->width;
+        }
+        return 0;
+    case FILTER_MEDIAN:
+        pass->left = stage->width / 2;
+        pass->count = stage->width;
+        return 0;
+    case FILTER_GAUSSIAN:
+        half = (int) ceil(3 * stage->sigma);
+        pass->left = half;
+        pass->count = 2 * half + 1;
+        for (i = -half; i <= half; i++) {
+            pass->taps[i + half] = exp(-i * i / (2 * stage->sigma * stage->sigma));
+            sum += pass->taps[i + half];
+        }
+        for (i = 0; i < pass->count; i++) {
+            pass->taps[i] /= sum;
+        }
+        return 0;
+    case FILTER_SAVGOL:
+        pass->left = stage->width / 2;
+        pass->count = stage->width;
+        return savitzkyGolayTaps(stage->width, stage->order, stage->derivative, pass->taps);
+    }
+    return -1;
+}
+
+static int savitzkyGolayTaps(int width, int order, int derivative, double *taps)
+{
+    int n = order + 1, half = width / 2, i, j, k, pivot;
+    double a[n][2 * n], u, power, factor, t;
+
+    //J'J, with the identity beside it to become the inverse
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            a[i][j] = 0;
+            a[i][n + j] = i == j;
+        }
+    }
+    for (k = -half; k <= half; k++) {
+        u = (double) k / half;
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < n; j++) {
+                a[i][j] += pow(u, i + j);
+            }
+        }
+    }
+
+    //Gauss-Jordan, with partial pivoting
+    for (i = 0; i < n; i++) {
+        pivot = i;
+        for (j = i + 1; j < n; j++) {
+            if (fabs(a[j][i]) > fabs(a[pivot][i])) {
+                pivot = j;
+            }
+        }
+        if (fabs(a[pivot][i]) < 1e-12) {
+            return -1;
+        }
+        for (j = 0; j < 2 * n; j++) {
+            t = a[i][j];
+            a[i][j] = a[pivot][j];
+            a[pivot][j] = t;
+        }
+        factor = a[i][i];
+        for (j = 0; j < 2 * n; j++) {
+            a[i][j] /= factor;
+        }
+        for (j = 0; j < n; j++) {
+            if (j != i && a[j][i] != 0) {
+                factor = a[j][i];
+                for (k = 0; k < 2 * n; k++) {
+                    a[j][k] -= factor * a[i][k];
+                }
+            }
+        }
+    }
+
+    //D! for the derivative, and half^-D to take it back from u to pixels
+    factor = 1;
+    for (i = 2; i <= derivative; i++) {
+        factor *= i;
+    }
+    factor /= pow(half, derivative);
+    for (k = -half; k <= half; k++) {
+        u = (double) k / half;
+        power = 1;
+        t = 0;
+        for (i = 0; i < n; i++) {
+            t += a[derivative][n + i] * power;
+            power *= u;
+        }
+        taps[k + half] = factor * t;
+    }
+    return 0;
+}
+
+//add a stage, folding it into the pass before it if both are linear and
+//the two kernels together still fit
+static int addPass(filterChain *c, const filterStage *stage)
+{
+    filterPass next, *last = c->numPasses ? &c->passes[c->numPasses - 1] : NULL;
+    double taps[FILTER_MAX_TAPS];
+    int i, j;
+
+    if (stageTaps(stage, &next) != 0) {
+        return -1;
+    }
+    c->stages[c->numStages++] = *stage;
+
+    if (last && last->type != FILTER_MEDIAN && next.type != FILTER_MEDIAN
+        && last->count + next.count - 1 <= FILTER_MAX_TAPS) {
+        memset(taps, 0, sizeof (taps));
+        for (i = 0; i < last->count; i++) {
+            for (j = 0; j < next.count; j++) {
+                taps[i + j] += last->taps[i] * next.taps[j];
+            }
+        }
+        memcpy(last->taps, taps, sizeof (taps));
+        last->type = FILTER_CONVOLVE;
+        last->left += next.left;
+        last->count += next.count - 1;
+        return 0;
+    }
+    c->passes[c->numPasses++] = next;
+    return 0;
+}
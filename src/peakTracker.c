@@ -0,0 +1,255 @@
+/* peakTracker.c
+ * Fast per-frame peak estimation for streaming mode, and a rolling
+ * history of the results.
+ *
+ * The history keeps a running sum for the mean and two monotonic queues
+ * for the min and max, so every add and every query is O(1) (amortized)
+ * no matter how long the stream runs.
+ */
+#include <stdio.h>
+#include <pthread.h>
+
+#include "../include/spectrometerDriver.h"
+#include "../include/peakTracker.h"
+#include "../include/spectrumKernels.h"
+
+static pthread_mutex_t historyLock = PTHREAD_MUTEX_INITIALIZER;
+
+//monotonic queues of sequence numbers: wavelengths increase from the
+//front of minQueue and decrease from the front of maxQueue
+typedef struct {
+    unsigned int seq[PEAK_HISTORY_LENGTH];
+    int head;
+    int size;
+} seqQueue;
+
+//one of these per spectrometer
+typedef struct {
+    //the records themselves, indexed by sequence number % PEAK_HISTORY_LENGTH
+    peakRecord records[PEAK_HISTORY_LENGTH];
+    unsigned int nextSeq;
+    int count;
+    double sum;
+    seqQueue minQueue, maxQueue;
+} peakHistory;
+
+static peakHistory histories[MAX_SPECTROMETERS];
+
+static unsigned int queue_front(seqQueue *q);
+static unsigned int queue_back(seqQueue *q);
+static void queue_push(seqQueue *q, unsigned int seq);
+static void queue_popFront(seqQueue *q);
+static void queue_popBack(seqQueue *q);
+
+static double wavelengthAt(double *wavelengths, int numElements, double index);
+
+
+int estimatePeak(double *wavelengths, double *intensities, int numElements, peakRecord *out)
+{
+    int i, peakIndex = 0, low, high;
+    double peak, floor, threshold, half;
+    double sumW = 0, sumWL = 0, w;
+    double position, delta = 0, denom;
+
+    if (wavelengths == NULL || intensities == NULL || out == NULL || numElements < 3) {
+        printf("estimatePeak: bad array!\n");
+        return -1;
+    }
+
+    //argmax, plus the frame minimum as a crude baseline for the FWHM
+    peakIndex = spectrumPeakIndex(intensities, numElements, &floor);
+    peak = intensities[peakIndex];
+
+    //three-point parabola through the argmax. gives us the interpolated
+    //height, and the position when the window is too narrow for a centroid
+    out->intensity = peak;
+    if (peakIndex > 0 && peakIndex < numElements - 1) {
+        double y0 = intensities[peakIndex - 1];
+        double y2 = intensities[peakIndex + 1];
+
+        denom = y0 - 2 * peak + y2;
+        if (denom < 0) {
+            delta = 0.5 * (y0 - y2) / denom;
+            out->intensity = peak - 0.25 * (y0 - y2) * delta;
+        }
+    }
+
+    //walk out to the same .98 window that findPeakValueWavelength uses
+    threshold = .98 * peak;
+    low = high = peakIndex;
+    while (low > 0 && intensities[low - 1] > threshold) {
+        low--;
+    }
+    while (high < numElements - 1 && intensities[high + 1] > threshold) {
+        high++;
+    }
+
+    //centroid of the part of the peak poking above the threshold
+    if (high - low >= 2) {
+        for (i = low; i <= high; i++) {
+            w = intensities[i] - threshold;
+            sumW += w;
+            sumWL += w * wavelengths[i];
+        }
+    }
+
+    if (sumW > 0) {
+        out->wavelength = sumWL / sumW;
+    } else {
+        out->wavelength = wavelengthAt(wavelengths, numElements, peakIndex + delta);
+    }
+
+    //FWHM: interpolate where each side crosses half of the peak height
+    half = floor + (peak - floor) / 2;
+
+    i = peakIndex;
+    while (i > 0 && intensities[i - 1] > half) {
+        i--;
+    }
+    if (i > 0) {
+        position = (i - 1) + (half - intensities[i - 1]) / (intensities[i] - intensities[i - 1]);
+    } else {
+        position = 0;
+    }
+    out->fwhm = -wavelengthAt(wavelengths, numElements, position);
+
+    i = peakIndex;
+    while (i < numElements - 1 && intensities[i + 1] > half) {
+        i++;
+    }
+    if (i < numElements - 1) {
+        position = i + (intensities[i] - half) / (intensities[i] - intensities[i + 1]);
+    } else {
+        position = numElements - 1;
+    }
+    out->fwhm += wavelengthAt(wavelengths, numElements, position);
+
+    return 0;
+}
+
+void peakHistoryReset()
+{
+    int d;
+
+    pthread_mutex_lock(&historyLock);
+    for (d = 0; d < MAX_SPECTROMETERS; d++) {
+        histories[d].nextSeq = 0;
+        histories[d].count = 0;
+        histories[d].sum = 0;
+        histories[d].minQueue.head = histories[d].minQueue.size = 0;
+        histories[d].maxQueue.head = histories[d].maxQueue.size = 0;
+    }
+    pthread_mutex_unlock(&historyLock);
+}
+
+void peakHistoryAdd(int device, peakRecord r)
+{
+    peakHistory *h;
+    unsigned int seq;
+
+    if (device < 0 || device >= MAX_SPECTROMETERS) {
+        return;
+    }
+    h = &histories[device];
+
+    pthread_mutex_lock(&historyLock);
+    seq = h->nextSeq++;
+
+    //retire the oldest record once we are full
+    if (h->count == PEAK_HISTORY_LENGTH) {
+        unsigned int oldSeq = seq - PEAK_HISTORY_LENGTH;
+
+        h->sum -= h->records[oldSeq % PEAK_HISTORY_LENGTH].wavelength;
+        if (h->minQueue.size && queue_front(&h->minQueue) == oldSeq) {
+            queue_popFront(&h->minQueue);
+        }
+        if (h->maxQueue.size && queue_front(&h->maxQueue) == oldSeq) {
+            queue_popFront(&h->maxQueue);
+        }
+        h->count--;
+    }
+
+    h->records[seq % PEAK_HISTORY_LENGTH] = r;
+    h->sum += r.wavelength;
+    h->count++;
+
+    //anything behind us that can never be the min (or max) again is dropped
+    while (h->minQueue.size && h->records[queue_back(&h->minQueue) % PEAK_HISTORY_LENGTH].wavelength >= r.wavelength) {
+        queue_popBack(&h->minQueue);
+    }
+    queue_push(&h->minQueue, seq);
+
+    while (h->maxQueue.size && h->records[queue_back(&h->maxQueue) % PEAK_HISTORY_LENGTH].wavelength <= r.wavelength) {
+        queue_popBack(&h->maxQueue);
+    }
+    queue_push(&h->maxQueue, seq);
+
+    pthread_mutex_unlock(&historyLock);
+}
+
+peakStats getPeakHistoryStats(int device)
+{
+    peakStats s = {0, 0, 0, 0, {0, 0, 0, 0, 0}};
+    peakHistory *h;
+
+    if (device < 0 || device >= MAX_SPECTROMETERS) {
+        return s;
+    }
+    h = &histories[device];
+
+    pthread_mutex_lock(&historyLock);
+    if (h->count) {
+        s.count = h->count;
+        s.min = h->records[queue_front(&h->minQueue) % PEAK_HISTORY_LENGTH].wavelength;
+        s.max = h->records[queue_front(&h->maxQueue) % PEAK_HISTORY_LENGTH].wavelength;
+        s.mean = h->sum / h->count;
+        s.last = h->records[(h->nextSeq - 1) % PEAK_HISTORY_LENGTH];
+    }
+    pthread_mutex_unlock(&historyLock);
+
+    return s;
+}
+
+
+//linear interpolation of the wavelength array at a fractional pixel index
+static double wavelengthAt(double *wavelengths, int numElements, double index)
+{
+    int i = (int) index;
+    double frac = index - i;
+
+    if (i < 0) {
+        return wavelengths[0];
+    }
+    if (i >= numElements - 1) {
+        return wavelengths[numElements - 1];
+    }
+    return wavelengths[i] + frac * (wavelengths[i + 1] - wavelengths[i]);
+}
+
+//tiny ring-buffer deque used by the min/max queues
+static unsigned int queue_front(seqQueue *q)
+{
+    return q->seq[q->head];
+}
+
+static unsigned int queue_back(seqQueue *q)
+{
+    return q->seq[(q->head + q->size - 1) % PEAK_HISTORY_LENGTH];
+}
+
+static void queue_push(seqQueue *q, unsigned int seq)
+{
+    q->seq[(q->head + q->size) % PEAK_HISTORY_LENGTH] = seq;
+    q->size++;
+}
+
+static void queue_popFront(seqQueue *q)
+{
+    q->head = (q->head + 1) % PEAK_HISTORY_LENGTH;
+    q->size--;
+}
+
+static void queue_popBack(seqQueue *q)
+{
+    q->size--;
+}
@@ -0,0 +1,254 @@
+/* pressureSampler.c
+ * High-rate pressure sampling.
+ *
+ * The sampler thread reads the ADC on a fixed schedule. Each raw reading
+ * goes through a 3-tap median (to knock out single-read SPI glitches) and
+ * then a block mean over `decimation` readings, which is our low-pass.
+ * Filtered samples land in a ring buffer for the server to send in
+ * batches, and are averaged again into a 1 Hz history.
+ */
+#include <stdio.h>
+#include <pthread.h>
+
+#include <wiringPi.h>
+
+#include "../include/spectrometerDriver.h"
+#include "../include/pressureSampler.h"
+
+static pthread_mutex_t samplerLock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile int running = 0;
+static volatile int threadAlive = 0;
+static int sampleRate = PRESSURE_DEFAULT_RATE;
+static int decimationFactor = PRESSURE_DEFAULT_DECIMATION;
+
+//filtered samples waiting to be sent
+static unsigned short ring[PRESSURE_RING_LENGTH];
+static unsigned int ringTimes[PRESSURE_RING_LENGTH];
+static unsigned char ringBreaks[PRESSURE_RING_LENGTH];   //sample is not one period after the last
+static int ringHead = 0;
+static int ringCount = 0;
+static int ringPeriodMicros = 0;
+
+//downsampled history. each entry keeps its own time, since the sampler
+//only runs while someone wants pressure and the history has gaps
+static unsigned short history[PRESSURE_HISTORY_LENGTH];
+static unsigned int historyTimes[PRESSURE_HISTORY_LENGTH];
+static int historyHead = 0;
+static int historyCount = 0;
+
+//the history entry being built
+static long historySum = 0;
+static int historySamples = 0;
+static unsigned int historyStart = 0;
+
+static int median3(int a, int b, int c);
+static void pushFiltered(unsigned short value, unsigned int now, int broken);
+
+
+PI_THREAD(samplerThread)
+{
+    int window[3] = {0, 0, 0};
+    int reads = 0, primed = 0;
+    long blockSum = 0;
+    int blockCount = 0, rate = 0, decimation = 0;
+    int broken = 1;
+    unsigned int period = 0, next = micros();
+
+    while (running) {
+        //pick up rate changes between blocks
+        if (blockCount == 0 && (rate != sampleRate || decimation != decimationFactor)) {
+            pthread_mutex_lock(&samplerLock);
+            rate = sampleRate;
+            decimation = decimationFactor;
+            period = 1000000 / rate;
+            ringPeriodMicros = period * decimation;
+            //the ring only holds evenly spaced samples, so flush it on a change
+            ringCount = 0;
+            pthread_mutex_unlock(&samplerLock);
+            next = micros();
+            broken = 1;
+        }
+
+        window[reads % 3] = getPressureReading();
+        reads++;
+        if (reads >= 3) {
+            primed = 1;
+        }
+        blockSum += primed ? median3(window[0], window[1], window[2]) : window[(reads - 1) % 3];
+        blockCount++;
+
+        if (blockCount == decimation) {
+            pushFiltered((unsigned short) (blockSum / blockCount), millis(), broken);
+            broken = 0;
+            blockSum = 0;
+            blockCount = 0;
+        }
+
+        //sleep until the next slot. if we fell behind, don't try to catch up
+        next += period;
+        int remaining = (int) (next - micros());
+        if (remaining > 0) {
+            delayMicroseconds(remaining);
+        } else {
+            //the current block is late, so it starts a new run
+            next = micros();
+            broken = 1;
+        }
+    }
+    threadAlive = 0;
+    return NULL;
+}
+
+int startPressureSampler(int rateHz, int decimation)
+{
+    if (rateHz <= 0) {
+        rateHz = PRESSURE_DEFAULT_RATE;
+    }
+    if (rateHz > PRESSURE_MAX_RATE) {
+        printf("Pressure rate %i too high; clamping to %i\n", rateHz, PRESSURE_MAX_RATE);
+        rateHz = PRESSURE_MAX_RATE;
+    }
+    if (decimation <= 0) {
+        decimation = PRESSURE_DEFAULT_DECIMATION;
+    }
+    if (decimation > rateHz) {
+        decimation = rateHz;
+    }
+
+    pthread_mutex_lock(&samplerLock);
+    sampleRate = rateHz;
+    decimationFactor = decimation;
+    pthread_mutex_unlock(&samplerLock);
+
+    printf("Pressure sampler at %i Hz, decimating by %i\n", rateHz, decimation);
+
+    if (running) {
+        return 0;
+    }
+
+    //let a previous thread finish before starting another one
+    while (threadAlive) {
+        delay(1);
+    }
+
+    //don't fold readings from before the stop into the first new entry,
+    //or drain them as if they ran straight on into the new ones
+    pthread_mutex_lock(&samplerLock);
+    ringCount = 0;
+    historySum = 0;
+    historySamples = 0;
+    pthread_mutex_unlock(&samplerLock);
+
+    //set before the thread runs, so a stop and start before it gets going
+    //still waits for it rather than starting a second one
+    threadAlive = 1;
+    running = 1;
+    if (piThreadCreate(samplerThread)) {
+        printf("pi thread failed somehow!\n");
+        running = 0;
+        threadAlive = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void stopPressureSampler()
+{
+    running = 0;
+}
+
+int pressureSamplerRunning()
+{
+    return running;
+}
+
+int drainPressureSamples(unsigned short *samples, int max, pressureBatch *batch)
+{
+    int i, n;
+
+    pthread_mutex_lock(&samplerLock);
+    //a batch is evenly spaced, so it ends at the next break in timing
+    n = ringCount < max ? ringCount : max;
+    for (i = 0; i < n; i++) {
+        if (i > 0 && ringBreaks[(ringHead + i) % PRESSURE_RING_LENGTH]) {
+            n = i;
+            break;
+        }
+        samples[i] = ring[(ringHead + i) % PRESSURE_RING_LENGTH];
+    }
+    batch->count = n;
+    batch->periodMicros = ringPeriodMicros;
+    batch->startTime = n ? ringTimes[ringHead] : millis();
+    ringHead = (ringHead + n) % PRESSURE_RING_LENGTH;
+    ringCount -= n;
+    pthread_mutex_unlock(&samplerLock);
+
+    return n;
+}
+
+int getPressureHistory(unsigned short *samples, unsigned int *times, int max)
+{
+    int i, n, start;
+
+    pthread_mutex_lock(&samplerLock);
+    n = historyCount < max ? historyCount : max;
+    start = historyHead - n + PRESSURE_HISTORY_LENGTH;
+    for (i = 0; i < n; i++) {
+        samples[i] = history[(start + i) % PRESSURE_HISTORY_LENGTH];
+        times[i] = historyTimes[(start + i) % PRESSURE_HISTORY_LENGTH];
+    }
+    pthread_mutex_unlock(&samplerLock);
+
+    return n;
+}
+
+
+static int median3(int a, int b, int c)
+{
+    if (a > b) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    //now a <= b
+    if (c <= a) {
+        return a;
+    }
+    return c < b ? c : b;
+}
+
+//add a filtered sample to the transmit ring, and fold it into the history
+static void pushFiltered(unsigned short value, unsigned int now, int broken)
+{
+    pthread_mutex_lock(&samplerLock);
+
+    //if nobody is draining, drop the oldest sample
+    if (ringCount == PRESSURE_RING_LENGTH) {
+        ringHead = (ringHead + 1) % PRESSURE_RING_LENGTH;
+        ringCount--;
+    }
+    int slot = (ringHead + ringCount) % PRESSURE_RING_LENGTH;
+    ring[slot] = value;
+    ringTimes[slot] = now;
+    ringBreaks[slot] = broken;
+    ringCount++;
+
+    if (historySamples == 0) {
+        historyStart = now;
+    }
+    historySum += value;
+    historySamples++;
+    if (now - historyStart >= PRESSURE_HISTORY_PERIOD) {
+        history[historyHead] = (unsigned short) (historySum / historySamples);
+        historyTimes[historyHead] = now;
+        historyHead = (historyHead + 1) % PRESSURE_HISTORY_LENGTH;
+        if (historyCount < PRESSURE_HISTORY_LENGTH) {
+            historyCount++;
+        }
+        historySum = 0;
+        historySamples = 0;
+    }
+
+    pthread_mutex_unlock(&samplerLock);
+}
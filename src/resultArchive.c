@@ -0,0 +1,651 @@
+/* resultArchive.c
+ * The experiment table, the result columns and their indexes.
+ *
+ * On disk, in ARCHIVE_DIR:
+ *   experiments.tbl    fixed-size archivedExperiment records
+ *   time.col ...       one array per column, in result row order
+ *   patient.idx, doctor.idx, start.idx   sorted (key, experiment) pairs
+ * An experiment's columns are written before its table record, so after
+ * a crash any rows past the last experiment are just cut off, as is a
+ * torn record at the end of the table. If a column has lost rows, the
+ * table goes back to the last experiment it still has all of. The
+ * indexes are rewritten whole (they hold one entry per experiment) and
+ * rebuilt from the table if they don't match it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "../include/resultArchive.h"
+
+#define SECONDS_PER_DAY 86400.0
+
+typedef struct {
+    unsigned int start;         //time() it started
+    unsigned int firstRow;
+    unsigned int numRows;
+    int numScans;
+    int timeBetweenScans;
+    int integrationTime;
+    int boxcarWidth;
+    int avgPerScan;
+    int deviceMask;
+    char timestamp[ARCHIVE_NAME_LENGTH];
+    char doctor[ARCHIVE_NAME_LENGTH];
+    char patient[ARCHIVE_NAME_LENGTH];
+} archivedExperiment;
+
+typedef struct {
+    char key[ARCHIVE_NAME_LENGTH];
+    unsigned int experiment;
+} nameEntry;
+
+typedef struct {
+    unsigned int start;
+    unsigned int experiment;
+} timeEntry;
+
+//the columns, and the size of one value in each
+enum archive_columns {
+    COLUMN_TIME,
+    COLUMN_SCAN,
+    COLUMN_DEVICE,
+    COLUMN_PEAK,
+    COLUMN_SHIFT,
+    COLUMN_QUALITY,
+    NUM_COLUMNS
+};
+static const char *columnNames[NUM_COLUMNS] = {"time", "scan", "device", "peak", "shift", "quality"};
+static const int columnSizes[NUM_COLUMNS] = {4, 2, 1, 8, 8, 4};
+
+static pthread_mutex_t archiveLock = PTHREAD_MUTEX_INITIALIZER;
+static int loaded = 0;
+
+static archivedExperiment *experiments;
+static int numExperiments, experimentCapacity;
+
+static unsigned char *columns[NUM_COLUMNS];
+static unsigned int numRows, rowCapacity;
+
+static nameEntry *byPatient, *byDoctor;
+static timeEntry *byStart;
+
+static int loadArchive();
+static int growRows(unsigned int rows);
+static int growExperiments(int count);
+static int loadIndex(const char *name, void *index, int entrySize);
+static void buildIndexes();
+static int saveIndexes();
+static int writeFile(const char *name, void *data, long length);
+static long readFile(const char *name, void **data);
+static int appendFile(const char *name, void *data, long length);
+static void trimFile(const char *name, long length);
+static void trimColumns(unsigned int rows);
+static int compareNames(const void *a, const void *b);
+static int compareTimes(const void *a, const void *b);
+static int findName(nameEntry *index, const char *key);
+static double fieldValue(int field, unsigned int row);
+
+
+int archiveAddExperiment(specSettings s, unsigned int start, archiveRow *rows, int count)
+{
+    archivedExperiment x;
+    unsigned char *values[NUM_COLUMNS];
+    unsigned short scan;
+    unsigned char device;
+    float quality;
+    char path[128];
+    int i, c, err = 0;
+
+    pthread_mutex_lock(&archiveLock);
+    if (loadArchive() != 0 || growRows(numRows + count) != 0 || growExperiments(numExperiments + 1) != 0) {
+        pthread_mutex_unlock(&archiveLock);
+        return -1;
+    }
+
+    //columns first, straight into the in-memory arrays
+    for (c = 0; c < NUM_COLUMNS; c++) {
+        values[c] = columns[c] + (long) numRows * columnSizes[c];
+    }
+    for (i = 0; i < count; i++) {
+        scan = rows[i].scan;
+        device = rows[i].device;
+        quality = rows[i].quality;
+        memcpy(values[COLUMN_TIME] + 4 * i, &rows[i].wallTime, 4);
+        memcpy(values[COLUMN_SCAN] + 2 * i, &scan, 2);
+        values[COLUMN_DEVICE][i] = device;
+        memcpy(values[COLUMN_PEAK] + 8 * i, &rows[i].peak, 8);
+        memcpy(values[COLUMN_SHIFT] + 8 * i, &rows[i].shift, 8);
+        memcpy(values[COLUMN_QUALITY] + 4 * i, &quality, 4);
+    }
+    for (c = 0; c < NUM_COLUMNS && !err; c++) {
+        sprintf(path, "%s.col", columnNames[c]);
+        err = appendFile(path, values[c], (long) count * columnSizes[c]);
+    }
+
+    //...then the record that makes them count
+    memset(&x, 0, sizeof (x));
+    x.start = start;
+    x.firstRow = numRows;
+    x.numRows = count;
+    x.numScans = s.numScans;
+    x.timeBetweenScans = s.timeBetweenScans;
+    x.integrationTime = s.integrationTime;
+    x.boxcarWidth = s.boxcarWidth;
+    x.avgPerScan = s.avgPerScan;
+    x.deviceMask = s.deviceMask;
+    snprintf(x.timestamp, sizeof (x.timestamp), "%s", s.timestamp ? s.timestamp : "");
+    snprintf(x.doctor, sizeof (x.doctor), "%s", s.doctorName ? s.doctorName : "");
+    snprintf(x.patient, sizeof (x.patient), "%s", s.patientName ? s.patientName : "");
+    if (!err) {
+        err = appendFile("experiments.tbl", &x, sizeof (x));
+    }
+    if (err) {
+        //whatever did get written would be taken for the next experiment's
+        printf("could not archive experiment %s\n", x.timestamp);
+        trimColumns(numRows);
+        trimFile("experiments.tbl", (long) numExperiments * sizeof (archivedExperiment));
+        pthread_mutex_unlock(&archiveLock);
+        return -1;
+    }
+
+    experiments[numExperiments++] = x;
+    numRows += count;
+    buildIndexes();
+    saveIndexes();
+    pthread_mutex_unlock(&archiveLock);
+
+    printf("archived experiment %s: %i results\n", x.timestamp, count);
+    return 0;
+}
+
+int archiveQueryStats(archiveQuery *q, archiveStats *stats)
+{
+    unsigned int *chosen, r, t0 = 0;
+    int i, first, n = 0;
+    double v, t, sumT = 0, sumV = 0, sumTT = 0, sumTV = 0;
+    archivedExperiment *x;
+
+    memset(stats, 0, sizeof (*stats));
+
+    pthread_mutex_lock(&archiveLock);
+    if (loadArchive() != 0) {
+        pthread_mutex_unlock(&archiveLock);
+        return -1;
+    }
+    chosen = malloc((numExperiments ? numExperiments : 1) * sizeof (unsigned int));
+    if (!chosen) {
+        pthread_mutex_unlock(&archiveLock);
+        return -1;
+    }
+
+    //the candidates, in start order: every experiment in the time range
+    //comes from the start index; a name narrows it down first
+    if (q->patient || q->doctor) {
+        nameEntry *index = q->patient ? byPatient : byDoctor;
+        const char *key = q->patient ? q->patient : q->doctor;
+        timeEntry *found = malloc((numExperiments ? numExperiments : 1) * sizeof (timeEntry));
+        if (!found) {
+            free(chosen);
+            pthread_mutex_unlock(&archiveLock);
+            return -1;
+        }
+        for (first = findName(index, key); first < numExperiments && !strcmp(index[first].key, key); first++) {
+            found[n].experiment = index[first].experiment;
+            found[n].start = experiments[found[n].experiment].start;
+            n++;
+        }
+        qsort(found, n, sizeof (timeEntry), compareTimes);
+        for (i = 0; i < n; i++) {
+            chosen[i] = found[i].experiment;
+        }
+        free(found);
+    } else {
+        for (i = 0; i < numExperiments; i++) {
+            chosen[n++] = byStart[i].experiment;
+        }
+    }
+
+    //everything else is a filter on that list
+    first = n;
+    for (i = n - 1; i >= 0; i--) {
+        x = &experiments[chosen[i]];
+        if ((q->from && x->start < q->from) || (q->to && x->start > q->to)
+            || (q->patient && q->doctor && strcmp(x->doctor, q->doctor))) {
+            continue;
+        }
+        if (q->lastRuns > 0 && n - first >= q->lastRuns) {
+            break;
+        }
+        chosen[--first] = chosen[i];
+    }
+
+    //then one pass down each chosen experiment's slice of the columns
+    stats->experiments = n - first;
+    for (i = first; i < n; i++) {
+        x = &experiments[chosen[i]];
+        for (r = x->firstRow; r < x->firstRow + x->numRows; r++) {
+            if (q->device >= 0 && columns[COLUMN_DEVICE][r] != q->device) {
+                continue;
+            }
+            v = fieldValue(q->field, r);
+            if (q->field == ARCHIVE_QUALITY && v < 0) {
+                continue;
+            }
+            unsigned int when;
+            memcpy(&when, columns[COLUMN_TIME] + 4 * r, 4);
+            if (stats->count == 0) {
+                t0 = when;
+                stats->min = stats->max = v;
+                stats->first = stats->last = when;
+            }
+            //times relative to the first, so the sums keep their precision
+            t = ((double) when - t0) / SECONDS_PER_DAY;
+            sumT += t;
+            sumV += v;
+            sumTT += t * t;
+            sumTV += t * v;
+            stats->min = v < stats->min ? v : stats->min;
+            stats->max = v > stats->max ? v : stats->max;
+            stats->first = when < stats->first ? when : stats->first;
+            stats->last = when > stats->last ? when : stats->last;
+            stats->count++;
+        }
+    }
+    free(chosen);
+    pthread_mutex_unlock(&archiveLock);
+
+    if (stats->count > 0) {
+        double denominator = stats->count * sumTT - sumT * sumT;
+        stats->mean = sumV / stats->count;
+        stats->slope = denominator > 0 ? (stats->count * sumTV - sumT * sumV) / denominator : 0;
+    }
+    return 0;
+}
+
+int parseArchiveQuery(fieldView payload, archiveQuery *q, char names[2][ARCHIVE_NAME_LENGTH])
+{
+    fieldView field, key, value;
+
+    memset(q, 0, sizeof (*q));
+    q->device = -1;
+    q->field = ARCHIVE_SHIFT;
+
+    while (nextField(&payload, &field, ';')) {
+        if (field.length == 0) {
+            continue;
+        }
+        value = field;
+        nextField(&value, &key, '=');
+        if (value.data == NULL) {
+            return -1;
+        }
+        if (fieldEquals(key, "patient")) {
+            fieldCopy(value, names[0], ARCHIVE_NAME_LENGTH);
+            q->patient = names[0];
+        } else if (fieldEquals(key, "doctor")) {
+            fieldCopy(value, names[1], ARCHIVE_NAME_LENGTH);
+            q->doctor = names[1];
+        } else if (fieldEquals(key, "from")) {
+            q->from = fieldToInt(value, 0);
+        } else if (fieldEquals(key, "to")) {
+            q->to = fieldToInt(value, 0);
+        } else if (fieldEquals(key, "last")) {
+            q->lastRuns = fieldToInt(value, 0);
+        } else if (fieldEquals(key, "device")) {
+            q->device = fieldToInt(value, -1);
+        } else if (fieldEquals(key, "field")) {
+            if (fieldEquals(value, "peak")) {
+                q->field = ARCHIVE_PEAK;
+            } else if (fieldEquals(value, "shift")) {
+                q->field = ARCHIVE_SHIFT;
+            } else if (fieldEquals(value, "quality")) {
+                q->field = ARCHIVE_QUALITY;
+            } else {
+                return -1;
+            }
+        } else {
+            printf("unknown query key %.*s\n", key.length, key.data);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//one value of one column, as a double
+static double fieldValue(int field, unsigned int row)
+{
+    double d;
+    float f;
+
+    switch (field) {
+    case ARCHIVE_PEAK:
+        memcpy(&d, columns[COLUMN_PEAK] + 8 * row, 8);
+        return d;
+    case ARCHIVE_QUALITY:
+        memcpy(&f, columns[COLUMN_QUALITY] + 4 * row, 4);
+        return f;
+    default:
+        memcpy(&d, columns[COLUMN_SHIFT] + 8 * row, 8);
+        return d;
+    }
+}
+
+//read the whole archive in, the first time it is needed. caller holds archiveLock
+static int loadArchive()
+{
+    void *data, *columnData[NUM_COLUMNS];
+    long length, columnLengths[NUM_COLUMNS];
+    unsigned int rows = 0, present = ~0u;
+    char path[128];
+    int i, c, kept;
+
+    if (loaded) {
+        return 0;
+    }
+    mkdir(ARCHIVE_DIR, 0755);
+
+    length = readFile("experiments.tbl", &data);
+    numExperiments = length > 0 ? length / sizeof (archivedExperiment) : 0;
+    if (length % sizeof (archivedExperiment)) {
+        //a record torn by a crash; the next one has to start on a boundary
+        printf("archive table ends in a partial record; dropping it\n");
+        trimFile("experiments.tbl", (long) numExperiments * sizeof (archivedExperiment));
+    }
+    if (growExperiments(numExperiments) != 0) {
+        free(data);
+        return -1;
+    }
+    if (numExperiments) {
+        memcpy(experiments, data, numExperiments * sizeof (archivedExperiment));
+    }
+    free(data);
+
+    //the rows every column still has all of
+    for (c = 0; c < NUM_COLUMNS; c++) {
+        sprintf(path, "%s.col", columnNames[c]);
+        columnLengths[c] = readFile(path, &columnData[c]);
+        if (columnLengths[c] / columnSizes[c] < present) {
+            present = columnLengths[c] / columnSizes[c];
+        }
+    }
+
+    //experiments are appended in row order, so keep them up to the first
+    //one a column has lost rows of; nothing past that can be trusted
+    for (kept = 0; kept < numExperiments; kept++) {
+        if (experiments[kept].firstRow + experiments[kept].numRows > present) {
+            break;
+        }
+        if (experiments[kept].firstRow + experiments[kept].numRows > rows) {
+            rows = experiments[kept].firstRow + experiments[kept].numRows;
+        }
+    }
+    if (kept < numExperiments) {
+        printf("archive columns are short; keeping the first %i of %i experiments\n", kept, numExperiments);
+        numExperiments = kept;
+        trimFile("experiments.tbl", (long) numExperiments * sizeof (archivedExperiment));
+    }
+
+    if (growRows(rows) != 0) {
+        for (c = 0; c < NUM_COLUMNS; c++) {
+            free(columnData[c]);
+        }
+        return -1;
+    }
+    for (c = 0; c < NUM_COLUMNS; c++) {
+        if (rows) {
+            memcpy(columns[c], columnData[c], (long) rows * columnSizes[c]);
+        }
+        free(columnData[c]);
+    }
+    //rows written for an experiment that never made it into the table
+    for (c = 0; c < NUM_COLUMNS; c++) {
+        if (columnLengths[c] > (long) rows * columnSizes[c]) {
+            trimColumns(rows);
+            break;
+        }
+    }
+    numRows = rows;
+
+    if (loadIndex("patient.idx", byPatient, sizeof (nameEntry)) != 0
+        || loadIndex("doctor.idx", byDoctor, sizeof (nameEntry)) != 0
+        || loadIndex("start.idx", byStart, sizeof (timeEntry)) != 0) {
+        printf("archive indexes don't match the table; rebuilding them\n");
+        buildIndexes();
+        saveIndexes();
+    }
+    loaded = 1;
+    printf("archive: %i experiments, %u results\n", numExperiments, numRows);
+    return 0;
+}
+
+//read one index, if it has exactly one entry per experiment
+static int loadIndex(const char *name, void *index, int entrySize)
+{
+    void *data;
+    long length = readFile(name, &data);
+
+    if (length != (long) numExperiments * entrySize) {
+        free(data);
+        return -1;
+    }
+    if (length) {
+        memcpy(index, data, length);
+    }
+    free(data);
+    return 0;
+}
+
+//sort the experiments into the three indexes. caller holds archiveLock
+static void buildIndexes()
+{
+    int i;
+
+    for (i = 0; i < numExperiments; i++) {
+        snprintf(byPatient[i].key, ARCHIVE_NAME_LENGTH, "%s", experiments[i].patient);
+        byPatient[i].experiment = i;
+        snprintf(byDoctor[i].key, ARCHIVE_NAME_LENGTH, "%s", experiments[i].doctor);
+        byDoctor[i].experiment = i;
+        byStart[i].start = experiments[i].start;
+        byStart[i].experiment = i;
+    }
+    qsort(byPatient, numExperiments, sizeof (nameEntry), compareNames);
+    qsort(byDoctor, numExperiments, sizeof (nameEntry), compareNames);
+    qsort(byStart, numExperiments, sizeof (timeEntry), compareTimes);
+}
+
+static int saveIndexes()
+{
+    int err = 0;
+
+    err |= writeFile("patient.idx", byPatient, numExperiments * sizeof (nameEntry));
+    err |= writeFile("doctor.idx", byDoctor, numExperiments * sizeof (nameEntry));
+    err |= writeFile("start.idx", byStart, numExperiments * sizeof (timeEntry));
+    return err ? -1 : 0;
+}
+
+//first entry whose key is not less than key
+static int findName(nameEntry *index, const char *key)
+{
+    int low = 0, high = numExperiments, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (strcmp(index[mid].key, key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+//names, then start order within a name
+static int compareNames(const void *a, const void *b)
+{
+    const nameEntry *x = a, *y = b;
+    int c = strcmp(x->key, y->key);
+
+    if (c) {
+        return c;
+    }
+    return experiments[x->experiment].start < experiments[y->experiment].start ? -1
+         : experiments[x->experiment].start > experiments[y->experiment].start;
+}
+
+static int compareTimes(const void *a, const void *b)
+{
+    const timeEntry *x = a, *y = b;
+
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->experiment < y->experiment ? -1 : x->experiment > y->experiment;
+}
+
+static int growRows(unsigned int rows)
+{
+    unsigned int capacity = rowCapacity ? rowCapacity : 4096;
+    unsigned char *grown;
+    int c;
+
+    if (rows <= rowCapacity) {
+        return 0;
+    }
+    while (capacity < rows) {
+        capacity *= 2;
+    }
+    for (c = 0; c < NUM_COLUMNS; c++) {
+        grown = realloc(columns[c], (long) capacity * columnSizes[c]);
+        if (!grown) {
+            printf("we didnt get the memory for the archive\n");
+            return -1;
+        }
+        columns[c] = grown;
+    }
+    rowCapacity = capacity;
+    return 0;
+}
+
+static int growExperiments(int count)
+{
+    int capacity = experimentCapacity ? experimentCapacity : 64;
+    void *x, *p, *d, *s;
+
+    if (count <= experimentCapacity) {
+        return 0;
+    }
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    x = realloc(experiments, capacity * sizeof (archivedExperiment));
+    if (x) {
+        experiments = x;
+    }
+    p = realloc(byPatient, capacity * sizeof (nameEntry));
+    if (p) {
+        byPatient = p;
+    }
+    d = realloc(byDoctor, capacity * sizeof (nameEntry));
+    if (d) {
+        byDoctor = d;
+    }
+    s = realloc(byStart, capacity * sizeof (timeEntry));
+    if (s) {
+        byStart = s;
+    }
+    if (!x || !p || !d || !s) {
+        printf("we didnt get the memory for the archive\n");
+        return -1;
+    }
+    experimentCapacity = capacity;
+    return 0;
+}
+
+//replace a whole file: write it beside the old one, then rename over it
+static int writeFile(const char *name, void *data, long length)
+{
+    char path[256], tmp[256];
+    FILE *f;
+    int ok;
+
+    sprintf(path, "%s/%s", ARCHIVE_DIR, name);
+    sprintf(tmp, "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        return -1;
+    }
+    ok = length == 0 || fwrite(data, length, 1, f) == 1;
+    fclose(f);
+    return ok && rename(tmp, path) == 0 ? 0 : -1;
+}
+
+static int appendFile(const char *name, void *data, long length)
+{
+    char path[256];
+    int fd, ok;
+
+    sprintf(path, "%s/%s", ARCHIVE_DIR, name);
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    ok = write(fd, data, length) == length;
+    fsync(fd);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+//cut a file back to length, if it is longer
+static void trimFile(const char *name, long length)
+{
+    char path[256];
+    struct stat st;
+
+    sprintf(path, "%s/%s", ARCHIVE_DIR, name);
+    if (stat(path, &st) == 0 && st.st_size > length && truncate(path, length) != 0) {
+        printf("could not trim %s\n", path);
+    }
+}
+
+//every column back to rows
+static void trimColumns(unsigned int rows)
+{
+    char name[128];
+    int c;
+
+    for (c = 0; c < NUM_COLUMNS; c++) {
+        sprintf(name, "%s.col", columnNames[c]);
+        trimFile(name, (long) rows * columnSizes[c]);
+    }
+}
+
+//the whole file, malloc'ed into data (NULL and 0 if there isn't one)
+static long readFile(const char *name, void **data)
+{
+    char path[256];
+    FILE *f;
+    long length;
+
+    *data = NULL;
+    sprintf(path, "%s/%s", ARCHIVE_DIR, name);
+    f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    *data = malloc(length > 0 ? length : 1);
+    if (!*data || (length > 0 && fread(*data, length, 1, f) != 1)) {
+        free(*data);
+        *data = NULL;
+        length = 0;
+    }
+    fclose(f);
+    return length;
+}
@@ -0,0 +1,395 @@
+/* scanStore.c
+ * Write-ahead scan file for the experiment FSM.
+ *
+ * Records are written with a single write() each, so the only damage a
+ * crash can do is a short or half-synced record at the very end, which
+ * the checksum catches when the file is reopened. Scans are fsynced in
+ * batches of scansPerSync; results aren't, since they can always be
+ * fitted again from the scans.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/uio.h>
+
+#include "../include/scanStore.h"
+#include "../include/spectrumKernels.h"
+
+#define STORE_MAGIC "SCANWAL1"
+#define MAGIC_LENGTH 8
+#define RECORD_PREFIX 5         //type + length
+#define RECORD_CHECKSUM 4
+#define SCAN_FIELDS 16          //scan, device, timestamp, wall time
+#define RAW_SCAN_FIELDS 20      //the scan fields, then the number of reads summed (or averaged)
+#define MAX_SCAN_PAYLOAD (RAW_SCAN_FIELDS + MAX_PIXELS * sizeof (double))
+#define RESULT_PAYLOAD 32       //scan, device, result, shift, quality
+#define OLD_RESULT_PAYLOAD 24   //...before the fit quality was kept
+#define MAX_RECORD (RECORD_PREFIX + MAX_SCAN_PAYLOAD + RECORD_CHECKSUM)
+#define READ_BLOCK 1024         //raw sums converted per pread
+
+static long appendRecord(scanStore *s, int type, struct iovec *parts, int numParts);
+static int writeAll(int fd, void *data, int length);
+
+
+int scanStoreCreate(scanStore *s, const char *path, const char *header, int scansPerSync)
+{
+    unsigned short length = strlen(header);
+
+    strncpy(s->path, path, SCAN_STORE_PATH_LENGTH - 1);
+    s->path[SCAN_STORE_PATH_LENGTH - 1] = '\0';
+    s->scansPerSync = scansPerSync;
+    s->unsynced = 0;
+    pthread_mutex_init(&s->lock, NULL);
+
+    s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (s->fd < 0) {
+        printf("could not create scan store %s\n", path);
+        return -1;
+    }
+    if (writeAll(s->fd, STORE_MAGIC, MAGIC_LENGTH) || writeAll(s->fd, &length, 2)
+        || writeAll(s->fd, (void *) header, length)) {
+        printf("could not write scan store header\n");
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    //the header has to be there before any scan is worth keeping
+    fsync(s->fd);
+    return 0;
+}
+
+int scanStoreOpen(scanStore *s, const char *path, char *header, int headerSize,
+                  void (*visit)(storedRecord *record, void *arg), void *arg)
+{
+    static unsigned char buf[MAX_RECORD];
+    char magic[MAGIC_LENGTH];
+    unsigned short headerLength;
+    unsigned int length, sum;
+    storedRecord r;
+    long offset;
+    int n;
+
+    strncpy(s->path, path, SCAN_STORE_PATH_LENGTH - 1);
+    s->path[SCAN_STORE_PATH_LENGTH - 1] = '\0';
+    s->scansPerSync = 0;
+    s->unsynced = 0;
+    pthread_mutex_init(&s->lock, NULL);
+
+    s->fd = open(path, O_RDWR);
+    if (s->fd < 0) {
+        return -1;
+    }
+    if (pread(s->fd, magic, MAGIC_LENGTH, 0) != MAGIC_LENGTH || memcmp(magic, STORE_MAGIC, MAGIC_LENGTH)
+        || pread(s->fd, &headerLength, 2, MAGIC_LENGTH) != 2 || headerLength >= headerSize
+        || pread(s->fd, header, headerLength, MAGIC_LENGTH + 2) != headerLength) {
+        printf("%s is not a scan store\n", path);
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    header[headerLength] = '\0';
+
+    //walk the records until we run out or hit a damaged one
+    offset = MAGIC_LENGTH + 2 + headerLength;
+    while (1) {
+        n = pread(s->fd, buf, RECORD_PREFIX, offset);
+        if (n != RECORD_PREFIX) {
+            break;
+        }
+        memcpy(&length, &buf[1], 4);
+        if (length > MAX_SCAN_PAYLOAD) {
+            break;
+        }
+        n = pread(s->fd, &buf[RECORD_PREFIX], length + RECORD_CHECKSUM, offset + RECORD_PREFIX);
+        if (n != (int) (length + RECORD_CHECKSUM)) {
+            break;
+        }
+        memcpy(&sum, &buf[RECORD_PREFIX + length], 4);
+        if (sum != scanStoreChecksum(SCAN_STORE_CHECKSUM_START, &buf[RECORD_PREFIX], length)) {
+            break;
+        }
+
+        memset(&r, 0, sizeof (r));
+        r.type = buf[0];
+        memcpy(&r.scan, &buf[RECORD_PREFIX], 4);
+        memcpy(&r.device, &buf[RECORD_PREFIX + 4], 4);
+        if (r.type == RECORD_SCAN && length > SCAN_FIELDS && (length - SCAN_FIELDS) % sizeof (double) == 0) {
+            memcpy(&r.timestamp, &buf[RECORD_PREFIX + 8], 4);
+            memcpy(&r.wallTime, &buf[RECORD_PREFIX + 12], 4);
+            r.spectrumOffset = offset + RECORD_PREFIX + SCAN_FIELDS;
+            r.numPixels = (length - SCAN_FIELDS) / sizeof (double);
+        } else if (r.type == RECORD_COUNTED_SCAN && length > RAW_SCAN_FIELDS
+                   && (length - RAW_SCAN_FIELDS) % sizeof (double) == 0) {
+            memcpy(&r.timestamp, &buf[RECORD_PREFIX + 8], 4);
+            memcpy(&r.wallTime, &buf[RECORD_PREFIX + 12], 4);
+            memcpy(&r.readsUsed, &buf[RECORD_PREFIX + 16], 4);
+            r.spectrumOffset = offset + RECORD_PREFIX + RAW_SCAN_FIELDS;
+            r.numPixels = (length - RAW_SCAN_FIELDS) / sizeof (double);
+        } else if (r.type == RECORD_RAW_SCAN && length > RAW_SCAN_FIELDS
+                   && (length - RAW_SCAN_FIELDS) % sizeof (unsigned int) == 0) {
+            memcpy(&r.timestamp, &buf[RECORD_PREFIX + 8], 4);
+            memcpy(&r.wallTime, &buf[RECORD_PREFIX + 12], 4);
+            memcpy(&r.numReads, &buf[RECORD_PREFIX + 16], 4);
+            r.spectrumOffset = offset + RECORD_PREFIX + RAW_SCAN_FIELDS;
+            r.numPixels = (length - RAW_SCAN_FIELDS) / sizeof (unsigned int);
+            if (r.numReads <= 0) {
+                break;
+            }
+            r.readsUsed = r.numReads;
+        } else if (r.type == RECORD_RESULT && (length == RESULT_PAYLOAD || length == OLD_RESULT_PAYLOAD)) {
+            memcpy(&r.result, &buf[RECORD_PREFIX + 8], 8);
+            memcpy(&r.shift, &buf[RECORD_PREFIX + 16], 8);
+            r.quality = -1;
+            if (length == RESULT_PAYLOAD) {
+                memcpy(&r.quality, &buf[RECORD_PREFIX + 24], 8);
+            }
+        } else {
+            break;
+        }
+        if (visit) {
+            visit(&r, arg);
+        }
+        offset += RECORD_PREFIX + length + RECORD_CHECKSUM;
+    }
+
+    //drop whatever the crash left half written, and carry on from there
+    if (ftruncate(s->fd, offset) != 0 || lseek(s->fd, offset, SEEK_SET) != offset) {
+        printf("could not trim scan store %s\n", path);
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+long scanStoreAppendScan(scanStore *s, int scan, int device, unsigned int timestamp,
+                         double *spectrum, int readsUsed, int numPixels)
+{
+    unsigned char fields[RAW_SCAN_FIELDS];
+    unsigned int wallTime = time(NULL);
+    struct iovec parts[2];
+    long offset;
+
+    if (numPixels <= 0 || numPixels > MAX_PIXELS) {
+        return -1;
+    }
+    memcpy(&fields[0], &scan, 4);
+    memcpy(&fields[4], &device, 4);
+    memcpy(&fields[8], &timestamp, 4);
+    memcpy(&fields[12], &wallTime, 4);
+    memcpy(&fields[16], &readsUsed, 4);
+
+    //the spectrum goes straight from the caller's buffer to the file
+    parts[0].iov_base = fields;
+    parts[0].iov_len = RAW_SCAN_FIELDS;
+    parts[1].iov_base = spectrum;
+    parts[1].iov_len = numPixels * sizeof (double);
+
+    pthread_mutex_lock(&s->lock);
+    offset = appendRecord(s, RECORD_COUNTED_SCAN, parts, 2);
+    if (offset >= 0 && s->scansPerSync >= 0 && ++s->unsynced >= s->scansPerSync) {
+        fsync(s->fd);
+        s->unsynced = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return offset < 0 ? -1 : offset + RECORD_PREFIX + RAW_SCAN_FIELDS;
+}
+
+long scanStoreAppendRawScan(scanStore *s, int scan, int device, unsigned int timestamp,
+                            unsigned int *sums, int numReads, int numPixels)
+{
+    unsigned char fields[RAW_SCAN_FIELDS];
+    unsigned int wallTime = time(NULL);
+    struct iovec parts[2];
+    long offset;
+
+    if (numPixels <= 0 || numPixels > MAX_PIXELS || numReads <= 0) {
+        return -1;
+    }
+    memcpy(&fields[0], &scan, 4);
+    memcpy(&fields[4], &device, 4);
+    memcpy(&fields[8], &timestamp, 4);
+    memcpy(&fields[12], &wallTime, 4);
+    memcpy(&fields[16], &numReads, 4);
+
+    parts[0].iov_base = fields;
+    parts[0].iov_len = RAW_SCAN_FIELDS;
+    parts[1].iov_base = sums;
+    parts[1].iov_len = numPixels * sizeof (unsigned int);
+
+    pthread_mutex_lock(&s->lock);
+    offset = appendRecord(s, RECORD_RAW_SCAN, parts, 2);
+    if (offset >= 0 && s->scansPerSync >= 0 && ++s->unsynced >= s->scansPerSync) {
+        fsync(s->fd);
+        s->unsynced = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return offset < 0 ? -1 : offset + RECORD_PREFIX + RAW_SCAN_FIELDS;
+}
+
+int scanStoreAppendResult(scanStore *s, int scan, int device, double result, double shift, double quality)
+{
+    unsigned char payload[RESULT_PAYLOAD];
+    struct iovec part = {payload, RESULT_PAYLOAD};
+    long offset;
+
+    memcpy(&payload[0], &scan, 4);
+    memcpy(&payload[4], &device, 4);
+    memcpy(&payload[8], &result, 8);
+    memcpy(&payload[16], &shift, 8);
+    memcpy(&payload[24], &quality, 8);
+
+    pthread_mutex_lock(&s->lock);
+    offset = appendRecord(s, RECORD_RESULT, &part, 1);
+    pthread_mutex_unlock(&s->lock);
+
+    return offset < 0 ? -1 : 0;
+}
+
+int scanStoreReadSpectrum(scanStore *s, long offset, int numReads, int first, int count, double *out)
+{
+    unsigned int sums[READ_BLOCK];
+    int length = count * sizeof (double), n;
+
+    if (s->fd < 0 || first < 0 || count < 0) {
+        return -1;
+    }
+    if (numReads <= 0) {
+        return pread(s->fd, out, length, offset + first * sizeof (double)) == length ? 0 : -1;
+    }
+
+    //raw: a block of sums at a time, divided on the way out
+    while (count > 0) {
+        n = count < READ_BLOCK ? count : READ_BLOCK;
+        length = n * sizeof (unsigned int);
+        if (pread(s->fd, sums, length, offset + first * sizeof (unsigned int)) != length) {
+            return -1;
+        }
+        spectrumSumsToDoubles(sums, 1.0 / numReads, out, n);
+        first += n;
+        out += n;
+        count -= n;
+    }
+    return 0;
+}
+
+void scanStoreSync(scanStore *s)
+{
+    pthread_mutex_lock(&s->lock);
+    if (s->fd >= 0) {
+        fsync(s->fd);
+        s->unsynced = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void scanStoreClose(scanStore *s, int remove)
+{
+    pthread_mutex_lock(&s->lock);
+    if (s->fd >= 0) {
+        if (!remove) {
+            fsync(s->fd);
+        }
+        close(s->fd);
+        s->fd = -1;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (remove) {
+        unlink(s->path);
+    }
+}
+
+int scanStoreFindAll(char paths[][SCAN_STORE_PATH_LENGTH], int max)
+{
+    DIR *dir = opendir(SCAN_STORE_DIR);
+    struct dirent *entry;
+    int n = 0, length, suffixLength = strlen(SCAN_STORE_SUFFIX);
+
+    if (!dir) {
+        return 0;
+    }
+    while (n < max && (entry = readdir(dir)) != NULL) {
+        length = strlen(entry->d_name);
+        if (length > suffixLength && !strcmp(&entry->d_name[length - suffixLength], SCAN_STORE_SUFFIX)) {
+            snprintf(paths[n++], SCAN_STORE_PATH_LENGTH, "%s/%s", SCAN_STORE_DIR, entry->d_name);
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+
+//FNV-1a; plenty to spot a torn write. hash carries on from an earlier part
+unsigned int scanStoreChecksum(unsigned int hash, const void *data, int length)
+{
+    const unsigned char *p = data;
+    int i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//writes one whole record, payload gathered from parts, at the end of the
+//file with a single writev. caller holds the lock.
+//returns the offset the record starts at
+static long appendRecord(scanStore *s, int type, struct iovec *parts, int numParts)
+{
+    unsigned char prefix[RECORD_PREFIX];
+    struct iovec record[4];
+    unsigned int sum = SCAN_STORE_CHECKSUM_START, length = 0;
+    long offset;
+    int i, n;
+
+    if (s->fd < 0) {
+        return -1;
+    }
+
+    record[0].iov_base = prefix;
+    record[0].iov_len = RECORD_PREFIX;
+    for (i = 0; i < numParts; i++) {
+        sum = scanStoreChecksum(sum, parts[i].iov_base, parts[i].iov_len);
+        length += parts[i].iov_len;
+        record[i + 1] = parts[i];
+    }
+    record[numParts + 1].iov_base = &sum;
+    record[numParts + 1].iov_len = RECORD_CHECKSUM;
+    prefix[0] = type;
+    memcpy(&prefix[1], &length, 4);
+
+    offset = lseek(s->fd, 0, SEEK_END);
+    n = offset < 0 ? -1 : writev(s->fd, record, numParts + 2);
+    if (n != (int) (RECORD_PREFIX + length + RECORD_CHECKSUM)) {
+        //don't leave half a record for the next one to land behind
+        if (n > 0) {
+            ftruncate(s->fd, offset);
+        }
+        printf("could not append to scan store %s\n", s->path);
+        return -1;
+    }
+    return offset;
+}
+
+static int writeAll(int fd, void *data, int length)
+{
+    unsigned char *p = data;
+    int n;
+
+    while (length > 0) {
+        n = write(fd, p, length);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,594 @@
+/* sessionRecorder.c
+ * Session capture and playback.
+ *
+ * Recording is a mutex around a buffered FILE; records are small except
+ * for spectra, which go out as float32 (or uint16 counts) rather than
+ * the doubles we hold them in.
+ *
+ * Playback is one thread walking the file in order. Spectra go into a
+ * short queue per device for the driver to take, pressure samples into
+ * a ring, and commands down a socketpair to the server. In real time it
+ * sleeps until each record is due and drops frames the server is too
+ * slow for; flat out it only waits for the server to take each frame,
+ * giving up on a device that stops taking them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <wiringPi.h>
+
+#include "../include/sessionRecorder.h"
+#include "../include/spectrumKernels.h"
+
+#define SESSION_MAGIC "SESSREC1"
+#define MAGIC_LENGTH 8
+#define RECORD_HEADER 10            //type, device, ms, length
+#define DEVICE_FIELDS 132           //serial, model, pixel count
+#define MAX_SESSION_PAYLOAD (DEVICE_FIELDS + MAX_PIXELS * sizeof (double))
+#define RECORD_FLUSH_INTERVAL 1000  //ms between flushes of the recording
+#define REPLAY_QUEUE_DEPTH 8        //frames waiting per device
+#define REPLAY_PRESSURE_LENGTH 4096
+#define REPLAY_STALL 2000           //ms before we stop waiting on a device
+#define NO_PRESSURE 777             //what the driver reads with no ADC
+
+typedef struct {
+    double *spectrum;
+    int capacity;
+    int numPixels;
+} replayedFrame;
+
+typedef struct {
+    replayedFrame slots[REPLAY_QUEUE_DEPTH];
+    int head;
+    int count;
+    int idle;                   //stopped taking frames; don't wait for it
+} frameQueue;
+
+typedef struct {
+    int present;
+    specDeviceInfo info;
+    double *wavelengths;
+} replayedDevice;
+
+//recording
+static pthread_mutex_t recordLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *recordFile = NULL;
+static volatile int recording = 0;
+static unsigned int recordStart;
+static unsigned int lastFlush;
+
+//playback. replayLock guards the queues, the ring and the counters
+static pthread_mutex_t replayLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frameReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t frameTaken = PTHREAD_COND_INITIALIZER;
+static FILE *replayFile = NULL;
+static int replayRealTime = 1;
+static int replaySock = -1;
+static volatile int replayEnded = 0;
+static replayedDevice replayDevices[MAX_SPECTROMETERS];
+static frameQueue queues[MAX_SPECTROMETERS];
+static unsigned short pressureRing[REPLAY_PRESSURE_LENGTH];
+static int pressureHead = 0, pressureCount = 0;
+static int lastPressure = NO_PRESSURE;
+
+static unsigned int replayStartTime, replayEndTime, recordedLength;
+static long framesReplayed, framesDropped, pressureReplayed, commandsReplayed;
+static long long bytesReplayed, bytesReceived;
+
+static void writeRecord(int type, int device, const void *a, int aLength, const void *b, int bLength);
+static int readRecord(FILE *f, unsigned char *header, unsigned char *payload);
+static void pushFrame(int type, int device, unsigned char *payload, int length);
+static void pushPressure(int reading);
+static int waitFor(pthread_cond_t *cond, int ms);
+static int sendAll(int fd, const void *data, int length);
+
+
+int sessionRecordStart(const char *path)
+{
+    int d;
+
+    pthread_mutex_lock(&recordLock);
+    recordFile = fopen(path, "wb");
+    if (!recordFile || fwrite(SESSION_MAGIC, 1, MAGIC_LENGTH, recordFile) != MAGIC_LENGTH) {
+        if (recordFile) {
+            fclose(recordFile);
+            recordFile = NULL;
+        }
+        pthread_mutex_unlock(&recordLock);
+        printf("could not create session recording %s\n", path);
+        return -1;
+    }
+    recordStart = millis();
+    lastFlush = recordStart;
+    recording = 1;
+    pthread_mutex_unlock(&recordLock);
+
+    printf("recording session to %s\n", path);
+    for (d = 0; d < MAX_SPECTROMETERS; d++) {
+        sessionRecordDevice(d);
+    }
+    return 0;
+}
+
+void sessionRecordStop()
+{
+    pthread_mutex_lock(&recordLock);
+    recording = 0;
+    if (recordFile) {
+        fclose(recordFile);
+        recordFile = NULL;
+    }
+    pthread_mutex_unlock(&recordLock);
+}
+
+int sessionRecording()
+{
+    return recording;
+}
+
+void sessionRecordDevice(int device)
+{
+    unsigned char fields[DEVICE_FIELDS];
+    specDeviceInfo info;
+    double *wavelengths;
+    int n;
+
+    if (!recording) {
+        return;
+    }
+    info = getDeviceInfo(device);
+    if (info.numPixels <= 0) {
+        return;
+    }
+    wavelengths = malloc(info.numPixels * sizeof (double));
+    if (!wavelengths) {
+        return;
+    }
+    n = getDeviceWavelengthArray(device, wavelengths, info.numPixels);
+    if (n > 0) {
+        memcpy(&fields[0], info.serialNumber, 64);
+        memcpy(&fields[64], info.model, 64);
+        memcpy(&fields[128], &n, 4);
+        writeRecord(SESSION_DEVICE, device, fields, DEVICE_FIELDS, wavelengths, n * sizeof (double));
+    }
+    free(wavelengths);
+}
+
+void sessionRecordFrame(int device, const double *spectrum, int numPixels)
+{
+    unsigned char packed[numPixels > 0 ? numPixels * 4 : 1];
+
+    if (!recording || numPixels <= 0 || numPixels > MAX_PIXELS) {
+        return;
+    }
+    spectrumEncodeFloat32(spectrum, packed, numPixels);
+    writeRecord(SESSION_FRAME, device, packed, numPixels * 4, NULL, 0);
+}
+
+void sessionRecordCounts(int device, const unsigned short *counts, int numPixels)
+{
+    if (!recording || numPixels <= 0 || numPixels > MAX_PIXELS) {
+        return;
+    }
+    writeRecord(SESSION_RAW_FRAME, device, counts, numPixels * sizeof (unsigned short), NULL, 0);
+}
+
+void sessionRecordPressure(int reading)
+{
+    unsigned short sample = reading;
+
+    if (!recording || reading < 0) {
+        return;
+    }
+    writeRecord(SESSION_PRESSURE, 0, &sample, 2, NULL, 0);
+}
+
+void sessionRecordCommand(commandView cmd)
+{
+    if (!recording) {
+        return;
+    }
+    writeRecord(SESSION_COMMAND, 0, &cmd.command, 1, cmd.payload.data, cmd.payload.length);
+}
+
+int sessionReplayOpen(const char *path, int realTime)
+{
+    static unsigned char payload[MAX_SESSION_PAYLOAD];
+    unsigned char header[RECORD_HEADER];
+    char magic[MAGIC_LENGTH];
+    replayedDevice *dev;
+    int length, n;
+
+    replayFile = fopen(path, "rb");
+    if (!replayFile || fread(magic, 1, MAGIC_LENGTH, replayFile) != MAGIC_LENGTH
+        || memcmp(magic, SESSION_MAGIC, MAGIC_LENGTH)) {
+        printf("%s is not a session recording\n", path);
+        if (replayFile) {
+            fclose(replayFile);
+            replayFile = NULL;
+        }
+        return -1;
+    }
+
+    //the driver asks about the devices before playback starts, so find
+    //them now. the last description of each slot wins
+    while ((length = readRecord(replayFile, header, payload)) >= 0) {
+        memcpy(&recordedLength, &header[2], 4);
+        if (header[0] != SESSION_DEVICE || header[1] >= MAX_SPECTROMETERS || length < DEVICE_FIELDS) {
+            continue;
+        }
+        dev = &replayDevices[header[1]];
+        memcpy(&n, &payload[128], 4);
+        if (n <= 0 || length != DEVICE_FIELDS + n * (int) sizeof (double)) {
+            continue;
+        }
+        free(dev->wavelengths);
+        dev->wavelengths = malloc(n * sizeof (double));
+        if (!dev->wavelengths) {
+            dev->present = 0;
+            continue;
+        }
+        memcpy(dev->info.serialNumber, &payload[0], 64);
+        memcpy(dev->info.model, &payload[64], 64);
+        dev->info.serialNumber[63] = '\0';
+        dev->info.model[63] = '\0';
+        dev->info.numPixels = n;
+        memcpy(dev->wavelengths, &payload[DEVICE_FIELDS], n * sizeof (double));
+        dev->present = 1;
+    }
+    fseek(replayFile, MAGIC_LENGTH, SEEK_SET);
+
+    replayRealTime = realTime;
+    printf("replaying %s (%u ms recorded) %s\n", path, recordedLength,
+           realTime ? "in real time" : "as fast as possible");
+    return 0;
+}
+
+int sessionReplaying()
+{
+    return replayFile != NULL;
+}
+
+int sessionReplayDevice(int device, specDeviceInfo *info, double *wavelengths, int max)
+{
+    replayedDevice *dev;
+    int n;
+
+    if (device < 0 || device >= MAX_SPECTROMETERS || !replayDevices[device].present) {
+        return -1;
+    }
+    dev = &replayDevices[device];
+    *info = dev->info;
+    n = dev->info.numPixels < max ? dev->info.numPixels : max;
+    if (wavelengths && n > 0) {
+        memcpy(wavelengths, dev->wavelengths, n * sizeof (double));
+    }
+    return dev->info.numPixels;
+}
+
+int sessionReplayFrame(int device, double *spectrum, int max, unsigned int *timestamp)
+{
+    frameQueue *q;
+    replayedFrame *frame;
+    int n;
+
+    if (device < 0 || device >= MAX_SPECTROMETERS) {
+        return -1;
+    }
+    q = &queues[device];
+
+    pthread_mutex_lock(&replayLock);
+    while (q->count == 0 && !replayEnded) {
+        pthread_cond_wait(&frameReady, &replayLock);
+    }
+    if (q->count == 0) {
+        pthread_mutex_unlock(&replayLock);
+        return -1;
+    }
+    frame = &q->slots[q->head];
+    n = frame->numPixels < max ? frame->numPixels : max;
+    memcpy(spectrum, frame->spectrum, n * sizeof (double));
+    q->head = (q->head + 1) % REPLAY_QUEUE_DEPTH;
+    q->count--;
+    q->idle = 0;
+    framesReplayed++;
+    pthread_cond_broadcast(&frameTaken);
+    pthread_mutex_unlock(&replayLock);
+
+    *timestamp = millis();
+    return n;
+}
+
+int sessionReplayPressure()
+{
+    int reading;
+
+    pthread_mutex_lock(&replayLock);
+    if (pressureCount > 0) {
+        lastPressure = pressureRing[pressureHead];
+        pressureHead = (pressureHead + 1) % REPLAY_PRESSURE_LENGTH;
+        pressureCount--;
+        pressureReplayed++;
+    }
+    reading = lastPressure;
+    pthread_mutex_unlock(&replayLock);
+    return reading;
+}
+
+/*replayThread
+ * plays the recording from the top, then waits for the server to take
+ * the last of the frames and shuts the command socket
+ */
+PI_THREAD(replayThread)
+{
+    static unsigned char payload[MAX_SESSION_PAYLOAD];
+    unsigned char header[RECORD_HEADER];
+    unsigned short frameLength;
+    unsigned int due;
+    int length, d, busy;
+
+    replayStartTime = millis();
+    while ((length = readRecord(replayFile, header, payload)) >= 0) {
+        memcpy(&due, &header[2], 4);
+        if (replayRealTime && (int) (due - (millis() - replayStartTime)) > 0) {
+            delay(due - (millis() - replayStartTime));
+        }
+        bytesReplayed += RECORD_HEADER + length;
+
+        switch (header[0]) {
+        case SESSION_FRAME:
+        case SESSION_RAW_FRAME:
+            pushFrame(header[0], header[1], payload, length);
+            break;
+
+        case SESSION_PRESSURE:
+            if (length == 2) {
+                pushPressure(payload[0] | payload[1] << 8);
+            }
+            break;
+
+        case SESSION_COMMAND:
+            //framed just as the phone would send it
+            if (length > 0 && length <= COMMAND_MAX_LENGTH) {
+                frameLength = length;
+                if (sendAll(replaySock, &frameLength, 2) || sendAll(replaySock, payload, length)) {
+                    printf("server stopped taking commands\n");
+                } else {
+                    commandsReplayed++;
+                }
+            }
+            break;
+        }
+    }
+
+    //let the server finish with what's queued, unless it has stopped asking
+    pthread_mutex_lock(&replayLock);
+    replayEnded = 1;
+    pthread_cond_broadcast(&frameReady);
+    while (1) {
+        busy = 0;
+        for (d = 0; d < MAX_SPECTROMETERS; d++) {
+            if (queues[d].count && !queues[d].idle) {
+                busy = 1;
+            }
+        }
+        if (!busy || waitFor(&frameTaken, REPLAY_STALL) == ETIMEDOUT) {
+            break;
+        }
+    }
+    replayEndTime = millis();
+    pthread_mutex_unlock(&replayLock);
+
+    shutdown(replaySock, SHUT_WR);
+    return NULL;
+}
+
+/*drainThread
+ * reads (and counts) everything the server sends our pretend client
+ */
+PI_THREAD(drainThread)
+{
+    unsigned char buf[4096];
+    int n;
+
+    while ((n = read(replaySock, buf, sizeof (buf))) > 0) {
+        bytesReceived += n;
+    }
+    close(replaySock);
+    return NULL;
+}
+
+int sessionReplayConnect()
+{
+    int fds[2];
+
+    if (!replayFile || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return -1;
+    }
+    replaySock = fds[1];
+    if (piThreadCreate(drainThread) || piThreadCreate(replayThread)) {
+        printf("pi thread failed somehow!\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    return fds[0];
+}
+
+void sessionReplayReport()
+{
+    unsigned int elapsed;
+
+    pthread_mutex_lock(&replayLock);
+    elapsed = (replayEnded ? replayEndTime : millis()) - replayStartTime;
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+    printf("\nreplay: %u ms recorded, played in %u ms (%.2fx)\n",
+           recordedLength, elapsed, (double) recordedLength / elapsed);
+    printf("  frames:    %li taken, %li dropped, %.1f/s\n",
+           framesReplayed, framesDropped, framesReplayed * 1000.0 / elapsed);
+    printf("  pressure:  %li samples\n", pressureReplayed);
+    printf("  commands:  %li\n", commandsReplayed);
+    printf("  in:        %lli bytes of recording, %.2f MB/s\n", bytesReplayed, bytesReplayed / 1000.0 / elapsed);
+    printf("  out:       %lli bytes to the client, %.2f MB/s\n\n", bytesReceived, bytesReceived / 1000.0 / elapsed);
+    pthread_mutex_unlock(&replayLock);
+}
+
+
+//one whole record, payload in up to two parts. flushes now and then so
+//a killed server leaves most of its recording behind
+static void writeRecord(int type, int device, const void *a, int aLength, const void *b, int bLength)
+{
+    unsigned char header[RECORD_HEADER];
+    unsigned int now, length = aLength + bLength;
+
+    pthread_mutex_lock(&recordLock);
+    if (!recordFile) {
+        pthread_mutex_unlock(&recordLock);
+        return;
+    }
+    now = millis();
+    header[0] = type;
+    header[1] = device;
+    now -= recordStart;
+    memcpy(&header[2], &now, 4);
+    memcpy(&header[6], &length, 4);
+    fwrite(header, 1, RECORD_HEADER, recordFile);
+    fwrite(a, 1, aLength, recordFile);
+    if (bLength > 0) {
+        fwrite(b, 1, bLength, recordFile);
+    }
+    if ((int) (millis() - lastFlush) >= RECORD_FLUSH_INTERVAL) {
+        fflush(recordFile);
+        lastFlush = millis();
+    }
+    pthread_mutex_unlock(&recordLock);
+}
+
+//the next record of a recording. a short one is the end, as is one
+//too big to be ours
+//returns the payload length, or -1 at the end
+static int readRecord(FILE *f, unsigned char *header, unsigned char *payload)
+{
+    unsigned int length;
+
+    if (fread(header, 1, RECORD_HEADER, f) != RECORD_HEADER) {
+        return -1;
+    }
+    memcpy(&length, &header[6], 4);
+    if (length > MAX_SESSION_PAYLOAD || fread(payload, 1, length, f) != length) {
+        return -1;
+    }
+    return length;
+}
+
+//queue a recorded spectrum for the driver, as doubles. caller is the
+//replay thread
+static void pushFrame(int type, int device, unsigned char *payload, int length)
+{
+    int size = type == SESSION_FRAME ? 4 : 2, n = length / size, i;
+    frameQueue *q;
+    replayedFrame *frame;
+    unsigned short count;
+    unsigned int start;
+    double *spectrum;
+    float f;
+
+    if (device >= MAX_SPECTROMETERS || n <= 0 || n > MAX_PIXELS) {
+        return;
+    }
+    q = &queues[device];
+
+    pthread_mutex_lock(&replayLock);
+    start = millis();
+    while (q->count == REPLAY_QUEUE_DEPTH && !q->idle && !replayRealTime) {
+        if ((int) (millis() - start) >= REPLAY_STALL) {
+            printf("device %i stopped taking frames; dropping them\n", device);
+            q->idle = 1;
+            break;
+        }
+        waitFor(&frameTaken, REPLAY_STALL);
+    }
+    if (q->count == REPLAY_QUEUE_DEPTH) {
+        //nobody wanted the oldest one in time
+        q->head = (q->head + 1) % REPLAY_QUEUE_DEPTH;
+        q->count--;
+        framesDropped++;
+    }
+
+    frame = &q->slots[(q->head + q->count) % REPLAY_QUEUE_DEPTH];
+    if (n > frame->capacity) {
+        spectrum = realloc(frame->spectrum, n * sizeof (double));
+        if (!spectrum) {
+            pthread_mutex_unlock(&replayLock);
+            printf("we didnt get the memory for a frame\n");
+            return;
+        }
+        frame->spectrum = spectrum;
+        frame->capacity = n;
+    }
+    for (i = 0; i < n; i++) {
+        if (size == 4) {
+            memcpy(&f, &payload[4 * i], 4);
+            frame->spectrum[i] = f;
+        } else {
+            memcpy(&count, &payload[2 * i], 2);
+            frame->spectrum[i] = count;
+        }
+    }
+    frame->numPixels = n;
+    q->count++;
+    pthread_cond_broadcast(&frameReady);
+    pthread_mutex_unlock(&replayLock);
+}
+
+//the ring just keeps the newest samples if the sampler falls behind
+static void pushPressure(int reading)
+{
+    pthread_mutex_lock(&replayLock);
+    if (pressureCount == REPLAY_PRESSURE_LENGTH) {
+        pressureHead = (pressureHead + 1) % REPLAY_PRESSURE_LENGTH;
+        pressureCount--;
+    }
+    pressureRing[(pressureHead + pressureCount) % REPLAY_PRESSURE_LENGTH] = reading;
+    pressureCount++;
+    pthread_mutex_unlock(&replayLock);
+}
+
+//pthread_cond_timedwait for ms from now, on replayLock
+static int waitFor(pthread_cond_t *cond, int ms)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(cond, &replayLock, &until);
+}
+
+static int sendAll(int fd, const void *data, int length)
+{
+    const unsigned char *p = data;
+    int n;
+
+    while (length > 0) {
+        n = send(fd, p, length, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
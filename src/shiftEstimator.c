@@ -0,0 +1,286 @@
+/* shiftEstimator.c
+ * Real FFT and the cross-correlation shift estimate built on it.
+ *
+ * A real signal of size points is packed as size / 2 complex points
+ * (even samples real, odd imaginary), which is just the same array read
+ * two at a time. One complex FFT of that, and a pass of split twiddles
+ * to untangle the even and odd halves, gives the first size / 2 + 1 bins
+ * of the real transform; the rest are their mirror images.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/shiftEstimator.h"
+
+static void fftComplex(fftPlan *p, double *data);
+static void resample(shiftEstimator *s, const double *wavelengths, const double *intensities,
+                     int numPixels, double *out);
+
+
+int fftPlanCreate(fftPlan *p, int size)
+{
+    int half = size / 2, bits = 0, i, j;
+
+    if (size < 4 || (size & (size - 1))) {
+        return -1;
+    }
+    if (p->size == size) {
+        return 0;
+    }
+    fftPlanDestroy(p);
+
+    p->bitReverse = malloc(half * sizeof (int));
+    p->twiddle = malloc(2 * (half / 2) * sizeof (double));
+    p->split = malloc(2 * (half / 2 + 1) * sizeof (double));
+    if (!p->bitReverse || !p->twiddle || !p->split) {
+        printf("we didnt get the memory for an FFT of %i\n", size);
+        fftPlanDestroy(p);
+        return -1;
+    }
+
+    while ((1 << bits) < half) {
+        bits++;
+    }
+    for (i = 0; i < half; i++) {
+        p->bitReverse[i] = 0;
+        for (j = 0; j < bits; j++) {
+            if (i & (1 << j)) {
+                p->bitReverse[i] |= 1 << (bits - 1 - j);
+            }
+        }
+    }
+    for (i = 0; i < half / 2; i++) {
+        p->twiddle[2 * i] = cos(-2 * M_PI * i / half);
+        p->twiddle[2 * i + 1] = sin(-2 * M_PI * i / half);
+    }
+    for (i = 0; i <= half / 2; i++) {
+        p->split[2 * i] = cos(-2 * M_PI * i / size);
+        p->split[2 * i + 1] = sin(-2 * M_PI * i / size);
+    }
+    p->size = size;
+    return 0;
+}
+
+void fftPlanDestroy(fftPlan *p)
+{
+    free(p->bitReverse);
+    free(p->twiddle);
+    free(p->split);
+    memset(p, 0, sizeof (*p));
+}
+
+void fftReal(fftPlan *p, double *data)
+{
+    int half = p->size / 2, k;
+    double zr, zi, cr, ci, er, ei, or, oi, wr, wi;
+
+    fftComplex(p, data);
+
+    //Z[half] = Z[0], so bin 0 pairs up like the rest
+    data[2 * half] = data[0];
+    data[2 * half + 1] = data[1];
+
+    //X[k] = E + W^k O and X[half - k] = conj(E - W^k O), where
+    //E = (Z[k] + conj(Z[half - k])) / 2 and O = -i (Z[k] - conj(Z[half - k])) / 2
+    for (k = 0; k <= half / 2; k++) {
+        zr = data[2 * k];
+        zi = data[2 * k + 1];
+        cr = data[2 * (half - k)];
+        ci = -data[2 * (half - k) + 1];
+        er = (zr + cr) / 2;
+        ei = (zi + ci) / 2;
+        or = (zi - ci) / 2;
+        oi = -(zr - cr) / 2;
+        wr = p->split[2 * k];
+        wi = p->split[2 * k + 1];
+
+        data[2 * k] = er + wr * or - wi * oi;
+        data[2 * k + 1] = ei + wr * oi + wi * or;
+        data[2 * (half - k)] = er - (wr * or - wi * oi);
+        data[2 * (half - k) + 1] = -(ei - (wr * oi + wi * or));
+    }
+}
+
+void fftRealInverse(fftPlan *p, double *data)
+{
+    int half = p->size / 2, k;
+    double xr, xi, cr, ci, er, ei, dr, di, or, oi, wr, wi;
+
+    //undo the split: Z[k] = E + i O and Z[half - k] = conj(E) + i conj(O), where
+    //E = (X[k] + conj(X[half - k])) / 2 and O = conj(W^k) (X[k] - conj(X[half - k])) / 2
+    for (k = 0; k <= half / 2; k++) {
+        xr = data[2 * k];
+        xi = data[2 * k + 1];
+        cr = data[2 * (half - k)];
+        ci = -data[2 * (half - k) + 1];
+        er = (xr + cr) / 2;
+        ei = (xi + ci) / 2;
+        dr = (xr - cr) / 2;
+        di = (xi - ci) / 2;
+        wr = p->split[2 * k];
+        wi = -p->split[2 * k + 1];
+        or = wr * dr - wi * di;
+        oi = wr * di + wi * dr;
+
+        data[2 * k] = er - oi;
+        data[2 * k + 1] = ei + or;
+        data[2 * (half - k)] = er + oi;
+        data[2 * (half - k) + 1] = -ei + or;
+    }
+
+    //inverse complex FFT by conjugating on the way in and out
+    for (k = 0; k < half; k++) {
+        data[2 * k + 1] = -data[2 * k + 1];
+    }
+    fftComplex(p, data);
+    for (k = 0; k < half; k++) {
+        data[2 * k] /= half;
+        data[2 * k + 1] /= -half;
+    }
+}
+
+int shiftSetReference(shiftEstimator *s, const double *wavelengths, const double *intensities, int numPixels)
+{
+    int size = 4;
+    double *reference;
+
+    if (!wavelengths || !intensities || numPixels < 3 || wavelengths[numPixels - 1] <= wavelengths[0]) {
+        return -1;
+    }
+    s->ready = 0;
+    s->samples = numPixels;
+    s->start = wavelengths[0];
+    s->step = (wavelengths[numPixels - 1] - wavelengths[0]) / (numPixels - 1);
+
+    //padded to twice the length, so the correlation doesn't wrap around
+    while (size < 2 * numPixels) {
+        size *= 2;
+    }
+    if (fftPlanCreate(&s->plan, size) != 0) {
+        return -1;
+    }
+    reference = realloc(s->reference, (size + 2) * sizeof (double));
+    if (!reference) {
+        printf("we didnt get the memory for a reference spectrum\n");
+        return -1;
+    }
+    s->reference = reference;
+
+    resample(s, wavelengths, intensities, numPixels, reference);
+    fftReal(&s->plan, reference);
+    for (size = 0; size <= s->plan.size / 2; size++) {
+        reference[2 * size + 1] = -reference[2 * size + 1];
+    }
+    s->ready = 1;
+    return 0;
+}
+
+int shiftEstimate(shiftEstimator *s, const double *wavelengths, const double *intensities, int numPixels, double *shift)
+{
+    int size = s->plan.size, half = size / 2, k, best = 0;
+    double work[size + 2], re, im, left, right, curve, offset = 0;
+
+    if (!s->ready || !wavelengths || !intensities || numPixels < 2) {
+        return -1;
+    }
+    resample(s, wavelengths, intensities, numPixels, work);
+    fftReal(&s->plan, work);
+
+    //times the conjugated reference, and back: the correlation at every lag
+    for (k = 0; k <= half; k++) {
+        re = work[2 * k] * s->reference[2 * k] - work[2 * k + 1] * s->reference[2 * k + 1];
+        im = work[2 * k] * s->reference[2 * k + 1] + work[2 * k + 1] * s->reference[2 * k];
+        work[2 * k] = re;
+        work[2 * k + 1] = im;
+    }
+    fftRealInverse(&s->plan, work);
+
+    //lags past the middle are the negative ones
+    for (k = 1; k < size; k++) {
+        if (work[k] > work[best]) {
+            best = k;
+        }
+    }
+    left = work[(best + size - 1) % size];
+    right = work[(best + 1) % size];
+    curve = left - 2 * work[best] + right;
+    if (curve < 0) {
+        offset = (left - right) / (2 * curve);
+    }
+    *shift = ((best < half ? best : best - size) + offset) * s->step;
+    return 0;
+}
+
+void shiftReset(shiftEstimator *s)
+{
+    fftPlanDestroy(&s->plan);
+    free(s->reference);
+    memset(s, 0, sizeof (*s));
+}
+
+//in-place complex FFT of size / 2 points
+static void fftComplex(fftPlan *p, double *data)
+{
+    int half = p->size / 2, length, i, j, k, stride;
+    double tr, ti, wr, wi;
+
+    for (i = 0; i < half; i++) {
+        j = p->bitReverse[i];
+        if (j > i) {
+            tr = data[2 * i];
+            ti = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = tr;
+            data[2 * j + 1] = ti;
+        }
+    }
+    for (length = 2; length <= half; length *= 2) {
+        stride = half / length;
+        for (i = 0; i < half; i += length) {
+            for (k = 0; k < length / 2; k++) {
+                double *a = &data[2 * (i + k)], *b = &data[2 * (i + k + length / 2)];
+                wr = p->twiddle[2 * k * stride];
+                wi = p->twiddle[2 * k * stride + 1];
+                tr = b[0] * wr - b[1] * wi;
+                ti = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+//onto the reference's grid, with a straight line through the two ends
+//taken off and zeros after it. out holds plan.size + 2 doubles
+static void resample(shiftEstimator *s, const double *wavelengths, const double *intensities,
+                     int numPixels, double *out)
+{
+    int i, j = 0, n = s->samples;
+    double w, t, first, last;
+
+    for (i = 0; i < n; i++) {
+        w = s->start + i * s->step;
+        while (j < numPixels - 2 && wavelengths[j + 1] < w) {
+            j++;
+        }
+        if (w <= wavelengths[0]) {
+            out[i] = intensities[0];
+        } else if (w >= wavelengths[numPixels - 1]) {
+            out[i] = intensities[numPixels - 1];
+        } else {
+            t = (w - wavelengths[j]) / (wavelengths[j + 1] - wavelengths[j]);
+            out[i] = intensities[j] + t * (intensities[j + 1] - intensities[j]);
+        }
+    }
+    first = out[0];
+    last = out[n - 1];
+    for (i = 0; i < n; i++) {
+        out[i] -= first + (last - first) * i / (n - 1);
+    }
+    memset(&out[n], 0, (s->plan.size + 2 - n) * sizeof (double));
+}
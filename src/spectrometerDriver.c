@@ -1,351 +1,1343 @@
-/*
- * Custom wrapper for the spectrometer project for easy function calls 
- * in response to incoming commands
- * 
- * 
- * /
-/***********************************************************************/
-#include "../include/spectrometerDriver.h"
-#include "api/SeaBreezeWrapper.h"
-
-
-#include <stdio.h>
-#include <stdlib.h>
-
-#include <wiringPi.h>
-#include <mcp3004.h>
-
-
-//DEFINES
-
-
-#define MILLISEC_TO_MICROSEC 1000
-#define MAX_INTENSITY 3500
-
-#define BASE 100 //ADC stuff
-#define SPI_CHAN 0
-
-//wiringPi pin1 = pi header pin 12 = broadcom pin 18
-//using at terminal "gpio readall" 
-#define PWM_PIN 1
-#define LED_PIN 25
-
-//MODULE DEFINES AND FUNCTIONS
-static int spectrometerIndex = 0;
-static int errorCode = 0;
-static FILE *outputFile;
-static FILE *waves;
-static int inited = 0;
-static double spectrumArray[NUM_WAVELENGTHS];
-static specSettings thisSpec = {5, 60, 1000, 0, 3};
-
-static int specConnected = 0;
-static int adcConnected = 0;
-
-
-
-static int Hardware_Init();
-
-int setIntegrationTime(int newTime)
-{
-    if (!inited) {
-        if (Hardware_Init() != 0) {
-            printf("Init failure at setIntegrationTime()\n");
-            return -1;
-        }
-    }
-
-    if (specConnected) {
-        seabreeze_set_integration_time_microsec(spectrometerIndex, &errorCode, newTime * MILLISEC_TO_MICROSEC);
-        if (errorCode) {
-            printf("Integration time failure in connected spectrometer :(\n");
-        }
-        return errorCode;
-    } else {
-        return -1;
-    }
-}
-
-int applySpecSettings(specSettings in)
-{
-    thisSpec.numScans = in.numScans;
-    thisSpec.timeBetweenScans = in.timeBetweenScans;
-    thisSpec.integrationTime = in.integrationTime;
-    thisSpec.boxcarWidth = in.boxcarWidth;
-    thisSpec.avgPerScan = in.avgPerScan;
-    thisSpec.doctorName = in.doctorName;
-    thisSpec.patientName = in.patientName;
-
-    if (!inited) {
-        if (Hardware_Init() != 0) {
-            printf("Init failure at applySpecSettings()\n");
-            return -1;
-        }
-    }
-
-    //update hardware to new settings
-    if (specConnected) {
-        return setIntegrationTime(thisSpec.integrationTime);
-    }
-
-    return 0;
-}
-
-int getSpectrometerReading(double *inBuff)
-{
-    int i;
-
-    if (!inited) {
-        if (Hardware_Init() != 0) {
-            printf("Init failure at getSpectrometerReading()\n");
-            return -1;
-        }
-    }
-
-    //default to this parabola to provide a peak of some sort
-    for (i = 0; i < NUM_WAVELENGTHS; i++) {
-        spectrumArray[i] = -.1* (((i - 800)) * ((i - 800))) + 200;
-        //inBuff[i] = i;
-    }
-
-    errorCode = 0;
-    if (specConnected) {
-        seabreeze_get_formatted_spectrum(spectrometerIndex, &errorCode, spectrumArray, NUM_WAVELENGTHS);
-        printf("spec appears connected\n");
-    }
-
-    boxcarAverage(thisSpec.boxcarWidth, spectrumArray, inBuff, NUM_WAVELENGTHS);
-
-    if (errorCode) {
-        printf("Error: problem getting spectrum\n");
-        return -1;
-    }
-    return 0;
-}
-
-
-int getSpectrometerWavelengthArray(double *wavelengths) {
-	if(specConnected) {
-		seabreeze_get_wavelengths(spectrometerIndex, &errorCode, wavelengths, NUM_WAVELENGTHS);
-		return errorCode;
-	} else {
-		for(int i = 0; i < NUM_WAVELENGTHS; i++) {
-			wavelengths[i] = i;
-		}
-		return 0;
-	}
-}
-
-
-
-int getPressureReading()
-{
-    if (!inited) {
-        if (Hardware_Init()) {
-            printf("Init failure at getPressureReading\n");
-            return -1;
-        }
-    }
-
-    if (adcConnected) {
-        return analogRead(BASE);
-        printf("ADC appears connected\n");
-    } else {
-        return 777;
-    }
-
-
-}
-
-void motor_ON()
-{
-    if (!inited) {
-        if (Hardware_Init()) {
-            printf("Bad Times at motor ON");
-            exit(-1);
-        }
-    }
-    pwmWrite(PWM_PIN, 540);
-}
-
-void motor_OFF()
-{
-    if (!inited) {
-        if (Hardware_Init()) {
-            printf("Bad Times at motor OFF");
-            exit(-1);
-        }
-    }
-    pwmWrite(PWM_PIN, 0);
-}
-
-void led_ON()
-{
-    if (!inited) {
-        if (Hardware_Init()) {
-            printf("Bad Times at LED_ON");
-            exit(-1);
-        }
-    }
-    digitalWrite(LED_PIN, 1);
-}
-
-void led_OFF()
-{
-    if (!inited) {
-        if (Hardware_Init()) {
-            printf("Bad Times at LED_OFF");
-            exit(-1);
-        }
-    }
-    digitalWrite(LED_PIN, 0);
-}
-
-int endSession()
-{
-    printf("Closing...");
-    if(specConnected) {
-		seabreeze_close_spectrometer(spectrometerIndex, &errorCode);
-		if (errorCode) {
-			printf("Unable to close spectrometer.\n");
-			return 1;
-		}
-	}
-
-    inited = 0;
-    return 0;
-}
-
-static int Hardware_Init()
-{
-    errorCode = 0;
-
-    //try to open the spec and set flag accordingly
-    printf("Opening spectrometer...");
-    seabreeze_open_spectrometer(spectrometerIndex, &errorCode);
-
-    if (errorCode) {
-        printf("no device connected; applying defaults\n");
-        specConnected = FALSE;
-    } else {
-        specConnected = TRUE;
-    }
-
-    //apply  integration time if connected
-    if (specConnected) {
-        printf("done.\n");
-        printf("Setting integration time to %i ms...", thisSpec.integrationTime);
-        seabreeze_set_integration_time_microsec(spectrometerIndex, &errorCode, thisSpec.integrationTime * MILLISEC_TO_MICROSEC);
-        if (errorCode) {
-            printf("Unable to set integration time.\n");
-            return 1;
-        }
-    }
-
-    //try to do other hardware
-    printf("Initializing wiringPi, PWM and ADC...");
-    if (wiringPiSetup() == -1) {
-		printf("failed at wiringpi setup!\n");	
-        return -1;
-    }
-    //BASE sets the new pin base.
-    //From digging through wiringpi source, mcp3004 setup returns TRUE
-    //when it sets up successfully. This is unfortunately opposite of 
-    //the convention i have been using.
-
-
-
-
-    if (mcp3004Setup(BASE, SPI_CHAN)) {
-        adcConnected = TRUE;
-        printf("ADC appears connected.\n");
-    } else {
-        adcConnected = FALSE;
-        printf("no ADC found.\n");
-    }
-
-    //DISABLE ANALOG READINGS FOR DEBUG:
-    //adcConnected = FALSE;
-
-    //set this pin up as PWM
-    pinMode(PWM_PIN, PWM_OUTPUT);
-    pinMode(LED_PIN, OUTPUT);
-
-
-
-    printf("done.\n");
-    inited = 1;
-    printf("now inited.\n");
-    return 0;
-}
-
-int boxcarAverage(int width, double *inputArray, double *outputArray, int numElements)
-{
-
-    signed int i, j, k, l;
-
-    if (width < 0) {
-        printf("Boxcar width must be an integer betwwen 0 and 16. Defaulting to 0.\n");
-        width = 0;
-    }
-    if (width > 16) {
-        printf("Boxcar width must be an integer betwwen 0 and 16. Defaulting to 16.\n");
-        width = 16;
-    }
-
-    if (width == 0 || width == 1) {
-        for (i = 0; i < numElements; i++) {
-            outputArray[i] = inputArray[i];
-        }
-        return 1;
-    }
-    printf("applying boxcar width %i\n", width);
-
-
-    for (i = 0; i < numElements; i++) {
-        //these are a bit funky with integers, but should still make 
-        //a window with the input value in the center.
-
-        //printf("for element %i and width %i, averaging input at: ",i,width);
-        outputArray[i] = 0;
-        for (j = 0; j < width; j++) {
-
-            if (j == 0) {
-                k = i - (width / 2);
-            }
-
-            //using l for the arrays ensures k doesnt get stuck when
-            //starting a few before 0
-            if (k < 0) {
-                l = 0; //clamp the index
-            } else if (k >= numElements) {
-                l = numElements - 1; //clamp the index
-            } else {
-                l = k;
-            }
-            //printf(" %i  ",l);
-            outputArray[i] += inputArray[l]; //sum them
-            k++;
-        }
-        //printf("\n");
-        outputArray[i] /= width; //perform the average here
-    }
-    return 1;
-}
-
-void printSpecSettings(specSettings in)
-{
-    printf("\n print spec settings \n");
-    printf(" ===================\n");
-    printf("Doctor           = %s\n", in.doctorName);
-    printf("Patient          = %s\n", in.patientName);
-    printf("Timestamp        = %s\n", in.timestamp);
-    printf("numScans         = %i\n", in.numScans);
-    printf("timeBetweenScans = %i\n", in.timeBetweenScans);
-    printf("integrationTime  = %i\n", in.integrationTime);
-    printf("boxcarWidth      = %i\n", in.boxcarWidth);
-    printf("avgPerScan       = %i\n\n", in.avgPerScan);
-}
-
-
-
+/*
+ * Custom wrapper for the spectrometer project for easy function calls 
+ * in response to incoming commands
+ * 
+ * 
+ * /
+/***********************************************************************/
+#include "../include/spectrometerDriver.h"
+#include "../include/spectrumKernels.h"
+#include "../include/sessionRecorder.h"
+#include "../include/baselineRemoval.h"
+#include "api/SeaBreezeWrapper.h"
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <wiringPi.h>
+#include <mcp3004.h>
+
+
+//DEFINES
+
+
+#define MILLISEC_TO_MICROSEC 1000
+
+//auto-exposure aims the brightest pixel at AUTO_EXPOSURE_TARGET and is
+//happy anywhere from LOW to HIGH, comfortably short of MAX_INTENSITY.
+//integration times in ms
+#define AUTO_EXPOSURE_LOW (MAX_INTENSITY * 6 / 10)
+#define AUTO_EXPOSURE_TARGET (MAX_INTENSITY * 7 / 10)
+#define AUTO_EXPOSURE_HIGH (MAX_INTENSITY * 85 / 100)
+#define AUTO_EXPOSURE_START 10      //first probe; short, so it's unlikely to clip
+#define AUTO_EXPOSURE_LONGEST 10000
+#define AUTO_EXPOSURE_STEP 8        //most a probe will lengthen the exposure by
+#define AUTO_EXPOSURE_PROBES 8
+
+#define BASE 100 //ADC stuff
+#define SPI_CHAN 0
+
+//wiringPi pin1 = pi header pin 12 = broadcom pin 18
+//using at terminal "gpio readall" 
+#define PWM_PIN 1
+#define LED_PIN 25
+
+//wavelength calibrations are cached here, one file per serial number
+#define CALIBRATION_DIR "./calibration"
+#define CALIBRATION_TOLERANCE 1e-6      //nm; the files keep six decimals
+
+//hot-plug supervisor timing, all in ms
+#define SUPERVISOR_PERIOD 1000
+#define RECONNECT_MIN_BACKOFF 500
+#define RECONNECT_MAX_BACKOFF 30000
+
+//MODULE DEFINES AND FUNCTIONS
+static FILE *outputFile;
+static FILE *waves;
+static int inited = 0;
+static specSettings thisSpec = {.numScans = 5, .timeBetweenScans = 60, .integrationTime = 1000, .boxcarWidth = 0, .avgPerScan = 3};
+static filterChain activeFilters;  //what every formatted reading goes through; starts as nothing
+
+static int adcConnected = 0;
+
+//everything we know about one spectrometer. Slot d is seabreeze index d.
+typedef struct {
+    int index;
+    int errorCode;
+    volatile int state;             //spec_connection_states
+
+    //every seabreeze call on this device happens under this lock, so the
+    //supervisor can probe and reopen it without tripping over an acquisition
+    pthread_mutex_t lock;
+
+    //filled in when the device is opened so nobody has to ask it again.
+    //both arrays hold info.numPixels readings
+    specDeviceInfo info;
+    double *wavelengths;
+    double *spectrumArray;
+    int capacity;
+
+    //the unformatted spectrum, if it is just one uint16 per pixel
+    //(rawLength is 0 if not, and raw frames are made from spectrumArray)
+    int rawLength;
+    unsigned char *rawBuffer;
+
+    //shortest integration time it will take, in ms
+    int minIntegration;
+
+    //supervisor bookkeeping
+    int backoff;
+    unsigned int nextCheck;
+    int calibrationChecked;         //0 while the wavelengths are the cache's word only
+
+    //parallel acquisition hand-off, guarded by acquireLock
+    pthread_cond_t wake;
+    int requested;
+    int wantRaw;
+    specFrame *frame;
+} specDevice;
+
+static specDevice devices[MAX_SPECTROMETERS];
+static int numDevices = 1;          //highest slot ever seen + 1; slot 0 always exists
+
+static int supervisorStarted = 0;
+static void (*connectionCallback)(int device, int state) = NULL;
+
+//acquireSpectra hands work to one worker thread per device and waits here
+static pthread_mutex_t acquireCallLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t acquireLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t acquireDone = PTHREAD_COND_INITIALIZER;
+static int acquisitionsPending = 0;
+
+
+
+static int Hardware_Init();
+static int shortestIntegration();
+static int acquire(int deviceMask, specFrame *frames, int raw);
+static int readDevice(specDevice *d, specFrame *frame, int raw);
+static int readRawCounts(specDevice *d, specFrame *frame);
+static int reserveCounts(specFrame *frame, int numPixels);
+static int resizeDevice(specDevice *d, int numPixels);
+static int reserveFrame(specFrame *frame, int numPixels);
+static void *acquisitionWorker(void *arg);
+static int openSpectrometer(specDevice *d);
+static void setSpecState(specDevice *d, int state);
+static void loadSimulatedCalibration(specDevice *d);
+static int loadReplayedDevice(specDevice *d);
+static int loadDeviceCalibration(specDevice *d);
+static int readCalibrationFile(specDevice *d, char *path);
+static void writeCalibrationFile(specDevice *d, char *path);
+static void checkCalibration(specDevice *d);
+
+int initHardware()
+{
+    if (inited) {
+        return 0;
+    }
+    return Hardware_Init();
+}
+
+int setIntegrationTime(int newTime)
+{
+    int d, err = 0;
+
+    if (!inited) {
+        if (Hardware_Init() != 0) {
+            printf("Init failure at setIntegrationTime()\n");
+            return -1;
+        }
+    }
+
+    //remembered so the supervisor can reapply it after a reconnect
+    thisSpec.integrationTime = newTime;
+
+    for (d = 0; d < numDevices; d++) {
+        specDevice *dev = &devices[d];
+
+        pthread_mutex_lock(&dev->lock);
+        if (dev->state == SPEC_CONNECTED && !sessionReplaying()) {
+            seabreeze_set_integration_time_microsec(dev->index, &dev->errorCode, newTime * MILLISEC_TO_MICROSEC);
+            if (dev->errorCode) {
+                printf("Integration time failure in spectrometer %i :(\n", d);
+                err = dev->errorCode;
+            }
+        } else if (d == 0) {
+            err = -1;
+        }
+        pthread_mutex_unlock(&dev->lock);
+    }
+    return err;
+}
+
+int setBoxcarWidth(int width)
+{
+    thisSpec.boxcarWidth = width;
+    return filterChainCompile(&activeFilters, width, NULL);
+}
+
+int setFilterChain(const filterChain *chain)
+{
+    activeFilters = *chain;
+    return 0;
+}
+
+int autoExpose(int deviceMask)
+{
+    specFrame frames[MAX_SPECTROMETERS] = {{0}};
+    double brightest, floor, peak, low;
+    int k, next, numFrames, probe, t = AUTO_EXPOSURE_START;
+
+    if (t < shortestIntegration()) {
+        t = shortestIntegration();
+    }
+    for (probe = 0; probe < AUTO_EXPOSURE_PROBES; probe++) {
+        setIntegrationTime(t);
+        //raw counts, so no boxcar hides a clipped pixel
+        numFrames = acquire(deviceMask, frames, 1);
+        brightest = -1;
+        floor = 0;
+        for (k = 0; k < numFrames; k++) {
+            if (frames[k].status == 0) {
+                peak = framePeak(&frames[k], &low);
+                if (peak > brightest) {
+                    brightest = peak;
+                    floor = low;
+                }
+            }
+        }
+        if (brightest < 0) {
+            printf("auto-exposure: nothing to read\n");
+            t = -1;
+            break;
+        }
+        next = adjustExposure(t, brightest, floor);
+        if (next == t) {
+            break;
+        }
+        t = next;
+    }
+    freeSpecFrames(frames, MAX_SPECTROMETERS);
+
+    if (t > 0) {
+        setIntegrationTime(t);
+        printf("auto-exposure settled on %i ms after %i probes\n", t, probe + 1);
+    }
+    return t;
+}
+
+int adjustExposure(int integrationTime, double peak, double floor)
+{
+    double t;
+    int shortest = shortestIntegration();
+
+    if (peak >= AUTO_EXPOSURE_LOW && peak <= AUTO_EXPOSURE_HIGH) {
+        return integrationTime;
+    }
+    if (peak >= MAX_INTENSITY) {
+        //clipped, so there's no telling how far over it is
+        t = integrationTime / 4.0;
+    } else if (peak - floor <= 0 || AUTO_EXPOSURE_TARGET <= floor) {
+        t = integrationTime * (double) AUTO_EXPOSURE_STEP;
+    } else {
+        //the signal above the dark floor grows with the exposure
+        t = integrationTime * (AUTO_EXPOSURE_TARGET - floor) / (peak - floor);
+        if (t > integrationTime * (double) AUTO_EXPOSURE_STEP) {
+            t = integrationTime * (double) AUTO_EXPOSURE_STEP;
+        }
+    }
+
+    if (t < shortest) {
+        t = shortest;
+    } else if (t > AUTO_EXPOSURE_LONGEST) {
+        t = AUTO_EXPOSURE_LONGEST;
+    }
+    return (int) (t + 0.5);
+}
+
+double framePeak(const specFrame *frame, double *floor)
+{
+    unsigned short high = 0, low = 0xffff;
+    double minimum = 0;
+    int i;
+
+    if (frame->numPixels <= 0) {
+        if (floor) {
+            *floor = 0;
+        }
+        return 0;
+    }
+    if (!frame->raw) {
+        i = spectrumPeakIndex(frame->spectrum, frame->numPixels, &minimum);
+        if (floor) {
+            *floor = minimum;
+        }
+        return frame->spectrum[i];
+    }
+    for (i = 0; i < frame->numPixels; i++) {
+        if (frame->counts[i] > high) {
+            high = frame->counts[i];
+        }
+        if (frame->counts[i] < low) {
+            low = frame->counts[i];
+        }
+    }
+    if (floor) {
+        *floor = low;
+    }
+    return high;
+}
+
+//the exposure has to suit every spectrometer, so the longest of their minimums
+static int shortestIntegration()
+{
+    int d, shortest = 1;
+
+    for (d = 0; d < numDevices; d++) {
+        if (devices[d].state == SPEC_CONNECTED && devices[d].minIntegration > shortest) {
+            shortest = devices[d].minIntegration;
+        }
+    }
+    return shortest;
+}
+
+int applySpecSettings(specSettings in)
+{
+    thisSpec.numScans = in.numScans;
+    thisSpec.timeBetweenScans = in.timeBetweenScans;
+    thisSpec.integrationTime = in.integrationTime;
+    thisSpec.boxcarWidth = in.boxcarWidth;
+    filterChainCompile(&activeFilters, in.boxcarWidth, in.filters);
+    thisSpec.avgPerScan = in.avgPerScan;
+    thisSpec.doctorName = in.doctorName;
+    thisSpec.patientName = in.patientName;
+    thisSpec.deviceMask = in.deviceMask;
+
+    if (!inited) {
+        if (Hardware_Init() != 0) {
+            printf("Init failure at applySpecSettings()\n");
+            return -1;
+        }
+    }
+
+    //update hardware to new settings
+    if (devices[0].state == SPEC_CONNECTED || numDevices > 1) {
+        return setIntegrationTime(thisSpec.integrationTime);
+    }
+
+    return 0;
+}
+
+int parseSpecOption(specSettings *spec, fieldView option)
+{
+    fieldView key, value, item;
+    int d;
+
+    value = option;
+    nextField(&value, &key, '=');
+    if (value.data == NULL) {
+        return -1;
+    }
+
+    //devices=0,2 -> use spectrometers 0 and 2
+    if (fieldEquals(key, "devices")) {
+        spec->deviceMask = 0;
+        while (nextField(&value, &item, ',')) {
+            d = fieldToInt(item, -1);
+            if (d >= 0 && d < MAX_SPECTROMETERS) {
+                spec->deviceMask |= 1 << d;
+            }
+        }
+        return 0;
+    }
+
+    //exposure=auto -> find the integration time rather than using the one sent
+    if (fieldEquals(key, "exposure")) {
+        spec->autoExposure = fieldEquals(value, "auto") ? 1 : 0;
+        return 0;
+    }
+
+    //precision=X -> adaptive averaging, to a standard error of X counts
+    if (fieldEquals(key, "precision")) {
+        spec->precision = fieldToDouble(value, 0);
+        if (spec->precision < 0) {
+            spec->precision = 0;
+        }
+        return 0;
+    }
+
+    //minreads=N -> the fewest reads adaptive averaging will stop at
+    if (fieldEquals(key, "minreads")) {
+        spec->minReads = fieldToInt(value, 0);
+        return 0;
+    }
+
+    //shift=xcorr|fit -> measure shifts by cross-correlation (default) or from the peak fits
+    if (fieldEquals(key, "shift")) {
+        spec->shiftMethod = fieldEquals(value, "fit") ? SHIFT_FIT : SHIFT_CORRELATE;
+        return 0;
+    }
+
+    //baseline=off|als|arpls -> take the background off each spectrum before its peak is found
+    if (fieldEquals(key, "baseline")) {
+        spec->baselineMethod = fieldEquals(value, "als") ? BASELINE_ALS
+                             : fieldEquals(value, "arpls") ? BASELINE_ARPLS : BASELINE_OFF;
+        return 0;
+    }
+
+    //lambda=X -> how stiff that baseline is; bigger = smoother
+    if (fieldEquals(key, "lambda")) {
+        spec->baselineLambda = fieldToDouble(value, 0);
+        if (spec->baselineLambda < 0) {
+            spec->baselineLambda = 0;
+        }
+        return 0;
+    }
+
+    //filter=median:5,sg:11:2 -> run every reading through these after the boxcar
+    if (fieldEquals(key, "filter")) {
+        char text[FILTER_TEXT_LENGTH];
+        filterChain check;
+        if (value.length >= (int) sizeof (text)) {
+            printf("filter chain is too long\n");
+            return -1;
+        }
+        fieldCopy(value, text, sizeof (text));
+        if (strcmp(text, "none") == 0) {
+            text[0] = '\0';
+        }
+        //a chain that won't compile leaves the old one in place
+        if (filterChainCompile(&check, 0, text) != 0) {
+            return -1;
+        }
+        snprintf(spec->filters, sizeof (spec->filters), "%s", text);
+        return 0;
+    }
+
+    //raw=1 -> average raw counts in experiments
+    if (fieldEquals(key, "raw")) {
+        spec->rawMode = fieldToInt(value, 0) ? 1 : 0;
+        return 0;
+    }
+
+    //sync=N -> fsync the scan file every N scans
+    if (fieldEquals(key, "sync")) {
+        spec->scansPerSync = fieldEquals(value, "off") ? -1 : fieldToInt(value, 0);
+        if (spec->scansPerSync < -1) {
+            spec->scansPerSync = 0;
+        }
+        return 0;
+    }
+
+    printf("unknown settings option %.*s\n", option.length, option.data);
+    return -1;
+}
+
+int getSpectrometerReading(double *inBuff, int max)
+{
+    return getDeviceReading(0, inBuff, max);
+}
+
+int getDeviceReading(int device, double *inBuff, int max)
+{
+    specFrame frame = {0};
+    int n;
+
+    if (!inited) {
+        if (Hardware_Init() != 0) {
+            printf("Init failure at getSpectrometerReading()\n");
+            return -1;
+        }
+    }
+    if (device < 0 || device >= numDevices) {
+        return -1;
+    }
+
+    if (readDevice(&devices[device], &frame, 0) != 0) {
+        freeSpecFrames(&frame, 1);
+        return -1;
+    }
+    n = frame.numPixels < max ? frame.numPixels : max;
+    memcpy(inBuff, frame.spectrum, n * sizeof (double));
+    freeSpecFrames(&frame, 1);
+    return n;
+}
+
+int acquireSpectra(int deviceMask, specFrame *frames)
+{
+    return acquire(deviceMask, frames, 0);
+}
+
+int acquireRawSpectra(int deviceMask, specFrame *frames)
+{
+    return acquire(deviceMask, frames, 1);
+}
+
+static int acquire(int deviceMask, specFrame *frames, int raw)
+{
+    int d, n = 0;
+
+    if (!inited) {
+        if (Hardware_Init() != 0) {
+            printf("Init failure at acquireSpectra()\n");
+            return -1;
+        }
+    }
+    if (deviceMask == 0) {
+        deviceMask = 1;
+    }
+
+    //one set of frames at a time; the workers each hold one request
+    pthread_mutex_lock(&acquireCallLock);
+    pthread_mutex_lock(&acquireLock);
+    for (d = 0; d < numDevices; d++) {
+        if (deviceMask & (1 << d)) {
+            devices[d].frame = &frames[n++];
+            devices[d].wantRaw = raw;
+            devices[d].requested = 1;
+            acquisitionsPending++;
+            pthread_cond_signal(&devices[d].wake);
+        }
+    }
+    while (acquisitionsPending) {
+        pthread_cond_wait(&acquireDone, &acquireLock);
+    }
+    pthread_mutex_unlock(&acquireLock);
+    pthread_mutex_unlock(&acquireCallLock);
+
+    return n;
+}
+
+void freeSpecFrames(specFrame *frames, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(frames[i].spectrum);
+        free(frames[i].counts);
+        frames[i].spectrum = NULL;
+        frames[i].counts = NULL;
+        frames[i].capacity = 0;
+        frames[i].countCapacity = 0;
+        frames[i].numPixels = 0;
+    }
+}
+
+int getNumSpectrometers()
+{
+    return numDevices;
+}
+
+int getSpectrometerWavelengthArray(double *wavelengths, int max) {
+    return getDeviceWavelengthArray(0, wavelengths, max);
+}
+
+int getDeviceWavelengthArray(int device, double *wavelengths, int max) {
+    int n;
+
+    if (!inited) {
+        if (Hardware_Init() != 0) {
+            printf("Init failure at getSpectrometerWavelengthArray()\n");
+            return -1;
+        }
+    }
+    if (device < 0 || device >= MAX_SPECTROMETERS) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&devices[device].lock);
+    n = devices[device].info.numPixels < max ? devices[device].info.numPixels : max;
+    if (n > 0) {
+	    memcpy(wavelengths, devices[device].wavelengths, n * sizeof (double));
+    }
+    pthread_mutex_unlock(&devices[device].lock);
+	return n;
+}
+
+int getDeviceNumPixels(int device)
+{
+    int n;
+
+    if (device < 0 || device >= MAX_SPECTROMETERS) {
+        return 0;
+    }
+    pthread_mutex_lock(&devices[device].lock);
+    n = devices[device].info.numPixels;
+    pthread_mutex_unlock(&devices[device].lock);
+    return n;
+}
+
+specDeviceInfo getSpectrometerInfo()
+{
+    return getDeviceInfo(0);
+}
+
+specDeviceInfo getDeviceInfo(int device)
+{
+    specDeviceInfo info = {"none", "none", 0};
+
+    if (device < 0 || device >= MAX_SPECTROMETERS) {
+        return info;
+    }
+    pthread_mutex_lock(&devices[device].lock);
+    info = devices[device].info;
+    pthread_mutex_unlock(&devices[device].lock);
+    return info;
+}
+
+int getSpecConnectionState()
+{
+    return getDeviceConnectionState(0);
+}
+
+int getDeviceConnectionState(int device)
+{
+    if (device < 0 || device >= MAX_SPECTROMETERS) {
+        return SPEC_ABSENT;
+    }
+    return devices[device].state;
+}
+
+void setSpecConnectionCallback(void (*callback)(int device, int state))
+{
+    connectionCallback = callback;
+}
+
+/*supervisorThread
+ * Watches every spectrometer slot for the life of the process. Connected
+ * devices get poked every SUPERVISOR_PERIOD; lost ones (and empty slots,
+ * so a hot-plugged device gets picked up) get an open attempt, backing
+ * off up to RECONNECT_MAX_BACKOFF between attempts.
+ */
+PI_THREAD(supervisorThread)
+{
+    int d, err;
+    char serial[64];
+
+    while (1) {
+        delay(RECONNECT_MIN_BACKOFF);
+
+        for (d = 0; d < MAX_SPECTROMETERS; d++) {
+            specDevice *dev = &devices[d];
+
+            if ((int) (millis() - dev->nextCheck) < 0) {
+                continue;
+            }
+
+            if (dev->state == SPEC_CONNECTED) {
+                dev->nextCheck = millis() + SUPERVISOR_PERIOD;
+
+                //somebody mid-acquisition means the device is clearly alive
+                if (pthread_mutex_trylock(&dev->lock) != 0) {
+                    continue;
+                }
+                err = 0;
+                seabreeze_get_serial_number(dev->index, &err, serial, sizeof (serial));
+                if (!err && !dev->calibrationChecked) {
+                    checkCalibration(dev);
+                }
+                pthread_mutex_unlock(&dev->lock);
+
+                if (err) {
+                    printf("Spectrometer %i stopped answering.\n", d);
+                    setSpecState(dev, SPEC_RECONNECTING);
+                }
+                dev->backoff = RECONNECT_MIN_BACKOFF;
+                continue;
+            }
+
+            pthread_mutex_lock(&dev->lock);
+            if (dev->state == SPEC_RECONNECTING) {
+                //drop the dead handle before trying again
+                seabreeze_close_spectrometer(dev->index, &err);
+            }
+            err = openSpectrometer(dev);
+            pthread_mutex_unlock(&dev->lock);
+
+            if (err == 0) {
+                printf("Spectrometer %i (%s) connected.\n", d, dev->info.serialNumber);
+                setSpecState(dev, SPEC_CONNECTED);
+                dev->backoff = RECONNECT_MIN_BACKOFF;
+                dev->nextCheck = millis() + SUPERVISOR_PERIOD;
+            } else {
+                dev->nextCheck = millis() + dev->backoff;
+                dev->backoff *= 2;
+                if (dev->backoff > RECONNECT_MAX_BACKOFF) {
+                    dev->backoff = RECONNECT_MAX_BACKOFF;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+
+
+int getPressureReading()
+{
+    int reading;
+
+    if (!inited) {
+        if (Hardware_Init()) {
+            printf("Init failure at getPressureReading\n");
+            return -1;
+        }
+    }
+
+    if (sessionReplaying()) {
+        return sessionReplayPressure();
+    }
+
+    if (adcConnected) {
+        reading = analogRead(BASE);
+        sessionRecordPressure(reading);
+        return reading;
+    } else {
+        return 777;
+    }
+
+
+}
+
+void motor_ON()
+{
+    if (!inited) {
+        if (Hardware_Init()) {
+            printf("Bad Times at motor ON");
+            exit(-1);
+        }
+    }
+    pwmWrite(PWM_PIN, 540);
+}
+
+void motor_OFF()
+{
+    if (!inited) {
+        if (Hardware_Init()) {
+            printf("Bad Times at motor OFF");
+            exit(-1);
+        }
+    }
+    pwmWrite(PWM_PIN, 0);
+}
+
+void led_ON()
+{
+    if (!inited) {
+        if (Hardware_Init()) {
+            printf("Bad Times at LED_ON");
+            exit(-1);
+        }
+    }
+    digitalWrite(LED_PIN, 1);
+}
+
+void led_OFF()
+{
+    if (!inited) {
+        if (Hardware_Init()) {
+            printf("Bad Times at LED_OFF");
+            exit(-1);
+        }
+    }
+    digitalWrite(LED_PIN, 0);
+}
+
+int endSession()
+{
+    int d, err = 0;
+
+    printf("Closing...");
+    for (d = 0; d < numDevices; d++) {
+        pthread_mutex_lock(&devices[d].lock);
+        if (devices[d].state == SPEC_CONNECTED) {
+            seabreeze_close_spectrometer(devices[d].index, &devices[d].errorCode);
+            if (devices[d].errorCode) {
+                printf("Unable to close spectrometer %i.\n", d);
+                err = 1;
+            }
+        }
+        pthread_mutex_unlock(&devices[d].lock);
+    }
+    if (err) {
+        return 1;
+    }
+
+    inited = 0;
+    return 0;
+}
+
+static int Hardware_Init()
+{
+    static int devicesCreated = 0;
+    int d, opened[MAX_SPECTROMETERS];
+    pthread_t worker;
+
+    //one context (and one acquisition thread) per slot, made just once
+    if (!devicesCreated) {
+        for (d = 0; d < MAX_SPECTROMETERS; d++) {
+            devices[d].index = d;
+            devices[d].state = SPEC_ABSENT;
+            devices[d].backoff = RECONNECT_MIN_BACKOFF;
+            pthread_mutex_init(&devices[d].lock, NULL);
+            pthread_cond_init(&devices[d].wake, NULL);
+            strcpy(devices[d].info.serialNumber, "none");
+            strcpy(devices[d].info.model, "none");
+            if (pthread_create(&worker, NULL, acquisitionWorker, &devices[d])) {
+                printf("pi thread failed somehow!\n");
+                return 1;
+            }
+            pthread_detach(worker);
+        }
+        devicesCreated = 1;
+    }
+
+    //try to open every spec and set flags accordingly
+    for (d = 0; d < MAX_SPECTROMETERS; d++) {
+        specDevice *dev = &devices[d];
+
+        opened[d] = 0;
+        printf("Opening spectrometer %i...", d);
+        pthread_mutex_lock(&dev->lock);
+        if (sessionReplaying()) {
+            //the recording stands in for the hardware
+            if (dev->state != SPEC_CONNECTED && loadReplayedDevice(dev) == 0) {
+                opened[d] = 1;
+            } else {
+                printf("none.\n");
+            }
+        } else if (dev->state != SPEC_CONNECTED) {
+            if (openSpectrometer(dev) == 0) {
+                opened[d] = 1;
+            } else if (d == 0 && dev->state == SPEC_ABSENT) {
+                printf("no device connected; applying defaults\n");
+                loadSimulatedCalibration(dev);
+            } else {
+                printf("none.\n");
+            }
+        }
+        pthread_mutex_unlock(&dev->lock);
+    }
+
+    //the callback may want the device info, so publish outside the lock
+    for (d = 0; d < MAX_SPECTROMETERS; d++) {
+        if (opened[d]) {
+            setSpecState(&devices[d], SPEC_CONNECTED);
+        }
+    }
+
+    //from here on the supervisor looks after the spectrometers
+    //(replayed ones can't come and go)
+    if (!supervisorStarted && !sessionReplaying()) {
+        if (piThreadCreate(supervisorThread)) {
+            printf("pi thread failed somehow!\n");
+            return 1;
+        }
+        supervisorStarted = 1;
+    }
+
+    //try to do other hardware
+    printf("Initializing wiringPi, PWM and ADC...");
+    if (wiringPiSetup() == -1) {
+		printf("failed at wiringpi setup!\n");	
+        return -1;
+    }
+    //BASE sets the new pin base.
+    //From digging through wiringpi source, mcp3004 setup returns TRUE
+    //when it sets up successfully. This is unfortunately opposite of 
+    //the convention i have been using.
+
+
+
+
+    if (mcp3004Setup(BASE, SPI_CHAN)) {
+        adcConnected = TRUE;
+        printf("ADC appears connected.\n");
+    } else {
+        adcConnected = FALSE;
+        printf("no ADC found.\n");
+    }
+
+    //DISABLE ANALOG READINGS FOR DEBUG:
+    //adcConnected = FALSE;
+
+    //set this pin up as PWM
+    pinMode(PWM_PIN, PWM_OUTPUT);
+    pinMode(LED_PIN, OUTPUT);
+
+
+
+    printf("done.\n");
+    inited = 1;
+    printf("now inited.\n");
+    return 0;
+}
+
+//one reading from one device into frame, filters applied (or raw counts,
+//untouched). timestamp is set to the middle of the integration so frames
+//from different devices line up
+static int readDevice(specDevice *d, specFrame *frame, int raw)
+{
+    unsigned int start;
+    int i, n;
+
+    frame->numPixels = 0;
+    frame->raw = raw;
+
+    //the device went away and the supervisor is on it. don't wait around.
+    //empty slots other than 0 have nothing to simulate either
+    if (d->state == SPEC_RECONNECTING || (d->state == SPEC_ABSENT && d->index != 0)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&d->lock);
+
+    n = d->info.numPixels;
+    if (n <= 0 || (raw ? reserveCounts(frame, n) : reserveFrame(frame, n)) != 0) {
+        pthread_mutex_unlock(&d->lock);
+        return -1;
+    }
+
+    if (sessionReplaying()) {
+        //whatever the recording has next for this device
+        n = sessionReplayFrame(d->index, d->spectrumArray, n, &frame->timestamp);
+        if (n <= 0) {
+            pthread_mutex_unlock(&d->lock);
+            return -1;
+        }
+    } else if (raw && d->state == SPEC_CONNECTED && d->rawLength) {
+        return readRawCounts(d, frame);
+    } else {
+        //default to this parabola to provide a peak of some sort
+        for (i = 0; i < n; i++) {
+            d->spectrumArray[i] = -.1* (((i - 800)) * ((i - 800))) + 200;
+        }
+
+        start = millis();
+        d->errorCode = 0;
+        if (d->state == SPEC_CONNECTED) {
+            seabreeze_get_formatted_spectrum(d->index, &d->errorCode, d->spectrumArray, n);
+        }
+        frame->timestamp = start + (millis() - start) / 2;
+        if (!d->errorCode) {
+            sessionRecordFrame(d->index, d->spectrumArray, n);
+        }
+    }
+
+    if (raw) {
+        //no raw data to be had from this one, so make counts of the formatted
+        //spectrum; it's still 16-bit from here on
+        spectrumCountsFromDoubles(d->spectrumArray, frame->counts, n);
+    } else {
+        //spectrumArray is only scratch now, so the chain can use it between passes
+        filterChainApply(&activeFilters, d->spectrumArray, frame->spectrum, n);
+    }
+    frame->numPixels = n;
+
+    if (d->errorCode) {
+        pthread_mutex_unlock(&d->lock);
+        printf("Error: problem getting spectrum from device %i\n", d->index);
+        setSpecState(d, SPEC_RECONNECTING);
+        return -1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+//the raw half of readDevice: counts straight off the detector. called
+//with d->lock held, and releases it
+static int readRawCounts(specDevice *d, specFrame *frame)
+{
+    unsigned int start;
+
+    if (!d->rawBuffer) {
+        d->rawBuffer = malloc(d->rawLength);
+        if (!d->rawBuffer) {
+            pthread_mutex_unlock(&d->lock);
+            printf("we didnt get the memory for a raw spectrum\n");
+            return -1;
+        }
+    }
+
+    start = millis();
+    d->errorCode = 0;
+    seabreeze_get_unformatted_spectrum(d->index, &d->errorCode, d->rawBuffer, d->rawLength);
+    frame->timestamp = start + (millis() - start) / 2;
+
+    if (d->errorCode) {
+        pthread_mutex_unlock(&d->lock);
+        printf("Error: problem getting spectrum from device %i\n", d->index);
+        setSpecState(d, SPEC_RECONNECTING);
+        return -1;
+    }
+
+    //little-endian uint16s, same as us
+    memcpy(frame->counts, d->rawBuffer, d->rawLength);
+    frame->numPixels = d->info.numPixels;
+    sessionRecordCounts(d->index, frame->counts, frame->numPixels);
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+//(re)size a device's arrays for a new pixel count. caller holds d->lock
+static int resizeDevice(specDevice *d, int numPixels)
+{
+    double *wavelengths, *spectrum;
+
+    if (numPixels > d->capacity) {
+        wavelengths = realloc(d->wavelengths, numPixels * sizeof (double));
+        if (wavelengths) {
+            d->wavelengths = wavelengths;
+        }
+        spectrum = realloc(d->spectrumArray, numPixels * sizeof (double));
+        if (spectrum) {
+            d->spectrumArray = spectrum;
+        }
+        if (!wavelengths || !spectrum) {
+            printf("we didnt get the memory for %i pixels\n", numPixels);
+            d->info.numPixels = 0;
+            return -1;
+        }
+        d->capacity = numPixels;
+    }
+    d->info.numPixels = numPixels;
+    return 0;
+}
+
+//...and the same for raw counts
+static int reserveCounts(specFrame *frame, int numPixels)
+{
+    unsigned short *counts;
+
+    if (numPixels > frame->countCapacity) {
+        counts = realloc(frame->counts, numPixels * sizeof (unsigned short));
+        if (!counts) {
+            printf("we didnt get the memory for a frame\n");
+            return -1;
+        }
+        frame->counts = counts;
+        frame->countCapacity = numPixels;
+    }
+    return 0;
+}
+
+//make sure a caller's frame can hold numPixels readings
+static int reserveFrame(specFrame *frame, int numPixels)
+{
+    double *spectrum;
+
+    if (numPixels > frame->capacity) {
+        spectrum = realloc(frame->spectrum, numPixels * sizeof (double));
+        if (!spectrum) {
+            printf("we didnt get the memory for a frame\n");
+            return -1;
+        }
+        frame->spectrum = spectrum;
+        frame->capacity = numPixels;
+    }
+    return 0;
+}
+
+//each device gets one of these, so a set of frames is read in parallel
+static void *acquisitionWorker(void *arg)
+{
+    specDevice *d = arg;
+    specFrame *frame;
+
+    pthread_mutex_lock(&acquireLock);
+    while (1) {
+        while (!d->requested) {
+            pthread_cond_wait(&d->wake, &acquireLock);
+        }
+        frame = d->frame;
+        pthread_mutex_unlock(&acquireLock);
+
+        frame->device = d->index;
+        frame->status = readDevice(d, frame, d->wantRaw);
+
+        pthread_mutex_lock(&acquireLock);
+        d->requested = 0;
+        acquisitionsPending--;
+        pthread_cond_broadcast(&acquireDone);
+    }
+    return NULL;
+}
+
+//opens the device, reapplies thisSpec and (re)loads the calibration.
+//used for the first open and by the supervisor. caller holds d->lock
+static int openSpectrometer(specDevice *d)
+{
+    d->errorCode = 0;
+    seabreeze_open_spectrometer(d->index, &d->errorCode);
+    if (d->errorCode) {
+        return d->errorCode;
+    }
+
+    //pull the calibration now, so the first experiment doesn't have to.
+    //a reconnect may well be a different device, so always reload it
+    if (loadDeviceCalibration(d) != 0) {
+        printf("Unable to read wavelength calibration.\n");
+        seabreeze_close_spectrometer(d->index, &d->errorCode);
+        return -1;
+    }
+
+    //in whole ms, rounded up
+    d->minIntegration = (seabreeze_get_min_integration_time_microsec(d->index, &d->errorCode) + MILLISEC_TO_MICROSEC - 1) / MILLISEC_TO_MICROSEC;
+    if (d->errorCode || d->minIntegration < 1) {
+        d->errorCode = 0;
+        d->minIntegration = 1;
+    }
+
+    printf("Setting integration time to %i ms...", thisSpec.integrationTime);
+    seabreeze_set_integration_time_microsec(d->index, &d->errorCode, thisSpec.integrationTime * MILLISEC_TO_MICROSEC);
+    if (d->errorCode) {
+        printf("Unable to set integration time.\n");
+        seabreeze_close_spectrometer(d->index, &d->errorCode);
+        return -1;
+    }
+    printf("done.\n");
+    return 0;
+}
+
+//publish a connection change to whoever asked to hear about it
+static void setSpecState(specDevice *d, int state)
+{
+    if (state == d->state) {
+        return;
+    }
+    d->state = state;
+    if (state == SPEC_CONNECTED && d->index >= numDevices) {
+        numDevices = d->index + 1;
+    }
+    if (state == SPEC_CONNECTED) {
+        //a recording has to know what it was reading from
+        sessionRecordDevice(d->index);
+    }
+
+    if (connectionCallback) {
+        connectionCallback(d->index, state);
+    }
+}
+
+//a slot of the recording being replayed, in place of a real device.
+//caller holds d->lock
+static int loadReplayedDevice(specDevice *d)
+{
+    specDeviceInfo info;
+    int n = sessionReplayDevice(d->index, &info, NULL, 0);
+
+    if (n <= 0 || resizeDevice(d, n) != 0) {
+        return -1;
+    }
+    sessionReplayDevice(d->index, &d->info, d->wavelengths, n);
+    d->rawLength = 0;
+    printf("replaying %s (%i pixels)\n", d->info.serialNumber, n);
+    return 0;
+}
+
+//with no device we fall back to pixel numbers for wavelengths
+static void loadSimulatedCalibration(specDevice *d)
+{
+    int i;
+
+    strcpy(d->info.serialNumber, "none");
+    strcpy(d->info.model, "simulated");
+    if (resizeDevice(d, DEFAULT_PIXELS) != 0) {
+        return;
+    }
+    for (i = 0; i < DEFAULT_PIXELS; i++) {
+        d->wavelengths[i] = i;
+    }
+}
+
+//fills info and wavelengths. The calibration is read from the device
+//once per serial number and then kept in CALIBRATION_DIR; a cached one
+//is used straight away and checked against the device later by the
+//supervisor, so a recalibrated EEPROM replaces it
+static int loadDeviceCalibration(specDevice *d)
+{
+    char path[256];
+    int numPixels;
+
+    seabreeze_get_serial_number(d->index, &d->errorCode, d->info.serialNumber, sizeof (d->info.serialNumber));
+    if (d->errorCode) {
+        return d->errorCode;
+    }
+    seabreeze_get_model(d->index, &d->errorCode, d->info.model, sizeof (d->info.model));
+    if (d->errorCode) {
+        strcpy(d->info.model, "unknown");
+        d->errorCode = 0;
+    }
+
+    //everything downstream is sized from this
+    numPixels = seabreeze_get_formatted_spectrum_length(d->index, &d->errorCode);
+    if (d->errorCode || numPixels <= 0 || numPixels > MAX_PIXELS) {
+        printf("%s didn't give a sensible pixel count; assuming %i\n", d->info.serialNumber, DEFAULT_PIXELS);
+        numPixels = DEFAULT_PIXELS;
+        d->errorCode = 0;
+    }
+    if (resizeDevice(d, numPixels) != 0) {
+        return -1;
+    }
+
+    //raw mode reads the unformatted spectrum directly, but only where
+    //that is plainly one count per pixel
+    d->rawLength = seabreeze_get_unformatted_spectrum_length(d->index, &d->errorCode);
+    if (d->errorCode || d->rawLength != numPixels * (int) sizeof (unsigned short)) {
+        d->rawLength = 0;
+        d->errorCode = 0;
+    }
+    free(d->rawBuffer);
+    d->rawBuffer = NULL;
+
+    sprintf(path, "%s/%s.cal", CALIBRATION_DIR, d->info.serialNumber);
+    if (readCalibrationFile(d, path) == 0) {
+        printf("loaded cached calibration for %s %s\n", d->info.model, d->info.serialNumber);
+        d->calibrationChecked = 0;
+        return 0;
+    }
+
+    printf("no cached calibration for %s; asking the device...", d->info.serialNumber);
+    seabreeze_get_wavelengths(d->index, &d->errorCode, d->wavelengths, d->info.numPixels);
+    if (d->errorCode) {
+        return d->errorCode;
+    }
+    writeCalibrationFile(d, path);
+    d->calibrationChecked = 1;
+    printf("done.\n");
+    return 0;
+}
+
+//reads the calibration off the device and, if it no longer matches the
+//cached one, takes the device's and rewrites the cache. caller holds d->lock
+static void checkCalibration(specDevice *d)
+{
+    char path[256];
+    double *fresh = malloc(d->info.numPixels * sizeof (double));
+    int i, changed = 0;
+
+    if (!fresh) {
+        return;
+    }
+    d->errorCode = 0;
+    seabreeze_get_wavelengths(d->index, &d->errorCode, fresh, d->info.numPixels);
+    if (d->errorCode) {
+        //try again next time round
+        d->errorCode = 0;
+        free(fresh);
+        return;
+    }
+    for (i = 0; i < d->info.numPixels; i++) {
+        if (fabs(fresh[i] - d->wavelengths[i]) > CALIBRATION_TOLERANCE) {
+            changed = 1;
+        }
+    }
+    if (changed) {
+        printf("calibration of %s has changed on the device; replacing the cached one\n", d->info.serialNumber);
+        memcpy(d->wavelengths, fresh, d->info.numPixels * sizeof (double));
+        sprintf(path, "%s/%s.cal", CALIBRATION_DIR, d->info.serialNumber);
+        writeCalibrationFile(d, path);
+    }
+    d->calibrationChecked = 1;
+    free(fresh);
+}
+
+//calibration file: model on a line of its own, then pixel count, then one
+//wavelength per line. It only counts if the model and pixel count match
+static int readCalibrationFile(specDevice *d, char *path)
+{
+    FILE *f = fopen(path, "r");
+    char model[sizeof (d->info.model) + 2];
+    int i, numPixels;
+
+    if (!f) {
+        return -1;
+    }
+    if (!fgets(model, sizeof (model), f)) {
+        fclose(f);
+        return -1;
+    }
+    model[strcspn(model, "\r\n")] = '\0';
+    if (strcmp(model, d->info.model) != 0
+        || fscanf(f, "%i", &numPixels) != 1 || numPixels != d->info.numPixels) {
+        fclose(f);
+        return -1;
+    }
+    for (i = 0; i < numPixels; i++) {
+        if (fscanf(f, "%lf", &d->wavelengths[i]) != 1) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static void writeCalibrationFile(specDevice *d, char *path)
+{
+    FILE *f;
+    int i;
+
+    mkdir(CALIBRATION_DIR, 0755);
+    f = fopen(path, "w");
+    if (!f) {
+        printf("could not cache calibration at %s\n", path);
+        return;
+    }
+    fprintf(f, "%s\n%i\n", d->info.model, d->info.numPixels);
+    for (i = 0; i < d->info.numPixels; i++) {
+        fprintf(f, "%.6f\n", d->wavelengths[i]);
+    }
+    fclose(f);
+}
+
+int boxcarAverage(int width, double *inputArray, double *outputArray, int numElements)
+{
+    if (width < 0) {
+        printf("Boxcar width must be an integer betwwen 0 and 16. Defaulting to 0.\n");
+        width = 0;
+    }
+    if (width > 16) {
+        printf("Boxcar width must be an integer betwwen 0 and 16. Defaulting to 16.\n");
+        width = 16;
+    }
+    if (width > 1) {
+        printf("applying boxcar width %i\n", width);
+    }
+
+    //a running sum, so the width costs nothing
+    spectrumBoxcar(width, inputArray, outputArray, numElements);
+    return 1;
+}
+
+void printSpecSettings(specSettings in)
+{
+    printf("\n print spec settings \n");
+    printf(" ===================\n");
+    printf("Doctor           = %s\n", in.doctorName);
+    printf("Patient          = %s\n", in.patientName);
+    printf("Timestamp        = %s\n", in.timestamp);
+    printf("numScans         = %i\n", in.numScans);
+    printf("timeBetweenScans = %i\n", in.timeBetweenScans);
+    printf("integrationTime  = %i\n", in.integrationTime);
+    printf("boxcarWidth      = %i\n", in.boxcarWidth);
+    printf("avgPerScan       = %i\n", in.avgPerScan);
+    printf("deviceMask       = %i\n", in.deviceMask);
+    printf("scansPerSync     = %i\n", in.scansPerSync);
+    printf("rawMode          = %i\n", in.rawMode);
+    printf("autoExposure     = %i\n", in.autoExposure);
+    printf("precision        = %g\n", in.precision);
+    printf("minReads         = %i\n", in.minReads);
+    printf("shiftMethod      = %s\n", in.shiftMethod == SHIFT_FIT ? "fit" : "xcorr");
+    printf("baselineMethod   = %s\n", in.baselineMethod == BASELINE_ALS ? "als"
+                                     : in.baselineMethod == BASELINE_ARPLS ? "arpls" : "off");
+    printf("baselineLambda   = %g\n", in.baselineLambda);
+    printf("filters          = %s\n\n", in.filters[0] ? in.filters : "none");
+}
+
+
+
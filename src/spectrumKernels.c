@@ -0,0 +1,370 @@
+/* spectrumKernels.c
+ * Pixel loops, specialised for the common detector sizes.
+ *
+ * Each kernel body is an always-inline function of n. The public
+ * function calls it once per known size with n as a literal, so each
+ * case gets its own fully constant copy, and once with the real n as
+ * the fallback. Built with -O2 (see the Makefile), or none of this
+ * buys anything.
+ */
+#include <string.h>
+
+#include "../include/spectrumKernels.h"
+
+#define KERNEL static inline __attribute__((always_inline))
+
+//call CALL(n) with n pinned to a constant for the sizes we know
+#define SPECIALISE(n)               \
+    switch (n) {                    \
+    case 1024: CALL(1024); break;   \
+    case 2048: CALL(2048); break;   \
+    case 3648: CALL(3648); break;   \
+    default: CALL(n); break;        \
+    }
+
+
+KERNEL void boxcarBody(int width, const double *restrict in, double *restrict out, int n)
+{
+    int i, left = width / 2, right = width - left - 1;
+    double sum = 0;
+
+    //window for pixel i is [i - left, i + right], indices clamped to the ends
+    for (i = -left; i <= right; i++) {
+        sum += in[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+    }
+    for (i = 0; i < n; i++) {
+        int drop = i - left, add = i + right + 1;
+
+        out[i] = sum / width;
+        sum -= in[drop < 0 ? 0 : drop];
+        sum += in[add >= n ? n - 1 : add];
+    }
+}
+
+void spectrumBoxcar(int width, const double *in, double *out, int n)
+{
+    if (width <= 1) {
+        memcpy(out, in, n * sizeof (double));
+        return;
+    }
+#define CALL(N) boxcarBody(width, in, out, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+KERNEL void convolveBody(const double *restrict taps, int left, int count,
+                         const double *restrict in, double *restrict out, int n)
+{
+    int i, j, k, start = left < n ? left : n, end = n - (count - left - 1);
+    double sum;
+
+    if (end < start) {
+        end = start;
+    }
+    for (i = start; i < end; i++) {
+        out[i] = 0;
+    }
+    for (j = 0; j < count; j++) {
+        const double t = taps[j];
+        for (i = start; i < end; i++) {
+            out[i] += t * in[i - left + j];
+        }
+    }
+
+    //the ends, where the window runs off the detector
+    for (i = 0; i < n; i++) {
+        if (i >= start && i < end) {
+            i = end - 1;
+            continue;
+        }
+        sum = 0;
+        for (j = 0; j < count; j++) {
+            k = i - left + j;
+            sum += taps[j] * in[k < 0 ? 0 : (k >= n ? n - 1 : k)];
+        }
+        out[i] = sum;
+    }
+}
+
+void spectrumConvolve(const double *taps, int left, int count, const double *in, double *out, int n)
+{
+#define CALL(N) convolveBody(taps, left, count, in, out, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+KERNEL void medianBody(int width, const double *restrict in, double *restrict out, int n)
+{
+    int i, j, left = width / 2, right = width - left - 1;
+    double window[width], v;
+
+    //sorted by insertion as it is filled
+    for (i = -left; i <= right; i++) {
+        v = in[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+        for (j = i + left; j > 0 && window[j - 1] > v; j--) {
+            window[j] = window[j - 1];
+        }
+        window[j] = v;
+    }
+    for (i = 0; i < n; i++) {
+        int drop = i - left, add = i + right + 1;
+
+        out[i] = (window[(width - 1) / 2] + window[width / 2]) / 2;
+
+        //take the oldest reading out and slide the newest into its place
+        v = in[drop < 0 ? 0 : drop];
+        for (j = 0; j < width - 1 && window[j] != v; j++) {
+        }
+        v = in[add >= n ? n - 1 : add];
+        for (; j > 0 && window[j - 1] > v; j--) {
+            window[j] = window[j - 1];
+        }
+        for (; j < width - 1 && window[j + 1] < v; j++) {
+            window[j] = window[j + 1];
+        }
+        window[j] = v;
+    }
+}
+
+void spectrumMedian(int width, const double *in, double *out, int n)
+{
+    if (width <= 1) {
+        memcpy(out, in, n * sizeof (double));
+        return;
+    }
+#define CALL(N) medianBody(width, in, out, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+KERNEL void accumulateBody(double *restrict sum, const double *restrict in, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sum[i] += in[i];
+    }
+}
+
+void spectrumAccumulate(double *sum, const double *in, int n)
+{
+#define CALL(N) accumulateBody(sum, in, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+KERNEL void scaleBody(double *data, double factor, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        data[i] *= factor;
+    }
+}
+
+void spectrumScale(double *data, double factor, int n)
+{
+#define CALL(N) scaleBody(data, factor, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+KERNEL void accumulateCountsBody(unsigned int *restrict sum, const unsigned short *restrict counts, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sum[i] += counts[i];
+    }
+}
+
+void spectrumAccumulateCounts(unsigned int *sum, const unsigned short *counts, int n)
+{
+#define CALL(N) accumulateCountsBody(sum, counts, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+KERNEL void accumulateSquaresBody(double *restrict sumSquares, const double *restrict in, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sumSquares[i] += in[i] * in[i];
+    }
+}
+
+void spectrumAccumulateSquares(double *sumSquares, const double *in, int n)
+{
+#define CALL(N) accumulateSquaresBody(sumSquares, in, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+KERNEL void accumulateCountSquaresBody(double *restrict sumSquares, const unsigned short *restrict counts, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sumSquares[i] += (double) counts[i] * counts[i];
+    }
+}
+
+void spectrumAccumulateCountSquares(double *sumSquares, const unsigned short *counts, int n)
+{
+#define CALL(N) accumulateCountSquaresBody(sumSquares, counts, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+//sample variance from the sum and sum of squares of reads readings
+KERNEL double worstVarianceBody(const double *sum, const double *sumSquares, int reads, int n)
+{
+    int i;
+    double v, worst = 0;
+
+    for (i = 0; i < n; i++) {
+        v = sumSquares[i] - sum[i] * sum[i] / reads;
+        if (v > worst) {
+            worst = v;
+        }
+    }
+    return worst / (reads - 1);
+}
+
+double spectrumWorstVariance(const double *sum, const double *sumSquares, int reads, int n)
+{
+    double worst = 0;
+
+    if (reads < 2) {
+        return -1;
+    }
+#define CALL(N) worst = worstVarianceBody(sum, sumSquares, reads, N)
+    SPECIALISE(n)
+#undef CALL
+    return worst;
+}
+
+
+KERNEL double worstCountVarianceBody(const unsigned int *sum, const double *sumSquares, int reads, int n)
+{
+    int i;
+    double v, worst = 0;
+
+    for (i = 0; i < n; i++) {
+        v = sumSquares[i] - (double) sum[i] * sum[i] / reads;
+        if (v > worst) {
+            worst = v;
+        }
+    }
+    return worst / (reads - 1);
+}
+
+double spectrumWorstCountVariance(const unsigned int *sum, const double *sumSquares, int reads, int n)
+{
+    double worst = 0;
+
+    if (reads < 2) {
+        return -1;
+    }
+#define CALL(N) worst = worstCountVarianceBody(sum, sumSquares, reads, N)
+    SPECIALISE(n)
+#undef CALL
+    return worst;
+}
+
+
+KERNEL void countsFromDoublesBody(const double *restrict in, unsigned short *restrict out, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = in[i] <= 0 ? 0 : (in[i] >= 65535 ? 65535 : (unsigned short) (in[i] + 0.5));
+    }
+}
+
+void spectrumCountsFromDoubles(const double *in, unsigned short *out, int n)
+{
+#define CALL(N) countsFromDoublesBody(in, out, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+KERNEL void sumsToDoublesBody(const unsigned int *restrict sums, double scale, double *restrict out, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = sums[i] * scale;
+    }
+}
+
+void spectrumSumsToDoubles(const unsigned int *sums, double scale, double *out, int n)
+{
+#define CALL(N) sumsToDoublesBody(sums, scale, out, N)
+    SPECIALISE(n)
+#undef CALL
+}
+
+
+KERNEL int peakBody(const double *in, int n, double *minimum)
+{
+    int i, peakIndex = 0;
+    double peak = in[0], low = in[0];
+
+    for (i = 1; i < n; i++) {
+        if (in[i] > peak) {
+            peak = in[i];
+            peakIndex = i;
+        }
+        if (in[i] < low) {
+            low = in[i];
+        }
+    }
+    if (minimum) {
+        *minimum = low;
+    }
+    return peakIndex;
+}
+
+int spectrumPeakIndex(const double *in, int n, double *minimum)
+{
+    int index = 0;
+
+    if (n <= 0) {
+        return 0;
+    }
+#define CALL(N) index = peakBody(in, N, minimum)
+    SPECIALISE(n)
+#undef CALL
+    return index;
+}
+
+
+KERNEL void encodeBody(const double *restrict in, unsigned char *restrict out, int n)
+{
+    int i;
+    float f;
+
+    //the Pi is little-endian, so a float's bytes go over as they are
+    for (i = 0; i < n; i++) {
+        f = in[i];
+        memcpy(&out[4 * i], &f, 4);
+    }
+}
+
+void spectrumEncodeFloat32(const double *in, unsigned char *out, int n)
+{
+#define CALL(N) encodeBody(in, out, N)
+    SPECIALISE(n)
+#undef CALL
+}
@@ -0,0 +1,341 @@
+/* spectrumPyramid.c
+ * Builds and reads the level-of-detail file of an experiment.
+ *
+ * Every row written to a level is merged into the row being built on the
+ * level above straight away; when that row has all the rows it covers it
+ * is written out and merged upwards in turn. Rows go to fixed offsets,
+ * so the levels are laid out one after another while being filled in
+ * together.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../include/spectrumPyramid.h"
+
+#define PYRAMID_MAGIC "SPECLOD1"
+#define MAGIC_LENGTH 8
+
+static long headerLength(int numLevels);
+static void layoutLevels(spectrumPyramid *p);
+static void resetRow(pyramidCell *cells, int cols);
+static int emitRow(spectrumPyramid *p, int level);
+static void mergeRow(spectrumPyramid *p, int level, const pyramidCell *cells);
+static int writeAt(int fd, const void *data, long length, long offset);
+
+
+int pyramidCreate(spectrumPyramid *p, const char *path, int rows, int cols)
+{
+    unsigned int header[1 + 2 * PYRAMID_MAX_LEVELS];
+    char tmp[sizeof (p->path) + 8];
+    int k, r = rows, c = cols;
+
+    memset(p, 0, sizeof (*p));
+    p->fd = -1;
+    if (rows <= 0 || cols <= 0) {
+        return -1;
+    }
+
+    //halve each axis until it is small enough, or both are
+    p->levels[0].rows = r;
+    p->levels[0].cols = c;
+    p->numLevels = 1;
+    while ((r > PYRAMID_MIN_SIDE || c > PYRAMID_MIN_SIDE) && p->numLevels < PYRAMID_MAX_LEVELS) {
+        r = r > PYRAMID_MIN_SIDE ? (r + 1) / 2 : r;
+        c = c > PYRAMID_MIN_SIDE ? (c + 1) / 2 : c;
+        p->levels[p->numLevels].rows = r;
+        p->levels[p->numLevels].cols = c;
+        p->numLevels++;
+    }
+    layoutLevels(p);
+
+    //level 0's pending row is just the current row, handed upwards
+    for (k = 0; k < p->numLevels; k++) {
+        p->pending[k] = malloc(p->levels[k].cols * sizeof (pyramidCell));
+        if (!p->pending[k]) {
+            printf("we didnt get the memory for the pyramid\n");
+            pyramidClose(p);
+            return -1;
+        }
+        resetRow(p->pending[k], p->levels[k].cols);
+    }
+    p->values = malloc(3 * cols * sizeof (float));
+    if (!p->values) {
+        printf("we didnt get the memory for the pyramid\n");
+        pyramidClose(p);
+        return -1;
+    }
+
+    snprintf(p->path, sizeof (p->path), "%s", path);
+    sprintf(tmp, "%s.tmp", p->path);
+    p->fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    header[0] = p->numLevels;
+    for (k = 0; k < p->numLevels; k++) {
+        header[1 + 2 * k] = p->levels[k].rows;
+        header[2 + 2 * k] = p->levels[k].cols;
+    }
+    if (p->fd < 0 || writeAt(p->fd, PYRAMID_MAGIC, MAGIC_LENGTH, 0)
+        || writeAt(p->fd, header, (1 + 2 * p->numLevels) * 4, MAGIC_LENGTH)) {
+        printf("could not create pyramid %s\n", tmp);
+        pyramidClose(p);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int pyramidAddBand(spectrumPyramid *p, const double *band, int count)
+{
+    pyramidCell *row = p->pending[0];
+    int r, c, cols = p->levels[0].cols;
+    double v;
+
+    if (p->fd < 0) {
+        return -1;
+    }
+    for (r = 0; r < count && p->written[0] < p->levels[0].rows; r++) {
+        for (c = 0; c < cols; c++) {
+            v = band[c * count + r];
+            row[c].min = row[c].max = v;
+            row[c].sum = isnan(v) ? 0 : v;
+            row[c].count = !isnan(v);
+        }
+        if (emitRow(p, 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int pyramidFinish(spectrumPyramid *p)
+{
+    char tmp[sizeof (p->path) + 8];
+    int k, err = p->fd < 0;
+
+    //the last row of a level with an odd number of rows covers just one
+    for (k = 1; k < p->numLevels && !err; k++) {
+        if (p->merged[k] > 0) {
+            err = emitRow(p, k);
+        }
+    }
+    for (k = 0; k < p->numLevels && !err; k++) {
+        if (p->written[k] != p->levels[k].rows) {
+            printf("pyramid level %i has %i of %i rows\n", k, p->written[k], p->levels[k].rows);
+            err = 1;
+        }
+    }
+    if (!err && fsync(p->fd) != 0) {
+        err = 1;
+    }
+
+    sprintf(tmp, "%s.tmp", p->path);
+    pyramidClose(p);
+    if (err || rename(tmp, p->path) != 0) {
+        printf("could not write pyramid %s\n", p->path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int pyramidOpen(spectrumPyramid *p, const char *path)
+{
+    unsigned int header[1 + 2 * PYRAMID_MAX_LEVELS];
+    char magic[MAGIC_LENGTH];
+    struct stat st;
+    int k;
+
+    memset(p, 0, sizeof (*p));
+    snprintf(p->path, sizeof (p->path), "%s", path);
+    p->fd = open(path, O_RDONLY);
+    if (p->fd < 0) {
+        return -1;
+    }
+    if (pread(p->fd, magic, MAGIC_LENGTH, 0) != MAGIC_LENGTH || memcmp(magic, PYRAMID_MAGIC, MAGIC_LENGTH)
+        || pread(p->fd, header, 4, MAGIC_LENGTH) != 4 || header[0] < 1 || header[0] > PYRAMID_MAX_LEVELS
+        || pread(p->fd, &header[1], 8 * header[0], MAGIC_LENGTH + 4) != (long) (8 * header[0])) {
+        printf("%s is not a pyramid\n", path);
+        pyramidClose(p);
+        return -1;
+    }
+    p->numLevels = header[0];
+    for (k = 0; k < p->numLevels; k++) {
+        p->levels[k].rows = header[1 + 2 * k];
+        p->levels[k].cols = header[2 + 2 * k];
+        if (p->levels[k].rows <= 0 || p->levels[k].cols <= 0) {
+            printf("%s is damaged\n", path);
+            pyramidClose(p);
+            return -1;
+        }
+    }
+    layoutLevels(p);
+
+    k = p->numLevels - 1;
+    if (fstat(p->fd, &st) != 0 || st.st_size < p->levels[k].offset
+        + (long) p->levels[k].rows * p->levels[k].cols * pyramidValuesPerCell(k) * (long) sizeof (float)) {
+        printf("%s is cut short\n", path);
+        pyramidClose(p);
+        return -1;
+    }
+    return 0;
+}
+
+int pyramidChooseLevel(spectrumPyramid *p, int maxRows, int maxCols)
+{
+    int k;
+
+    for (k = 0; k < p->numLevels; k++) {
+        if ((maxRows <= 0 || p->levels[k].rows <= maxRows) && (maxCols <= 0 || p->levels[k].cols <= maxCols)) {
+            return k;
+        }
+    }
+    return p->numLevels - 1;
+}
+
+int pyramidRead(spectrumPyramid *p, int level, int row, int col, int count, int width,
+                float *out, int *rows, int *cols)
+{
+    pyramidLevel *l;
+    int r, n = pyramidValuesPerCell(level);
+    long length;
+
+    *rows = *cols = 0;
+    if (p->fd < 0 || level < 0 || level >= p->numLevels || row < 0 || col < 0) {
+        return -1;
+    }
+    l = &p->levels[level];
+    count = row + count > l->rows ? l->rows - row : count;
+    width = col + width > l->cols ? l->cols - col : width;
+    if (count <= 0 || width <= 0) {
+        return 0;
+    }
+
+    //one pread per row of the window
+    length = (long) width * n * sizeof (float);
+    for (r = 0; r < count; r++) {
+        if (pread(p->fd, &out[(long) r * width * n], length,
+                  l->offset + ((long) (row + r) * l->cols + col) * n * sizeof (float)) != length) {
+            return -1;
+        }
+    }
+    *rows = count;
+    *cols = width;
+    return count * width * n;
+}
+
+int pyramidValuesPerCell(int level)
+{
+    return level == 0 ? 1 : 3;
+}
+
+void pyramidClose(spectrumPyramid *p)
+{
+    int k;
+
+    if (p->fd >= 0) {
+        close(p->fd);
+        p->fd = -1;
+    }
+    for (k = 0; k < PYRAMID_MAX_LEVELS; k++) {
+        free(p->pending[k]);
+        p->pending[k] = NULL;
+    }
+    free(p->values);
+    p->values = NULL;
+}
+
+static long headerLength(int numLevels)
+{
+    return MAGIC_LENGTH + 4 + 8 * numLevels;
+}
+
+//each level's cells start where the one below ends
+static void layoutLevels(spectrumPyramid *p)
+{
+    int k;
+
+    p->levels[0].offset = headerLength(p->numLevels);
+    for (k = 1; k < p->numLevels; k++) {
+        p->levels[k].offset = p->levels[k - 1].offset + (long) p->levels[k - 1].rows
+            * p->levels[k - 1].cols * pyramidValuesPerCell(k - 1) * sizeof (float);
+    }
+}
+
+static void resetRow(pyramidCell *cells, int cols)
+{
+    int c;
+
+    for (c = 0; c < cols; c++) {
+        cells[c].min = INFINITY;
+        cells[c].max = -INFINITY;
+        cells[c].sum = 0;
+        cells[c].count = 0;
+    }
+}
+
+//write a level's pending row, pass it up, and start the next one
+static int emitRow(spectrumPyramid *p, int level)
+{
+    pyramidLevel *l = &p->levels[level];
+    pyramidCell *cells = p->pending[level];
+    int c, n = pyramidValuesPerCell(level);
+    float *v = p->values;
+
+    for (c = 0; c < l->cols; c++) {
+        if (level == 0) {
+            v[c] = cells[c].count ? cells[c].sum : NAN;
+        } else if (cells[c].count) {
+            v[3 * c] = cells[c].min;
+            v[3 * c + 1] = cells[c].max;
+            v[3 * c + 2] = cells[c].sum / cells[c].count;
+        } else {
+            v[3 * c] = v[3 * c + 1] = v[3 * c + 2] = NAN;
+        }
+    }
+    if (writeAt(p->fd, v, (long) l->cols * n * sizeof (float),
+                l->offset + (long) p->written[level] * l->cols * n * sizeof (float))) {
+        return -1;
+    }
+    p->written[level]++;
+
+    if (level + 1 < p->numLevels) {
+        pyramidLevel *up = &p->levels[level + 1];
+        mergeRow(p, level + 1, cells);
+        if (++p->merged[level + 1] == (up->rows < l->rows ? 2 : 1)) {
+            if (emitRow(p, level + 1) != 0) {
+                return -1;
+            }
+        }
+    }
+    p->merged[level] = 0;
+    resetRow(cells, l->cols);
+    return 0;
+}
+
+//fold a row of the level below into this level's pending row
+static void mergeRow(spectrumPyramid *p, int level, const pyramidCell *cells)
+{
+    pyramidCell *into = p->pending[level];
+    int c, below = p->levels[level - 1].cols;
+    int factor = p->levels[level].cols < below ? 2 : 1;
+
+    for (c = 0; c < below; c++) {
+        pyramidCell *to = &into[c / factor];
+        if (!cells[c].count) {
+            continue;
+        }
+        to->min = cells[c].min < to->min ? cells[c].min : to->min;
+        to->max = cells[c].max > to->max ? cells[c].max : to->max;
+        to->sum += cells[c].sum;
+        to->count += cells[c].count;
+    }
+}
+
+static int writeAt(int fd, const void *data, long length, long offset)
+{
+    return pwrite(fd, data, length, offset) == length ? 0 : -1;
+}
@@ -0,0 +1,158 @@
+/* statusPublisher.c
+ * Versioned, cached experiment status and the thread that pushes it.
+ *
+ * Two locks. stateLock covers the version numbers and the subscription,
+ * and is taken by statusChanged from inside the experiments' own lock,
+ * so nothing is ever called with it held. encodeLock covers the cache;
+ * the encoder (which calls back into the experiments) runs under it.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <wiringPi.h>
+
+#include "../include/statusPublisher.h"
+
+static pthread_mutex_t stateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stateChanged = PTHREAD_COND_INITIALIZER;
+static unsigned int version = 1;    //bumped on every change
+static unsigned int sentVersion;    //last one pushed to the subscriber
+static int subscribed = 0;
+static int threadStarted = 0;
+
+static pthread_mutex_t encodeLock = PTHREAD_MUTEX_INITIALIZER;
+static char cache[STATUS_MAX_LENGTH];
+static int cachedLength = 0;
+static unsigned int cachedVersion = 0;  //0 = never encoded
+
+static int (*encodeStatus)(char *buf, int size);
+static int (*sendStatus)(void *bytes, int length);
+
+static void refreshCache();
+
+
+/*publisherThread
+ * sleeps until there is a subscriber and a version it hasn't seen, lets
+ * the changes settle, then sends the status once. Skips the send if the
+ * encoding came out the same as last time.
+ */
+PI_THREAD(publisherThread)
+{
+    static char sent[STATUS_MAX_LENGTH];
+    static char out[STATUS_MAX_LENGTH];
+    int sentLength = -1, length;
+
+    pthread_mutex_lock(&stateLock);
+    while (1) {
+        while (!subscribed || version == sentVersion) {
+            pthread_cond_wait(&stateChanged, &stateLock);
+        }
+        pthread_mutex_unlock(&stateLock);
+
+        delay(STATUS_COALESCE);
+
+        pthread_mutex_lock(&encodeLock);
+        refreshCache();
+        length = cachedLength;
+        memcpy(out, cache, length);
+        pthread_mutex_lock(&stateLock);
+        sentVersion = cachedVersion;
+        if (!subscribed || (length == sentLength && !memcmp(out, sent, length))) {
+            pthread_mutex_unlock(&encodeLock);
+            continue;
+        }
+        pthread_mutex_unlock(&stateLock);
+        pthread_mutex_unlock(&encodeLock);
+
+        memcpy(sent, out, length);
+        sentLength = length;
+        if (length > 0 && sendStatus) {
+            sendStatus(out, length);
+        }
+        pthread_mutex_lock(&stateLock);
+    }
+    return NULL;
+}
+
+int statusPublisherStart(int (*encode)(char *buf, int size), int (*send)(void *bytes, int length))
+{
+    pthread_mutex_lock(&encodeLock);
+    encodeStatus = encode;
+    sendStatus = send;
+    cachedVersion = 0;
+    pthread_mutex_unlock(&encodeLock);
+
+    pthread_mutex_lock(&stateLock);
+    if (!threadStarted) {
+        if (piThreadCreate(publisherThread)) {
+            pthread_mutex_unlock(&stateLock);
+            printf("pi thread failed somehow!\n");
+            return -1;
+        }
+        threadStarted = 1;
+    }
+    pthread_mutex_unlock(&stateLock);
+    return 0;
+}
+
+int statusChanged()
+{
+    pthread_mutex_lock(&stateLock);
+    version++;
+    if (subscribed) {
+        pthread_cond_signal(&stateChanged);
+    }
+    pthread_mutex_unlock(&stateLock);
+    return 0;
+}
+
+void statusSubscribe(int on)
+{
+    pthread_mutex_lock(&stateLock);
+    if (on && !subscribed) {
+        //so the new subscriber hears where things stand
+        sentVersion = 0;
+        pthread_cond_signal(&stateChanged);
+    }
+    subscribed = on;
+    pthread_mutex_unlock(&stateLock);
+}
+
+int statusSnapshot(char *buf, int size, unsigned int *version)
+{
+    int length;
+
+    pthread_mutex_lock(&encodeLock);
+    refreshCache();
+    length = cachedLength < size ? cachedLength : size;
+    memcpy(buf, cache, length);
+    if (version) {
+        *version = cachedVersion;
+    }
+    pthread_mutex_unlock(&encodeLock);
+    return length;
+}
+
+//encode the status again if it has changed. caller holds encodeLock
+static void refreshCache()
+{
+    unsigned int current;
+
+    pthread_mutex_lock(&stateLock);
+    current = version;
+    pthread_mutex_unlock(&stateLock);
+
+    if (current == cachedVersion || !encodeStatus) {
+        return;
+    }
+    //anything that changes while we encode bumps the version again,
+    //and gets encoded next time
+    cachedLength = encodeStatus(cache, sizeof (cache));
+    if (cachedLength < 0) {
+        cachedLength = 0;
+    } else if (cachedLength > (int) sizeof (cache)) {
+        cachedLength = sizeof (cache);
+    }
+    cachedVersion = current;
+}
@@ -0,0 +1,287 @@
+/* telemetry.c
+ * Framing and scheduling for everything we send to the client.
+ *
+ * Callers queue messages from whatever thread they are on. A single
+ * sender thread owns the socket writes, one frame at a time. High
+ * priority messages go before low ones; among them, one that fits in a
+ * frame goes before a long one, and a long one goes a chunk at a time.
+ * So a status update or pressure batch never waits behind more than one
+ * chunk of anything, whether a spectrum or a pressure history.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <wiringPi.h>
+
+#include "../include/telemetry.h"
+
+typedef struct telemetryMessage {
+    unsigned char channel;
+    unsigned int timestamp;
+    int length;
+    int offset;                 //payload bytes already sent
+    struct telemetryMessage *next;
+    unsigned char data[];
+} telemetryMessage;
+
+typedef struct {
+    telemetryMessage *head;
+    telemetryMessage *tail;
+    int count;
+} messageQueue;
+
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+
+static messageQueue highQueue, lowQueue;
+static int clientSock = -1;
+static volatile int running = 0;
+static volatile int connected = 0;
+static volatile int threadAlive = 0;
+
+static void queue_append(messageQueue *q, telemetryMessage *m);
+static telemetryMessage *queue_pop(messageQueue *q);
+static void queue_remove(messageQueue *q, telemetryMessage *m);
+static void queue_destroy(messageQueue *q);
+static telemetryMessage *nextHigh();
+static int writeFrame(telemetryMessage *m, int chunkLength, int more);
+
+
+PI_THREAD(senderThread)
+{
+    telemetryMessage *m;
+    messageQueue *q;
+    int chunk, more;
+
+    pthread_mutex_lock(&queueLock);
+    while (running) {
+        if (!highQueue.head && !lowQueue.head) {
+            pthread_cond_wait(&queueReady, &queueLock);
+            continue;
+        }
+
+        m = nextHigh();
+        q = m ? &highQueue : &lowQueue;
+        if (!m) {
+            m = lowQueue.head;
+        }
+        chunk = m->length - m->offset;
+        if (chunk > TELEMETRY_CHUNK_SIZE) {
+            chunk = TELEMETRY_CHUNK_SIZE;
+        }
+        more = m->offset + chunk < m->length;
+
+        //the message stays queued while we write it. only this thread
+        //takes high ones off, and the low head is never the one dropped
+        //on overflow, so it is safe to unlock here
+        pthread_mutex_unlock(&queueLock);
+        if (connected && writeFrame(m, chunk, more) < 0) {
+            printf("Client Disconnected. Noticed upon write.\n");
+            connected = 0;
+        }
+        pthread_mutex_lock(&queueLock);
+
+        m->offset += chunk;
+        if (m->offset >= m->length) {
+            queue_remove(q, m);
+            free(m);
+        }
+    }
+    pthread_mutex_unlock(&queueLock);
+    threadAlive = 0;
+    return NULL;
+}
+
+int telemetryStart(int client)
+{
+    //make sure a previous sender is gone
+    telemetryStop();
+
+    clientSock = client;
+    connected = 1;
+    running = 1;
+    //alive from here, not from when it first runs, so a stop before then
+    //still waits for it
+    threadAlive = 1;
+    if (piThreadCreate(senderThread)) {
+        printf("pi thread failed somehow!\n");
+        running = 0;
+        connected = 0;
+        threadAlive = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void telemetryStop()
+{
+    pthread_mutex_lock(&queueLock);
+    running = 0;
+    connected = 0;
+    pthread_cond_broadcast(&queueReady);
+    pthread_mutex_unlock(&queueLock);
+
+    while (threadAlive) {
+        delay(1);
+    }
+
+    pthread_mutex_lock(&queueLock);
+    queue_destroy(&highQueue);
+    queue_destroy(&lowQueue);
+    pthread_mutex_unlock(&queueLock);
+}
+
+int telemetrySend(int channel, int priority, void *data, int length)
+{
+    telemetryMessage *m;
+
+    if (!connected) {
+        return 0;
+    }
+
+    m = malloc(sizeof (telemetryMessage) + length);
+    if (!m) {
+        printf("we didnt get the memory for a message :(\n");
+        return connected;
+    }
+    m->channel = channel;
+    m->timestamp = millis();
+    m->length = length;
+    m->offset = 0;
+    m->next = NULL;
+    memcpy(m->data, data, length);
+
+    pthread_mutex_lock(&queueLock);
+    if (priority == PRIORITY_HIGH) {
+        queue_append(&highQueue, m);
+    } else {
+        //a slow link shouldn't let stale spectra pile up. drop the oldest
+        //one behind the head (the head may be halfway out the door).
+        //anything else low priority was asked for, so it all goes
+        if (channel == CHANNEL_SPECTRUM && lowQueue.count >= TELEMETRY_MAX_LOW_QUEUED) {
+            telemetryMessage *prev = lowQueue.head, *stale;
+            while (prev->next && prev->next->channel != CHANNEL_SPECTRUM) {
+                prev = prev->next;
+            }
+            stale = prev->next;
+            if (stale) {
+                prev->next = stale->next;
+                if (lowQueue.tail == stale) {
+                    lowQueue.tail = prev;
+                }
+                lowQueue.count--;
+                free(stale);
+            }
+        }
+        queue_append(&lowQueue, m);
+    }
+    pthread_cond_signal(&queueReady);
+    pthread_mutex_unlock(&queueLock);
+
+    return connected;
+}
+
+
+//the high priority message to send a frame of next: the oldest that fits
+//in one frame, or failing that the oldest. A message never overtakes an
+//earlier one on its own channel, so no channel has two half-sent.
+//called with queueLock held
+static telemetryMessage *nextHigh()
+{
+    telemetryMessage *m, *oldest = NULL;
+    unsigned int seen = 0;
+
+    for (m = highQueue.head; m; m = m->next) {
+        if (!(seen & (1u << m->channel))) {
+            if (m->length - m->offset <= TELEMETRY_CHUNK_SIZE) {
+                return m;
+            }
+            if (!oldest) {
+                oldest = m;
+            }
+        }
+        seen |= 1u << m->channel;
+    }
+    return oldest;
+}
+
+//header and chunk go out in one write so a frame is never interleaved.
+//chunks are never more than TELEMETRY_CHUNK_SIZE, so it all fits here
+static int writeFrame(telemetryMessage *m, int chunkLength, int more)
+{
+    unsigned char buf[TELEMETRY_HEADER_SIZE + TELEMETRY_CHUNK_SIZE];
+    unsigned short length = chunkLength;
+    int total = TELEMETRY_HEADER_SIZE + chunkLength;
+    int err, written = 0;
+
+    buf[0] = m->channel;
+    buf[1] = more ? TELEMETRY_MORE_FRAGMENTS : 0;
+    memcpy(&buf[2], &length, 2);
+    memcpy(&buf[4], &m->timestamp, 4);
+    memcpy(&buf[TELEMETRY_HEADER_SIZE], &m->data[m->offset], chunkLength);
+
+    while (written < total) {
+        err = write(clientSock, &buf[written], total - written);
+        if (err < 0) {
+            break;
+        }
+        written += err;
+    }
+    return written < total ? -1 : 0;
+}
+
+static void queue_append(messageQueue *q, telemetryMessage *m)
+{
+    if (q->tail) {
+        q->tail->next = m;
+    } else {
+        q->head = m;
+    }
+    q->tail = m;
+    q->count++;
+}
+
+static telemetryMessage *queue_pop(messageQueue *q)
+{
+    telemetryMessage *m = q->head;
+
+    if (m) {
+        q->head = m->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+        q->count--;
+    }
+    return m;
+}
+
+//take m out from wherever it is in the queue
+static void queue_remove(messageQueue *q, telemetryMessage *m)
+{
+    telemetryMessage **at = &q->head, *prev = NULL;
+
+    while (*at && *at != m) {
+        prev = *at;
+        at = &(*at)->next;
+    }
+    if (!*at) {
+        return;
+    }
+    *at = m->next;
+    if (q->tail == m) {
+        q->tail = prev;
+    }
+    q->count--;
+}
+
+static void queue_destroy(messageQueue *q)
+{
+    telemetryMessage *m;
+
+    while ((m = queue_pop(q)) != NULL) {
+        free(m);
+    }
+}
@@ -0,0 +1,200 @@
+/* workPool.c
+ * Work-stealing thread pool.
+ *
+ * A job is a range of indices. Each worker owns a [next, end) slice of it
+ * and takes indices from the front; a worker whose slice is empty takes
+ * the back half of the fullest slice it can find. Per-slice locks are
+ * only ever held for a few instructions, so the fits themselves run
+ * fully in parallel.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../include/workPool.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    int next;
+    int end;
+} workSlice;
+
+static pthread_mutex_t jobCallLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobDone = PTHREAD_COND_INITIALIZER;
+
+static int numWorkers = 0;
+static workSlice slices[WORKPOOL_MAX_WORKERS];
+
+//the current job; generation changes every time a new one is posted
+static workFunction jobFunction;
+static void *jobArg;
+static unsigned int generation = 0;
+static int workersBusy = 0;
+
+static int takeOwn(workSlice *s);
+static int steal(int thief);
+static void *worker(void *arg);
+
+
+int workPoolInit(int requested)
+{
+    static int workerIds[WORKPOOL_MAX_WORKERS];
+    pthread_t thread;
+    int i;
+
+    pthread_mutex_lock(&poolLock);
+    if (numWorkers) {
+        pthread_mutex_unlock(&poolLock);
+        return 0;
+    }
+
+    if (requested <= 0) {
+        requested = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (requested <= 0) {
+        requested = 1;
+    }
+    if (requested > WORKPOOL_MAX_WORKERS) {
+        requested = WORKPOOL_MAX_WORKERS;
+    }
+
+    for (i = 0; i < requested; i++) {
+        pthread_mutex_init(&slices[i].lock, NULL);
+        slices[i].next = slices[i].end = 0;
+        workerIds[i] = i;
+        if (pthread_create(&thread, NULL, worker, &workerIds[i])) {
+            printf("pi thread failed somehow!\n");
+            break;
+        }
+        pthread_detach(thread);
+        numWorkers++;
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    printf("work pool running with %i workers\n", numWorkers);
+    return numWorkers ? 0 : -1;
+}
+
+int workPoolRun(workFunction fn, void *arg, int count)
+{
+    int i, start;
+
+    if (count <= 0) {
+        return 0;
+    }
+    if (workPoolInit(0) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&jobCallLock);
+    pthread_mutex_lock(&poolLock);
+
+    //hand out contiguous blocks, the remainder going one each to the first few
+    start = 0;
+    for (i = 0; i < numWorkers; i++) {
+        int size = count / numWorkers + (i < count % numWorkers ? 1 : 0);
+
+        pthread_mutex_lock(&slices[i].lock);
+        slices[i].next = start;
+        slices[i].end = start + size;
+        pthread_mutex_unlock(&slices[i].lock);
+        start += size;
+    }
+
+    jobFunction = fn;
+    jobArg = arg;
+    workersBusy = numWorkers;
+    generation++;
+    pthread_cond_broadcast(&jobReady);
+
+    while (workersBusy) {
+        pthread_cond_wait(&jobDone, &poolLock);
+    }
+    pthread_mutex_unlock(&poolLock);
+    pthread_mutex_unlock(&jobCallLock);
+
+    return 0;
+}
+
+
+static void *worker(void *arg)
+{
+    int id = *(int *) arg;
+    unsigned int seen = 0;
+    int index;
+
+    pthread_mutex_lock(&poolLock);
+    while (1) {
+        while (generation == seen) {
+            pthread_cond_wait(&jobReady, &poolLock);
+        }
+        seen = generation;
+        pthread_mutex_unlock(&poolLock);
+
+        //our own block first, then whatever we can steal
+        while ((index = takeOwn(&slices[id])) >= 0 || (index = steal(id)) >= 0) {
+            jobFunction(jobArg, index);
+        }
+
+        pthread_mutex_lock(&poolLock);
+        if (--workersBusy == 0) {
+            pthread_cond_signal(&jobDone);
+        }
+    }
+    return NULL;
+}
+
+//next index from the front of our own slice, or -1 if it's empty
+static int takeOwn(workSlice *s)
+{
+    int index = -1;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->next < s->end) {
+        index = s->next++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return index;
+}
+
+//move the back half of the fullest other slice into ours, and return its
+//first index. -1 once there's nothing left anywhere
+static int steal(int thief)
+{
+    int i, victim, remaining, best, mid, index;
+
+    while (1) {
+        victim = -1;
+        best = 0;
+        for (i = 0; i < numWorkers; i++) {
+            remaining = slices[i].end - slices[i].next;
+            if (i != thief && remaining > best) {
+                best = remaining;
+                victim = i;
+            }
+        }
+        if (victim < 0) {
+            return -1;
+        }
+
+        pthread_mutex_lock(&slices[victim].lock);
+        remaining = slices[victim].end - slices[victim].next;
+        if (remaining <= 0) {
+            //somebody beat us to it; look again
+            pthread_mutex_unlock(&slices[victim].lock);
+            continue;
+        }
+        mid = slices[victim].next + remaining / 2;
+        index = mid;
+        pthread_mutex_lock(&slices[thief].lock);
+        slices[thief].next = mid + 1;
+        slices[thief].end = slices[victim].end;
+        pthread_mutex_unlock(&slices[thief].lock);
+        slices[victim].end = mid;
+        pthread_mutex_unlock(&slices[victim].lock);
+
+        return index;
+    }
+}
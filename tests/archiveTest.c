@@ -0,0 +1,224 @@
+/* archiveTest.c
+ * Archives a handful of synthetic experiments whose shifts lie on a
+ * known line in time, and checks the mean, range and slope that queries
+ * over them give; then damages the files the ways a crash can, and
+ * checks the archive comes back to the experiments it still has whole.
+ *
+ * The archive lives at a fixed path under the working directory, so
+ * this runs in a directory of its own under /tmp. It is only read from
+ * disk once per process, so the steps that need a fresh load run this
+ * program again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../include/resultArchive.h"
+#include "testCheck.h"
+
+#define EXPERIMENTS 6
+#define SCANS 4
+#define START 1600000000u
+#define DAY 86400
+#define ROW_TIME_LENGTH 4       //bytes per row of time.col
+
+//experiment e starts e days in; its scans are a minute apart
+static unsigned int when(int e, int scan)
+{
+    return START + e * DAY + scan * 60;
+}
+
+//device 0's shift climbs 2 a day from 0.5; device 1's sits at 100
+static double shiftAt(unsigned int t, int device)
+{
+    return device ? 100 : 0.5 + 2.0 * (t - START) / DAY;
+}
+
+static void add(int e)
+{
+    specSettings s = {.numScans = SCANS, .doctorName = e % 2 ? "cy" : "bob",
+                      .patientName = e < 4 ? "ann" : "dee", .timestamp = "t"};
+    archiveRow rows[2 * SCANS];
+    int i;
+
+    for (i = 0; i < 2 * SCANS; i++) {
+        rows[i].wallTime = when(e, i / 2);
+        rows[i].scan = i / 2;
+        rows[i].device = i % 2;
+        rows[i].peak = 550 + e;
+        rows[i].shift = shiftAt(rows[i].wallTime, i % 2);
+        rows[i].quality = i / 2 == 0 ? -1 : 0.9;
+    }
+    CHECK(archiveAddExperiment(s, when(e, 0), rows, 2 * SCANS) == 0, "experiment %i not archived", e);
+}
+
+//mean and least-squares slope per day of device 0's shift over experiments
+//first..last, worked out directly
+static void expected(int first, int last, double *mean, double *slope)
+{
+    double t, v, sumT = 0, sumV = 0, sumTT = 0, sumTV = 0;
+    int e, scan, n = 0;
+
+    for (e = first; e <= last; e++) {
+        for (scan = 0; scan < SCANS; scan++) {
+            t = (double) (when(e, scan) - START) / DAY;
+            v = shiftAt(when(e, scan), 0);
+            sumT += t;
+            sumV += v;
+            sumTT += t * t;
+            sumTV += t * v;
+            n++;
+        }
+    }
+    *mean = sumV / n;
+    *slope = (n * sumTV - sumT * sumV) / (n * sumTT - sumT * sumT);
+}
+
+static archiveStats query(const char *patient, const char *doctor, int device, int field, int lastRuns,
+                          unsigned int from, unsigned int to)
+{
+    archiveQuery q = {patient, doctor, from, to, lastRuns, device, field};
+    archiveStats stats;
+
+    CHECK(archiveQueryStats(&q, &stats) == 0, "query failed");
+    return stats;
+}
+
+static void checkQueries()
+{
+    archiveStats s;
+    double mean, slope;
+
+    //a shift on a line in time has that slope, whatever else is in the rows
+    s = query(NULL, NULL, 0, ARCHIVE_SHIFT, 0, 0, 0);
+    expected(0, EXPERIMENTS - 1, &mean, &slope);
+    CHECK(s.experiments == EXPERIMENTS && s.count == EXPERIMENTS * SCANS, "%i experiments, %i scans", s.experiments, s.count);
+    CHECK_NEAR(s.slope, 2, 1e-9, "slope");
+    CHECK_NEAR(s.mean, mean, 1e-9, "mean");
+    CHECK_NEAR(s.min, 0.5, 1e-9, "min");
+    CHECK_NEAR(s.max, shiftAt(when(EXPERIMENTS - 1, SCANS - 1), 0), 1e-9, "max");
+    CHECK(s.first == when(0, 0) && s.last == when(EXPERIMENTS - 1, SCANS - 1), "time range %u..%u", s.first, s.last);
+
+    //the other device is flat, and both together are neither
+    s = query(NULL, NULL, 1, ARCHIVE_SHIFT, 0, 0, 0);
+    CHECK(s.count == EXPERIMENTS * SCANS && s.mean == 100 && fabs(s.slope) < 1e-9, "device 1: mean %g, slope %g", s.mean, s.slope);
+    s = query(NULL, NULL, -1, ARCHIVE_SHIFT, 0, 0, 0);
+    CHECK(s.count == 2 * EXPERIMENTS * SCANS && s.max == 100, "both devices: %i scans", s.count);
+
+    //a patient's last few runs
+    s = query("ann", NULL, 0, ARCHIVE_SHIFT, 2, 0, 0);
+    expected(2, 3, &mean, &slope);
+    CHECK(s.experiments == 2 && s.count == 2 * SCANS, "ann's last 2: %i experiments", s.experiments);
+    CHECK_NEAR(s.mean, mean, 1e-9, "ann's last 2 mean");
+    CHECK_NEAR(s.slope, slope, 1e-9, "ann's last 2 slope");
+
+    //a doctor, a patient and a doctor together, and a time range
+    s = query(NULL, "cy", 0, ARCHIVE_SHIFT, 0, 0, 0);
+    CHECK(s.experiments == EXPERIMENTS / 2 && s.first == when(1, 0), "cy: %i experiments", s.experiments);
+    s = query("ann", "bob", 0, ARCHIVE_SHIFT, 0, 0, 0);
+    CHECK(s.experiments == 2 && s.last == when(2, SCANS - 1), "ann with bob: %i experiments", s.experiments);
+    s = query(NULL, NULL, 0, ARCHIVE_SHIFT, 0, when(1, 0), when(3, 0));
+    expected(1, 3, &mean, &slope);
+    CHECK(s.experiments == 3, "days 1-3: %i experiments", s.experiments);
+    CHECK_NEAR(s.mean, mean, 1e-9, "days 1-3 mean");
+    s = query("nobody", NULL, 0, ARCHIVE_SHIFT, 0, 0, 0);
+    CHECK(s.experiments == 0 && s.count == 0, "nobody: %i experiments", s.experiments);
+
+    //scans of unknown quality are left out of quality queries
+    s = query(NULL, NULL, 0, ARCHIVE_QUALITY, 0, 0, 0);
+    CHECK(s.count == EXPERIMENTS * (SCANS - 1), "quality over %i scans", s.count);
+    CHECK_NEAR(s.mean, 0.9, 1e-6, "quality mean");
+    s = query(NULL, NULL, 0, ARCHIVE_PEAK, 0, 0, 0);
+    CHECK(s.min == 550 && s.max == 550 + EXPERIMENTS - 1, "peak range %g..%g", s.min, s.max);
+}
+
+static long fileSize(const char *name)
+{
+    char path[256];
+    struct stat st;
+
+    sprintf(path, "%s/%s", ARCHIVE_DIR, name);
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+//runs this program again to do one step, so it loads the archive from
+//the files afresh
+static void inChild(const char *step)
+{
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", "archiveTest", step, (char *) NULL);
+        exit(127);
+    }
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "%s step had failures", step);
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/archiveTestXXXXXX", command[64];
+    archiveQuery q;
+    archiveStats s;
+    char names[2][ARCHIVE_NAME_LENGTH];
+    FILE *f;
+    long rows, record;
+    int e;
+
+    if (argc > 1 && !strcmp(argv[1], "fill")) {
+        for (e = 0; e < EXPERIMENTS; e++) {
+            add(e);
+        }
+        return checkFailures;
+    }
+    if (argc > 1 && !strcmp(argv[1], "check")) {
+        checkQueries();
+        return checkFailures;
+    }
+
+    CHECK(mkdtemp(dir) && chdir(dir) == 0 && mkdir("experiment_results", 0755) == 0, "no directory to work in");
+    inChild("fill");
+    inChild("check");
+
+    //a crash part way through the last experiment's time column, and a
+    //torn record on the end of the table
+    rows = fileSize("time.col") / ROW_TIME_LENGTH;
+    CHECK(rows == 2 * EXPERIMENTS * SCANS, "%li rows", rows);
+    record = fileSize("experiments.tbl") / EXPERIMENTS;
+    CHECK(truncate(ARCHIVE_DIR "/time.col", (rows - 3) * ROW_TIME_LENGTH) == 0, "couldn't cut the column");
+    f = fopen(ARCHIVE_DIR "/experiments.tbl", "ab");
+    fwrite("torn", 4, 1, f);
+    fclose(f);
+
+    //only the experiments whose rows are all there are kept, and the
+    //files are cut back to them
+    s = query(NULL, NULL, 0, ARCHIVE_SHIFT, 0, 0, 0);
+    CHECK(s.experiments == EXPERIMENTS - 1, "%i experiments after the crash", s.experiments);
+    CHECK(fileSize("experiments.tbl") == (EXPERIMENTS - 1) * record, "table not cut back");
+    CHECK(fileSize("time.col") == (rows - 2 * SCANS) * ROW_TIME_LENGTH
+          && fileSize("shift.col") == (rows - 2 * SCANS) * 8, "columns not trimmed to match");
+
+    //so the next experiment's rows are its own
+    add(EXPERIMENTS - 1);
+    s = query("dee", NULL, 0, ARCHIVE_SHIFT, 0, 0, 0);
+    CHECK(s.experiments == 2 && s.count == 2 * SCANS && s.last == when(EXPERIMENTS - 1, SCANS - 1),
+          "re-added experiment: %i experiments, %i scans", s.experiments, s.count);
+    inChild("check");
+
+    //and the payload a client sends
+    CHECK(parseArchiveQuery(fieldFromString("patient=ann;doctor=bob;device=1;field=peak;last=3;from=5;to=9"), &q, names) == 0
+          && !strcmp(q.patient, "ann") && !strcmp(q.doctor, "bob") && q.device == 1 && q.field == ARCHIVE_PEAK
+          && q.lastRuns == 3 && q.from == 5 && q.to == 9, "query payload misread");
+    CHECK(parseArchiveQuery(fieldFromString("colour=red"), &q, names) == -1, "unknown key accepted");
+
+    sprintf(command, "rm -rf %s", dir);
+    system(command);
+    return CHECK_RESULT();
+}
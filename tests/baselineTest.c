@@ -0,0 +1,106 @@
+/* baselineTest.c
+ * ALS and arPLS on spectra whose background is known: a straight line,
+ * which the curvature penalty leaves alone, with and without a peak on
+ * top. The banded solve is checked against the system it solves.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/baselineRemoval.h"
+#include "testCheck.h"
+
+#define PIXELS 1024
+#define CENTRE 600
+#define HEIGHT 1000.0
+
+static double background(int i)
+{
+    return 300 + 0.4 * i;
+}
+
+static double peak(int i)
+{
+    return HEIGHT * exp(-(i - CENTRE) * (i - CENTRE) / (2 * 6.0 * 6.0));
+}
+
+//(W + lambda D'D) z - W y, at its largest, for the weights and baseline
+//the workspace was left with
+static double systemResidual(baselineWorkspace *b, const double *y, double lambda)
+{
+    double penalty[PIXELS], worst = 0, r;
+    int i;
+
+    //D'D z is D' of the second differences of z
+    memset(penalty, 0, sizeof (penalty));
+    for (i = 0; i + 2 < PIXELS; i++) {
+        r = b->baseline[i] - 2 * b->baseline[i + 1] + b->baseline[i + 2];
+        penalty[i] += r;
+        penalty[i + 1] -= 2 * r;
+        penalty[i + 2] += r;
+    }
+    for (i = 0; i < PIXELS; i++) {
+        r = fabs(b->weights[i] * (b->baseline[i] - y[i]) + lambda * penalty[i]);
+        worst = r > worst ? r : worst;
+    }
+    return worst;
+}
+
+static void checkMethod(const char *name, int method)
+{
+    baselineWorkspace b;
+    double y[PIXELS], original[PIXELS], worst = 0, lambda = 1e5;
+    int i, solves;
+
+    //a line is its own baseline, whatever the weights
+    memset(&b, 0, sizeof (b));
+    for (i = 0; i < PIXELS; i++) {
+        y[i] = background(i);
+    }
+    solves = baselineRemove(&b, method, lambda, y, PIXELS);
+    CHECK(solves >= 1, "%s: %i solves on a line", name, solves);
+    for (i = 0; i < PIXELS; i++) {
+        worst = fabs(y[i]) > worst ? fabs(y[i]) : worst;
+    }
+    CHECK(worst < 1e-6, "%s: a line left %g behind", name, worst);
+
+    //a peak on the line comes out on a flat floor
+    for (i = 0; i < PIXELS; i++) {
+        original[i] = y[i] = background(i) + peak(i);
+    }
+    solves = baselineRemove(&b, method, lambda, y, PIXELS);
+    CHECK(solves >= 1 && solves <= BASELINE_MAX_ITERATIONS, "%s: %i solves", name, solves);
+    CHECK(systemResidual(&b, original, lambda) < 1e-6 * HEIGHT, "%s: baseline doesn't solve its system", name);
+    CHECK_NEAR(y[CENTRE], HEIGHT, 0.02 * HEIGHT, "peak height");
+    worst = 0;
+    for (i = 0; i < PIXELS; i++) {
+        if (abs(i - CENTRE) > 40) {
+            worst = fabs(y[i]) > worst ? fabs(y[i]) : worst;
+        }
+    }
+    CHECK(worst < 0.01 * HEIGHT, "%s: %g left off the peak", name, worst);
+    baselineFree(&b);
+}
+
+int main()
+{
+    baselineWorkspace b;
+    double y[PIXELS];
+    int i;
+
+    checkMethod("ALS", BASELINE_ALS);
+    checkMethod("arPLS", BASELINE_ARPLS);
+
+    //off, or too short to have a curvature, leaves the spectrum alone
+    memset(&b, 0, sizeof (b));
+    for (i = 0; i < PIXELS; i++) {
+        y[i] = background(i) + peak(i);
+    }
+    CHECK(baselineRemove(&b, BASELINE_OFF, 0, y, PIXELS) == 0, "off did something");
+    CHECK(baselineRemove(&b, BASELINE_ALS, 0, y, 2) == -1, "two pixels were accepted");
+    CHECK_NEAR(y[0], background(0), 0, "untouched pixel");
+    CHECK_NEAR(y[CENTRE], background(CENTRE) + peak(CENTRE), 0, "untouched peak");
+    baselineFree(&b);
+    return CHECK_RESULT();
+}
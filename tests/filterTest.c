@@ -0,0 +1,141 @@
+/* filterTest.c
+ * Savitzky-Golay taps against the published tables, a folded chain
+ * against its stages run one at a time, and the running median against
+ * sorting each window.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/filterChain.h"
+#include "../include/spectrumKernels.h"
+#include "testCheck.h"
+
+#define PIXELS 500
+
+//Savitzky and Golay's tables, as corrected by Steinier et al.
+static const struct {
+    const char *text;
+    int width;
+    double norm;
+    double taps[9];
+} published[] = {
+    {"sg:5:2", 5, 35, {-3, 12, 17, 12, -3}},
+    {"sg:7:2", 7, 21, {-2, 3, 6, 7, 6, 3, -2}},
+    {"sg:9:3", 9, 231, {-21, 14, 39, 54, 59, 54, 39, 14, -21}},
+    {"sg:7:4", 7, 231, {5, -30, 75, 131, 75, -30, 5}},
+    {"sg:5:2:1", 5, 10, {-2, -1, 0, 1, 2}},
+    {"sg:7:2:2", 7, 42, {5, 0, -3, -4, -3, 0, 5}},
+};
+
+static void checkPublishedTaps()
+{
+    filterChain c;
+    int i, k;
+
+    for (i = 0; i < (int) (sizeof (published) / sizeof (published[0])); i++) {
+        CHECK(filterChainCompile(&c, 0, published[i].text) == 0, "%s didn't compile", published[i].text);
+        CHECK(c.numPasses == 1 && c.passes[0].count == published[i].width
+              && c.passes[0].left == published[i].width / 2, "%s: wrong window", published[i].text);
+        for (k = 0; k < published[i].width; k++) {
+            CHECK(fabs(c.passes[0].taps[k] - published[i].taps[k] / published[i].norm) < 1e-12,
+                  "%s tap %i: %g, expected %g", published[i].text, k, c.passes[0].taps[k],
+                  published[i].taps[k] / published[i].norm);
+        }
+    }
+}
+
+static void makeSpectrum(double *s)
+{
+    int i;
+
+    for (i = 0; i < PIXELS; i++) {
+        s[i] = 100 + 800 * exp(-(i - 230) * (i - 230) / 200.0) + 30 * sin(i * 0.7) + (i * 37 % 11);
+    }
+}
+
+//linear stages fold into one pass, which gives what running them one by
+//one does, except within the folded kernel's reach of the ends
+static void checkFolding()
+{
+    static const char *stages[] = {"sg:7:2", "gauss:1.5", "sg:5:2:1"};
+    filterChain folded, single;
+    double in[PIXELS], out[PIXELS], step[PIXELS], next[PIXELS];
+    int i, s, reach;
+
+    CHECK(filterChainCompile(&folded, 3, "sg:7:2,gauss:1.5,sg:5:2:1") == 0, "chain didn't compile");
+    CHECK(folded.numStages == 4 && folded.numPasses == 1, "%i stages in %i passes", folded.numStages, folded.numPasses);
+    reach = folded.passes[0].count;
+
+    makeSpectrum(in);
+    filterChainApply(&folded, in, out, PIXELS);
+
+    makeSpectrum(step);
+    spectrumBoxcar(3, step, next, PIXELS);
+    memcpy(step, next, sizeof (step));
+    for (s = 0; s < 3; s++) {
+        filterChainCompile(&single, 0, stages[s]);
+        filterChainApply(&single, step, next, PIXELS);
+        memcpy(step, next, sizeof (step));
+    }
+    for (i = reach; i < PIXELS - reach; i++) {
+        CHECK(fabs(out[i] - step[i]) < 1e-9, "folded chain at %i: %g, one by one %g", i, out[i], step[i]);
+    }
+
+    //a median keeps the stages either side of it apart
+    CHECK(filterChainCompile(&folded, 0, "sg:5:2,median:3,gauss:1") == 0, "median chain didn't compile");
+    CHECK(folded.numPasses == 3 && folded.passes[1].type == FILTER_MEDIAN, "median folded away");
+
+    //a lone boxcar keeps its running sum
+    filterChainCompile(&folded, 5, "");
+    CHECK(folded.numPasses == 1 && folded.passes[0].type == FILTER_BOXCAR, "lone boxcar became a convolution");
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+//every window copied, clamped to the ends, and sorted
+static void checkMedian(int width)
+{
+    double in[PIXELS], out[PIXELS], window[FILTER_MAX_TAPS], expected;
+    int i, j, k;
+
+    makeSpectrum(in);
+    spectrumMedian(width, in, out, PIXELS);
+    for (i = 0; i < PIXELS; i++) {
+        for (j = 0; j < width; j++) {
+            k = i - width / 2 + j;
+            window[j] = in[k < 0 ? 0 : k >= PIXELS ? PIXELS - 1 : k];
+        }
+        qsort(window, width, sizeof (double), compareDoubles);
+        expected = width % 2 ? window[width / 2] : (window[width / 2 - 1] + window[width / 2]) / 2;
+        CHECK(out[i] == expected, "median of %i at %i: %g, expected %g", width, i, out[i], expected);
+    }
+}
+
+int main()
+{
+    filterChain c, d;
+
+    checkPublishedTaps();
+    checkFolding();
+    checkMedian(1);
+    checkMedian(4);
+    checkMedian(5);
+    checkMedian(15);
+
+    //a bad stage leaves just the boxcar
+    CHECK(filterChainCompile(&c, 3, "sg:4:2") == -1, "even Savitzky-Golay width accepted");
+    CHECK(c.numStages == 1 && c.passes[0].type == FILTER_BOXCAR, "bad chain not reset to the boxcar");
+    CHECK(filterChainCompile(&c, 0, "median:5,wobble:3") == -1, "unknown stage accepted");
+    CHECK(filterChainCompile(&c, 0, "gauss:1,sg:11:2") == 0 && filterChainCompile(&d, 0, "gauss:1,sg:11:2") == 0
+          && filterChainEquals(&c, &d), "same chain not equal");
+    filterChainCompile(&d, 0, "gauss:1,sg:11:3");
+    CHECK(!filterChainEquals(&c, &d), "different chains equal");
+    return CHECK_RESULT();
+}
@@ -0,0 +1,124 @@
+/* pyramidTest.c
+ * Builds the pyramid of a matrix with odd sides and a few missing cells,
+ * handed over in uneven bands, and checks every cell of every level
+ * against the min, max and mean of the pixels it covers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "../include/spectrumPyramid.h"
+#include "testCheck.h"
+
+#define ROWS 203
+#define COLS 37
+#define BAND 7
+#define PATH "pyramidTest" PYRAMID_SUFFIX
+
+//scan 5 is from a smaller detector: it has no pixels past 150
+static double cell(int r, int c)
+{
+    if (c == 5 && r >= 150) {
+        return NAN;
+    }
+    return sin(r * 0.05) * 100 + c * 3 + (r * 7 + c * 13) % 17;
+}
+
+static void build()
+{
+    spectrumPyramid p;
+    double band[BAND * COLS];
+    int r, c, count;
+
+    CHECK(pyramidCreate(&p, PATH, ROWS, COLS) == 0, "couldn't create %s", PATH);
+    for (r = 0; r < ROWS; r += count) {
+        count = ROWS - r < BAND ? ROWS - r : BAND;
+        for (c = 0; c < COLS; c++) {
+            int k;
+            for (k = 0; k < count; k++) {
+                band[c * count + k] = cell(r + k, c);
+            }
+        }
+        CHECK(pyramidAddBand(&p, band, count) == 0, "band at row %i not added", r);
+    }
+    CHECK(pyramidFinish(&p) == 0, "couldn't finish");
+}
+
+//every cell of one level, against the block of level 0 it stands for
+static void checkLevel(spectrumPyramid *p, int level, int rowSpan, int colSpan)
+{
+    int rows, cols, r, c, i, j, count, n = pyramidValuesPerCell(level);
+    float *out = malloc(p->levels[level].rows * p->levels[level].cols * 3 * sizeof (float));
+    double v, min, max, sum;
+
+    CHECK(pyramidRead(p, level, 0, 0, p->levels[level].rows, p->levels[level].cols, out, &rows, &cols)
+          == rows * cols * n, "level %i not read", level);
+    CHECK(rows == p->levels[level].rows && cols == p->levels[level].cols, "level %i read as %i x %i", level, rows, cols);
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            count = 0;
+            min = INFINITY;
+            max = -INFINITY;
+            sum = 0;
+            for (i = r * rowSpan; i < (r + 1) * rowSpan && i < ROWS; i++) {
+                for (j = c * colSpan; j < (c + 1) * colSpan && j < COLS; j++) {
+                    v = cell(i, j);
+                    if (!isnan(v)) {
+                        min = v < min ? v : min;
+                        max = v > max ? v : max;
+                        sum += v;
+                        count++;
+                    }
+                }
+            }
+            float *got = &out[(r * cols + c) * n];
+            if (count == 0) {
+                CHECK(isnan(got[0]), "level %i (%i, %i) should be missing", level, r, c);
+            } else if (level == 0) {
+                CHECK_NEAR(got[0], min, 1e-4, "level 0 cell");
+            } else {
+                CHECK_NEAR(got[0], min, 1e-4, "min");
+                CHECK_NEAR(got[1], max, 1e-4, "max");
+                CHECK_NEAR(got[2], sum / count, 1e-4, "mean");
+            }
+        }
+    }
+    free(out);
+}
+
+int main()
+{
+    spectrumPyramid p;
+    float window[3 * 4 * 4];
+    int level, rowSpan = 1, colSpan = 1, rows, cols;
+
+    build();
+    CHECK(pyramidOpen(&p, PATH) == 0, "couldn't open %s", PATH);
+    CHECK(p.numLevels > 2 && p.levels[0].rows == ROWS && p.levels[0].cols == COLS, "wrong shape");
+
+    for (level = 0; level < p.numLevels; level++) {
+        if (level > 0) {
+            rowSpan *= p.levels[level].rows < p.levels[level - 1].rows ? 2 : 1;
+            colSpan *= p.levels[level].cols < p.levels[level - 1].cols ? 2 : 1;
+        }
+        checkLevel(&p, level, rowSpan, colSpan);
+    }
+    CHECK(p.levels[p.numLevels - 1].rows <= PYRAMID_MIN_SIDE && p.levels[p.numLevels - 1].cols <= PYRAMID_MIN_SIDE,
+          "top level is %i x %i", p.levels[p.numLevels - 1].rows, p.levels[p.numLevels - 1].cols);
+
+    //the finest level that fits, or the coarsest there is
+    CHECK(pyramidChooseLevel(&p, 0, 0) == 0, "no limit should be level 0");
+    level = pyramidChooseLevel(&p, 60, 0);
+    CHECK(p.levels[level].rows <= 60 && (level == 0 || p.levels[level - 1].rows > 60), "level %i for 60 rows", level);
+    CHECK(pyramidChooseLevel(&p, 1, 1) == p.numLevels - 1, "nothing fits; should be the coarsest");
+
+    //a window hanging off the corner is clipped
+    CHECK(pyramidRead(&p, 1, p.levels[1].rows - 2, p.levels[1].cols - 3, 4, 4, window, &rows, &cols) == 2 * 3 * 3
+          && rows == 2 && cols == 3, "corner window read as %i x %i", rows, cols);
+
+    pyramidClose(&p);
+    unlink(PATH);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,162 @@
+/* scanStoreTest.c
+ * Writes a scan store, reopens it, and checks every record comes back;
+ * then cuts the last record short, and corrupts one, and checks the
+ * store recovers to the records before it and can be appended to again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../include/scanStore.h"
+#include "testCheck.h"
+
+#define PATH "scanStoreTest" SCAN_STORE_SUFFIX
+#define HEADER "5;60;1000;0;3;doctor;patient;timestamp"
+#define PIXELS 300
+#define MAX_SEEN 16
+#define COUNTED_RECORD (5 + 20 + PIXELS * 8 + 4)  //type, length, fields, spectrum, checksum
+
+typedef struct {
+    int count;
+    storedRecord records[MAX_SEEN];
+} seen;
+
+static void visit(storedRecord *record, void *arg)
+{
+    seen *s = arg;
+
+    if (s->count < MAX_SEEN) {
+        s->records[s->count] = *record;
+    }
+    s->count++;
+}
+
+static long fileSize(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void fill(double *spectrum, unsigned int *sums, int scan)
+{
+    int i;
+
+    for (i = 0; i < PIXELS; i++) {
+        spectrum[i] = 1000 * scan + i + 0.25;
+        sums[i] = 4 * (100 * scan + i);
+    }
+}
+
+//reopen, and check the first count records are what writeScan put there
+static void reopen(scanStore *store, seen *s, int count)
+{
+    double spectrum[PIXELS], expected[PIXELS];
+    unsigned int sums[PIXELS];
+    char header[SCAN_STORE_HEADER_LENGTH];
+    int i, k;
+
+    memset(s, 0, sizeof (*s));
+    CHECK(scanStoreOpen(store, PATH, header, sizeof (header), visit, s) == 0, "couldn't reopen");
+    CHECK(strcmp(header, HEADER) == 0, "header came back as %s", header);
+    CHECK(s->count == count, "%i records, expected %i", s->count, count);
+
+    //scan k: a counted scan from device 0, raw sums from device 1, and a result
+    for (i = 0; i < s->count && i < count; i++) {
+        storedRecord *r = &s->records[i];
+        int scan = i / 3;
+        CHECK(r->scan == scan, "record %i is scan %i", i, r->scan);
+        fill(expected, sums, scan);
+        if (i % 3 == 0) {
+            CHECK(r->type == RECORD_COUNTED_SCAN && r->device == 0 && r->readsUsed == 3 && r->numReads == 0
+                  && r->numPixels == PIXELS && r->timestamp == 100u * scan, "record %i isn't scan %i's", i, scan);
+        } else if (i % 3 == 1) {
+            CHECK(r->type == RECORD_RAW_SCAN && r->device == 1 && r->numReads == 4 && r->numPixels == PIXELS,
+                  "record %i isn't scan %i's raw sums", i, scan);
+            for (k = 0; k < PIXELS; k++) {
+                expected[k] = sums[k] / 4.0;
+            }
+        } else {
+            CHECK(r->type == RECORD_RESULT && r->result == 500 + scan && r->shift == 0.5 * scan
+                  && r->quality == 0.99, "record %i isn't scan %i's result", i, scan);
+            continue;
+        }
+        CHECK(scanStoreReadSpectrum(store, r->spectrumOffset, r->numReads, 0, PIXELS, spectrum) == 0,
+              "record %i not read back", i);
+        CHECK(memcmp(spectrum, expected, sizeof (spectrum)) == 0, "record %i read back wrong", i);
+    }
+}
+
+static void writeScan(scanStore *store, int scan)
+{
+    double spectrum[PIXELS];
+    unsigned int sums[PIXELS];
+
+    fill(spectrum, sums, scan);
+    CHECK(scanStoreAppendScan(store, scan, 0, 100 * scan, spectrum, 3, PIXELS) > 0, "scan %i not appended", scan);
+    CHECK(scanStoreAppendRawScan(store, scan, 1, 100 * scan, sums, 4, PIXELS) > 0, "raw scan %i not appended", scan);
+    CHECK(scanStoreAppendResult(store, scan, 0, 500 + scan, 0.5 * scan, 0.99) == 0, "result %i not appended", scan);
+}
+
+int main()
+{
+    scanStore store;
+    seen s;
+    char header[SCAN_STORE_HEADER_LENGTH];
+    double spectrum[PIXELS];
+    unsigned int sums[PIXELS];
+    long intact, size;
+    FILE *f;
+    int c;
+
+    CHECK(scanStoreCreate(&store, PATH, HEADER, 0) == 0, "couldn't create %s", PATH);
+    writeScan(&store, 0);
+    writeScan(&store, 1);
+    scanStoreClose(&store, 0);
+    reopen(&store, &s, 6);
+    intact = fileSize(PATH);
+
+    //a scan torn by a crash (here the raw one) is dropped, and cut off the file
+    writeScan(&store, 2);
+    scanStoreClose(&store, 0);
+    size = fileSize(PATH);
+    CHECK(truncate(PATH, intact + COUNTED_RECORD + 500) == 0, "couldn't tear the file");
+    reopen(&store, &s, 7);
+    scanStoreClose(&store, 0);
+    CHECK(fileSize(PATH) == intact + COUNTED_RECORD, "torn record left in the file");
+
+    //and the store carries on from the last whole record
+    reopen(&store, &s, 7);
+    fill(spectrum, sums, 2);
+    scanStoreAppendRawScan(&store, 2, 1, 200, sums, 4, PIXELS);
+    scanStoreAppendResult(&store, 2, 0, 502, 1, 0.99);
+    scanStoreClose(&store, 0);
+    CHECK(fileSize(PATH) == size, "appending after recovery: %li bytes, expected %li", fileSize(PATH), size);
+    reopen(&store, &s, 9);
+    CHECK(s.records[8].type == RECORD_RESULT && s.records[8].scan == 2,
+          "records appended after recovery lost");
+    scanStoreClose(&store, 0);
+
+    //a bad checksum ends the store at the record before it
+    f = fopen(PATH, "r+b");
+    fseek(f, intact + 40, SEEK_SET);
+    c = fgetc(f);
+    fseek(f, intact + 40, SEEK_SET);
+    fputc(c ^ 0xFF, f);
+    fclose(f);
+    reopen(&store, &s, 6);
+    CHECK(fileSize(PATH) == intact, "corrupt record not cut off");
+    scanStoreClose(&store, 1);
+    CHECK(access(PATH, F_OK) != 0, "store not removed");
+
+    //and something else altogether isn't a store
+    f = fopen(PATH, "wb");
+    fputs("SCANWAL0 not really", f);
+    fclose(f);
+    CHECK(scanStoreOpen(&store, PATH, header, sizeof (header), visit, &s) == -1, "opened a file that isn't a store");
+    unlink(PATH);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,92 @@
+/* shiftTest.c
+ * The FFT against a direct DFT, and the shift estimator against
+ * Gaussians moved by known sub-pixel amounts, on an evenly spaced
+ * detector and on one whose wavelengths bunch up towards the red end.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/shiftEstimator.h"
+#include "testCheck.h"
+
+#define PIXELS 1024
+#define FFT_SIZE 64
+
+static double gaussian(double x, double centre, double sigma)
+{
+    return 1000 * exp(-(x - centre) * (x - centre) / (2 * sigma * sigma)) + 20;
+}
+
+static void checkFft()
+{
+    fftPlan p;
+    double data[FFT_SIZE + 2], original[FFT_SIZE], re, im;
+    int i, k;
+
+    memset(&p, 0, sizeof (p));
+    CHECK(fftPlanCreate(&p, FFT_SIZE) == 0, "no plan for %i points", FFT_SIZE);
+    for (i = 0; i < FFT_SIZE; i++) {
+        original[i] = data[i] = sin(0.3 * i) + 0.5 * cos(1.7 * i) + (i % 5);
+    }
+    fftReal(&p, data);
+    for (k = 0; k <= FFT_SIZE / 2; k++) {
+        re = im = 0;
+        for (i = 0; i < FFT_SIZE; i++) {
+            re += original[i] * cos(2 * M_PI * k * i / FFT_SIZE);
+            im -= original[i] * sin(2 * M_PI * k * i / FFT_SIZE);
+        }
+        CHECK_NEAR(data[2 * k], re, 1e-9, "real part");
+        CHECK_NEAR(data[2 * k + 1], im, 1e-9, "imaginary part");
+    }
+
+    //and back again, scaled by 1 / size on the way
+    fftRealInverse(&p, data);
+    for (i = 0; i < FFT_SIZE; i++) {
+        CHECK_NEAR(data[i], original[i], 1e-9, "round trip");
+    }
+    fftPlanDestroy(&p);
+}
+
+//a peak at 550 moved by each shift, measured against the unmoved one
+static void checkShifts(const char *detector, const double *wavelengths)
+{
+    static const double shifts[] = {0, 0.25, 0.37, -0.61, 1.5, -3.2};
+    shiftEstimator s;
+    double reference[PIXELS], moved[PIXELS], shift;
+    int i, j;
+
+    memset(&s, 0, sizeof (s));
+    for (i = 0; i < PIXELS; i++) {
+        reference[i] = gaussian(wavelengths[i], 550, 2);
+    }
+    CHECK(shiftSetReference(&s, wavelengths, reference, PIXELS) == 0, "%s: no reference", detector);
+
+    for (j = 0; j < (int) (sizeof (shifts) / sizeof (shifts[0])); j++) {
+        for (i = 0; i < PIXELS; i++) {
+            moved[i] = gaussian(wavelengths[i], 550 + shifts[j], 2);
+        }
+        shift = 1e9;
+        CHECK(shiftEstimate(&s, wavelengths, moved, PIXELS, &shift) == 0, "%s: no estimate", detector);
+        CHECK(fabs(shift - shifts[j]) <= 0.02, "%s: shift %g measured as %g", detector, shifts[j], shift);
+    }
+    shiftReset(&s);
+    CHECK(shiftEstimate(&s, wavelengths, moved, PIXELS, &shift) == -1, "%s: estimate with no reference", detector);
+}
+
+int main()
+{
+    double even[PIXELS], bunched[PIXELS];
+    int i;
+
+    //100nm across the detector, about 0.1nm a pixel
+    for (i = 0; i < PIXELS; i++) {
+        even[i] = 500 + 100.0 * i / PIXELS;
+        bunched[i] = 500 + 130.0 * i / PIXELS - 30.0 * i * i / ((double) PIXELS * PIXELS);
+    }
+
+    checkFft();
+    checkShifts("even", even);
+    checkShifts("bunched", bunched);
+    return CHECK_RESULT();
+}
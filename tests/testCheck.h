@@ -0,0 +1,34 @@
+/* testCheck.h
+ * What the behaviour checks in tests/ share: CHECK notes a failure and
+ * carries on, so one run shows everything that is wrong, and
+ * CHECK_RESULT is what main returns.
+ *
+ * Each check is a program of its own, linked against just the objects it
+ * tests; "make test" builds and runs them all. They need no hardware,
+ * and any files they write go under the directory they are run in.
+ */
+#ifndef TESTCHECK_H
+#define TESTCHECK_H
+
+#include <stdio.h>
+#include <math.h>
+
+static int checkFailures = 0;
+
+#define CHECK(condition, ...) do { \
+        if (!(condition)) { \
+            printf("FAIL %s:%i: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            checkFailures++; \
+        } \
+    } while (0)
+
+//within tolerance of each other
+#define CHECK_NEAR(actual, expected, tolerance, what) \
+    CHECK(fabs((actual) - (expected)) <= (tolerance), "%s: %g, expected %g", what, (double) (actual), (double) (expected))
+
+#define CHECK_RESULT() (checkFailures ? (printf("%s: %i failed\n", __FILE__, checkFailures), 1) \
+                                      : (printf("%s: ok\n", __FILE__), 0))
+
+#endif
@@ -0,0 +1,454 @@
+/* soak.c
+ * Soak and stress harness for BTServer.
+ *
+ * Starts the server with --local, so it takes its client on a unix
+ * socket and (with no spectrometer plugged in) reads the simulated one,
+ * then drives it with a random mix of commands for as long as asked,
+ * dropping the connection and making it again every so often. Every
+ * sample period it records the server's resident memory, thread count
+ * and open file descriptors from /proc, and the round trip of a
+ * PEAK_HISTORY probe, and prints them as a line of CSV.
+ *
+ * At the end the samples after the warm-up are split into quarters, and
+ * anything that is clearly higher in the last quarter than in the first
+ * fails the run. A leak of a thread or a descriptor per connection, or
+ * of memory per experiment, shows up within the hour.
+ *
+ * Run it where the server normally runs (it starts short experiments,
+ * which need PeakDetector.py and ./experiment_results, and deletes their
+ * files again):
+ *   soak [--server ./BTServer] [--minutes 240] [--period 10] [--seed N]
+ * Exits 0 if nothing grew, 1 if something did, 2 if the server died.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "../include/spectrometerDriver.h"
+#include "../include/telemetry.h"
+
+#define SOAK_SOCKET "/tmp/btserver.soak"
+#define MAX_SAMPLES 100000
+#define PROBE_TIMEOUT 5000          //ms before a probe counts as lost
+#define RECONNECT_EVERY 300         //commands between dropped connections, on average
+#define EXPERIMENT_EVERY 400        //and between short experiments
+#define WARMUP_FRACTION 10          //the first 1/10 of the samples aren't judged
+
+//how much the last quarter may be above the first
+#define RSS_SLACK_KB 2048
+#define RSS_SLACK_FRACTION 0.10
+#define THREAD_SLACK 2
+#define FD_SLACK 2
+#define LATENCY_SLACK_MS 20
+
+typedef struct {
+    unsigned int time;          //seconds since the start
+    long rssKb;
+    int threads;
+    int fds;
+    int latencyMs;
+} soakSample;
+
+static pid_t server;
+static char *socketPath = SOAK_SOCKET;
+static int client = -1;
+static volatile int readerDone = 1;     //the connection has gone from the server's end
+
+//the reader thread tells the prober when the PEAK_HISTORY reply comes
+static pthread_mutex_t probeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probeAnswered = PTHREAD_COND_INITIALIZER;
+static int probeWaiting = 0;
+
+static soakSample samples[MAX_SAMPLES];
+static int numSamples = 0;
+static int experimentsStarted = 0;
+
+static int connectToServer();
+static void *readerThread(void *arg);
+static int sendCommand(char command, const char *payload);
+static void sendRandomCommand();
+static int probeLatency();
+static int takeSample(soakSample *s, unsigned int elapsed);
+static void removeFinishedExperiments();
+static int judge();
+static double quarterMean(int first, int count, int which);
+static unsigned int nowMs();
+
+
+int main(int argc, char **argv)
+{
+    char *serverPath = "./BTServer";
+    double minutes = 240, period = 10;
+    unsigned int seed = time(NULL), start, nextSample;
+    pthread_t reader;
+    int i, status;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--server") && i + 1 < argc) {
+            serverPath = argv[++i];
+        } else if (!strcmp(argv[i], "--minutes") && i + 1 < argc) {
+            minutes = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--period") && i + 1 < argc) {
+            period = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+        } else {
+            printf("unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    srand(seed);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "soak: %s for %.0f minutes, a sample every %.0f s, seed %u\n", serverPath, minutes, period, seed);
+
+    //the server's own chatter goes to a file, so ours is just the CSV
+    server = fork();
+    if (server == 0) {
+        if (!freopen("soak_server.log", "w", stdout)) {
+            _exit(2);
+        }
+        dup2(fileno(stdout), fileno(stderr));
+        execl(serverPath, serverPath, "--local", socketPath, (char *) NULL);
+        _exit(2);
+    }
+    if (server < 0) {
+        printf("could not start %s\n", serverPath);
+        return 2;
+    }
+
+    printf("seconds,rss_kb,threads,fds,latency_ms\n");
+    start = nowMs();
+    nextSample = start;
+    while (nowMs() - start < minutes * 60000) {
+        if (waitpid(server, &status, WNOHANG) == server) {
+            printf("the server died (status %i)\n", status);
+            return 2;
+        }
+        if (client >= 0 && readerDone) {
+            close(client);
+            client = -1;
+        }
+        if (client < 0) {
+            readerDone = 0;
+            if (connectToServer() != 0 || pthread_create(&reader, NULL, readerThread, NULL) != 0) {
+                readerDone = 1;
+                usleep(100000);
+                continue;
+            }
+            pthread_detach(reader);
+        }
+
+        if ((int) (nowMs() - nextSample) >= 0) {
+            nextSample += period * 1000;
+            if (numSamples < MAX_SAMPLES && takeSample(&samples[numSamples], (nowMs() - start) / 1000) == 0) {
+                soakSample *s = &samples[numSamples++];
+                printf("%u,%li,%i,%i,%i\n", s->time, s->rssKb, s->threads, s->fds, s->latencyMs);
+                fflush(stdout);
+            }
+            removeFinishedExperiments();
+            continue;
+        }
+
+        //a dropped link now and then, like the clinic gets; the server
+        //has to tidy up after every one
+        if (rand() % RECONNECT_EVERY == 0) {
+            shutdown(client, SHUT_RDWR);
+            while (!readerDone) {
+                usleep(1000);
+            }
+            close(client);
+            client = -1;
+            continue;
+        }
+        sendRandomCommand();
+        usleep(20000 + rand() % 200000);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, &status, 0);
+    removeFinishedExperiments();
+    unlink(socketPath);
+    return judge();
+}
+
+static int connectToServer()
+{
+    struct sockaddr_un addr = {0};
+
+    client = socket(AF_UNIX, SOCK_STREAM, 0);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof (addr.sun_path), "%s", socketPath);
+    if (client < 0 || connect(client, (struct sockaddr *) &addr, sizeof (addr)) != 0) {
+        if (client >= 0) {
+            close(client);
+        }
+        client = -1;
+        return -1;
+    }
+    return 0;
+}
+
+//takes every telemetry frame off the socket, so the server never backs
+//up, and watches for the probe's reply. Ends with the connection
+static void *readerThread(void *arg)
+{
+    unsigned char header[TELEMETRY_HEADER_SIZE], payload[65536];
+    unsigned short length;
+    int fd = client, got, n;
+
+    (void) arg;
+    for (;;) {
+        for (got = 0; got < TELEMETRY_HEADER_SIZE; got += n) {
+            n = read(fd, &header[got], TELEMETRY_HEADER_SIZE - got);
+            if (n <= 0) {
+                readerDone = 1;
+                return NULL;
+            }
+        }
+        memcpy(&length, &header[2], 2);
+        for (got = 0; got < length; got += n) {
+            n = read(fd, &payload[got], length - got);
+            if (n <= 0) {
+                readerDone = 1;
+                return NULL;
+            }
+        }
+
+        //short enough for one frame, so never in fragments
+        if (header[0] == CHANNEL_PEAK && length > 0 && payload[0] == PEAK_HISTORY) {
+            pthread_mutex_lock(&probeLock);
+            probeWaiting = 0;
+            pthread_cond_signal(&probeAnswered);
+            pthread_mutex_unlock(&probeLock);
+        }
+    }
+}
+
+//[uint16 length][command][payload], as commandParser reads them
+static int sendCommand(char command, const char *payload)
+{
+    unsigned char buf[COMMAND_BUFFER_SIZE];
+    unsigned short length = 1 + strlen(payload);
+
+    memcpy(buf, &length, 2);
+    buf[2] = command;
+    memcpy(&buf[3], payload, length - 1);
+    return write(client, buf, 2 + length) == 2 + length ? 0 : -1;
+}
+
+static void sendRandomCommand()
+{
+    char payload[256];
+    int r = rand() % 100;
+
+    if (rand() % EXPERIMENT_EVERY == 0) {
+        //a short one, so plenty of them start and finish in a soak
+        snprintf(payload, sizeof (payload), "3;1;10;0;2;soak;soak;soak_%i;start", experimentsStarted++);
+        sendCommand(SETTINGS, payload);
+    } else if (r < 20) {
+        sendCommand(SNAPSHOT, "");
+    } else if (r < 28) {
+        sendCommand(START_STREAM, "");
+    } else if (r < 40) {
+        sendCommand(STOP_STREAM, "");
+    } else if (r < 48) {
+        sendCommand(PEAK_STREAM, "");
+    } else if (r < 54) {
+        sendCommand(REQUEST_PRESSURE, "");
+    } else if (r < 62) {
+        sendCommand(PRESSURE_HISTORY, "5");
+    } else if (r < 70) {
+        sendCommand(PEAK_HISTORY, "");
+    } else if (r < 78) {
+        sendCommand(EXP_STATUS, rand() % 2 ? "subscribe" : "unsubscribe");
+    } else if (r < 82) {
+        sendCommand(SPEC_CONNECTION, "");
+    } else if (r < 88) {
+        sendCommand(EXP_QUERY, "patient=soak;field=peak");
+    } else if (r < 94 && experimentsStarted > 0) {
+        snprintf(payload, sizeof (payload), "soak_%i;pixels=64;scans=64", rand() % experimentsStarted);
+        sendCommand(EXP_LOOKUP, payload);
+    } else if (experimentsStarted > 0) {
+        snprintf(payload, sizeof (payload), "soak_%i;offset=0;chunks=4", rand() % experimentsStarted);
+        sendCommand(EXP_LOOKUP, payload);
+    } else {
+        sendCommand(HARDWARE_OFF, "");
+    }
+}
+
+//ms from sending PEAK_HISTORY to its reply, PROBE_TIMEOUT if there's none
+static int probeLatency()
+{
+    struct timespec until;
+    unsigned int sent = nowMs();
+    int answered;
+
+    pthread_mutex_lock(&probeLock);
+    probeWaiting = 1;
+    pthread_mutex_unlock(&probeLock);
+    if (client < 0 || sendCommand(PEAK_HISTORY, "") != 0) {
+        return PROBE_TIMEOUT;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += PROBE_TIMEOUT / 1000;
+    pthread_mutex_lock(&probeLock);
+    while (probeWaiting) {
+        if (pthread_cond_timedwait(&probeAnswered, &probeLock, &until) != 0) {
+            break;
+        }
+    }
+    answered = !probeWaiting;
+    pthread_mutex_unlock(&probeLock);
+    return answered ? (int) (nowMs() - sent) : PROBE_TIMEOUT;
+}
+
+static int takeSample(soakSample *s, unsigned int elapsed)
+{
+    char path[64], line[256];
+    FILE *f;
+    DIR *dir;
+    struct dirent *entry;
+
+    memset(s, 0, sizeof (*s));
+    s->time = elapsed;
+    s->latencyMs = probeLatency();
+
+    sprintf(path, "/proc/%i/status", (int) server);
+    f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof (line), f)) {
+        sscanf(line, "VmRSS: %li", &s->rssKb);
+        sscanf(line, "Threads: %i", &s->threads);
+    }
+    fclose(f);
+
+    sprintf(path, "/proc/%i/fd", (int) server);
+    dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    while ((entry = readdir(dir))) {
+        s->fds += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+    return 0;
+}
+
+//the files of soak experiments that are done with, so a long soak doesn't
+//fill the card. Anything still running keeps its scan store
+static void removeFinishedExperiments()
+{
+    char path[512], store[512];
+    struct dirent *entry;
+    DIR *dir = opendir("./experiment_results");
+
+    if (!dir) {
+        return;
+    }
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "soak_", 5) || strchr(entry->d_name, '.')) {
+            continue;
+        }
+        sprintf(store, "./experiment_results/%s.scans", entry->d_name);
+        if (access(store, F_OK) == 0) {
+            continue;
+        }
+        sprintf(path, "./experiment_results/%s", entry->d_name);
+        unlink(path);
+        sprintf(path, "./experiment_results/%s.lod", entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+//1 if anything grew from the first quarter of the judged samples to the last
+static int judge()
+{
+    int first = numSamples / WARMUP_FRACTION, count = numSamples - first, failed = 0;
+    double before, after;
+
+    if (count < 8) {
+        printf("only %i samples after the warm-up; too few to judge\n", count);
+        return 0;
+    }
+
+    before = quarterMean(first, count, 0);
+    after = quarterMean(first, count, 1);
+    printf("rss: %.0f -> %.0f kB\n", before, after);
+    if (after - before > RSS_SLACK_KB && after > before * (1 + RSS_SLACK_FRACTION)) {
+        printf("FAIL: resident memory keeps growing\n");
+        failed = 1;
+    }
+
+    before = quarterMean(first, count, 2);
+    after = quarterMean(first, count, 3);
+    printf("threads: %.1f -> %.1f\n", before, after);
+    if (after - before > THREAD_SLACK) {
+        printf("FAIL: threads keep piling up\n");
+        failed = 1;
+    }
+
+    before = quarterMean(first, count, 4);
+    after = quarterMean(first, count, 5);
+    printf("fds: %.1f -> %.1f\n", before, after);
+    if (after - before > FD_SLACK) {
+        printf("FAIL: file descriptors keep leaking\n");
+        failed = 1;
+    }
+
+    before = quarterMean(first, count, 6);
+    after = quarterMean(first, count, 7);
+    printf("latency: %.1f -> %.1f ms\n", before, after);
+    if (after > 2 * before + LATENCY_SLACK_MS) {
+        printf("FAIL: replies keep getting slower\n");
+        failed = 1;
+    }
+
+    printf(failed ? "soak FAILED\n" : "soak passed\n");
+    return failed;
+}
+
+//mean of one field over the first (even which) or last (odd) quarter of
+//the count samples from first: rss, threads, fds, latency in that order
+static double quarterMean(int first, int count, int which)
+{
+    int i, n = count / 4, from = which % 2 ? first + count - n : first;
+    double sum = 0;
+
+    for (i = from; i < from + n; i++) {
+        switch (which / 2) {
+        case 0:
+            sum += samples[i].rssKb;
+            break;
+        case 1:
+            sum += samples[i].threads;
+            break;
+        case 2:
+            sum += samples[i].fds;
+            break;
+        default:
+            sum += samples[i].latencyMs;
+            break;
+        }
+    }
+    return sum / n;
+}
+
+static unsigned int nowMs()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}